@@ -0,0 +1,738 @@
+/*
+ * Throughput benchmark for the acquisition and processing pipeline
+ *
+ * Synthetic TOFPET frames (see Core/EventGenerator) are laid out in a daqd style frame ring (a file in the work directory)
+ * and pushed through each processing stage in isolation and through the full chains used by
+ * writeRaw, buildSingle and buildCoincidence, for each requested thread pool size.
+ * The input of a stage is prepared by running the stages upstream of it, which is not timed.
+ *
+ * Results go to stdout as tab separated values, one line per stage, thread count and run;
+ * the stages' own messages go to stderr.
+ */
+#include <TFile.h>
+#include <TNtuple.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <SHM.hpp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <Common/Constants.hpp>
+#include <Common/SystemInformation.hpp>
+#include <Core/Event.hpp>
+#include <Core/EventGenerator.hpp>
+#include <Core/ThreadPool.hpp>
+#include <Core/CoarseSorter.hpp>
+#include <Core/CoincidenceFilter.hpp>
+#include <Core/RawHitWriter.hpp>
+#include <Core/CrystalPositions.hpp>
+#include <Core/NaiveGrouper.hpp>
+#include <Core/CoincidenceGrouper.hpp>
+#include <TOFPET/RawV3.hpp>
+#include <TOFPET/P2.hpp>
+#include <TOFPET/P2Extract.hpp>
+
+using namespace std;
+using namespace DAQ;
+using namespace DAQ::Core;
+using namespace DAQ::Common;
+using namespace DAQ::TOFPET;
+
+const long long T = (long long)(SYSTEM_PERIOD * 1E12);
+
+static double wallTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9 * ts.tv_nsec;
+}
+
+struct GeneratorConfig {
+	double rate;			// singles rate for the whole system, in Hz
+	long long nFrames;
+	int nCrystals;			// crystals in each of the 2 regions
+	float coincidenceFraction;	// fraction of gammas emitted as a back to back pair
+	float multiHitProbability;	// probability of a hit spilling into a neighbour crystal
+	uint64_t seed;
+};
+
+// Crystals 0..nCrystals-1 are region 0 and the next nCrystals are region 1, facing each other
+static void writeChannelMap(const char *fileName, int nCrystals)
+{
+	FILE *f = fopen(fileName, "w");
+	if(f == NULL) {
+		fprintf(stderr, "Could not open '%s' for writing\n", fileName);
+		exit(1);
+	}
+	int side = int(ceil(sqrt(nCrystals)));
+	for(int region = 0; region < 2; region++) {
+		for(int n = 0; n < nCrystals; n++) {
+			int xi = n % side;
+			int yi = n / side;
+			fprintf(f, "%d\t%d\t%d\t%d\t%f\t%f\t%f\t%d\n",
+				region * nCrystals + n, region, xi, yi,
+				4.0 * xi, 4.0 * yi, region == 0 ? -100.0 : 100.0, 0);
+		}
+	}
+	fclose(f);
+}
+
+/*
+ * Writes the generator's frames into a frame ring file, laid out as daqd would, and returns the number of events
+ * The rate counts the hits of both gammas of a pair, before multi-hits
+ */
+static long long writeFrameRing(const char *fileName, GeneratorConfig &config, SystemInformation *systemInformation)
+{
+	uint32_t flags = 0;
+#ifndef __NO_CHANNEL_IDLE_TIME__
+	flags |= DAQd::SHMHasIdleTime;
+#endif
+	EventGenerator::Config generatorConfig = EventGenerator::defaultConfig();
+	double gammaRate = config.rate / (1.0 + config.coincidenceFraction);
+	generatorConfig.coincidenceRate = gammaRate * config.coincidenceFraction;
+	generatorConfig.singlesRate = gammaRate * (1.0 - config.coincidenceFraction);
+	generatorConfig.multiHitProbability = config.multiHitProbability;
+	generatorConfig.seed = config.seed;
+
+	EventGenerator *generator = new EventGenerator(systemInformation, generatorConfig);
+	FrameRingFileWriter *writer = new FrameRingFileWriter(fileName, config.nFrames, flags);
+	EventGenerator::Frame frame;
+	long long nEvents = 0;
+	for(long long n = 0; n < config.nFrames; n++) {
+		generator->nextFrame(frame);
+		writer->addFrame(frame);
+		nEvents += frame.hits.size();
+	}
+	delete writer;
+	delete generator;
+	return nEvents;
+}
+
+// Keeps the buffers it receives, to be fed into the stage under test
+template <class TEvent>
+class CaptureSink : public EventSink<TEvent> {
+public:
+	CaptureSink(vector<EventBuffer<TEvent> *> &buffers) : buffers(buffers) {};
+	virtual void pushT0(double t0) {};
+	virtual void pushEvents(EventBuffer<TEvent> *buffer) {
+		if(buffer != NULL) buffers.push_back(buffer);
+	};
+	virtual void finish() {};
+	virtual void report() {};
+private:
+	vector<EventBuffer<TEvent> *> &buffers;
+};
+
+// Fills a singles tree like buildSingle's lmData
+class SinglesTreeWriter : public EventSink<Hit>, public EventSource<Hit> {
+public:
+	SinglesTreeWriter(const char *fileName, EventSink<Hit> *sink)
+	: EventSource<Hit>(sink) {
+		file = new TFile(fileName, "RECREATE");
+		data = new TTree("lmData", "Event List", 2);
+		int bs = 512*1024;
+		data->Branch("time", &time, bs);
+		data->Branch("channel", &channel, bs);
+		data->Branch("tot", &tot, bs);
+		data->Branch("energy", &energy, bs);
+		data->Branch("tac", &tac, bs);
+		data->Branch("channelIdleTime", &channelIdleTime, bs);
+		data->Branch("tacIdleTime", &tacIdleTime, bs);
+		data->Branch("xi", &xi, bs);
+		data->Branch("yi", &yi, bs);
+		data->Branch("x", &x, bs);
+		data->Branch("y", &y, bs);
+		data->Branch("z", &z, bs);
+		data->Branch("tqT", &tqT, bs);
+		data->Branch("tqE", &tqE, bs);
+	};
+
+	virtual void pushT0(double t0) {};
+	virtual void pushEvents(EventBuffer<Hit> *buffer) {
+		if(buffer == NULL) return;
+		unsigned nEvents = buffer->getSize();
+		for(unsigned i = 0; i < nEvents; i++) {
+			Hit &hit = buffer->get(i);
+			if(hit.badEvent) continue;
+			time = hit.time;
+			channel = hit.raw->channelID;
+			tot = 1E-3*(hit.timeEnd - hit.time);
+			energy = hit.energy;
+			tac = hit.raw->d.tofpet.tac;
+			channelIdleTime = hit.raw->channelIdleTime * T * 1E-12;
+			tacIdleTime = hit.raw->d.tofpet.tacIdleTime * T * 1E-12;
+			xi = hit.xi;
+			yi = hit.yi;
+			x = hit.x;
+			y = hit.y;
+			z = hit.z;
+			tqT = hit.tofpet_TQT;
+			tqE = hit.tofpet_TQE;
+			data->Fill();
+		}
+		sink->pushEvents(buffer);
+	};
+	virtual void finish() {
+		file->Write();
+		file->Close();
+		sink->finish();
+	};
+	virtual void report() {};
+
+private:
+	TFile *file;
+	TTree *data;
+	long long time;
+	unsigned short channel;
+	float tot;
+	float energy;
+	unsigned short tac;
+	double channelIdleTime;
+	double tacIdleTime;
+	int xi, yi;
+	float x, y, z;
+	float tqT, tqE;
+};
+
+// Fills a coincidence tree with the first hit of each photon, a subset of buildCoincidence's lmData
+class CoincidenceTreeWriter : public EventSink<Coincidence>, public EventSource<Coincidence> {
+public:
+	CoincidenceTreeWriter(const char *fileName, EventSink<Coincidence> *sink)
+	: EventSource<Coincidence>(sink) {
+		file = new TFile(fileName, "RECREATE");
+		data = new TTree("lmData", "Event List", 2);
+		int bs = 512*1024;
+		for(int s = 0; s < 2; s++) {
+			string prefix = s == 0 ? "1" : "2";
+			data->Branch(("n" + prefix).c_str(), &n[s], bs);
+			data->Branch(("time" + prefix).c_str(), &time[s], bs);
+			data->Branch(("channel" + prefix).c_str(), &channel[s], bs);
+			data->Branch(("tot" + prefix).c_str(), &tot[s], bs);
+			data->Branch(("energy" + prefix).c_str(), &energy[s], bs);
+			data->Branch(("x" + prefix).c_str(), &x[s], bs);
+			data->Branch(("y" + prefix).c_str(), &y[s], bs);
+			data->Branch(("z" + prefix).c_str(), &z[s], bs);
+		}
+	};
+
+	virtual void pushT0(double t0) {};
+	virtual void pushEvents(EventBuffer<Coincidence> *buffer) {
+		if(buffer == NULL) return;
+		unsigned nEvents = buffer->getSize();
+		for(unsigned i = 0; i < nEvents; i++) {
+			Coincidence &c = buffer->get(i);
+			for(int s = 0; s < 2; s++) {
+				GammaPhoton &p = *c.photons[s];
+				Hit &hit = *p.hits[0];
+				n[s] = p.nHits;
+				time[s] = hit.time;
+				channel[s] = hit.raw->channelID;
+				tot[s] = 1E-3*(hit.timeEnd - hit.time);
+				energy[s] = p.energy;
+				x[s] = hit.x;
+				y[s] = hit.y;
+				z[s] = hit.z;
+			}
+			data->Fill();
+		}
+		sink->pushEvents(buffer);
+	};
+	virtual void finish() {
+		file->Write();
+		file->Close();
+		sink->finish();
+	};
+	virtual void report() {};
+
+private:
+	TFile *file;
+	TTree *data;
+	unsigned short n[2];
+	long long time[2];
+	unsigned short channel[2];
+	float tot[2];
+	float energy[2];
+	float x[2], y[2], z[2];
+};
+
+// The SHM decoding loop of writeRaw, for TOFPET data; returns the number of events
+static long long decodeFrames(DAQd::SHM *shm, EventSink<RawHit> *sink)
+{
+	unsigned bs = shm->getSizeInFrames();
+	EventBuffer<RawHit> *outBuffer = NULL;
+	long long maxFrameID = 0, lastMaxFrameID = 0;
+	long long nEvents = 0;
+
+	sink->pushT0(0);
+	for(unsigned index = 0; index < bs; index++) {
+		long long frameID = shm->getFrameID(index);
+		maxFrameID = maxFrameID > frameID ? maxFrameID : frameID;
+		int nFrameEvents = shm->getNEvents(index);
+
+		if(outBuffer == NULL) {
+			outBuffer = new EventBuffer<RawHit>(EVENT_BLOCK_SIZE, NULL);
+		}
+		for(int n = 0; n < nFrameEvents; n++) {
+			RawHit &p = outBuffer->getWriteSlot();
+			p.feType = RawHit::TOFPET;
+			unsigned tCoarse = shm->getTCoarse(index, n);
+			unsigned eCoarse = shm->getECoarse(index, n);
+			p.time = (1024LL * frameID + tCoarse) * T;
+			p.timeEnd = (1024LL * frameID + eCoarse) * T;
+			if((p.timeEnd - p.time) < -256*T) p.timeEnd += (1024LL * T);
+			p.channelID = 64 * shm->getAsicID(index, n) + shm->getChannelID(index, n);
+			p.d.tofpet.tac = shm->getTACID(index, n);
+			p.d.tofpet.tcoarse = tCoarse;
+			p.d.tofpet.ecoarse = eCoarse;
+			p.d.tofpet.tfine =  shm->getTFine(index, n);
+			p.d.tofpet.efine = shm->getEFine(index, n);
+			p.channelIdleTime = shm->getChannelIdleTime(index, n);
+			p.d.tofpet.tacIdleTime = shm->getTACIdleTime(index, n);
+			outBuffer->pushWriteSlot();
+		}
+		nEvents += nFrameEvents;
+
+		if(outBuffer->getSize() >= (EVENT_BLOCK_SIZE - DAQd::MaxDataFrameSize) || index == bs - 1) {
+			outBuffer->setTMin(lastMaxFrameID * 1024 * T);
+			outBuffer->setTMax((maxFrameID+1) * 1024 * T - 1);
+			lastMaxFrameID = maxFrameID;
+			sink->pushEvents(outBuffer);
+			outBuffer = NULL;
+		}
+	}
+	sink->finish();
+	return nEvents;
+}
+
+struct Benchmark {
+	DAQd::SHM *shm;
+	SystemInformation *systemInformation;
+	TOFPET::P2 *P2;
+	string prefix;
+	long long nRawEvents;
+
+	// Same settings as writeRaw and buildCoincidence with their usual parameters
+	float cWindow;
+	float minToT;
+	float gRadius;
+	float gWindow;
+	float minEnergy;
+	float maxEnergy;
+};
+
+static EventSink<RawHit> *acquisitionFilter(Benchmark &b, EventSink<RawHit> *sink)
+{
+	float cWindowCoarse = (ceil(b.cWindow/SYSTEM_PERIOD)) * SYSTEM_PERIOD;
+	float minToTCoarse = (floor(b.minToT/SYSTEM_PERIOD) - 2) * SYSTEM_PERIOD;
+	return new CoincidenceFilter(b.systemInformation, cWindowCoarse, minToTCoarse, sink);
+}
+
+static EventSink<RawHit> *singlesChain(Benchmark &b, EventSink<Hit> *sink)
+{
+	return new P2Extract(b.P2, false, 0.0, 0.20, false,
+		new CrystalPositions(b.systemInformation,
+		sink));
+}
+
+static EventSink<Hit> *groupingChain(Benchmark &b, EventSink<Coincidence> *sink)
+{
+	return new NaiveGrouper(b.gRadius, b.gWindow, b.minEnergy, b.maxEnergy, GammaPhoton::maxHits,
+		new CoincidenceGrouper(b.cWindow,
+		sink));
+}
+
+template <class TEvent>
+static long long countEvents(vector<EventBuffer<TEvent> *> &buffers)
+{
+	long long n = 0;
+	for(unsigned i = 0; i < buffers.size(); i++)
+		n += buffers[i]->getSize();
+	return n;
+}
+
+// Decodes the frames into a capture chain, which is deleted afterwards
+static void captureFrames(DAQd::SHM *shm, EventSink<RawHit> *sink)
+{
+	decodeFrames(shm, sink);
+	delete sink;
+}
+
+// Pushes the prepared buffers through the stage; the stage owns them from then on
+template <class TEvent>
+static double timeStage(EventSink<TEvent> *stage, vector<EventBuffer<TEvent> *> &input)
+{
+	double t0 = wallTime();
+	stage->pushT0(0);
+	for(unsigned i = 0; i < input.size(); i++)
+		stage->pushEvents(input[i]);
+	stage->finish();
+	double elapsed = wallTime() - t0;
+	input.clear();
+	delete stage;
+	return elapsed;
+}
+
+static double timeReader(Benchmark &b, EventSink<RawHit> *sink)
+{
+	string inputPrefix = b.prefix + "_in";
+	double t0 = wallTime();
+	RawReaderV3 *reader = new RawReaderV3((char *)inputPrefix.c_str(), SYSTEM_PERIOD, 0, b.nRawEvents, -1, false, sink);
+	reader->wait();
+	double elapsed = wallTime() - t0;
+	delete reader;
+	return elapsed;
+}
+
+static const char *stageNames[] = {
+	"decode", "sort", "cfilter", "rawwriter", "rawreader",
+	"p2extract", "positions", "ngrouper", "cgrouper",
+	"singleswriter", "coincwriter",
+	"chain-acquisition", "chain-singles", "chain-coincidences",
+	NULL
+};
+
+// Runs a stage once and returns its elapsed time, setting nEvents to the number of input events
+static double runStage(Benchmark &b, const string &name, long long &nEvents)
+{
+	vector<EventBuffer<RawHit> *> rawHits;
+	vector<EventBuffer<Hit> *> hits;
+	vector<EventBuffer<GammaPhoton> *> photons;
+	vector<EventBuffer<Coincidence> *> coincidences;
+	string rootFileName = b.prefix + ".root";
+	string outputPrefix = b.prefix + "_out";
+
+	if(name == "decode") {
+		double t0 = wallTime();
+		EventSink<RawHit> *sink = new NullSink<RawHit>();
+		nEvents = decodeFrames(b.shm, sink);
+		double elapsed = wallTime() - t0;
+		delete sink;
+		return elapsed;
+	}
+	else if(name == "sort") {
+		captureFrames(b.shm, new CaptureSink<RawHit>(rawHits));
+		nEvents = countEvents(rawHits);
+		return timeStage<RawHit>(new CoarseSorter(new NullSink<RawHit>()), rawHits);
+	}
+	else if(name == "cfilter") {
+		captureFrames(b.shm, new CoarseSorter(new CaptureSink<RawHit>(rawHits)));
+		nEvents = countEvents(rawHits);
+		return timeStage<RawHit>(acquisitionFilter(b, new NullSink<RawHit>()), rawHits);
+	}
+	else if(name == "rawwriter") {
+		captureFrames(b.shm, new CoarseSorter(new CaptureSink<RawHit>(rawHits)));
+		nEvents = countEvents(rawHits);
+		double t0 = wallTime();
+		RawWriterV3 *writer = new RawWriterV3((char *)outputPrefix.c_str());
+		writer->openStep(0, 0);
+		timeStage<RawHit>(new RawHitWriterHandler(writer, new NullSink<RawHit>()), rawHits);
+		writer->closeStep();
+		delete writer;
+		return wallTime() - t0;
+	}
+	else if(name == "rawreader") {
+		nEvents = b.nRawEvents;
+		return timeReader(b, new NullSink<RawHit>());
+	}
+	else if(name == "p2extract") {
+		captureFrames(b.shm, new CoarseSorter(new CaptureSink<RawHit>(rawHits)));
+		nEvents = countEvents(rawHits);
+		return timeStage<RawHit>(new P2Extract(b.P2, false, 0.0, 0.20, false, new NullSink<Hit>()), rawHits);
+	}
+	else if(name == "positions") {
+		captureFrames(b.shm, new CoarseSorter(new P2Extract(b.P2, false, 0.0, 0.20, false, new CaptureSink<Hit>(hits))));
+		nEvents = countEvents(hits);
+		return timeStage<Hit>(new CrystalPositions(b.systemInformation, new NullSink<Hit>()), hits);
+	}
+	else if(name == "ngrouper") {
+		captureFrames(b.shm, new CoarseSorter(singlesChain(b, new CaptureSink<Hit>(hits))));
+		nEvents = countEvents(hits);
+		return timeStage<Hit>(new NaiveGrouper(b.gRadius, b.gWindow, b.minEnergy, b.maxEnergy, GammaPhoton::maxHits, new NullSink<GammaPhoton>()), hits);
+	}
+	else if(name == "cgrouper") {
+		captureFrames(b.shm, new CoarseSorter(singlesChain(b,
+			new NaiveGrouper(b.gRadius, b.gWindow, b.minEnergy, b.maxEnergy, GammaPhoton::maxHits,
+			new CaptureSink<GammaPhoton>(photons)))));
+		nEvents = countEvents(photons);
+		return timeStage<GammaPhoton>(new CoincidenceGrouper(b.cWindow, new NullSink<Coincidence>()), photons);
+	}
+	else if(name == "singleswriter") {
+		captureFrames(b.shm, new CoarseSorter(singlesChain(b, new CaptureSink<Hit>(hits))));
+		nEvents = countEvents(hits);
+		return timeStage<Hit>(new SinglesTreeWriter(rootFileName.c_str(), new NullSink<Hit>()), hits);
+	}
+	else if(name == "coincwriter") {
+		captureFrames(b.shm, new CoarseSorter(singlesChain(b, groupingChain(b, new CaptureSink<Coincidence>(coincidences)))));
+		nEvents = countEvents(coincidences);
+		return timeStage<Coincidence>(new CoincidenceTreeWriter(rootFileName.c_str(), new NullSink<Coincidence>()), coincidences);
+	}
+	else if(name == "chain-acquisition") {
+		// writeRaw, with the software coincidence filter
+		double t0 = wallTime();
+		RawWriterV3 *writer = new RawWriterV3((char *)outputPrefix.c_str());
+		writer->openStep(0, 0);
+		EventSink<RawHit> *sink = new CoarseSorter(
+			acquisitionFilter(b,
+			new RawHitWriterHandler(writer,
+			new NullSink<RawHit>()
+			)));
+		nEvents = decodeFrames(b.shm, sink);
+		delete sink;
+		writer->closeStep();
+		delete writer;
+		return wallTime() - t0;
+	}
+	else if(name == "chain-singles") {
+		// buildSingle
+		nEvents = b.nRawEvents;
+		return timeReader(b,
+			singlesChain(b,
+			new SinglesTreeWriter(rootFileName.c_str(),
+			new NullSink<Hit>()
+			)));
+	}
+	else if(name == "chain-coincidences") {
+		// buildCoincidence
+		nEvents = b.nRawEvents;
+		return timeReader(b,
+			singlesChain(b,
+			groupingChain(b,
+			new CoincidenceTreeWriter(rootFileName.c_str(),
+			new NullSink<Coincidence>()
+			))));
+	}
+
+	fprintf(stderr, "Unknown stage '%s'\n", name.c_str());
+	exit(1);
+}
+
+static vector<string> splitList(const char *list)
+{
+	vector<string> items;
+	string s(list);
+	size_t start = 0;
+	while(start <= s.size()) {
+		size_t end = s.find(',', start);
+		if(end == string::npos) end = s.size();
+		if(end > start) items.push_back(s.substr(start, end - start));
+		start = end + 1;
+	}
+	return items;
+}
+
+void displayHelp(char * program)
+{
+	fprintf(stderr, "usage: %s [options]\n", program);
+	fprintf(stderr, "\noptional arguments:\n");
+	fprintf(stderr,  "  --help \t\t\t Show this help message and exit \n");
+	fprintf(stderr,  "  --frames=N\t\t\t Number of frames to generate (default is 50000)\n");
+	fprintf(stderr,  "  --rate=RATE\t\t\t Singles rate for the whole system, in Hz (default is 3E6)\n");
+	fprintf(stderr,  "  --crystals=N\t\t\t Crystals in each of the two detector regions (default is 1024)\n");
+	fprintf(stderr,  "  --coincidence-fraction=F\t Fraction of gammas emitted as a back to back pair (default is 0.3)\n");
+	fprintf(stderr,  "  --multihit=P\t\t\t Probability of a hit spilling into a neighbour crystal (default is 0.2)\n");
+	fprintf(stderr,  "  --seed=N\t\t\t Random generator seed (default is 1)\n");
+	fprintf(stderr,  "  --threads=LIST\t\t Comma separated thread pool sizes, capped at the number of CPUs, each size is run once (default is 1,2,4,8)\n");
+	fprintf(stderr,  "  --stages=LIST\t\t\t Comma separated stages to run (default is all)\n");
+	fprintf(stderr,  "  --repeat=N\t\t\t Number of runs for each stage and thread count (default is 3)\n");
+	fprintf(stderr,  "  --work-dir=DIR\t\t Directory for the frame ring and output files (default is /tmp)\n");
+	fprintf(stderr, "\nstages:\n ");
+	for(int i = 0; stageNames[i] != NULL; i++)
+		fprintf(stderr, " %s", stageNames[i]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\noutput (stdout):\n");
+	fprintf(stderr, "  stage threads run events seconds events_per_second ns_per_event, tab separated\n");
+};
+
+void displayUsage( char * program)
+{
+	fprintf(stderr, "usage: %s [options]\n", program);
+};
+
+int main(int argc, char *argv[])
+{
+	static struct option longOptions[] = {
+		{ "help", no_argument, 0, 0 },
+		{ "frames", required_argument, 0, 0 },
+		{ "rate", required_argument, 0, 0 },
+		{ "crystals", required_argument, 0, 0 },
+		{ "coincidence-fraction", required_argument, 0, 0 },
+		{ "multihit", required_argument, 0, 0 },
+		{ "seed", required_argument, 0, 0 },
+		{ "threads", required_argument, 0, 0 },
+		{ "stages", required_argument, 0, 0 },
+		{ "repeat", required_argument, 0, 0 },
+		{ "work-dir", required_argument, 0, 0 },
+		{ NULL, 0, 0, 0 }
+	};
+
+	GeneratorConfig config;
+	config.rate = 3E6;
+	config.nFrames = 50000;
+	config.nCrystals = 1024;
+	config.coincidenceFraction = 0.3;
+	config.multiHitProbability = 0.2;
+	config.seed = 1;
+	const char *threadList = "1,2,4,8";
+	const char *stageList = NULL;
+	int nRepeat = 3;
+	const char *workDir = "/tmp";
+
+	while(1) {
+		int optionIndex = 0;
+		int c = getopt_long(argc, argv, "", longOptions, &optionIndex);
+		if(c == -1) break;
+
+		if(optionIndex == 0) {
+			displayHelp(argv[0]);
+			return(1);
+		}
+		else if(optionIndex == 1) {
+			config.nFrames = atoll(optarg);
+		}
+		else if(optionIndex == 2) {
+			config.rate = atof(optarg);
+		}
+		else if(optionIndex == 3) {
+			config.nCrystals = atoi(optarg);
+		}
+		else if(optionIndex == 4) {
+			config.coincidenceFraction = atof(optarg);
+		}
+		else if(optionIndex == 5) {
+			config.multiHitProbability = atof(optarg);
+		}
+		else if(optionIndex == 6) {
+			config.seed = strtoull(optarg, NULL, 0);
+		}
+		else if(optionIndex == 7) {
+			threadList = optarg;
+		}
+		else if(optionIndex == 8) {
+			stageList = optarg;
+		}
+		else if(optionIndex == 9) {
+			nRepeat = atoi(optarg);
+		}
+		else if(optionIndex == 10) {
+			workDir = optarg;
+		}
+		else {
+			displayUsage(argv[0]);
+			fprintf(stderr, "\n%s: error: Unknown option!\n", argv[0]);
+			return(1);
+		}
+	}
+	if(config.nFrames < 1 || config.rate < 0 || nRepeat < 1) {
+		fprintf(stderr, "\n%s: error: --frames and --repeat must be positive and --rate not negative\n", argv[0]);
+		return(1);
+	}
+	if(config.nCrystals < 1 || 2 * config.nCrystals > SYSTEM_NCHANNELS) {
+		fprintf(stderr, "\n%s: error: --crystals must be between 1 and %d\n", argv[0], SYSTEM_NCHANNELS / 2);
+		return(1);
+	}
+
+	vector<string> stages;
+	if(stageList != NULL) {
+		stages = splitList(stageList);
+	}
+	else {
+		for(int i = 0; stageNames[i] != NULL; i++)
+			stages.push_back(stageNames[i]);
+	}
+	vector<string> threadItems = splitList(threadList);
+	vector<int> threads;
+	// ThreadPool never runs more workers than CPUs, so larger counts are reported as what actually runs
+	int nCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+	for(unsigned i = 0; i < threadItems.size(); i++) {
+		int n = atoi(threadItems[i].c_str());
+		if(n < 1) {
+			fprintf(stderr, "\n%s: error: bad thread count '%s'\n", argv[0], threadItems[i].c_str());
+			return(1);
+		}
+		if(n > nCPUs) {
+			fprintf(stderr, "%s: %d threads capped to the %d CPUs\n", argv[0], n, nCPUs);
+			n = nCPUs;
+		}
+		if(find(threads.begin(), threads.end(), n) != threads.end())
+			continue;
+		threads.push_back(n);
+	}
+
+	// Some stages report to stdout, keep it for the results only
+	fflush(stdout);
+	FILE *results = fdopen(dup(1), "w");
+	dup2(2, 1);
+
+	Benchmark b;
+	char prefix[1024];
+	sprintf(prefix, "%s/benchmark_%d", workDir, getpid());
+	b.prefix = prefix;
+	b.cWindow = 20E-9;
+	b.minToT = 150E-9;
+	b.gRadius = 20;
+	b.gWindow = 100E-9;
+	b.minEnergy = 150;
+	b.maxEnergy = 3000;
+
+	string mapFileName = b.prefix + ".map";
+	string ringFileName = b.prefix + ".shm";
+	writeChannelMap(mapFileName.c_str(), config.nCrystals);
+	b.systemInformation = new SystemInformation();
+	b.systemInformation->loadMapFile(mapFileName.c_str());
+	b.P2 = new TOFPET::P2(SYSTEM_NCRYSTALS);
+	b.P2->setAll(2.0);
+
+	long long nFrameEvents = writeFrameRing(ringFileName.c_str(), config, b.systemInformation);
+	b.shm = new DAQd::SHM(ringFileName);
+	fprintf(stderr, "benchmark:: %lld frames, %lld events (%.1f events/frame)\n",
+		config.nFrames, nFrameEvents, double(nFrameEvents) / config.nFrames);
+
+	// Input for the reader stages
+	string inputPrefix = b.prefix + "_in";
+	RawWriterV3 *writer = new RawWriterV3((char *)inputPrefix.c_str());
+	writer->openStep(0, 0);
+	EventSink<RawHit> *sink = new CoarseSorter(new RawHitWriterHandler(writer, new NullSink<RawHit>()));
+	decodeFrames(b.shm, sink);
+	delete sink;
+	writer->closeStep();
+	delete writer;
+	struct stat st;
+	stat((inputPrefix + ".raw3").c_str(), &st);
+	b.nRawEvents = st.st_size / sizeof(RawEventV3);
+
+	fprintf(results, "stage\tthreads\trun\tevents\tseconds\tevents_per_second\tns_per_event\n");
+	fflush(results);
+	ThreadPool *defaultPool = GlobalThreadPool;
+	for(unsigned s = 0; s < stages.size(); s++) {
+		for(unsigned t = 0; t < threads.size(); t++) {
+			// Stages take the global pool when they are built
+			ThreadPool *pool = new ThreadPool(threads[t]);
+			GlobalThreadPool = pool;
+			for(int run = 0; run < nRepeat; run++) {
+				long long nEvents = 0;
+				double elapsed = runStage(b, stages[s], nEvents);
+				fprintf(results, "%s\t%d\t%d\t%lld\t%.6f\t%.0f\t%.2f\n",
+					stages[s].c_str(), threads[t], run, nEvents, elapsed,
+					nEvents / elapsed, nEvents > 0 ? 1E9 * elapsed / nEvents : 0.0);
+				fflush(results);
+			}
+			GlobalThreadPool = defaultPool;
+			delete pool;
+		}
+	}
+
+	delete b.shm;
+	delete b.P2;
+	delete b.systemInformation;
+	const char *suffixes[] = { ".map", ".shm", ".root", "_in.raw3", "_in.idx3", "_out.raw3", "_out.idx3", NULL };
+	for(int i = 0; suffixes[i] != NULL; i++)
+		unlink((b.prefix + suffixes[i]).c_str());
+	fclose(results);
+	return 0;
+}
@@ -12,10 +12,14 @@
 #include <Core/NaiveGrouper.hpp>
 #include <Core/CoincidenceGrouper.hpp>
 #include <Core/CoincidenceFilter.hpp>
+#include <Core/StepScheduler.hpp>
 #include <assert.h>
 #include <math.h>
 #include <string.h>
 #include <getopt.h>
+#include <stdarg.h>
+#include <vector>
+#include <string>
 
 static float		eventStep1;
 static float		eventStep2;
@@ -69,10 +73,202 @@ using namespace std;
 
 
 
+// One side of a lmData entry
+struct CoincidenceSide {
+	unsigned short	n;
+	unsigned short	j;
+	unsigned	deltaT;
+	long long	time;
+	unsigned short	channel;
+	float		tot;
+	float		energy;
+	double		channelIdleTime;
+	unsigned short	tac;
+	double		tacIdleTime;
+	float		tqT;
+	float		tqE;
+	int		xi;
+	int		yi;
+	float		x;
+	float		y;
+	float		z;
+};
+
+struct CoincidenceRow {
+	CoincidenceSide side[2];
+};
+
+// Output of (part of) a step, kept while the step waits for the previous ones to be committed
+struct StepOutput {
+	std::vector<CoincidenceRow> rows;
+	std::string list;
+};
+
+static void setSide(CoincidenceSide &s, Hit &hit, int j, int n, float dt)
+{
+	long long T = SYSTEM_PERIOD * 1E12;
+	s.j = j;
+	s.n = n;
+	s.deltaT = dt;
+	s.time = hit.time;
+	s.channel = hit.raw->channelID;
+	s.tot = 1E-3*(hit.timeEnd - hit.time);
+	s.energy = hit.energy;
+	s.tac = hit.raw->d.tofpet.tac;
+	s.channelIdleTime = hit.raw->channelIdleTime * T * 1E-12;
+	s.tacIdleTime = hit.raw->d.tofpet.tacIdleTime * T * 1E-12;
+	s.tqT = hit.tofpet_TQT;
+	s.tqE = hit.tofpet_TQE;
+	s.x = hit.x;
+	s.y = hit.y;
+	s.z = hit.z;
+	s.xi = hit.xi;
+	s.yi = hit.yi;
+}
+
+static void listPrintf(std::string &list, const char *format, ...)
+{
+	char line[1024];
+	va_list ap;
+	va_start(ap, format);
+	int n = vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+	if(n > 0) list.append(line, n < (int)sizeof(line) ? n : sizeof(line) - 1);
+}
+
+// Processes several steps at a time, writing lmData, lmIndex and the list file in step order
+class StepWriter : public StepScheduler {
+public:
+	StepWriter(int nSteps, int firstStep, int maxActiveSteps, DAQ::TOFPET::RawScanner *scanner, bool stepCalibration, bool onlineMode,
+		TFile *lmFile, TTree *lmData, TTree *lmIndex, FILE *listFile)
+		: StepScheduler(nSteps, stepCalibration ? 1 : maxActiveSteps),
+		  firstStep(firstStep), scanner(scanner), onlineMode(onlineMode),
+		  lmFile(lmFile), lmData(lmData), lmIndex(lmIndex), listFile(listFile),
+		  steps(nSteps)
+	{
+		stepBegin = 0;
+		stepEnd = 0;
+		for(int n = 0; n < nSteps; n++) {
+			StepInfo &si = steps[n];
+			scanner->getStep(firstStep + n, si.step1, si.step2, si.eventsBegin, si.eventsEnd);
+		}
+	};
+
+	// Called with the output lock held
+	void writeOutput(int step, StepOutput &output) {
+		StepInfo &si = steps[step];
+		if(!isHead(step)) {
+			si.pending.rows.insert(si.pending.rows.end(), output.rows.begin(), output.rows.end());
+			si.pending.list.append(output.list);
+			return;
+		}
+		flush(si, si.pending);
+		flush(si, output);
+	};
+
+	// Builds and runs the pipeline for one step
+	virtual void runStep(int step, float step1, float step2, unsigned long long eventsBegin, unsigned long long eventsEnd) = 0;
+
+protected:
+	void processStep(int step) {
+		StepInfo &si = steps[step];
+		if(si.eventsBegin == si.eventsEnd) return;
+		if(!onlineMode)printf("Step %3d of %3d: %f %f (%llu to %llu)\n", firstStep + step + 1, scanner->getNSteps(), si.step1, si.step2, si.eventsBegin, si.eventsEnd);
+		runStep(step, si.step1, si.step2, si.eventsBegin, si.eventsEnd);
+	};
+
+	void commitStep(int step) {
+		StepInfo &si = steps[step];
+		if(si.eventsBegin == si.eventsEnd) return;
+
+		flush(si, si.pending);
+		if(lmData != NULL) {
+			eventStep1 = si.step1;
+			eventStep2 = si.step2;
+			stepEnd = lmData->GetEntries();
+			lmIndex->Fill();
+			stepBegin = stepEnd;
+			lmFile->Write();
+		}
+	};
+
+private:
+	struct StepInfo {
+		float step1;
+		float step2;
+		unsigned long long eventsBegin;
+		unsigned long long eventsEnd;
+		StepOutput pending;
+	};
+
+	void flush(StepInfo &si, StepOutput &output) {
+		if(lmData != NULL) {
+			eventStep1 = si.step1;
+			eventStep2 = si.step2;
+		}
+		for(unsigned i = 0; lmData != NULL && i < output.rows.size(); i++) {
+			CoincidenceSide &s1 = output.rows[i].side[0];
+			CoincidenceSide &s2 = output.rows[i].side[1];
+
+			event1J = s1.j;
+			event1N = s1.n;
+			event1DeltaT = s1.deltaT;
+			event1Time = s1.time;
+			event1Channel = s1.channel;
+			event1ToT = s1.tot;
+			event1Energy = s1.energy;
+			event1Tac = s1.tac;
+			event1ChannelIdleTime = s1.channelIdleTime;
+			event1TacIdleTime = s1.tacIdleTime;
+			event1TQT = s1.tqT;
+			event1TQE = s1.tqE;
+			event1X = s1.x;
+			event1Y = s1.y;
+			event1Z = s1.z;
+			event1Xi = s1.xi;
+			event1Yi = s1.yi;
+
+			event2J = s2.j;
+			event2N = s2.n;
+			event2DeltaT = s2.deltaT;
+			event2Time = s2.time;
+			event2Channel = s2.channel;
+			event2ToT = s2.tot;
+			event2Energy = s2.energy;
+			event2Tac = s2.tac;
+			event2ChannelIdleTime = s2.channelIdleTime;
+			event2TacIdleTime = s2.tacIdleTime;
+			event2TQT = s2.tqT;
+			event2TQE = s2.tqE;
+			event2X = s2.x;
+			event2Y = s2.y;
+			event2Z = s2.z;
+			event2Xi = s2.xi;
+			event2Yi = s2.yi;
+
+			lmData->Fill();
+		}
+		if(listFile != NULL && output.list.size() > 0) {
+			fwrite(output.list.data(), 1, output.list.size(), listFile);
+		}
+		std::vector<CoincidenceRow>().swap(output.rows);
+		std::string().swap(output.list);
+	};
+
+	int firstStep;
+	DAQ::TOFPET::RawScanner *scanner;
+	bool onlineMode;
+	TFile *lmFile;
+	TTree *lmData;
+	TTree *lmIndex;
+	FILE *listFile;
+	std::vector<StepInfo> steps;
+};
+
 class EventWriterRoot : public EventSink<Coincidence>, public EventSource<Coincidence> {
 public:
-	EventWriterRoot(TTree *lmTree, bool writeBadEvents, float maxDeltaT, int maxN, EventSink<Coincidence> *sink)
-	: EventSource<Coincidence>(sink), lmTree(lmTree), maxDeltaT((long long)(maxDeltaT*1E12)), maxN(maxN)
+	EventWriterRoot(StepWriter *stepWriter, int step, bool writeBadEvents, float maxDeltaT, int maxN, EventSink<Coincidence> *sink)
+	: EventSource<Coincidence>(sink), stepWriter(stepWriter), step(step), maxDeltaT((long long)(maxDeltaT*1E12)), maxN(maxN), writeBadEvents(writeBadEvents)
 	{
 	};
    
@@ -83,6 +279,7 @@ public:
 	void pushEvents(EventBuffer<Coincidence> *buffer) {
 		if(buffer == NULL) return;	
 		
+		StepOutput output;
 		unsigned nEvents = buffer->getSize();
 		for(unsigned i = 0; i < nEvents; i++) {
 			Coincidence &c = buffer->get(i);
@@ -96,7 +293,6 @@ public:
 					Hit &hit1 = *c.photons[0]->hits[j1];
 					Hit &hit2 = *c.photons[1]->hits[j2];
 					
-					long long T = SYSTEM_PERIOD * 1E12;
 					bool isBadEvent1=hit1.badEvent;
 					bool isBadEvent2=hit2.badEvent;
 					if(writeBadEvents==false && (isBadEvent1 || isBadEvent2))continue;
@@ -107,54 +303,20 @@ public:
 					float dt2 = hit2.time - t0_1;
 					if(dt2 > maxDeltaT) continue;
 					
-				
-					event1J = j1;
-					event1N = c.photons[0]->nHits;
-					event1DeltaT = dt1;
-					event1Time = hit1.time;
-					event1Channel = hit1.raw->channelID;
-					event1ToT = 1E-3*(hit1.timeEnd - hit1.time);
-					event1Energy=hit1.energy;
-					event1Tac = hit1.raw->d.tofpet.tac;
-					event1ChannelIdleTime = hit1.raw->channelIdleTime * T * 1E-12;
-					event1TacIdleTime = hit1.raw->d.tofpet.tacIdleTime * T * 1E-12;
-					event1TQT = hit1.tofpet_TQT;
-					event1TQE = hit1.tofpet_TQE;
-					event1X = hit1.x;
-					event1Y = hit1.y;
-					event1Z = hit1.z;
-					event1Xi = hit1.xi;
-					event1Yi = hit1.yi;			
-						
-					event2J = j2;
-					event2N = c.photons[1]->nHits;
-					event2DeltaT = dt2;
-					event2Time = hit2.time;
-					event2Channel = hit2.raw->channelID;
-					event2ToT = 1E-3*(hit2.timeEnd - hit2.time);
-					event2Energy=hit2.energy;
-					event2Tac = hit2.raw->d.tofpet.tac;
-					event2ChannelIdleTime = hit2.raw->channelIdleTime * T * 1E-12;
-					event2TacIdleTime = hit2.raw->d.tofpet.tacIdleTime * T * 1E-12;
-					event2TQT = hit2.tofpet_TQT;
-					event2TQE = hit2.tofpet_TQE;
-					event2X = hit2.x;
-					event2Y = hit2.y;
-					event2Z = hit2.z;
-					event2Xi = hit2.xi;
-					event2Yi = hit2.yi;					
-						
-					lmTree->Fill();
-				   
-					
-				
-
+					CoincidenceRow row;
+					setSide(row.side[0], hit1, j1, c.photons[0]->nHits, dt1);
+					setSide(row.side[1], hit2, j2, c.photons[1]->nHits, dt2);
+					output.rows.push_back(row);
 				}
 					
 			}
 			
 		}
 		
+		stepWriter->lockOutput();
+		stepWriter->writeOutput(step, output);
+		stepWriter->unlockOutput();
+		
 		sink->pushEvents(buffer);
 	};
 	
@@ -162,7 +324,8 @@ public:
 	void finish() { };
 	void report() { };
 private: 
-	TTree *lmTree;
+	StepWriter *stepWriter;
+	int step;
 	long long maxDeltaT;
 	int maxN;
 	bool writeBadEvents;
@@ -170,8 +333,8 @@ private:
 
 class EventWriterRootList : public EventSink<Coincidence>, public EventSource<Coincidence> {
 public:
-	EventWriterRootList(TTree *lmTree, bool writeBadEvents, float maxDeltaT, int maxN, FILE *listFile, float angle, float ctr, EventSink<Coincidence> *sink)
-		: EventSource<Coincidence>(sink), lmTree(lmTree), maxDeltaT((long long)(maxDeltaT*1E12)), maxN(maxN), listFile(listFile), angle(angle), ctr(ctr), writeBadEvents(writeBadEvents)
+	EventWriterRootList(StepWriter *stepWriter, int step, bool writeBadEvents, float maxDeltaT, int maxN, float angle, float ctr, EventSink<Coincidence> *sink)
+		: EventSource<Coincidence>(sink), stepWriter(stepWriter), step(step), maxDeltaT((long long)(maxDeltaT*1E12)), maxN(maxN), angle(angle), ctr(ctr), writeBadEvents(writeBadEvents)
 	{
 	};
    
@@ -182,6 +345,7 @@ public:
 	void pushEvents(EventBuffer<Coincidence> *buffer) {
 		if(buffer == NULL) return;	
 		
+		StepOutput output;
 		unsigned nEvents = buffer->getSize();
 		for(unsigned i = 0; i < nEvents; i++) {
 			Coincidence &c = buffer->get(i);
@@ -195,8 +359,6 @@ public:
 					Hit &hit1 = *c.photons[0]->hits[j1];
 					Hit &hit2 = *c.photons[1]->hits[j2];
 					
-					long long T = SYSTEM_PERIOD * 1E12;
-
 					bool isBadEvent1=hit1.badEvent;
 					bool isBadEvent2=hit2.badEvent;
 					if(writeBadEvents==false && (isBadEvent1 || isBadEvent2))continue;
@@ -204,7 +366,7 @@ public:
 					if(j1==0 && j2==0){
 						long long time = hit1.time + hit2.time;
 						long long deltaTime=hit1.time - hit2.time;
-						fprintf(listFile, "%10.6e\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%d\t%d\t%10.6e\t%10.6e\n", float(0.5E-12*time), angle, hit1.x, hit1.y, hit1.z, hit2.x, hit2.y, hit2.z, hit1.energy, hit2.energy, c.photons[0]->nHits, c.photons[1]->nHits, float(1e-12*deltaTime), ctr); 
+						listPrintf(output.list, "%10.6e\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%d\t%d\t%10.6e\t%10.6e\n", float(0.5E-12*time), angle, hit1.x, hit1.y, hit1.z, hit2.x, hit2.y, hit2.z, hit1.energy, hit2.energy, c.photons[0]->nHits, c.photons[1]->nHits, float(1e-12*deltaTime), ctr); 
 					}
 					
 					float dt1 = hit1.time - t0_1;
@@ -213,51 +375,20 @@ public:
 					float dt2 = hit2.time - t0_1;
 					if(dt2 > maxDeltaT) continue;
 					
-				
-					event1J = j1;
-					event1N = c.photons[0]->nHits;
-					event1DeltaT = dt1;
-					event1Time = hit1.time;
-					event1Channel = hit1.raw->channelID;
-					event1ToT = 1E-3*(hit1.timeEnd - hit1.time);
-					event1Energy=hit1.energy;
-					event1Tac = hit1.raw->d.tofpet.tac;
-					event1ChannelIdleTime = hit1.raw->channelIdleTime * T * 1E-12;
-					event1TacIdleTime = hit1.raw->d.tofpet.tacIdleTime * T * 1E-12;
-					event1TQT = hit1.tofpet_TQT;
-					event1TQE = hit1.tofpet_TQE;
-					event1X = hit1.x;
-					event1Y = hit1.y;
-					event1Z = hit1.z;
-					event1Xi = hit1.xi;
-					event1Yi = hit1.yi;			
-						
-					event2J = j2;
-					event2N = c.photons[1]->nHits;
-					event2DeltaT = dt2;
-					event2Time = hit2.time;
-					event2Channel = hit2.raw->channelID;
-					event2ToT = 1E-3*(hit2.timeEnd - hit2.time);
-					event2Energy=hit2.energy;
-					event2Tac = hit2.raw->d.tofpet.tac;
-					event2ChannelIdleTime = hit2.raw->channelIdleTime * T * 1E-12;
-					event2TacIdleTime = hit2.raw->d.tofpet.tacIdleTime * T * 1E-12;
-					event2TQT = hit2.tofpet_TQT;
-					event2TQE = hit2.tofpet_TQE;
-					event2X = hit2.x;
-					event2Y = hit2.y;
-					event2Z = hit2.z;
-					event2Xi = hit2.xi;
-					event2Yi = hit2.yi;					
-						
-					lmTree->Fill();
-				   
+					CoincidenceRow row;
+					setSide(row.side[0], hit1, j1, c.photons[0]->nHits, dt1);
+					setSide(row.side[1], hit2, j2, c.photons[1]->nHits, dt2);
+					output.rows.push_back(row);
 				}
 					
 			}
 			
 		}
 		
+		stepWriter->lockOutput();
+		stepWriter->writeOutput(step, output);
+		stepWriter->unlockOutput();
+		
 		sink->pushEvents(buffer);
 	};
 	
@@ -265,10 +396,10 @@ public:
 	void finish() { };
 	void report() { };
 private: 
-	TTree *lmTree;
+	StepWriter *stepWriter;
+	int step;
 	long long maxDeltaT;
 	int maxN;	
-	FILE *listFile;
 	float angle;
 	float ctr;
 	bool writeBadEvents;
@@ -279,8 +410,8 @@ private:
 class EventWriterList : public EventSink<Coincidence>, public EventSource<Coincidence> {
 public:
 	
-	EventWriterList(FILE *listFile, bool writeBadEvents, float angle, float ctr, EventSink<Coincidence> *sink)
-		: EventSource<Coincidence>(sink), listFile(listFile), angle(angle), ctr(ctr), writeBadEvents(writeBadEvents)
+	EventWriterList(StepWriter *stepWriter, int step, bool writeBadEvents, float angle, float ctr, EventSink<Coincidence> *sink)
+		: EventSource<Coincidence>(sink), stepWriter(stepWriter), step(step), angle(angle), ctr(ctr), writeBadEvents(writeBadEvents)
 	{
 	};
 
@@ -292,6 +423,7 @@ public:
 	void pushEvents(EventBuffer<Coincidence> *buffer) {
 		if(buffer == NULL) return;	
 		
+		StepOutput output;
 		unsigned nEvents = buffer->getSize();
 		for(unsigned i = 0; i < nEvents; i++) {
 			Coincidence &c = buffer->get(i);
@@ -315,11 +447,15 @@ public:
 			//if(j1!=0 || j2!=0)continue;
 			long long time = hit1.time + hit2.time;
 			long long deltaTime=hit1.time - hit2.time;
-			fprintf(listFile, "%10.6e\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%d\t%d\t%10.6e\t%10.6e\n", float(0.5E-12*time), angle, hit1.x, hit1.y, hit1.z, hit2.x, hit2.y, hit2.z, hit1.energy, hit2.energy, c.photons[0]->nHits, c.photons[1]->nHits, float(1e-12*deltaTime), ctr); 
+			listPrintf(output.list, "%10.6e\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%f\t%d\t%d\t%10.6e\t%10.6e\n", float(0.5E-12*time), angle, hit1.x, hit1.y, hit1.z, hit2.x, hit2.y, hit2.z, hit1.energy, hit2.energy, c.photons[0]->nHits, c.photons[1]->nHits, float(1e-12*deltaTime), ctr); 
 					
 
 		}
 				  	
+		stepWriter->lockOutput();
+		stepWriter->writeOutput(step, output);
+		stepWriter->unlockOutput();
+		
 		sink->pushEvents(buffer);
 	};
 	
@@ -327,7 +463,8 @@ public:
 	void finish() { };
 	void report() { };
 private: 
-	FILE *listFile;
+	StepWriter *stepWriter;
+	int step;
 	float angle;
 	float ctr;
 	bool writeBadEvents;
@@ -336,8 +473,8 @@ private:
 #ifdef __ENDOTOFPET__	
 class EventWriterListE : public EventSink<Coincidence>, EventSource<Coincidence> {
 public:
-	EventWriterListE(FILE *listFile, bool writeBadEvents, EventSink<Coincidence> *sink)
-		: EventSource<Coincidence>(sink) , listFile(listFile),  writeBadEvents(writeBadEvents) {
+	EventWriterListE(StepWriter *stepWriter, int step, bool writeBadEvents, EventSink<Coincidence> *sink)
+		: EventSource<Coincidence>(sink), stepWriter(stepWriter), step(step), writeBadEvents(writeBadEvents) {
 	};
 	
 	~EventWriterListE() {
@@ -347,6 +484,7 @@ public:
 	void pushEvents(EventBuffer<Coincidence> *buffer) {
 		if(buffer == NULL) return;	
 		
+		StepOutput output;
 		unsigned nEvents = buffer->getSize();
 		for(unsigned i = 0; i < nEvents; i++) {
 			Coincidence &c = buffer->get(i);
@@ -367,16 +505,20 @@ public:
 			int absIndex = xi1 + 64 * yi1 + 64 * 64 * xi2 + 64*64*4 * yi2;
 					//if(absIndex == 45070) printf("DBG %4d %4d %4d %4d %8d\n", xi1, yi1, xi2, yi2, absIndex);
 					
-			fprintf(listFile, "%d\t%lf\t%le\t%f\t%f\t%f\t%f\n",
+			listPrintf(output.list, "%d\t%lf\t%le\t%f\t%f\t%f\t%f\n",
 					absIndex,						
 					double(hit1.time) * 1E-12,
 					double(hit1.time - hit2.time)*1E-12,
 					hit1.energy,
 					hit2.energy,
-					0, 
-					0
+					0.0, 
+					0.0
 					);						
 		}
+		stepWriter->lockOutput();
+		stepWriter->writeOutput(step, output);
+		stepWriter->unlockOutput();
+		
 		sink->pushEvents(buffer);
 	};
 	
@@ -384,11 +526,116 @@ public:
 	void finish() { };
 	void report() { };
 private: 
-	FILE *listFile;
+	StepWriter *stepWriter;
+	int step;
 	bool writeBadEvents;
 };
 #endif
 
+class CoincidenceStepWriter : public StepWriter {
+public:
+	CoincidenceStepWriter(int nSteps, int firstStep, int maxActiveSteps, DAQ::TOFPET::RawScanner *scanner,
+		char *inputFilePrefix, char rawV, float readBackTime, bool onlineMode,
+		const char *setupFileName, bool stepCalibration, DAQ::TOFPET::P2 *P2,
+		DAQ::Common::SystemInformation *systemInformation,
+		bool useROOT, bool useLIST, float acqAngle, float ctrEstimate, 
+		float cWindow, float gWindow, int maxHits, float gWindowRoot, int maxHitsRoot,
+		float minEnergy, float maxEnergy, float minToT,
+		TFile *lmFile, TTree *lmData, TTree *lmIndex, FILE *listFile)
+		: StepWriter(nSteps, firstStep, maxActiveSteps, scanner, stepCalibration, onlineMode, 
+			     useROOT ? lmFile : NULL, useROOT ? lmData : NULL, useROOT ? lmIndex : NULL, useLIST ? listFile : NULL),
+		  inputFilePrefix(inputFilePrefix), rawV(rawV), readBackTime(readBackTime), onlineMode(onlineMode),
+		  setupFileName(setupFileName), stepCalibration(stepCalibration), P2(P2), systemInformation(systemInformation),
+		  useROOT(useROOT), useLIST(useLIST), acqAngle(acqAngle), ctrEstimate(ctrEstimate),
+		  cWindow(cWindow), gWindow(gWindow), maxHits(maxHits), gWindowRoot(gWindowRoot), maxHitsRoot(maxHitsRoot),
+		  minEnergy(minEnergy), maxEnergy(maxEnergy), minToT(minToT)
+	{
+	};
+
+	void runStep(int step, float step1, float step2, unsigned long long eventsBegin, unsigned long long eventsEnd) {
+		// Step dependent calibrations force maxActiveSteps to 1, so P2 is never shared while reloading
+		if(stepCalibration) {
+			P2->loadFiles(setupFileName, true, true, step1, step2);
+		}
+	
+		float gRadius = 20; // mm 
+		// Round up cWindow and minToT for use in CoincidenceFilter
+		float cWindowCoarse = (ceil(cWindow/SYSTEM_PERIOD)) * SYSTEM_PERIOD;
+		float minToTCoarse = (ceil(minToT/SYSTEM_PERIOD) + 2) * SYSTEM_PERIOD;
+
+		EventSink<Coincidence> * writer = NULL;
+
+#ifndef __ENDOTOFPET__	
+		if(useROOT == false) {
+			writer = new EventWriterList(this, step, false, acqAngle, ctrEstimate, new NullSink<Coincidence>());
+		}
+#else
+		if(useROOT == false) {
+			writer = new EventWriterListE(this, step, false, new NullSink<Coincidence>());
+		}
+#endif
+		else if(useLIST==false) {
+			writer = new EventWriterRoot(this, step, false, gWindow, maxHitsRoot, new NullSink<Coincidence>());
+		}
+		else {
+			writer = new EventWriterRootList(this, step, false, gWindow, maxHitsRoot, acqAngle, ctrEstimate, new NullSink<Coincidence>());
+		}
+
+
+
+		DAQ::TOFPET::RawReader *reader=NULL;
+
+#ifndef __ENDOTOFPET__	
+		EventSink<RawHit> * pipeSink= new CoincidenceFilter(systemInformation, cWindowCoarse, minToTCoarse,
+				new P2Extract(P2, false, 0.0, 0.20, true,
+				new CrystalPositions(systemInformation,
+				new NaiveGrouper(gRadius, gWindow, minEnergy, maxEnergy, maxHits,
+				new CoincidenceGrouper(cWindow,
+				writer
+			    )))));
+	
+		if(rawV=='3') 
+			reader = new DAQ::TOFPET::RawReaderV3(inputFilePrefix, SYSTEM_PERIOD,  eventsBegin, eventsEnd , readBackTime, onlineMode, pipeSink);
+	    else if(rawV=='2')
+		    reader = new DAQ::TOFPET::RawReaderV2(inputFilePrefix, SYSTEM_PERIOD,  eventsBegin, eventsEnd, pipeSink);
+#else
+			reader = new DAQ::ENDOTOFPET::RawReaderE(inputFilePrefix, SYSTEM_PERIOD,  eventsBegin, eventsEnd,
+				new CoincidenceFilter(systemInformation, cWindowCoarse, minToTCoarse,
+				new DAQ::ENDOTOFPET::Extract(new P2Extract(P2, false, 0.0, 0.20, true, NULL), new DAQ::STICv3::Sticv3Handler() , NULL,
+				new CrystalPositions(systemInformation,
+				new NaiveGrouper(gRadius, gWindow, minEnergy, maxEnergy, maxHits,
+				new CoincidenceGrouper(cWindow,
+				writer
+			))))));
+		
+#endif		
+		reader->wait();
+		delete reader;
+	};
+
+private:
+	char *inputFilePrefix;
+	char rawV;
+	float readBackTime;
+	bool onlineMode;
+	const char *setupFileName;
+	bool stepCalibration;
+	DAQ::TOFPET::P2 *P2;
+	DAQ::Common::SystemInformation *systemInformation;
+	bool useROOT;
+	bool useLIST;
+	float acqAngle;
+	float ctrEstimate;
+	float cWindow;
+	float gWindow;
+	int maxHits;
+	float gWindowRoot;
+	int maxHitsRoot;
+	float minEnergy;
+	float maxEnergy;
+	float minToT;
+};
+
 
 
 void displayHelp(char * program)
@@ -396,6 +643,7 @@ void displayHelp(char * program)
 	fprintf(stderr, "usage: %s setup_file rawfiles_prefix output_file_prefix\n", program);
 	fprintf(stderr, "\noptional arguments:\n");
 	fprintf(stderr,  "  --help \t\t\t Show this help message and exit \n");
+	fprintf(stderr,  "  --parallel-steps=N\t\t Number of steps processed concurrently (default is 4)\n");
 #ifndef __ENDOTOFPET__	
 	fprintf(stderr,  "  --onlineMode\t Use this flag to process data in real time during acquisition\n");
 	fprintf(stderr,  "  --acqDeltaTime=ACQDELTATIME\t If online mode is chosen, this variable defines how much data time (in seconds) to process (default is -1 which selects all data for the current step)\n");
@@ -443,6 +691,7 @@ int main(int argc, char *argv[])
 		{ "gMaxHits", required_argument,0,0 },
 		{ "gWindowRoot", required_argument,0,0 },
 		{ "gMaxHitsRoot", required_argument,0,0 },
+		{ "parallel-steps", required_argument,0,0 },
 		{ NULL, 0, 0, 0 }
 	};
 #ifndef __ENDOTOFPET__
@@ -451,13 +700,14 @@ int main(int argc, char *argv[])
 	float readBackTime=-1;
 #endif
 	bool onlineMode=false;
+	int maxActiveSteps = 4;
 	bool useROOT=true;
 	bool useLIST=false;
 	float acqAngle=0;
 	float ctrEstimate;
-	FILE * outListFile;
-	TFile *lmFile;
-	TTree *lmData, *lmIndex;
+	FILE * outListFile = NULL;
+	TFile *lmFile = NULL;
+	TTree *lmData = NULL, *lmIndex = NULL;
 
 	float cWindow = 20E-9; // s
 	float gWindow = 100E-9; // s
@@ -557,6 +807,10 @@ int main(int argc, char *argv[])
 			nOptArgs++;
 			maxHitsRoot=atoi(optarg);
 		}
+		else if(optionIndex==15){
+			nOptArgs++;
+			maxActiveSteps=atoi(optarg);
+		}
 		else{
 			displayUsage(argv[0]);
 			fprintf(stderr, "\n%s: error: Unknown option!\n", argv[0]);
@@ -660,88 +914,27 @@ int main(int argc, char *argv[])
 	}
 		
 
-	stepBegin = 0;
-	stepEnd = 0;
 	int N = scanner->getNSteps();
-	for(int step = 0; step < N; step++) {
-		unsigned long long eventsBegin;
-		unsigned long long eventsEnd;
-		if(onlineMode)step=N-1;
-	
-		scanner->getStep(step, eventStep1, eventStep2, eventsBegin, eventsEnd);	
-		if(eventsBegin==eventsEnd)continue;
-		if(!onlineMode)printf("Step %3d of %3d: %f %f (%llu to %llu)\n", step+1, scanner->getNSteps(), eventStep1, eventStep2, eventsBegin, eventsEnd);
-		if(N!=1){
-			if (strcmp(setupFileName, "none") == 0) {
-				P2->setAll(2.0);
-				printf("BIG FAT WARNING: no calibration file\n");
-			} 
-			else{
-				P2->loadFiles(setupFileName, true, true,eventStep1,eventStep2);
-			}
-		}
-		
-	
-		float gRadius = 20; // mm 
-		// Round up cWindow and minToT for use in CoincidenceFilter
-		float cWindowCoarse = (ceil(cWindow/SYSTEM_PERIOD)) * SYSTEM_PERIOD;
-		float minToTCoarse = (ceil(minToT/SYSTEM_PERIOD) + 2) * SYSTEM_PERIOD;
-
-		EventSink<Coincidence> * writer = NULL;
+	bool stepCalibration = N != 1 && strcmp(setupFileName, "none") != 0 && TOFPET::P2::isStepDependent(setupFileName);
 
-#ifndef __ENDOTOFPET__	
-		if(useROOT == false) {
-			writer = new EventWriterList(outListFile, false, acqAngle, ctrEstimate, new NullSink<Coincidence>());
-		}
+#ifndef __ENDOTOFPET__
+	char rawVersion = rawV[0];
 #else
-		if(useROOT == false) {
-			writer = new EventWriterListE(outListFile, false, new NullSink<Coincidence>());
-		}
+	char rawVersion = 'E';
+	float readBackTime = -1;
 #endif
-		else if(useLIST==false) {
-			writer = new EventWriterRoot(lmData, false, gWindow, maxHitsRoot, new NullSink<Coincidence>());
-		}
-		else {
-			writer = new EventWriterRootList(lmData, false, gWindow, maxHitsRoot, outListFile, acqAngle, ctrEstimate, new NullSink<Coincidence>());
-		}
-
-
-
-		DAQ::TOFPET::RawReader *reader=NULL;
-
-#ifndef __ENDOTOFPET__	
-		EventSink<RawHit> * pipeSink= new CoincidenceFilter(systemInformation, cWindowCoarse, minToTCoarse,
-				new P2Extract(P2, false, 0.0, 0.20, true,
-				new CrystalPositions(systemInformation,
-				new NaiveGrouper(gRadius, gWindow, minEnergy, maxEnergy, maxHits,
-				new CoincidenceGrouper(cWindow,
-				writer
-			    )))));
+	// In online mode, only the last step is processed
+	int firstStep = (onlineMode && N > 0) ? N-1 : 0;
+	StepWriter *stepWriter = new CoincidenceStepWriter(N - firstStep, firstStep, maxActiveSteps, scanner,
+		inputFilePrefix, rawVersion, readBackTime, onlineMode,
+		setupFileName, stepCalibration, P2, systemInformation,
+		useROOT, useLIST, acqAngle, ctrEstimate,
+		cWindow, gWindow, maxHits, gWindowRoot, maxHitsRoot,
+		minEnergy, maxEnergy, minToT,
+		lmFile, lmData, lmIndex, outListFile);
+	stepWriter->run();
+	delete stepWriter;
 	
-		if(rawV[0]=='3') 
-			reader = new DAQ::TOFPET::RawReaderV3(inputFilePrefix, SYSTEM_PERIOD,  eventsBegin, eventsEnd , readBackTime, onlineMode, pipeSink);
-	    else if(rawV[0]=='2')
-		    reader = new DAQ::TOFPET::RawReaderV2(inputFilePrefix, SYSTEM_PERIOD,  eventsBegin, eventsEnd, pipeSink);
-#else
-			reader = new DAQ::ENDOTOFPET::RawReaderE(inputFilePrefix, SYSTEM_PERIOD,  eventsBegin, eventsEnd,
-				new CoincidenceFilter(systemInformation, cWindowCoarse, minToTCoarse,
-				new DAQ::ENDOTOFPET::Extract(new P2Extract(P2, false, 0.0, 0.20, true, NULL), new DAQ::STICv3::Sticv3Handler() , NULL,
-				new CrystalPositions(systemInformation,
-				new NaiveGrouper(gRadius, gWindow, minEnergy, maxEnergy, maxHits,
-				new CoincidenceGrouper(cWindow,
-				writer
-			))))));
-		
-#endif		
-		reader->wait();
-		delete reader;
-		if(useROOT){
-			stepEnd = lmData->GetEntries();
-			lmIndex->Fill();
-			stepBegin = stepEnd;
-			lmFile->Write();
-		}
-	}
 	delete scanner;
 	delete systemInformation;
 	if(useROOT)lmFile->Close();
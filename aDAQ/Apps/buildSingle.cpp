@@ -10,10 +10,12 @@
 #include <Common/Constants.hpp>
 #include <Common/Utils.hpp>
 #include <Core/CrystalPositions.hpp>
+#include <Core/StepScheduler.hpp>
 #include <assert.h>
 #include <math.h>
 #include <string.h>
 #include <getopt.h>
+#include <vector>
 
 using namespace DAQ;
 using namespace DAQ::Core;
@@ -42,13 +44,33 @@ static float 		eventZ;
 static float		eventTQT;
 static float		eventTQE;
 
+// One lmData entry, kept while its step waits for the previous ones to be committed
+struct SingleEvent {
+	long long	time;
+	unsigned short	channel;
+	float		tot;
+	float		energy;
+	double		channelIdleTime;
+	unsigned short	tac;
+	double		tacIdleTime;
+	int		xi;
+	int		yi;
+	float		x;
+	float		y;
+	float		z;
+	float		tqT;
+	float		tqE;
+};
+
+class StepWriter;
+
 class EventWriter : public EventSink<Hit>, public EventSource<Hit> {
 
 
 
 public:
-	EventWriter(TTree *lmDataTuple, bool writeBadEvents, EventSink<Hit> *sink) 
-		: EventSource<Hit>(sink), lmDataTuple(lmDataTuple), writeBadEvents(writeBadEvents) {
+	EventWriter(StepWriter *stepWriter, int step, bool writeBadEvents, EventSink<Hit> *sink) 
+		: EventSource<Hit>(sink), stepWriter(stepWriter), step(step), writeBadEvents(writeBadEvents) {
 		
 	};
 	
@@ -56,51 +78,199 @@ public:
 		
 	};
 
-	void pushEvents(EventBuffer<Hit> *buffer) {
-		if(buffer == NULL) return;	
-		
-		unsigned nEvents = buffer->getSize();
-		for(unsigned i = 0; i < nEvents; i++) {
-			Hit &hit = buffer->get(i);
-			
-			bool isBadEvent = hit.badEvent;
-			if(writeBadEvents==false && isBadEvent)continue;
-			long long T = SYSTEM_PERIOD * 1E12;
-			eventTime = hit.time;
-			eventChannel = hit.raw->channelID;
-			eventToT = 1E-3*(hit.timeEnd - hit.time);
-			eventEnergy = hit.energy;
-			eventTac = hit.raw->d.tofpet.tac;
-			eventChannelIdleTime = hit.raw->channelIdleTime * T * 1E-12;
-			eventTacIdleTime = hit.raw->d.tofpet.tacIdleTime * T * 1E-12;
-			eventTQT = hit.tofpet_TQT;
-			eventTQE = hit.tofpet_TQE;
-			eventX = hit.x;
-			eventY = hit.y;
-			eventZ = hit.z;
-			eventXi = hit.xi;
-			eventYi = hit.yi;
-			
-			lmDataTuple->Fill();
-		}
-		
-		sink->pushEvents(buffer);
-	};
+	void pushEvents(EventBuffer<Hit> *buffer);
 	
 	void pushT0(double t0) { };
 	void finish() { };
 	void report() { };
 private: 
-	TTree *lmDataTuple;
+	StepWriter *stepWriter;
+	int step;
 	bool writeBadEvents;
 
 };
 
+// Processes several steps at a time, filling lmData and lmIndex in step order
+class StepWriter : public StepScheduler {
+public:
+	StepWriter(int nSteps, int firstStep, int maxActiveSteps,
+		DAQ::TOFPET::RawScanner *scanner, char *inputFilePrefix, char rawV, float readBackTime, bool onlineMode,
+		const char *setupFileName, bool stepCalibration, TOFPET::P2 *P2, 
+		DAQ::Common::SystemInformation *systemInformation,
+		TFile *lmFile, TTree *lmData, TTree *lmIndex) 
+		: StepScheduler(nSteps, stepCalibration ? 1 : maxActiveSteps), 
+		  firstStep(firstStep), scanner(scanner), inputFilePrefix(inputFilePrefix), rawV(rawV), readBackTime(readBackTime), onlineMode(onlineMode),
+		  setupFileName(setupFileName), stepCalibration(stepCalibration), P2(P2), systemInformation(systemInformation),
+		  lmFile(lmFile), lmData(lmData), lmIndex(lmIndex), 
+		  steps(nSteps)
+	{
+		stepBegin = 0;
+		stepEnd = 0;
+		for(int n = 0; n < nSteps; n++) {
+			StepInfo &si = steps[n];
+			scanner->getStep(firstStep + n, si.step1, si.step2, si.eventsBegin, si.eventsEnd);
+		}
+	};
+
+	// Called with the output lock held
+	void writeEvents(int step, std::vector<SingleEvent> &events) {
+		StepInfo &si = steps[step];
+		if(!isHead(step)) {
+			si.pending.insert(si.pending.end(), events.begin(), events.end());
+			return;
+		}
+		fill(si, si.pending);
+		std::vector<SingleEvent>().swap(si.pending);
+		fill(si, events);
+	};
+
+protected:
+	void processStep(int step) {
+		StepInfo &si = steps[step];
+		if(si.eventsBegin == si.eventsEnd) return;
+		if(!onlineMode)printf("Step %3d of %3d: %f %f (%llu to %llu)\n", firstStep + step + 1, scanner->getNSteps(), si.step1, si.step2, si.eventsBegin, si.eventsEnd);
+
+		// Step dependent calibrations force maxActiveSteps to 1, so P2 is never shared while reloading
+		if(stepCalibration) {
+			P2->loadFiles(setupFileName, true, true, si.step1, si.step2);
+		}
+	
+		DAQ::TOFPET::RawReader *reader=NULL;	
+
+#ifndef __ENDOTOFPET__	
+		EventSink<RawHit> * pipeSink = 	
+				new P2Extract(P2, false, 0.0, 0.20, false,
+				new CrystalPositions(systemInformation,
+				new EventWriter(this, step, false,
+				new NullSink<Hit>()
+		        )));
+	
+		if(rawV=='3') 
+			reader = new DAQ::TOFPET::RawReaderV3(inputFilePrefix, SYSTEM_PERIOD,  si.eventsBegin, si.eventsEnd, readBackTime, onlineMode,pipeSink);
+		else if(rawV=='2')
+		    reader = new DAQ::TOFPET::RawReaderV2(inputFilePrefix, SYSTEM_PERIOD,  si.eventsBegin, si.eventsEnd, pipeSink);
+#else
+		reader = new DAQ::ENDOTOFPET::RawReaderE(inputFilePrefix, SYSTEM_PERIOD,  si.eventsBegin, si.eventsEnd,
+				new DAQ::ENDOTOFPET::Extract(new P2Extract(P2, false, 0.0, 0.20, false, NULL), new DAQ::STICv3::Sticv3Handler() , NULL,
+				new CrystalPositions(systemInformation,
+				new EventWriter(this, step, false,
+				new NullSink<Hit>()
+				))));		
+#endif
+
+		reader->wait();
+		delete reader;
+	};
+
+	void commitStep(int step) {
+		StepInfo &si = steps[step];
+		if(si.eventsBegin == si.eventsEnd) return;
+
+		fill(si, si.pending);
+		std::vector<SingleEvent>().swap(si.pending);
+		
+		eventStep1 = si.step1;
+		eventStep2 = si.step2;
+		stepEnd = lmData->GetEntries();
+		lmIndex->Fill();
+		stepBegin = stepEnd;
+		
+		lmFile->Write();
+	};
+
+private:
+	struct StepInfo {
+		float step1;
+		float step2;
+		unsigned long long eventsBegin;
+		unsigned long long eventsEnd;
+		std::vector<SingleEvent> pending;
+	};
+
+	void fill(StepInfo &si, std::vector<SingleEvent> &events) {
+		eventStep1 = si.step1;
+		eventStep2 = si.step2;
+		for(unsigned i = 0; i < events.size(); i++) {
+			SingleEvent &e = events[i];
+			eventTime = e.time;
+			eventChannel = e.channel;
+			eventToT = e.tot;
+			eventEnergy = e.energy;
+			eventTac = e.tac;
+			eventChannelIdleTime = e.channelIdleTime;
+			eventTacIdleTime = e.tacIdleTime;
+			eventTQT = e.tqT;
+			eventTQE = e.tqE;
+			eventX = e.x;
+			eventY = e.y;
+			eventZ = e.z;
+			eventXi = e.xi;
+			eventYi = e.yi;
+			
+			lmData->Fill();
+		}
+	};
+
+	int firstStep;
+	DAQ::TOFPET::RawScanner *scanner;
+	char *inputFilePrefix;
+	char rawV;
+	float readBackTime;
+	bool onlineMode;
+	const char *setupFileName;
+	bool stepCalibration;
+	TOFPET::P2 *P2;
+	DAQ::Common::SystemInformation *systemInformation;
+	TFile *lmFile;
+	TTree *lmData;
+	TTree *lmIndex;
+	std::vector<StepInfo> steps;
+};
+
+void EventWriter::pushEvents(EventBuffer<Hit> *buffer)
+{
+	if(buffer == NULL) return;	
+	
+	std::vector<SingleEvent> events;
+	unsigned nEvents = buffer->getSize();
+	events.reserve(nEvents);
+	for(unsigned i = 0; i < nEvents; i++) {
+		Hit &hit = buffer->get(i);
+		
+		bool isBadEvent = hit.badEvent;
+		if(writeBadEvents==false && isBadEvent)continue;
+		long long T = SYSTEM_PERIOD * 1E12;
+		SingleEvent e;
+		e.time = hit.time;
+		e.channel = hit.raw->channelID;
+		e.tot = 1E-3*(hit.timeEnd - hit.time);
+		e.energy = hit.energy;
+		e.tac = hit.raw->d.tofpet.tac;
+		e.channelIdleTime = hit.raw->channelIdleTime * T * 1E-12;
+		e.tacIdleTime = hit.raw->d.tofpet.tacIdleTime * T * 1E-12;
+		e.tqT = hit.tofpet_TQT;
+		e.tqE = hit.tofpet_TQE;
+		e.x = hit.x;
+		e.y = hit.y;
+		e.z = hit.z;
+		e.xi = hit.xi;
+		e.yi = hit.yi;
+		events.push_back(e);
+	}
+	
+	stepWriter->lockOutput();
+	stepWriter->writeEvents(step, events);
+	stepWriter->unlockOutput();
+	
+	sink->pushEvents(buffer);
+}
+
 void displayHelp(char * program)
 {
 	fprintf(stderr, "usage: %s setup_file rawfiles_prefix output_file\n", program);
 	fprintf(stderr, "\noptional arguments:\n");
 	fprintf(stderr,  "  --help \t\t\t Show this help message and exit \n");
+	fprintf(stderr,  "  --parallel-steps=N\t\t Number of steps processed concurrently (default is 4)\n");
 #ifndef __ENDOTOFPET__	
 	fprintf(stderr,  "  --onlineMode\t Use this flag to process data in real time during acquisition\n");
 	fprintf(stderr,  "  --acqDeltaTime=ACQDELTATIME\t If online mode is chosen, this variable defines how much data time (in seconds) to process (default is -1 which selects all data for the current step)\n");
@@ -124,7 +294,9 @@ int main(int argc, char *argv[])
 		{ "help", no_argument, 0, 0 },
 		{ "onlineMode", no_argument,0,0 },
 		{ "acqDeltaTime", required_argument,0,0 },
-		{ "raw_version", required_argument,0,0 }
+		{ "raw_version", required_argument,0,0 },
+		{ "parallel-steps", required_argument,0,0 },
+		{ NULL, 0, 0, 0 }
 	};
 #ifndef __ENDOTOFPET__
 	char rawV[128];
@@ -132,6 +304,7 @@ int main(int argc, char *argv[])
 	float readBackTime=-1;
 #endif
 	bool onlineMode=false;
+	int maxActiveSteps = 4;
 
 	int optionIndex = -1;
 	int nOptArgs=0;
@@ -144,6 +317,10 @@ int main(int argc, char *argv[])
 			displayHelp(argv[0]);
 			return(1);
 		}
+		else if(optionIndex==4){
+			nOptArgs++;
+			maxActiveSteps = atoi(optarg);
+		}
 #ifndef __ENDOTOFPET__	
 		else if(optionIndex==1){
 			nOptArgs++;
@@ -153,7 +330,7 @@ int main(int argc, char *argv[])
 			nOptArgs++;
 			readBackTime=atof(optarg);
 		}
-		if(optionIndex==3){
+		else if(optionIndex==3){
 			nOptArgs++;
 			sprintf(rawV,optarg);
 			if(rawV[0]!='2' && rawV[0]!='3'){
@@ -238,62 +415,24 @@ int main(int argc, char *argv[])
 	lmIndex->Branch("stepBegin", &stepBegin, bs);
 	lmIndex->Branch("stepEnd", &stepEnd, bs);	
 
-	stepBegin = 0;
-	stepEnd = 0;
 	int N = scanner->getNSteps();
-	for(int step = 0; step < N; step++) {
-		unsigned long long eventsBegin;
-		unsigned long long eventsEnd;
-        
-		if(onlineMode)step=N-1;
-		
-		scanner->getStep(step, eventStep1, eventStep2, eventsBegin, eventsEnd);
-		if(eventsBegin==eventsEnd)continue;
-		if(!onlineMode)printf("Step %3d of %3d: %f %f (%llu to %llu)\n", step+1, scanner->getNSteps(), eventStep1, eventStep2, eventsBegin, eventsEnd);
-
-		if(N!=1){
-			if (strcmp(setupFileName, "none") == 0) {
-				P2->setAll(2.0);
-				printf("BIG FAT WARNING: no calibration file\n");
-			} 
-			else{
-				P2->loadFiles(setupFileName, true, true,eventStep1,eventStep2);
-			}
-		}
+	bool stepCalibration = N != 1 && strcmp(setupFileName, "none") != 0 && TOFPET::P2::isStepDependent(setupFileName);
 	
-		DAQ::TOFPET::RawReader *reader=NULL;	
-
-#ifndef __ENDOTOFPET__	
-		EventSink<RawHit> * pipeSink = 	
-				new P2Extract(P2, false, 0.0, 0.20, false,
-				new CrystalPositions(systemInformation,
-				new EventWriter(lmData, false,
-				new NullSink<Hit>()
-		        )));
-	
-		if(rawV[0]=='3') 
-			reader = new DAQ::TOFPET::RawReaderV3(inputFilePrefix, SYSTEM_PERIOD,  eventsBegin, eventsEnd, readBackTime, onlineMode,pipeSink);
-		else if(rawV[0]=='2')
-		    reader = new DAQ::TOFPET::RawReaderV2(inputFilePrefix, SYSTEM_PERIOD,  eventsBegin, eventsEnd, pipeSink);
+#ifndef __ENDOTOFPET__
+	char rawVersion = rawV[0];
 #else
-		reader = new DAQ::ENDOTOFPET::RawReaderE(inputFilePrefix, SYSTEM_PERIOD,  eventsBegin, eventsEnd,
-				new DAQ::ENDOTOFPET::Extract(new P2Extract(P2, false, 0.0, 0.20, false, NULL), new DAQ::STICv3::Sticv3Handler() , NULL,
-				new CrystalPositions(systemInformation,
-				new EventWriter(lmData, false,
-				new NullSink<Hit>()
-				))));		
+	char rawVersion = 'E';
+	float readBackTime = -1;
 #endif
-
-
-		reader->wait();
-		delete reader;
-		
-		stepEnd = lmData->GetEntries();
-		lmIndex->Fill();
-		stepBegin = stepEnd;
-		
-		lmFile->Write();
-	}
+	// In online mode, only the last step is processed
+	int firstStep = (onlineMode && N > 0) ? N-1 : 0;
+	StepWriter *stepWriter = new StepWriter(N - firstStep, firstStep, maxActiveSteps,
+		scanner, inputFilePrefix, rawVersion, readBackTime, onlineMode,
+		setupFileName, stepCalibration, P2, systemInformation,
+		lmFile, lmData, lmIndex);
+	stepWriter->run();
+	delete stepWriter;
+	
 	delete scanner;
 	delete systemInformation;
 	lmFile->Close();
@@ -13,6 +13,8 @@
 #include <STICv3/sticv3Handler.hpp>
 #include <TOFPET/P2Extract.hpp>
 #include <TOFPET/P2.hpp>
+#include <TOFPET/TQHistograms.hpp>
+#include <Core/OverlappedEventHandler.hpp>
 #include <Common/Constants.hpp>
 #include <Common/Utils.hpp>
 #include <Core/CrystalPositions.hpp>
@@ -20,6 +22,8 @@
 #include <math.h>
 #include <string.h>
 #include <getopt.h>
+#include <vector>
+#include <string>
 
 using namespace DAQ;
 using namespace DAQ::Core;
@@ -33,128 +37,126 @@ static float		eventStep2;
 static long long 	stepBegin;
 static long long 	stepEnd;
 
-static long long	eventTime;
-static unsigned short	eventChannel;
-static float		eventToT;
-static float		eventTQT;
-static float		eventTQE;
-
-class TQCorrWriter : public EventSink<Hit>, public EventSource<Hit>{
-
-
-
+class TQCorrWriter : public OverlappedEventHandler<Hit, Hit> {
 public:
-	TQCorrWriter(FILE *tQcalFile, bool writeBadEvents, P2 *lut, EventSink<Hit> *sink) 
-		: EventSource<Hit>(sink), tQcalFile(tQcalFile), lut(lut), writeBadEvents(writeBadEvents){
+	TQCorrWriter(FILE *tQcalFile, bool writeBadEvents, P2 *lut, std::vector<std::string> &loadStateFiles, const char *saveStateFile, EventSink<Hit> *sink) 
+		: OverlappedEventHandler<Hit, Hit>(sink), tQcalFile(tQcalFile), lut(lut), writeBadEvents(writeBadEvents), saveStateFile(saveStateFile) {
 		
 		start_t = 1.;
 		end_t = 3.;
 		start_e = 1.;
 		end_e = 3.;
-		char hist_T[128];
-		char hist_E[128];
-		
-		for(int channel=0; channel<SYSTEM_NCHANNELS; channel++){
-			sprintf(hist_T,"htqT_ch%d",channel);   
-			sprintf(hist_E,"htqE_ch%d",channel);   
-			if(int(lut->nBins_tqT[channel]) > 0){
-				htqT2D[channel] = new TH2D(hist_T, "tqt vs ToT",int(lut->nBins_tqT[channel]),1,3,6,0,300);
-			}
-			else{
-				htqT2D[channel] = new TH2D(hist_T, "tqt vs ToT",300,1,3,6,0,300);
-			}
-			if(int(lut->nBins_tqE[channel]) > 0){
-				htqE2D[channel] = new TH2D(hist_E, "tqE vs ToT",int(lut->nBins_tqE[channel]),1,3,6,0,300);
-			}
-			else{
-				htqE2D[channel] = new TH2D(hist_E, "tqE vs ToT",300,1,3,6,0,300);
-			}
 		
+		// Histograms from previous runs are accumulated into the total
+		total = new TQHistograms(lut, SYSTEM_NCHANNELS);
+		for(unsigned n = 0; n < loadStateFiles.size(); n++) {
+			printf("Loading tQ histograms from '%s'\n", loadStateFiles[n].c_str());
+			if(!total->load(loadStateFiles[n].c_str()))
+				exit(1);
 		}
+		
+		pthread_mutex_init(&shardLock, NULL);
 	};
 	
 	~TQCorrWriter() {
-		for(int channel=0; channel<SYSTEM_NCHANNELS; channel++){
-			delete htqT2D[channel];
-			delete htqE2D[channel];
-		}
+		for(unsigned n = 0; n < shards.size(); n++)
+			delete shards[n];
+		delete total;
+		pthread_mutex_destroy(&shardLock);
 		
 		fclose(tQcalFile);
 	};
 
-	void pushEvents(EventBuffer<Hit> *buffer) {
-		if(buffer == NULL) return;	
+	void finish() { 
+		OverlappedEventHandler<Hit, Hit>::finish();
 		
-		unsigned nEvents = buffer->getSize();
-		for(unsigned i = 0; i < nEvents; i++) {
-			Hit &e = buffer->get(i);
-			
-			
-			bool isBadEvent=e.badEvent;
-			if(writeBadEvents==false && isBadEvent)continue;
-
-			long long T = SYSTEM_PERIOD * 1E12;
-			
-			eventTime = e.time;
-			eventChannel = e.raw->channelID;
-			eventToT = 1E-3*(e.timeEnd - e.time);
-			eventTQT = e.tofpet_TQT;
-			eventTQE = e.tofpet_TQE;
-			htqT2D[eventChannel]->Fill(eventTQT, eventToT);
-			htqE2D[eventChannel]->Fill(eventTQE, eventToT);
+		// All workers are done, merge their shards
+		for(unsigned n = 0; n < shards.size(); n++) {
+			if(!total->add(shards[n])) {
+				fprintf(stderr, "Could not merge tQ histograms\n");
+				exit(1);
+			}
+		}
 		
+		if(saveStateFile != NULL) {
+			if(!total->save(saveStateFile))
+				exit(1);
 		}
 		
-		sink->pushEvents(buffer);
-	};
-	
-	void pushT0(double t0) { };
-	void finish() { 
+		// Every channel gets its rows, channels without data just get empty histograms
 		for(int channel = 0; channel < SYSTEM_NCHANNELS ; channel++){ 
 			for(int whichBranch = 0; whichBranch < 2; whichBranch++) {
 				for(int tot_bin=0;tot_bin<6;tot_bin++){
 					bool isT = (whichBranch == 0);
 					
-					//sprintf(args2, "tot > %s && tot < %s && channel == %s && step1==1 &&(fmod(time,6.4e6)<3500e3 || fmod(time,6.4e6)>3600e3)",totl_str, toth_str, ch_str);
+					Double_t C = isT ? (end_t-start_t)/total->getIntegral(channel, isT, tot_bin) : (end_e-start_e)/total->getIntegral(channel, isT, tot_bin) ;
 					
-
-					TH1D *htq = isT ? htqT2D[channel]->ProjectionX("htqT_proj",tot_bin+1,tot_bin+2) : htqE2D[channel]->ProjectionX("htqE_proj",tot_bin+1,tot_bin+2);
-								
-					Double_t C = isT ? (end_t-start_t)/htq->Integral() : (end_e-start_e)/htq->Integral() ;
-					
-					//printf("%5d\t%s\t%10.6e\t%10.6e\n",channel, isT ? "T" : "E", C, isT ? htq->Integral() : htq->Integral());
-
 					cumul=0;
 					
-					int nbins= isT ? int(lut->nBins_tqT[channel]) : int(lut->nBins_tqE[channel]);
+					int nbins= int(lut->getNBinsTQ(channel, isT));
 		    
 					for(int bin = 1; bin < nbins+1; bin++) {
-						if(bin != 1)cumul+= htq->GetBinContent(bin); 
+						double content = total->getBinContent(channel, isT, tot_bin, bin);
+						if(bin != 1)cumul+= content; 
 					
-						fprintf(tQcalFile, "%5d\t%c\t%d\t%d\t%10.6e\t%10.6e\n", channel, isT ? 'T' : 'E', tot_bin, bin-1,  htq->GetBinContent(bin), C*cumul); 
+						fprintf(tQcalFile, "%5d\t%c\t%d\t%d\t%10.6e\t%10.6e\n", channel, isT ? 'T' : 'E', tot_bin, bin-1,  content, C*cumul); 
 					}
 					
 				}
-				//htq->reset();
 			}
 			
 		}
 	};
-	void report() { };
+
+protected:
+	EventBuffer<Hit> * handleEvents(EventBuffer<Hit> *buffer) {
+		// Each concurrent worker fills its own shard
+		TQHistograms *shard = NULL;
+		pthread_mutex_lock(&shardLock);
+		if(freeShards.size() > 0) {
+			shard = freeShards.back();
+			freeShards.pop_back();
+		}
+		else {
+			shard = new TQHistograms(lut, SYSTEM_NCHANNELS);
+			shards.push_back(shard);
+		}
+		pthread_mutex_unlock(&shardLock);
+		
+		unsigned nEvents = buffer->getSize();
+		for(unsigned i = 0; i < nEvents; i++) {
+			Hit &e = buffer->get(i);
+			
+			bool isBadEvent=e.badEvent;
+			if(writeBadEvents==false && isBadEvent)continue;
+
+			int channel = e.raw->channelID;
+			float ToT = 1E-3*(e.timeEnd - e.time);
+			shard->fill(channel, true, e.tofpet_TQT, ToT);
+			shard->fill(channel, false, e.tofpet_TQE, ToT);
+		}
+		
+		pthread_mutex_lock(&shardLock);
+		freeShards.push_back(shard);
+		pthread_mutex_unlock(&shardLock);
+		
+		return buffer;
+	};
+	
 private: 
 	FILE *tQcalFile;
 	P2 *lut;
-	TH2D *htqT2D[SYSTEM_NCRYSTALS];
-	TH2D *htqE2D[SYSTEM_NCRYSTALS];
+	TQHistograms *total;
+	std::vector<TQHistograms *> shards;
+	std::vector<TQHistograms *> freeShards;
+	pthread_mutex_t shardLock;
 	float start_t;
 	float start_e;
 	float end_t;
 	float end_e;
 	float cumul;
 	bool writeBadEvents;
-
-	
-
+	const char *saveStateFile;
 };
 
 void displayHelp(char * program)
@@ -167,6 +169,8 @@ void displayHelp(char * program)
 	fprintf(stderr,  "  --acqDeltaTime=ACQDELTATIME\t If online mode is chosen, this variable defines how much data time (in seconds) to process (default is -1 which selects all data for the current step)\n");
 	fprintf(stderr,  "  --raw_version=RAW_VERSION\t The version of the raw file to be processed: 2 or 3 (default) \n");
 #endif
+	fprintf(stderr,  "  --load-state=PREFIX\t Add the tQ histograms saved by a previous run (may be given several times)\n");
+	fprintf(stderr,  "  --save-state=PREFIX\t Save the accumulated tQ histograms, so that later runs can add to them\n");
 	fprintf(stderr, "\npositional arguments:\n");
 	fprintf(stderr, "  setup_file \t\t\t File containing paths to tdc calibration file(s) (required), tQ correction file(s) (optional) and Energy calibration file(s) (optional)\n");
 	fprintf(stderr, "  rawfiles_prefix \t\t Path to raw data files prefix\n");
@@ -186,7 +190,10 @@ int main(int argc, char *argv[])
 		{ "help", no_argument, 0, 0 },
 		{ "onlineMode", no_argument,0,0 },
 		{ "acqDeltaTime", required_argument,0,0 },
-		{ "raw_version", required_argument,0,0 }
+		{ "raw_version", required_argument,0,0 },
+		{ "load-state", required_argument,0,0 },
+		{ "save-state", required_argument,0,0 },
+		{ NULL, 0, 0, 0 }
 	};
 
 #ifndef __ENDOTOFPET__
@@ -196,6 +203,8 @@ int main(int argc, char *argv[])
 #endif
 	bool onlineMode=false;
 	int nOptArgs=0;
+	std::vector<std::string> loadStatePrefixes;
+	char *saveStatePrefix = NULL;
 	while(1) {
 		int optionIndex = 0;
 		int c=getopt_long(argc, argv, "",longOptions, &optionIndex);
@@ -224,6 +233,14 @@ int main(int argc, char *argv[])
 			}
 		}	
 #endif	
+		else if(optionIndex==4){
+			nOptArgs++;
+			loadStatePrefixes.push_back(optarg);
+		}
+		else if(optionIndex==5){
+			nOptArgs++;
+			saveStatePrefix = optarg;
+		}
 		else{
 			displayUsage(argv[0]);
 			fprintf(stderr, "\n%s: error: Unknown option!\n", argv[0]);
@@ -268,6 +285,8 @@ int main(int argc, char *argv[])
 	
 
 	char filename_tq[256];
+	char stepSuffix[256];
+	char saveStateFile[1024];
 	FILE *f;
 	stepBegin = 0;
 	stepEnd = 0;
@@ -283,19 +302,28 @@ int main(int argc, char *argv[])
 		
        
 		if(N==1){
+			stepSuffix[0] = 0;
 			sprintf(filename_tq,"%s.tqcal",outputFilePrefix);
 			printf(filename_tq);
 		}
 		else{
+			sprintf(stepSuffix, "_stp1_%f_stp2_%f", eventStep1, eventStep2);
 			sprintf(filename_tq,"%s_stp1_%f_stp2_%f.tqcal",outputFilePrefix,eventStep1, eventStep2); 
 		}
 		f = fopen(filename_tq, "w");
+		
+		// State files follow the same naming as the output files
+		std::vector<std::string> loadStateFiles;
+		for(unsigned n = 0; n < loadStatePrefixes.size(); n++) 
+			loadStateFiles.push_back(loadStatePrefixes[n] + stepSuffix + ".tqstate");
+		if(saveStatePrefix != NULL) 
+			sprintf(saveStateFile, "%s%s.tqstate", saveStatePrefix, stepSuffix);
 
 		DAQ::TOFPET::RawReader *reader=NULL;
 #ifndef __ENDOTOFPET__	
 		EventSink<RawHit> * pipeSink = 
 				new P2Extract(P2, false, 0.0, 0.20, true,
-				new TQCorrWriter(f, false, P2,
+				new TQCorrWriter(f, false, P2, loadStateFiles, saveStatePrefix != NULL ? saveStateFile : NULL,
 				new NullSink<Hit>()
         ));
 
@@ -306,7 +334,7 @@ int main(int argc, char *argv[])
 #else
 		reader = new DAQ::ENDOTOFPET::RawReaderE(inputFilePrefix, SYSTEM_PERIOD,  eventsBegin, eventsEnd,
 				new DAQ::ENDOTOFPET::Extract(new P2Extract(P2, false, 0.0, 0.20, true, NULL), new DAQ::STICv3::Sticv3Handler() , NULL,
-				new TQCorrWriter(f, false, P2,
+				new TQCorrWriter(f, false, P2, loadStateFiles, saveStatePrefix != NULL ? saveStateFile : NULL,
 				new NullSink<Hit>()
 				)));
 #endif
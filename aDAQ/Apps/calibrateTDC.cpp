@@ -1,5 +1,6 @@
 #include <TFitResult.h>
 #include <TFile.h>
+#include <TDirectory.h>
 #include <TNtuple.h>
 #include <TChain.h>
 #include <TProfile.h>
@@ -16,9 +17,13 @@
 #include <TRandom.h>
 #include <TCanvas.h>
 #include <TStyle.h>
+#include <TROOT.h>
+#include <Math/MinimizerOptions.h>
 #include <Core/Event.hpp>
 #include <Core/EventSourceSink.hpp>
 #include <Core/OverlappedEventHandler.hpp>
+#include <Core/StepScheduler.hpp>
+#include <Core/ThreadPool.hpp>
 #include <TOFPET/P2.hpp>
 #include <TOFPET/RawV3.hpp>
 #include <assert.h>
@@ -35,6 +40,7 @@
 #include <errno.h>
 #include <sys/sysinfo.h>
 #include <vector>
+#include <deque>
 #include <boost/tuple/tuple.hpp>
 #include <boost/random.hpp>
 #include <boost/nondet_random.hpp>
@@ -46,6 +52,9 @@ static const float ErrorHistogramRange = 0.5;
 
 
 struct TacInfo {
+	// Set when the linearity fit succeeded; unlike the histogram pointers, 
+	// it stays valid after the ASIC group's file is closed
+	bool fitted;
 	TProfile *pA_Fine;
 	TProfile *pA_ControlT;
 	TH1* pA_ControlE;
@@ -70,6 +79,7 @@ struct TacInfo {
 	
 
 	TacInfo() {
+		fitted = false;
 		pA_Fine = NULL;
 		pA_ControlT = NULL;
 		pA_ControlE = NULL;
@@ -171,22 +181,70 @@ struct Event {
 	float interval;
 	float phase;
 };
-static const int READ_BUFFER_SIZE = 32*1024*1024 / sizeof(Event);
 
-void sortData(char *inputFilePrefix, char *outputFilePrefix, int nAsicsPerFile);
+// A block of sorted events, either a memory mapped temporary file or an in-memory arena
+struct EventFile {
+	Event *events;
+	size_t nEvents;
+	size_t mapSize;
+};
+static bool mapEventFile(const char *fName, EventFile &f);
+static void unmapEventFile(EventFile &f);
+
+static pthread_mutex_t plotLock = PTHREAD_MUTEX_INITIALIZER;
+// Histograms are appended to the ASIC group's file, from several fit threads
+static pthread_mutex_t directoryLock = PTHREAD_MUTEX_INITIALIZER;
+// TAC fits run in a pool of their own, which ASIC group threads wait on
+static DAQ::Core::ThreadPool *fitPool = NULL;
+
+// An ASIC group, calibrated by one calibration thread
+struct CalibrationJob {
+	int fileID;
+	int asicStart;
+	int asicEnd;
+	char *outputFilePrefix;
+	int linearityNbins;
+	float linearityRangeMinimum;
+	float linearityRangeMaximum;
+	int leakageNbins;
+	float leakageRangeMinimum;
+	float leakageRangeMaximum;
+	float nominalM;
+	TacInfo *tacInfo;
+	long long memorySize;
+	// Sorted data held in memory, which is given back to the memory budget when the job finishes
+	long long arenaSize;
+	// When set, events are already in memory and are not read from the temporary files
+	bool inMemory;
+	EventFile linearityData;
+	EventFile leakageData;
+};
+static long long estimateMemory(CalibrationJob *job);
+static void *calibrateJob(void *arg);
+
+// Events sorted into one ASIC group and kept in memory, when temporary files are not used
+struct SortedGroup {
+	int fileID;
+	int asicStart;
+	int asicEnd;
+	EventFile linearityData;
+	EventFile leakageData;
+};
+
+void sortData(char *inputFilePrefix, char *outputFilePrefix, int nAsicsPerFile, int maxActiveSteps, bool useArena, std::vector<SortedGroup> &groups);
 
 int calibrate(
 	int asicStart, int asicEnd,
-	int linearityDataFile, int linearityNbins, float linearityRangeMinimum, float linearityRangeMaximum,
-	int eakageDataFile, int leakageNbins, float leakageRangeMinimum, float leakageRangeMaximum,
+	EventFile &linearityData, int linearityNbins, float linearityRangeMinimum, float linearityRangeMaximum,
+	EventFile &leakageData, int leakageNbins, float leakageRangeMinimum, float leakageRangeMaximum,
 	TacInfo *tacInfo, DAQ::TOFPET::P2 &myP2,
 	float nominalM
 );
 
 void qualityControl(
 	int asicStart, int asicEnd, 
-	int linearityDataFile,
-	int leakageDataFile,
+	EventFile &linearityData,
+	EventFile &leakageData,
 	TacInfo *tacInfo, DAQ::TOFPET::P2 &myP2,
 	char *plotFilePrefix
 );
@@ -201,6 +259,10 @@ void displayHelp(char * program)
 	fprintf(stderr, "  --int-factor [=INT_FACTOR] \t\t Nominal TDC interpolation factor (Default is 128)\n");
 	fprintf(stderr, "  --asics_per_file [=ASICS_PER_FILE] \t Number of asics to be stored per calibration file (Default is 2). If set to ALL, only one file will be created with calibration for all ASICS with valid data.\n");
 	fprintf(stderr, "  --no-sorting \t\t\t Assumes the temporary data file have already been created and skips the sorting stage.\n");
+	fprintf(stderr, "  --parallel-steps=N \t\t\t Number of steps sorted concurrently (default is 4)\n");
+	fprintf(stderr, "  --max-workers=N \t\t\t Number of calibration threads (default is the number of CPUs)\n");
+	fprintf(stderr, "  --memory-budget=MiB \t\t\t Memory available to calibration threads (default is half of the system RAM)\n");
+	fprintf(stderr, "  --no-temporary-files \t\t Keep sorted data in memory instead of writing temporary files\n");
 	fprintf(stderr, "\npositional arguments:\n");
 	fprintf(stderr, "  tdc_data_file_prefix \t\t\t Prefix of data files to be used for TDC calibration\n");
 	fprintf(stderr, "  tdc_calibration_prefix \t\t Prefix of the output calibration files and plots\n");
@@ -223,14 +285,15 @@ int main(int argc, char *argv[])
 	int posInd=0;        
 	bool keepTemporary = false;
         bool doSorting = true;
+	int maxActiveSteps = 4;
+	bool useArena = false;
 
-	// Choose the default number of workers based on CPU and RAM
-	// Assume we need 4 GiB of system RAM per worker for good performance
-	int nCPU = sysconf(_SC_NPROCESSORS_ONLN);
+	// Choose the default number of workers based on CPU
+	// and the default memory budget as half of the system RAM
+	int maxWorkers = sysconf(_SC_NPROCESSORS_ONLN);
 	struct sysinfo si;
 	sysinfo(&si);
-	int maxMemWorkers = si.totalram * si.mem_unit / (4LL * 1024*1024*1024);
-	int maxWorkers = nCPU < maxMemWorkers ? nCPU : maxMemWorkers;
+	long long memoryBudget = (long long)si.totalram * si.mem_unit / 2;
 	
 	static struct option longOptions[] = {
 		{ "asics_per_file", required_argument, 0, 0 },
@@ -238,7 +301,11 @@ int main(int argc, char *argv[])
 		{ "help", no_argument, 0, 0 },
 		{ "no-sorting", no_argument, 0, 0 },
 		{ "max-workers", required_argument, 0, 0 },
-		{ "keep-temporary", no_argument, 0, 0 }
+		{ "keep-temporary", no_argument, 0, 0 },
+		{ "parallel-steps", required_argument, 0, 0 },
+		{ "memory-budget", required_argument, 0, 0 },
+		{ "no-temporary-files", no_argument, 0, 0 },
+		{ NULL, 0, 0, 0 }
 	};
 
 	
@@ -277,6 +344,15 @@ int main(int argc, char *argv[])
 		else if(optionIndex == 5) {
 			keepTemporary = true;
 		}
+		else if(optionIndex == 6) {
+			maxActiveSteps = atoi(optarg);
+		}
+		else if(optionIndex == 7) {
+			memoryBudget = atoll(optarg) * 1024*1024;
+		}
+		else if(optionIndex == 8) {
+			useArena = true;
+		}
 		else {
 			displayUsage(argv[0]);
 			fprintf(stderr, "\n%s: error: Unknown option!\n", argv[0]);
@@ -298,8 +374,15 @@ int main(int argc, char *argv[])
 	char *inputFilePrefix = argv[optind+0];
 	char *outputFilePrefix = argv[optind+1];
 	
+	if(useArena && !doSorting) {
+		displayUsage(argv[0]);
+		fprintf(stderr, "\n%s: error: --no-temporary-files requires the sorting stage!\n", argv[0]);
+		return(1);
+	}
+	
+	std::vector<SortedGroup> groups;
 	if(doSorting) {
-		sortData(inputFilePrefix, outputFilePrefix, nAsicsPerFile);
+		sortData(inputFilePrefix, outputFilePrefix, nAsicsPerFile, maxActiveSteps, useArena, groups);
 	}
 
 	char fName[1024];
@@ -321,125 +404,127 @@ int main(int argc, char *argv[])
 	fclose(rangeFile);
 	
 	
-	sprintf(fName, "%s_list.tmp", outputFilePrefix);
-	FILE *listFile = fopen(fName, "r");
-	if(listFile == NULL) {
-		int e = errno;
-		fprintf(stderr, "Could not open '%s' for reading : %d %s\n", fName, e, strerror(errno));
-		exit(1);
-	}	
-	
-	
 	std::vector<boost::tuple<int, int, int> > list;
 	int fileID, asicStart, asicEnd;
 	int asicMin = MAX_N_ASIC;
 	int asicMax = 0;
-	while(fscanf(listFile, "%d %d %d\n", &fileID, &asicStart, &asicEnd) == 3) {
-		list.push_back(boost::tuple<int, int, int>(fileID, asicStart, asicEnd));
+	long long arenaSize = 0;
+	if(useArena) {
+		for(unsigned n = 0; n < groups.size(); n++) {
+			list.push_back(boost::tuple<int, int, int>(groups[n].fileID, groups[n].asicStart, groups[n].asicEnd));
+			arenaSize += groups[n].linearityData.mapSize + groups[n].leakageData.mapSize;
+		}
+	}
+	else {
+		sprintf(fName, "%s_list.tmp", outputFilePrefix);
+		FILE *listFile = fopen(fName, "r");
+		if(listFile == NULL) {
+			int e = errno;
+			fprintf(stderr, "Could not open '%s' for reading : %d %s\n", fName, e, strerror(errno));
+			exit(1);
+		}	
+		while(fscanf(listFile, "%d %d %d\n", &fileID, &asicStart, &asicEnd) == 3) {
+			list.push_back(boost::tuple<int, int, int>(fileID, asicStart, asicEnd));
+		}
+		fclose(listFile);
+	}
+	for(unsigned n = 0; n < list.size(); n++) {
+		asicStart = list[n].get<1>();
+		asicEnd = list[n].get<2>();
 		asicMin = asicMin < asicStart ? asicMin : asicStart;
 		asicMax = asicMax > asicEnd ? asicMax : asicEnd;
 	}
 	
+	// Sorted data held in memory is released as each group is calibrated,
+	// but until then it takes from the calibration memory budget
+	memoryBudget -= arenaSize;
+	if(useArena) {
+		printf("Sorted data is using %lld MiB of memory\n", arenaSize / (1024*1024));
+	}
+	
 	int nChannels = asicMax * 64;
 	int nTAC = asicMax * 64 * 2 * 4;
-	TacInfo *tacInfo = (TacInfo *)mmap(NULL, sizeof(TacInfo)*nTAC, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
-	for(int tac = 0; tac < nTAC; tac++)
-		tacInfo[tac] = TacInfo();
+	// Each calibration thread fills a disjoint range of TACs
+	TacInfo *tacInfo = new TacInfo[nTAC];
 	
 	
 	
 
-	maxWorkers = maxWorkers > 1 ? maxWorkers : 1;
-	for(unsigned n = 0; n < list.size();) {
-		int nWorkers = list.size() - n;
-		nWorkers = nWorkers < maxWorkers ? nWorkers : maxWorkers;
-
-		printf("Calibrating ASICs %4d to %4d (%d workers)...\n",
-		       list[n].get<1>(), list[n + nWorkers - 1].get<2>() - 1,
-		       nWorkers
-		);
+	// ROOT must be told that histograms and fits will be handled from several threads
+	ROOT::EnableThreadSafety();
+	gROOT->SetBatch(kTRUE);
+	TF1::DefaultAddToGlobalList(kFALSE);
+	ROOT::Math::MinimizerOptions::SetDefaultMinimizer("Minuit2");
 
-		pid_t children[nWorkers];
-		for(int worker = 0; worker < nWorkers; worker++, n++) {
-			pid_t pid = fork();
-			if (pid == 0) {
-				int fileID = list[n].get<0>();
-				int asicStart = list[n].get<1>();
-				int asicEnd = list[n].get<2>();
-				
-				int gidStart = asicStart * 64 * 4 * 2;
-				int gidEnd = asicEnd * 64 * 4 * 2;
-
-				sprintf(fName,"%s_%d_linearity.tmp", outputFilePrefix, fileID);
-				int linearityDataFile = open(fName, O_RDONLY);
-				if(linearityDataFile == -1) 
-					exit(1);
-
-				sprintf(fName,"%s_%d_leakage.tmp", outputFilePrefix, fileID);
-				int leakageDataFile = open(fName, O_RDONLY);
-				if(leakageDataFile == -1) 
-					exit(1);
-				
-				posix_fadvise(linearityDataFile, 0, 0, POSIX_FADV_SEQUENTIAL);
-				posix_fadvise(leakageDataFile, 0, 0, POSIX_FADV_SEQUENTIAL);
+	maxWorkers = maxWorkers > 1 ? maxWorkers : 1;
+	DAQ::Core::ThreadPool *pool = new DAQ::Core::ThreadPool(maxWorkers);
+	pool->clientIncrease();
+	// Group threads mostly wait on their fits, so fits get a pool of their own
+	fitPool = new DAQ::Core::ThreadPool(maxWorkers);
+	fitPool->clientIncrease();
+	
+	// Run as many ASIC groups concurrently as the memory budget allows
+	std::deque<std::pair<DAQ::Core::ThreadPool::Job *, CalibrationJob *> > running;
+	long long memoryInUse = 0;
+	for(unsigned n = 0; n < list.size(); n++) {
+		CalibrationJob *job = new CalibrationJob();
+		job->fileID = list[n].get<0>();
+		job->asicStart = list[n].get<1>();
+		job->asicEnd = list[n].get<2>();
+		job->outputFilePrefix = outputFilePrefix;
+		job->linearityNbins = linearityNbins;
+		job->linearityRangeMinimum = linearityRangeMinimum;
+		job->linearityRangeMaximum = linearityRangeMaximum;
+		job->leakageNbins = leakageNbins;
+		job->leakageRangeMinimum = leakageRangeMinimum;
+		job->leakageRangeMaximum = leakageRangeMaximum;
+		job->nominalM = nominalM;
+		job->tacInfo = tacInfo;
+		job->inMemory = useArena;
+		job->arenaSize = 0;
+		if(useArena) {
+			job->linearityData = groups[n].linearityData;
+			job->leakageData = groups[n].leakageData;
+			job->arenaSize = job->linearityData.mapSize + job->leakageData.mapSize;
+		}
+		job->memorySize = estimateMemory(job);
+		
+		if(job->memorySize > memoryBudget) {
+			fprintf(stderr, "WARNING: ASICs %4d to %4d need about %lld MiB, which exceeds the memory budget (%lld MiB)\n",
+				job->asicStart, job->asicEnd - 1, 
+				job->memorySize / (1024*1024), memoryBudget / (1024*1024)
+			);
+		}
 
-				DAQ::TOFPET::P2 *myP2 = new DAQ::TOFPET::P2((asicEnd - asicStart) * 64);
-				
-				sprintf(fName,"%s_asics%02d-%02d.tdc.root", outputFilePrefix, asicStart, asicEnd-1);
-				
-				char plotFilePrefix[1024];
-				sprintf(plotFilePrefix, "%s_asics%02d-%02d", outputFilePrefix, asicStart, asicEnd-1);
-				
-				TFile * resumeFile = new TFile(fName, "RECREATE", "", 1);
-				// Create a un-used canvas, just to avoid the fits automatically creating one and printing a warning
-				TCanvas *blank = new TCanvas();
-				
-				int hasData = calibrate(
-							asicStart, asicEnd,
-							linearityDataFile, linearityNbins, linearityRangeMinimum, linearityRangeMaximum,
-							leakageDataFile, leakageNbins, leakageRangeMinimum, leakageRangeMaximum,
-							tacInfo, *myP2, nominalM
-						);
-
-				if(hasData == 0){
-					resumeFile->Close();
-					remove(fName);
-					exit(0);
-				}
-				else{	
-					qualityControl(
-						asicStart, asicEnd, 
-						linearityDataFile,
-						leakageDataFile,
-						tacInfo, *myP2,
-						plotFilePrefix
-					);
-					resumeFile->Write();
-					resumeFile->Close();
-					
-				}
-				delete myP2;
-				
-				posix_fadvise(linearityDataFile, 0, 0, POSIX_FADV_DONTNEED);
-				close(linearityDataFile);
-				posix_fadvise(leakageDataFile, 0, 0, POSIX_FADV_DONTNEED);
-				close(leakageDataFile);
-				
-				exit(0);
-			} 
-			else {
-				children[worker] = pid;
-				
-			}			
+		while(running.size() > 0 && 
+			(running.size() >= maxWorkers || memoryInUse + job->memorySize > memoryBudget)) {
+			running.front().first->wait();
+			memoryInUse -= running.front().second->memorySize;
+			memoryBudget += running.front().second->arenaSize;
+			delete running.front().first;
+			delete running.front().second;
+			running.pop_front();
 		}
-		for(int worker = 0; worker < nWorkers; worker++) {
- 			waitpid(children[worker], NULL, 0);
-		} 	
+		
+		printf("Calibrating ASICs %4d to %4d (%d running, %lld MiB)...\n",
+		       job->asicStart, job->asicEnd - 1,
+		       int(running.size() + 1), (memoryInUse + job->memorySize) / (1024*1024)
+		);
+		memoryInUse += job->memorySize;
+		running.push_back(std::make_pair(pool->queueJob(calibrateJob, (void *)job), job));
 	}
-	
-
+	while(running.size() > 0) {
+		running.front().first->wait();
+		delete running.front().first;
+		delete running.front().second;
+		running.pop_front();
+	}
+	pool->clientDecrease();
+	delete pool;
+	fitPool->clientDecrease();
+	delete fitPool;
 
-	// Copy parameters from shared memory to global P2 
+	// Copy parameters from the TAC table to global P2 
 	DAQ::TOFPET::P2 myP2(nChannels);
 	for(int asic = asicMin; asic < asicMax; asic++) {
 		for(int channel = 0; channel < 64; channel++) {
@@ -448,7 +533,7 @@ int main(int argc, char *argv[])
 				for(int tac = 0; tac < 4; tac++) {
 					unsigned gid = ((64*asic + channel) << 3) | (tOrE << 2) | (tac & 0x3);
 					TacInfo &ti = tacInfo[gid];
-					if(ti.pA_Fine == NULL)	continue;
+					if(!ti.fitted) continue;
 					
 					myP2.setShapeParameters((64*asic+channel), tac, isT, ti.shape.tB, ti.shape.m, ti.shape.p2);
 					myP2.setT0((64*asic+channel), tac, isT, ti.shape.tEdge);
@@ -470,7 +555,7 @@ int main(int argc, char *argv[])
 				TacInfo &tiT = tacInfo[gidT];
 				TacInfo &tiE = tacInfo[gidE];
 				
-				if(tiT.pA_Fine == NULL || tiE.pA_Fine == NULL) 
+				if(!tiT.fitted || !tiE.fitted) 
 					continue;
 			
 				float t0_T = myP2.getT0((64 * asic + channel), tac, true);
@@ -487,7 +572,7 @@ int main(int argc, char *argv[])
 				TacInfo &tiT = tacInfo[gidT];
 				TacInfo &tiE = tacInfo[gidE];
 				
-				if(tiT.pA_Fine == NULL || tiE.pA_Fine == NULL) 
+				if(!tiT.fitted || !tiE.fitted) 
 					continue;
 			
 				float t0_T = myP2.getT0((64 * asic + channel), tac, true);
@@ -511,7 +596,7 @@ int main(int argc, char *argv[])
 		myP2.storeFile(  64*nAsicsPerFile*n, 64*nAsicsPerFile*(n+1), tableFileName);
 	}
 	
-	if(!keepTemporary) {
+	if(!keepTemporary && !useArena) {
 		// Remove temporary files
 		for(unsigned n = 0; n < list.size(); n++) {
 			int fileID = list[n].get<0>();
@@ -533,9 +618,566 @@ int main(int argc, char *argv[])
 	return 0;
 }
 
+static bool mapEventFile(const char *fName, EventFile &f)
+{
+	f.events = NULL;
+	f.nEvents = 0;
+	f.mapSize = 0;
+	
+	int fd = open(fName, O_RDONLY);
+	if(fd == -1) {
+		int e = errno;
+		fprintf(stderr, "Could not open '%s' for reading : %d %s\n", fName, e, strerror(e));
+		return false;
+	}
+	
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		int e = errno;
+		fprintf(stderr, "Could not stat '%s' : %d %s\n", fName, e, strerror(e));
+		close(fd);
+		return false;
+	}
+	
+	if(st.st_size >= sizeof(Event)) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if(p == MAP_FAILED) {
+			int e = errno;
+			fprintf(stderr, "Could not map '%s' : %d %s\n", fName, e, strerror(e));
+			close(fd);
+			return false;
+		}
+		madvise(p, st.st_size, MADV_SEQUENTIAL);
+		f.events = (Event *)p;
+		f.mapSize = st.st_size;
+		f.nEvents = st.st_size / sizeof(Event);
+	}
+	close(fd);
+	return true;
+}
+
+static void unmapEventFile(EventFile &f)
+{
+	if(f.events != NULL) {
+		madvise(f.events, f.mapSize, MADV_DONTNEED);
+		munmap(f.events, f.mapSize);
+	}
+	f.events = NULL;
+	f.nEvents = 0;
+	f.mapSize = 0;
+}
+
+static long long fileSize(const char *fName)
+{
+	struct stat st;
+	if(stat(fName, &st) != 0) return 0;
+	return st.st_size;
+}
+
+// Histograms and P2 tables allocated by calibrate() and qualityControl(), 
+// plus the mapped event files which are scanned several times
+static long long estimateMemory(CalibrationJob *job)
+{
+	long long nTAC = (job->asicEnd - job->asicStart) * 64 * 2 * 4;
+	long long tacSize = 
+		2LL * (job->linearityNbins + 2) * (1024 + 2)		// hA_Fine2
+		+ 2 * 5LL * sizeof(double) * (job->linearityNbins + 2)	// pA_Fine, pA_ControlT
+		+ 2 * 5LL * sizeof(double) * (job->leakageNbins + 2)	// pB_Fine, pB_ControlT
+		+ sizeof(float) * (512 + 256 + 130)			// pA_ControlE, pB_ControlE, hA_Fine
+		+ 16*1024;						// Object and fit function overhead
+	
+	// Data held in memory is already accounted for
+	long long dataSize = 0;
+	if(!job->inMemory) {
+		char fName[1024];
+		sprintf(fName,"%s_%d_linearity.tmp", job->outputFilePrefix, job->fileID);
+		dataSize += fileSize(fName);
+		sprintf(fName,"%s_%d_leakage.tmp", job->outputFilePrefix, job->fileID);
+		dataSize += fileSize(fName);
+	}
+	
+	return nTAC * tacSize + dataSize + 16LL*1024*1024;
+}
+
+static void *calibrateJob(void *arg)
+{
+	CalibrationJob *job = (CalibrationJob *)arg;
+	int asicStart = job->asicStart;
+	int asicEnd = job->asicEnd;
+	char fName[1024];
+	
+	EventFile &linearityData = job->linearityData;
+	EventFile &leakageData = job->leakageData;
+	if(!job->inMemory) {
+		sprintf(fName,"%s_%d_linearity.tmp", job->outputFilePrefix, job->fileID);
+		if(!mapEventFile(fName, linearityData)) 
+			return NULL;
+
+		sprintf(fName,"%s_%d_leakage.tmp", job->outputFilePrefix, job->fileID);
+		if(!mapEventFile(fName, leakageData)) {
+			unmapEventFile(linearityData);
+			return NULL;
+		}
+	}
+
+	DAQ::TOFPET::P2 *myP2 = new DAQ::TOFPET::P2((asicEnd - asicStart) * 64);
+	
+	sprintf(fName,"%s_asics%02d-%02d.tdc.root", job->outputFilePrefix, asicStart, asicEnd-1);
+	
+	char plotFilePrefix[1024];
+	sprintf(plotFilePrefix, "%s_asics%02d-%02d", job->outputFilePrefix, asicStart, asicEnd-1);
+	
+	// Histograms created by this thread go into this file
+	TFile * resumeFile = new TFile(fName, "RECREATE", "", 1);
+	
+	int hasData = calibrate(
+				asicStart, asicEnd,
+				linearityData, job->linearityNbins, job->linearityRangeMinimum, job->linearityRangeMaximum,
+				leakageData, job->leakageNbins, job->leakageRangeMinimum, job->leakageRangeMaximum,
+				job->tacInfo, *myP2, job->nominalM
+			);
+
+	if(hasData == 0){
+		resumeFile->Close();
+		remove(fName);
+	}
+	else{	
+		qualityControl(
+			asicStart, asicEnd, 
+			linearityData,
+			leakageData,
+			job->tacInfo, *myP2,
+			plotFilePrefix
+		);
+		resumeFile->Write();
+		resumeFile->Close();
+	}
+	// WARNING: Closing the file deletes the histograms, 
+	// after this tacInfo's histogram pointers must not be used
+	delete resumeFile;
+	delete myP2;
+	
+	unmapEventFile(linearityData);
+	unmapEventFile(leakageData);
+	return NULL;
+}
+
+// Group wide inputs of the TAC fits of one calibrate() call
+struct FitContext {
+	unsigned gidStart;
+	int asicStart;
+	bool *asicPresent;
+	TH2S **hA_Fine2List;
+	TProfile **pB_FineList;
+	TacInfo *tacInfo;
+	// The ASIC group's file, where histograms created by fits go
+	TDirectory *directory;
+	int linearityNbins;
+	float linearityRangeMinimum;
+	float linearityRangeMaximum;
+	int leakageNbins;
+	float leakageRangeMinimum;
+	float leakageRangeMaximum;
+	float nominalM;
+};
+
+// The TACs of one channel, fitted by one fit pool job
+struct FitJob {
+	FitContext *context;
+	bool leakage;
+	unsigned gidBegin;
+	unsigned gidEnd;
+	bool hasData;
+};
+
+static void fitLinearity(FitContext &c, unsigned gid, TH2S *hA_Fine2, TF1 *fPol1)
+{
+	unsigned tac = gid & 0x3;
+	bool isT = ((gid >> 2) & 0x1) == 0;
+	unsigned channel = (gid >> 3) & 63;
+	unsigned asic = gid >> 9;
+	TacInfo &ti = c.tacInfo[gid];
+	boost::mt19937 generator;
+
+	char hName[128];
+
+	// Obtain a rough estimate of the TDC range
+	sprintf(hName, isT ? "C%03d_%02d_%d_A_T_hFine" : "C%03d_%02d_%d_A_E_hFine",
+		asic, channel, tac);
+	pthread_mutex_lock(&directoryLock);
+	TH1D *hA_Fine = hA_Fine2->ProjectionY(hName);
+	pthread_mutex_unlock(&directoryLock);
+	hA_Fine->Rebin(8);
+	hA_Fine->Smooth(4);
+	float adcMean = hA_Fine->GetMean();
+	int adcMeanBin = hA_Fine->FindBin(adcMean);
+	int adcMeanCount = hA_Fine->GetBinContent(adcMeanBin);
+	
+	int adcMinBin = adcMeanBin;
+	while(hA_Fine->GetBinContent(adcMinBin) > 0.20 * adcMeanCount)
+		adcMinBin--;
+	
+	int adcMaxBin = adcMeanBin;
+	while(hA_Fine->GetBinContent(adcMaxBin) > 0.20 * adcMeanCount)
+		adcMaxBin++;
+	
+	float adcMin = hA_Fine->GetBinCenter(adcMinBin);
+	float adcMax = hA_Fine->GetBinCenter(adcMaxBin);
+	
+	
+	// Set limits on ADC range to exclude spurious things.
+	hA_Fine2->GetYaxis()->SetRangeUser(
+		adcMin - 32 > 0.5 * c.nominalM ? adcMin - 32 : 0.5 * c.nominalM,
+		adcMax + 32 < 4.0 * c.nominalM ? adcMax + 32 : 4.0 * c.nominalM
+		);
+		
+	sprintf(hName, isT ? "C%03d_%02d_%d_A_T_pFine_X" : "C%03d_%02d_%d_A_E_pFine_X",
+		asic, channel, tac);
+	pthread_mutex_lock(&directoryLock);
+	TProfile *pA_Fine = ti.pA_Fine = hA_Fine2->ProfileX(hName, 1, -1, "s");
+	pthread_mutex_unlock(&directoryLock);
+	
+	
+	int nBinsX = pA_Fine->GetXaxis()->GetNbins();
+	float xMin = pA_Fine->GetXaxis()->GetXmin();
+	float xMax = pA_Fine->GetXaxis()->GetXmax();
+	
+	
+	// Obtain a rough estimate of the edge position
+	float tEdge = 0.0;
+	float lowerT0 = 0.0;
+	float upperT0 = 0.0;
+	float maxDeltaADC = 0;
+	adcMin = 1024.0;
+	for(int n = 10; n >= 1; n--) {
+		for(int j = 1; j < (nBinsX - 1 - n); j++) {
+			float v1 = pA_Fine->GetBinContent(j);
+			float v2 = pA_Fine->GetBinContent(j+n);
+			float e1 =  pA_Fine->GetBinError(j);
+			float e2 =  pA_Fine->GetBinError(j+n);
+			int c1 = pA_Fine->GetBinEntries(j);
+			int c2 = pA_Fine->GetBinEntries(j+n);
+			float t1 = pA_Fine->GetBinCenter(j);
+			float t2 = pA_Fine->GetBinCenter(j+n);
+			
+			if(c1 == 0 || c2 == 0) continue;
+			if(e1 > 5.0 || e2 > 5.0) continue;
+			
+			
+			float deltaADC = (v2 - v1);
+			float slope = (v2 - v1)/(t2 - t1);
+			// Slope is usually -c.nominalM
+			// But at edge, it's 10 x c.nominalM
+			if((slope > 5 * c.nominalM) && (deltaADC > maxDeltaADC)) {
+				tEdge = (t2 + t1)/2.0;
+				lowerT0 = t1;// - 0.5 * pA_Fine->GetXaxis()->GetBinWidth(0);
+				upperT0 = t2;// + 0.5 * pA_Fine->GetXaxis()->GetBinWidth(0);
+				adcMin = fminf (adcMin, pA_Fine->GetBinContent(j));
+				maxDeltaADC = deltaADC;
+			}
+		}
+	}
+	
+	if(adcMin == 1024.0) {
+		fprintf(stderr, "WARNING: Could not find a suitable edge position. Skipping TAC (A: %4d %2d %d %c)\n",
+			asic, channel, tac, isT  ? 'T' : 'E'
+		);
+		return;
+	}
+	
+	while(lowerT0 > 2.0 && tEdge > 2.0 && upperT0 > 2.0) {
+		lowerT0 -= 2.0;
+		tEdge -= 2.0;
+		upperT0 -= 2.0;
+	}
+	
+	float tEdgeTolerance = upperT0 - lowerT0;
+	// Fit a line to a TDC period to determine the interpolation factor
+	pA_Fine->Fit(fPol1, "Q0", "", tEdge + tEdgeTolerance, tEdge + 2.0  - tEdgeTolerance);
+	TF1 *fPol = pA_Fine->GetFunction("pol1");
+	if(fPol == NULL) {
+		fprintf(stderr, "WARNING: Could not make a linear fit. Skipping TAC. (A: %4d %2d %d %c)\n",
+			asic, channel, tac, isT  ? 'T' : 'E'
+		);
+		return;
+		
+	}
+	float estimatedM = - fPol->GetParameter(1);
+	if(estimatedM < 0.75 * c.nominalM || estimatedM > 1.25 * c.nominalM) {
+		fprintf(stderr, "WARNING: M (%6.1f) is out of range[%6.1f, %6.1f]. Skipping TAC. (A: %4d %2d %d %c)\n",
+			estimatedM, 0.75 * c.nominalM, 1.25 * c.nominalM,
+			asic, channel, tac, isT  ? 'T' : 'E'
+		);
+		return;
+	}
+	
+	
+	boost::uniform_real<> range(lowerT0, upperT0);
+	boost::variate_generator<boost::mt19937&, boost::uniform_real<> > nextRandomTEdge(generator, range);
+
+	TF1 *pf = new TF1("periodicF1", periodicF1, xMin, xMax, nPar1);
+	for(int p = 0; p < nPar1; p++) pf->SetParName(p, paramNames1[p]);
+	pf->SetNpx(2 * nBinsX);
+	
+	float b;
+	float m;
+	float tB;
+	float p2;
+	float currChi2 = INFINITY;
+	float prevChi2 = INFINITY;
+	int nTry = 0;
+	float maxChi2 = 2E6;
+	do {
+		pf->SetParameter(0, tEdge);		pf->SetParLimits(0, lowerT0, upperT0);
+		pf->SetParameter(1, adcMin);		pf->SetParLimits(1, adcMin - estimatedM * tEdgeTolerance, adcMin);
+		pf->SetParameter(2, estimatedM);	pf->SetParLimits(2, 0.99 * estimatedM, 1.01 * estimatedM),
+		pA_Fine->Fit(pf, "Q0", "", 0.5, xMax);
+		
+		TF1 *pf_ = pA_Fine->GetFunction("periodicF1");
+		if(pf_ != NULL) {
+			prevChi2 = currChi2;
+			currChi2 = pf_->GetChisquare() / pf_->GetNDF();	
+			
+			if((currChi2 < prevChi2)) {
+				tEdge = pf->GetParameter(0);
+				b  = pf->GetParameter(1);
+				m  = pf->GetParameter(2);		
+				tB = - (b/m - 1.0);
+				p2 = 0;
+			}
+		}
+		else {
+			//	tEdge = nextRandomTEdge();
+		}
+		nTry += 1;
+		
+	} while((currChi2 <= 0.95*prevChi2) && (nTry < 10));
+	
+	if(prevChi2 > maxChi2 && currChi2 > maxChi2) {
+		fprintf(stderr, "WARNING: NO FIT OR VERY BAD FIT (1). Skipping TAC. (A: %4d %2d %d %c)\n",
+			asic, channel, tac, isT  ? 'T' : 'E'
+		);
+		delete pf;
+		return;
+	}
+	
+	TF1 *pf2 = new TF1("periodicF2", periodicF2, xMin, xMax,  nPar2);		
+	pf2->SetNpx(2*nBinsX);
+	for(int p = 0; p < nPar2; p++) pf2->SetParName(p, paramNames2[p]);
+	
+	currChi2 = INFINITY;
+	prevChi2 = INFINITY;
+	nTry = 0;
+	do {
+		//pf2->SetParameter(0, tEdge);		pf2->SetParLimits(0, tEdge-0.1, tEdge+0.1);
+		pf2->FixParameter(0, tEdge);
+		pf2->SetParameter(1, tB);		pf2->SetParLimits(1, 1.10*tB, 0);
+		//pf2->FixParameter(1, tB);
+		pf2->SetParameter(2, m);		pf2->SetParLimits(2, 1.00 * m, 1.15 * m);
+		pf2->SetParameter(3, -1.0);		pf2->SetParLimits(3, -5.0, 0);
+		pA_Fine->Fit(pf2, "Q0", "", 0.5, xMax);
+
+		TF1 *pf_ = pA_Fine->GetFunction("periodicF2");
+		if(pf_ != NULL) {
+			prevChi2 = currChi2;
+			currChi2 = pf_->GetChisquare() / pf_->GetNDF();	
+			
+			if(currChi2 < prevChi2) {
+				tEdge = pf->GetParameter(0);
+				b  = pf->GetParameter(1);
+				m  = pf->GetParameter(2);		
+				tB = - (b/m - 1.0);
+				p2 = 0;								
+			}
+		}
+		nTry += 1;
+		
+	} while((currChi2 <= 0.95*prevChi2) && (nTry < 10));
+	
+	if(prevChi2 > maxChi2 && currChi2 > maxChi2) {
+		fprintf(stderr, "WARNING: NO FIT OR VERY BAD FIT (2). Skipping TAC. (A: %4d %2d %d %c)\n",
+			asic, channel, tac, isT  ? 'T' : 'E'
+		);
+		delete pf;
+		delete pf2;
+		return;
+	}
+		
+	ti.shape.tEdge = tEdge = pf2->GetParameter(0);
+	ti.shape.tB = tB = pf2->GetParameter(1);
+	ti.shape.m  = m  = pf2->GetParameter(2);
+	ti.shape.p2 = p2 = pf2->GetParameter(3);
+	
+
+
+	// Allocate the control histograms
+	pthread_mutex_lock(&directoryLock);
+	sprintf(hName, isT ? "C%03d_%02d_%d_A_T_control_T" : "C%03d_%02d_%d_A_E_control_T", 
+			asic, channel, tac);
+	ti.pA_ControlT = new TProfile(hName, hName, c.linearityNbins, c.linearityRangeMinimum, c.linearityRangeMaximum, "s");
+
+	sprintf(hName, isT ? "C%03d_%02d_%d_A_T_control_E" : "C%03d_%02d_%d_A_E_control_E", 
+			asic, channel, tac);
+	ti.pA_ControlE = new TH1F(hName, hName, 512, -ErrorHistogramRange, ErrorHistogramRange);
+	pthread_mutex_unlock(&directoryLock);
+	ti.fitted = true;
+	
+	delete pf;
+	delete pf2;
+}
+
+static void fitLeakage(FitContext &c, unsigned gid, TF1 *fPol1)
+{
+	unsigned tac = gid & 0x3;
+	bool isT = ((gid >> 2) & 0x1) == 0;
+	unsigned channel = (gid >> 3) & 63;
+	unsigned asic = gid >> 9;
+	TacInfo &ti = c.tacInfo[gid];
+
+	char hName[128];
+
+	if(!ti.fitted) return;
+	TProfile *pA_Fine = ti.pA_Fine;
+	TF1 * pf2 = pA_Fine->GetFunction("periodicF2");
+	if(pf2 == NULL) return;
+
+	float x = ti.shape.tEdge + 1.9;
+	float tQ = 3 - fmod(1024.0 + x - ti.shape.tEdge, 2.0);
+	float a00 = pf2->Eval(x);
+	
+	TProfile *pB_Fine = c.pB_FineList[gid-c.gidStart];
+	assert(pB_Fine != NULL);
+	if(pB_Fine->GetEntries() < 200) {
+		return;
+	}
+		
+	int nBinsX = pB_Fine->GetXaxis()->GetNbins();
+	float xMin = pB_Fine->GetXaxis()->GetXmin();
+	float xMax = pB_Fine->GetXaxis()->GetXmax();
+
+	float yMin = pB_Fine->GetBinContent(1);
+	float yMax = pB_Fine->GetBinContent(nBinsX);
+	float slope = (yMax - yMin)/(xMax - xMin);
+
+	
+//			TF1 *pl1 = new TF1("pl1", "[0]+[1]*x", xMin, xMax);		
+//			pl1->SetParameter(0, yMin);
+//			pl1->SetParameter(1, slope);
+//			pl1->SetParLimits(0, -20, 20);
+//			pl1->SetParLimits(1, -1.0, 1.0);
+//			pl1->SetNpx(nBinsX);
+	
+	int nTry = 0;
+	while(nTry < 10){
+		pB_Fine->Fit(fPol1, "Q0", "", xMin, xMax);
+		TF1 *fit = pB_Fine->GetFunction("pol1");
+		if(fit == NULL) break;
+		float chi2 = fit->GetChisquare();
+		float ndf = fit->GetNDF();
+		if(chi2/ndf < 2.0) break;
+		nTry += 1;
+	}
+	
+	
+	TF1 *fit = pB_Fine->GetFunction("pol1");
+	if(fit == NULL) {
+		fprintf(stderr, "WARNING: NO FIT! Skipping TAC. (B: %4d %2d %d %c)\n",
+			asic, channel, tac, isT  ? 'T' : 'E'
+		);
+//				delete pl1;
+		return;
+	}
+	float chi2 = fit->GetChisquare();
+	float ndf = fit->GetNDF();
+	ti.leakage.tQ = tQ;
+	ti.leakage.a0 = a00;//fit->GetParameter(0) + a00;
+	ti.leakage.a1 = fit->GetParameter(1) / (1024 * 4);
+	ti.leakage.a2 = 0;//fit->GetParameter(2) / ((1024 * 4)*(1024*4));
+	
+	pthread_mutex_lock(&directoryLock);
+	sprintf(hName, isT ? "C%03d_%02d_%d_B_T_control_T" : "C%03d_%02d_%d_B_E_control_T", 
+			asic, channel, tac);
+	ti.pB_ControlT = new TProfile(hName, hName, c.leakageNbins, c.leakageRangeMinimum, c.leakageRangeMaximum, "s");
+
+	sprintf(hName, isT ? "C%03d_%02d_%d_B_T_control_E" : "C%03d_%02d_%d_B_E_control_E", 
+			asic, channel, tac);
+	ti.pB_ControlE = new TH1F(hName, hName, 256, -ErrorHistogramRange, ErrorHistogramRange);
+	pthread_mutex_unlock(&directoryLock);
+	
+//			delete pl1;
+}
+
+static void *fitJob(void *arg)
+{
+	FitJob &job = *(FitJob *)arg;
+	FitContext &c = *job.context;
+
+	// Histograms created by this job go into the ASIC group's file
+	c.directory->cd();
+	// Fits run in several threads, so each job needs its own copy of the standard functions
+	TF1 *fPol1 = new TF1("pol1", "pol1", 0, 1);
+
+	for(unsigned gid = job.gidBegin; gid < job.gidEnd; gid++) {
+		unsigned tac = gid & 0x3;
+		bool isT = ((gid >> 2) & 0x1) == 0;
+		unsigned channel = (gid >> 3) & 63;
+		unsigned asic = gid >> 9;
+
+		// We had _no_ data for this ASIC, we assume it's not present in the system
+		// Let's just move on without further ado
+		if(!c.asicPresent[asic-c.asicStart])
+			continue;
+
+		if(job.leakage) {
+			fitLeakage(c, gid, fPol1);
+			continue;
+		}
+
+		TH2S *hA_Fine2 = c.hA_Fine2List[gid-c.gidStart];
+		if(hA_Fine2 == NULL) continue;
+		if(hA_Fine2->GetEntries() < 1000) {
+			fprintf(stderr, "WARNING: Not enough data to calibrate. Skipping TAC. (A: %4d %2d %d %c)\n",
+				asic, channel, tac, isT  ? 'T' : 'E'
+			);
+			continue;
+		}
+		job.hasData = true;
+		fitLinearity(c, gid, hA_Fine2, fPol1);
+	}
+
+	delete fPol1;
+	return NULL;
+}
+
+// Runs the linearity or the leakage fits of a group's TACs in the fit pool and waits for them;
+// returns true if any TAC had enough data
+static bool runFitJobs(FitContext &c, unsigned gidEnd, bool leakage)
+{
+	unsigned nJobs = (gidEnd - c.gidStart) / 8;
+	std::vector<FitJob> jobs(nJobs);
+	std::vector<DAQ::Core::ThreadPool::Job *> poolJobs(nJobs);
+	for(unsigned n = 0; n < nJobs; n++) {
+		FitJob &job = jobs[n];
+		job.context = &c;
+		job.leakage = leakage;
+		job.gidBegin = c.gidStart + 8*n;
+		job.gidEnd = job.gidBegin + 8;
+		job.hasData = false;
+		poolJobs[n] = fitPool->queueJob(fitJob, (void *)&job);
+	}
+
+	bool hasData = false;
+	for(unsigned n = 0; n < nJobs; n++) {
+		poolJobs[n]->wait();
+		delete poolJobs[n];
+		hasData |= jobs[n].hasData;
+	}
+	return hasData;
+}
+
 int calibrate(	int asicStart, int asicEnd,
-		int linearityDataFile, int linearityNbins, float linearityRangeMinimum, float linearityRangeMaximum,
-		int leakageDataFile, int leakageNbins, float leakageRangeMinimum, float leakageRangeMaximum,
+		EventFile &linearityData, int linearityNbins, float linearityRangeMinimum, float linearityRangeMaximum,
+		EventFile &leakageData, int leakageNbins, float leakageRangeMinimum, float leakageRangeMaximum,
 		TacInfo *tacInfo, DAQ::TOFPET::P2 &myP2,
 		float nominalM
 )
@@ -575,13 +1217,10 @@ int calibrate(	int asicStart, int asicEnd,
 		pB_FineList[gid-gidStart] = new TProfile(hName, hName, leakageNbins, leakageRangeMinimum, leakageRangeMaximum);
 	}
 
-	Event *eventBuffer = new Event[READ_BUFFER_SIZE];
-	int r;
-	lseek(linearityDataFile, 0, SEEK_SET);
-	while((r = read(linearityDataFile, eventBuffer, sizeof(Event)*READ_BUFFER_SIZE)) > 0) {
-		int nEvents = r / sizeof(Event);
-		for(int i = 0; i < nEvents; i++) {
-			Event &event = eventBuffer[i];
+	{
+		size_t nEvents = linearityData.nEvents;
+		for(size_t i = 0; i < nEvents; i++) {
+			Event &event = linearityData.events[i];
 			assert(hA_Fine2List[event.gid-gidStart] != NULL);
 			if(event.fine < 0.5 * nominalM || event.fine > 4 * nominalM) continue;
 			hA_Fine2List[event.gid-gidStart]->Fill(event.phase, event.fine);
@@ -590,264 +1229,40 @@ int calibrate(	int asicStart, int asicEnd,
 		}
 	}
 	
-	boost::mt19937 generator;
-
-	int hasData = 0;
+	// TACs are fitted in the fit pool, one channel per job, however ASICs are grouped into files
+	FitContext context;
+	context.gidStart = gidStart;
+	context.asicStart = asicStart;
+	context.asicPresent = asicPresent;
+	context.hA_Fine2List = hA_Fine2List;
+	context.pB_FineList = pB_FineList;
+	context.tacInfo = tacInfo;
+	context.directory = gDirectory;
+	context.linearityNbins = linearityNbins;
+	context.linearityRangeMinimum = linearityRangeMinimum;
+	context.linearityRangeMaximum = linearityRangeMaximum;
+	context.leakageNbins = leakageNbins;
+	context.leakageRangeMinimum = leakageRangeMinimum;
+	context.leakageRangeMaximum = leakageRangeMaximum;
+	context.nominalM = nominalM;
+
+	int hasData = runFitJobs(context, gidEnd, false) ? 1 : 0;
+	
+	// P2 is not thread safe, so fit jobs leave their results in tacInfo
 	for(unsigned gid = gidStart; gid < gidEnd; gid++) {
+		TacInfo &ti = tacInfo[gid];
+		if(!ti.fitted) continue;
 		unsigned tac = gid & 0x3;
 		bool isT = ((gid >> 2) & 0x1) == 0;
-		unsigned channel = (gid >> 3) & 63;
-		unsigned asic = gid >> 9;
-		TacInfo &ti = tacInfo[gid];
-		//if(asic != 0 || channel != 8) continue;
-
-		
-		// We had _no_ data for this ASIC, we assume it's not present in the system
-		// Let's just move on without further ado
-		if(!asicPresent[asic-asicStart])
-			continue;
-		
-		// Code below came from two loops
-		// and have conflitcting variable names
-		{
-		
-			TH2S *hA_Fine2 = hA_Fine2List[gid-gidStart];
-			if(hA_Fine2 == NULL) continue;
-			if(hA_Fine2->GetEntries() < 1000) {
-				fprintf(stderr, "WARNING: Not enough data to calibrate. Skipping TAC. (A: %4d %2d %d %c)\n",
-					asic, channel, tac, isT  ? 'T' : 'E'
-				);
-				continue;
-			}
-			hasData=1;
-			char hName[128];
-		
-			// Obtain a rough estimate of the TDC range
-			sprintf(hName, isT ? "C%03d_%02d_%d_A_T_hFine" : "C%03d_%02d_%d_A_E_hFine",
-				asic, channel, tac);
-			TH1D *hA_Fine = hA_Fine2->ProjectionY(hName);
-			hA_Fine->Rebin(8);
-			hA_Fine->Smooth(4);
-			float adcMean = hA_Fine->GetMean();
-			int adcMeanBin = hA_Fine->FindBin(adcMean);
-			int adcMeanCount = hA_Fine->GetBinContent(adcMeanBin);
-			
-			int adcMinBin = adcMeanBin;
-			while(hA_Fine->GetBinContent(adcMinBin) > 0.20 * adcMeanCount)
-				adcMinBin--;
-			
-			int adcMaxBin = adcMeanBin;
-			while(hA_Fine->GetBinContent(adcMaxBin) > 0.20 * adcMeanCount)
-				adcMaxBin++;
-			
-			float adcMin = hA_Fine->GetBinCenter(adcMinBin);
-			float adcMax = hA_Fine->GetBinCenter(adcMaxBin);
-			
-			
-			// Set limits on ADC range to exclude spurious things.
-			hA_Fine2->GetYaxis()->SetRangeUser(
-				adcMin - 32 > 0.5 * nominalM ? adcMin - 32 : 0.5 * nominalM,
-				adcMax + 32 < 4.0 * nominalM ? adcMax + 32 : 4.0 * nominalM
-				);
-				
-			sprintf(hName, isT ? "C%03d_%02d_%d_A_T_pFine_X" : "C%03d_%02d_%d_A_E_pFine_X",
-				asic, channel, tac);
-			TProfile *pA_Fine = ti.pA_Fine = hA_Fine2->ProfileX(hName, 1, -1, "s");
-			
-			
-			int nBinsX = pA_Fine->GetXaxis()->GetNbins();
-			float xMin = pA_Fine->GetXaxis()->GetXmin();
-			float xMax = pA_Fine->GetXaxis()->GetXmax();
-			
-			
-			// Obtain a rough estimate of the edge position
-			float tEdge = 0.0;
-			float lowerT0 = 0.0;
-			float upperT0 = 0.0;
-			float maxDeltaADC = 0;
-			adcMin = 1024.0;
-			for(int n = 10; n >= 1; n--) {
-				for(int j = 1; j < (nBinsX - 1 - n); j++) {
-					float v1 = pA_Fine->GetBinContent(j);
-					float v2 = pA_Fine->GetBinContent(j+n);
-					float e1 =  pA_Fine->GetBinError(j);
-					float e2 =  pA_Fine->GetBinError(j+n);
-					int c1 = pA_Fine->GetBinEntries(j);
-					int c2 = pA_Fine->GetBinEntries(j+n);
-					float t1 = pA_Fine->GetBinCenter(j);
-					float t2 = pA_Fine->GetBinCenter(j+n);
-					
-					if(c1 == 0 || c2 == 0) continue;
-					if(e1 > 5.0 || e2 > 5.0) continue;
-					
-					
-					float deltaADC = (v2 - v1);
-					float slope = (v2 - v1)/(t2 - t1);
-					// Slope is usually -nominalM
-					// But at edge, it's 10 x nominalM
-					if((slope > 5 * nominalM) && (deltaADC > maxDeltaADC)) {
-						tEdge = (t2 + t1)/2.0;
-						lowerT0 = t1;// - 0.5 * pA_Fine->GetXaxis()->GetBinWidth(0);
-						upperT0 = t2;// + 0.5 * pA_Fine->GetXaxis()->GetBinWidth(0);
-						adcMin = fminf (adcMin, pA_Fine->GetBinContent(j));
-						maxDeltaADC = deltaADC;
-					}
-				}
-			}
-			
-			if(adcMin == 1024.0) {
-				fprintf(stderr, "WARNING: Could not find a suitable edge position. Skipping TAC (A: %4d %2d %d %c)\n",
-					asic, channel, tac, isT  ? 'T' : 'E'
-				);
-				continue;
-			}
-			
-			while(lowerT0 > 2.0 && tEdge > 2.0 && upperT0 > 2.0) {
-				lowerT0 -= 2.0;
-				tEdge -= 2.0;
-				upperT0 -= 2.0;
-			}
-			
-			float tEdgeTolerance = upperT0 - lowerT0;
-			// Fit a line to a TDC period to determine the interpolation factor
-			pA_Fine->Fit("pol1", "Q", "", tEdge + tEdgeTolerance, tEdge + 2.0  - tEdgeTolerance);
-			TF1 *fPol = pA_Fine->GetFunction("pol1");
-			if(fPol == NULL) {
-				fprintf(stderr, "WARNING: Could not make a linear fit. Skipping TAC. (A: %4d %2d %d %c)\n",
-					asic, channel, tac, isT  ? 'T' : 'E'
-				);
-				continue;
-				
-			}
-			float estimatedM = - fPol->GetParameter(1);
-			if(estimatedM < 0.75 * nominalM || estimatedM > 1.25 * nominalM) {
-				fprintf(stderr, "WARNING: M (%6.1f) is out of range[%6.1f, %6.1f]. Skipping TAC. (A: %4d %2d %d %c)\n",
-					estimatedM, 0.75 * nominalM, 1.25 * nominalM,
-					asic, channel, tac, isT  ? 'T' : 'E'
-				);
-				continue;
-			}
-			
-			
-			boost::uniform_real<> range(lowerT0, upperT0);
-			boost::variate_generator<boost::mt19937&, boost::uniform_real<> > nextRandomTEdge(generator, range);
-		
-			TF1 *pf = new TF1("periodicF1", periodicF1, xMin, xMax, nPar1);
-			for(int p = 0; p < nPar1; p++) pf->SetParName(p, paramNames1[p]);
-			pf->SetNpx(2 * nBinsX);
-			
-			float b;
-			float m;
-			float tB;
-			float p2;
-			float currChi2 = INFINITY;
-			float prevChi2 = INFINITY;
-			int nTry = 0;
-			float maxChi2 = 2E6;
-			do {
-				pf->SetParameter(0, tEdge);		pf->SetParLimits(0, lowerT0, upperT0);
-				pf->SetParameter(1, adcMin);		pf->SetParLimits(1, adcMin - estimatedM * tEdgeTolerance, adcMin);
-				pf->SetParameter(2, estimatedM);	pf->SetParLimits(2, 0.99 * estimatedM, 1.01 * estimatedM),
-				pA_Fine->Fit("periodicF1", "Q", "", 0.5, xMax);
-				
-				TF1 *pf_ = pA_Fine->GetFunction("periodicF1");
-				if(pf_ != NULL) {
-					prevChi2 = currChi2;
-					currChi2 = pf_->GetChisquare() / pf_->GetNDF();	
-					
-					if((currChi2 < prevChi2)) {
-						tEdge = pf->GetParameter(0);
-						b  = pf->GetParameter(1);
-						m  = pf->GetParameter(2);		
-						tB = - (b/m - 1.0);
-						p2 = 0;
-					}
-				}
-				else {
-					//	tEdge = nextRandomTEdge();
-				}
-				nTry += 1;
-				
-			} while((currChi2 <= 0.95*prevChi2) && (nTry < 10));
-			
-			if(prevChi2 > maxChi2 && currChi2 > maxChi2) {
-				fprintf(stderr, "WARNING: NO FIT OR VERY BAD FIT (1). Skipping TAC. (A: %4d %2d %d %c)\n",
-					asic, channel, tac, isT  ? 'T' : 'E'
-				);
-				delete pf;
-				continue;
-			}
-			
-			TF1 *pf2 = new TF1("periodicF2", periodicF2, xMin, xMax,  nPar2);		
-			pf2->SetNpx(2*nBinsX);
-			for(int p = 0; p < nPar2; p++) pf2->SetParName(p, paramNames2[p]);
-			
-			currChi2 = INFINITY;
-			prevChi2 = INFINITY;
-			nTry = 0;
-			do {
-				//pf2->SetParameter(0, tEdge);		pf2->SetParLimits(0, tEdge-0.1, tEdge+0.1);
-				pf2->FixParameter(0, tEdge);
-				pf2->SetParameter(1, tB);		pf2->SetParLimits(1, 1.10*tB, 0);
-				//pf2->FixParameter(1, tB);
-				pf2->SetParameter(2, m);		pf2->SetParLimits(2, 1.00 * m, 1.15 * m);
-				pf2->SetParameter(3, -1.0);		pf2->SetParLimits(3, -5.0, 0);
-				pA_Fine->Fit("periodicF2", "Q", "", 0.5, xMax);
-
-				TF1 *pf_ = pA_Fine->GetFunction("periodicF2");
-				if(pf_ != NULL) {
-					prevChi2 = currChi2;
-					currChi2 = pf_->GetChisquare() / pf_->GetNDF();	
-					
-					if(currChi2 < prevChi2) {
-						tEdge = pf->GetParameter(0);
-						b  = pf->GetParameter(1);
-						m  = pf->GetParameter(2);		
-						tB = - (b/m - 1.0);
-						p2 = 0;								
-					}
-				}
-				nTry += 1;
-				
-			} while((currChi2 <= 0.95*prevChi2) && (nTry < 10));
-			
-			if(prevChi2 > maxChi2 && currChi2 > maxChi2) {
-				fprintf(stderr, "WARNING: NO FIT OR VERY BAD FIT (2). Skipping TAC. (A: %4d %2d %d %c)\n",
-					asic, channel, tac, isT  ? 'T' : 'E'
-				);
-				delete pf;
-				delete pf2;
-				continue;
-			}
-				
-			ti.shape.tEdge = tEdge = pf2->GetParameter(0);
-			ti.shape.tB = tB = pf2->GetParameter(1);
-			ti.shape.m  = m  = pf2->GetParameter(2);
-			ti.shape.p2 = p2 = pf2->GetParameter(3);
-			
-		
-			myP2.setShapeParameters((64*asic+channel)-channelStart, tac, isT, tB, m, p2);
-			myP2.setT0((64*asic+channel)-channelStart, tac, isT, tEdge);
-
-			// Allocate the control histograms
-			sprintf(hName, isT ? "C%03d_%02d_%d_A_T_control_T" : "C%03d_%02d_%d_A_E_control_T", 
-					asic, channel, tac);
-			ti.pA_ControlT = new TProfile(hName, hName, linearityNbins, linearityRangeMinimum, linearityRangeMaximum, "s");
-
-			sprintf(hName, isT ? "C%03d_%02d_%d_A_T_control_E" : "C%03d_%02d_%d_A_E_control_E", 
-					asic, channel, tac);
-			ti.pA_ControlE = new TH1F(hName, hName, 512, -ErrorHistogramRange, ErrorHistogramRange);
-			
-			delete pf;
-			delete pf2;
-		}
+		unsigned channel = gid >> 3;
+		myP2.setShapeParameters(channel-channelStart, tac, isT, ti.shape.tB, ti.shape.m, ti.shape.p2);
+		myP2.setT0(channel-channelStart, tac, isT, ti.shape.tEdge);
 	}
 	
-	lseek(leakageDataFile, 0, SEEK_SET);
-	while((r = read(leakageDataFile, eventBuffer, sizeof(Event)*READ_BUFFER_SIZE)) > 0) {
-		int nEvents = r / sizeof(Event);
-		for(int i = 0; i < nEvents; i++) {
-			Event &event = eventBuffer[i];
+	{
+		size_t nEvents = leakageData.nEvents;
+		for(size_t i = 0; i < nEvents; i++) {
+			Event &event = leakageData.events[i];
 			assert(event.gid >= gidStart);
 			assert(event.gid < gidEnd);
 			assert(pB_FineList[event.gid-gidStart] != NULL);
@@ -867,95 +1282,15 @@ int calibrate(	int asicStart, int asicEnd,
 			asicPresent[asic-asicStart] = true;
 		}
 	}
-	delete [] eventBuffer;
 
+	runFitJobs(context, gidEnd, true);
 	for(unsigned gid = gidStart; gid < gidEnd; gid++) {
+		TacInfo &ti = tacInfo[gid];
+		if(ti.pB_ControlT == NULL) continue;
 		unsigned tac = gid & 0x3;
 		bool isT = ((gid >> 2) & 0x1) == 0;
-		unsigned channel = (gid >> 3) & 63;
-		unsigned asic = gid >> 9;
-		TacInfo &ti = tacInfo[gid];
-		
-		// We had _no_ data for this ASIC, we assume it's not present in the system
-		// Let's just move on without further ado
-		if(!asicPresent[asic-asicStart])
-			continue;
-		
-		{
-			char hName[128];
-
-			TProfile *pA_Fine = ti.pA_Fine;
-			if(pA_Fine == NULL) continue;
-			TF1 * pf2 = pA_Fine->GetFunction("periodicF2");
-			if(pf2 == NULL) continue;
-
-			float x = ti.shape.tEdge + 1.9;
-			float tQ = 3 - fmod(1024.0 + x - ti.shape.tEdge, 2.0);
-			float a00 = pf2->Eval(x);
-			
-			TProfile *pB_Fine = pB_FineList[gid-gidStart];
-			assert(pB_Fine != NULL);
-			if(pB_Fine->GetEntries() < 200) {
-				continue;
-			}
-				
-			int nBinsX = pB_Fine->GetXaxis()->GetNbins();
-			float xMin = pB_Fine->GetXaxis()->GetXmin();
-			float xMax = pB_Fine->GetXaxis()->GetXmax();
-
-			float yMin = pB_Fine->GetBinContent(1);
-			float yMax = pB_Fine->GetBinContent(nBinsX);
-			float slope = (yMax - yMin)/(xMax - xMin);
-
-			
-//			TF1 *pl1 = new TF1("pl1", "[0]+[1]*x", xMin, xMax);		
-//			pl1->SetParameter(0, yMin);
-//			pl1->SetParameter(1, slope);
-//			pl1->SetParLimits(0, -20, 20);
-//			pl1->SetParLimits(1, -1.0, 1.0);
-//			pl1->SetNpx(nBinsX);
-			
-			int nTry = 0;
-			while(nTry < 10){
-				pB_Fine->Fit("pol1", "Q", "", xMin, xMax);
-				TF1 *fit = pB_Fine->GetFunction("pol1");
-				if(fit == NULL) break;
-				float chi2 = fit->GetChisquare();
-				float ndf = fit->GetNDF();
-				if(chi2/ndf < 2.0) break;
-				nTry += 1;
-			}
-			
-			
-			TF1 *fit = pB_Fine->GetFunction("pol1");
-			if(fit == NULL) {
-				fprintf(stderr, "WARNING: NO FIT! Skipping TAC. (B: %4d %2d %d %c)\n",
-					asic, channel, tac, isT  ? 'T' : 'E'
-				);
-//				delete pl1;
-				continue;
-			}
-			float chi2 = fit->GetChisquare();
-			float ndf = fit->GetNDF();
-			ti.leakage.tQ = tQ;
-			ti.leakage.a0 = a00;//fit->GetParameter(0) + a00;
-			ti.leakage.a1 = fit->GetParameter(1) / (1024 * 4);
-			ti.leakage.a2 = 0;//fit->GetParameter(2) / ((1024 * 4)*(1024*4));
-			
-			myP2.setLeakageParameters((64 * asic + channel)-channelStart, tac, isT, ti.leakage.tQ, ti.leakage.a0, ti.leakage.a1, ti.leakage.a2);
-			
-
-			sprintf(hName, isT ? "C%03d_%02d_%d_B_T_control_T" : "C%03d_%02d_%d_B_E_control_T", 
-					asic, channel, tac);
-			ti.pB_ControlT = new TProfile(hName, hName, leakageNbins, leakageRangeMinimum, leakageRangeMaximum, "s");
-		
-			sprintf(hName, isT ? "C%03d_%02d_%d_B_T_control_E" : "C%03d_%02d_%d_B_E_control_E", 
-					asic, channel, tac);
-			ti.pB_ControlE = new TH1F(hName, hName, 256, -ErrorHistogramRange, ErrorHistogramRange);
-			
-//			delete pl1;
-		}
-	
+		unsigned channel = gid >> 3;
+		myP2.setLeakageParameters(channel-channelStart, tac, isT, ti.leakage.tQ, ti.leakage.a0, ti.leakage.a1, ti.leakage.a2);
 	}
 
 	// Zero out channels for which 1 or more TAC did not calibrate
@@ -965,7 +1300,7 @@ int calibrate(	int asicStart, int asicEnd,
 		unsigned gidB = gidA + 8;
 		for(unsigned gid = gidA; gid < gidB; gid++) {
 			TacInfo &ti = tacInfo[gid];
-			channelOK &= (ti.pA_ControlT != NULL);
+			channelOK &= ti.fitted;
 		}
 
 		if(!channelOK) {
@@ -984,19 +1319,22 @@ int calibrate(	int asicStart, int asicEnd,
 	}
 
 
+	// The histograms themselves belong to the current directory
+	delete [] hA_Fine2List;
+	delete [] pB_FineList;
 	return hasData;
 
 }
 
 void qualityControl(
 	int asicStart, int asicEnd, 
-	int linearityDataFile,
-	int leakageDataFile,
+	EventFile &linearityData,
+	EventFile &leakageData,
 	TacInfo *tacInfo, DAQ::TOFPET::P2 &myP2,
 	char *plotFilePrefix
 )
 {
-	Event *eventBuffer = new Event[READ_BUFFER_SIZE];
+	TF1 *fGaus = new TF1("gaus", "gaus", -ErrorHistogramRange, ErrorHistogramRange);
 	// Correct t0 and build shape quality control histograms
 	const int nIterations = 3;
 
@@ -1040,12 +1378,10 @@ void qualityControl(
 			hBranchErrorA[bid]->Reset();
 		}
 	
-		lseek(linearityDataFile, 0, SEEK_SET);
-		int r;
-		while((r = read(linearityDataFile, eventBuffer, sizeof(Event)*READ_BUFFER_SIZE)) > 0) {
-			int nEvents = r / sizeof(Event);
-			for (int i = 0; i < nEvents; i++) {
-				Event &event = eventBuffer[i];
+		{
+			size_t nEvents = linearityData.nEvents;
+			for (size_t i = 0; i < nEvents; i++) {
+				Event &event = linearityData.events[i];
 				assert(event.gid >= gidStart);
 				assert(event.gid < gidEnd);
 
@@ -1097,7 +1433,7 @@ void qualityControl(
 			int nEntries = ti.pA_ControlE->GetEntries();
 			if (nEntries > 1000) {
 				TF1 *f = NULL;
-				ti.pA_ControlE->Fit("gaus", "Q");
+				ti.pA_ControlE->Fit(fGaus, "Q0");
 				f = ti.pA_ControlE->GetFunction("gaus");
 				if (f != NULL) {
 					offset = f->GetParameter(1);
@@ -1127,12 +1463,10 @@ void qualityControl(
 			hBranchErrorB[bid]->Reset();
 		}
 		
-		int r;
-		lseek(leakageDataFile, 0, SEEK_SET);
-		while((r = read(leakageDataFile, eventBuffer, sizeof(Event)*READ_BUFFER_SIZE)) > 0) {
-			int nEvents = r / sizeof(Event);
-			for(int i = 0; i < nEvents; i++) {
-				Event &event = eventBuffer[i];
+		{
+			size_t nEvents = leakageData.nEvents;
+			for(size_t i = 0; i < nEvents; i++) {
+				Event &event = leakageData.events[i];
 				assert(event.gid >= gidStart);
 				assert(event.gid < gidEnd);
 		
@@ -1173,7 +1507,7 @@ void qualityControl(
 			int nEntries = ti.pB_ControlE->GetEntries();
 			if (nEntries > 1000) {
 				TF1 *f = NULL;
-				ti.pB_ControlE->Fit("gaus", "Q");
+				ti.pB_ControlE->Fit(fGaus, "Q0");
 				f = ti.pB_ControlE->GetFunction("gaus");
 				if (f != NULL) {
 					offset = f->GetParameter(1);
@@ -1184,7 +1518,8 @@ void qualityControl(
 	}
 	delete [] localT0;
 	
-	
+	// Graphics are not thread safe, only one calibration at a time may plot
+	pthread_mutex_lock(&plotLock);
 	TCanvas *c = new TCanvas();
 	for(unsigned aOrB = 0; aOrB < 2; aOrB++) {
 		TH1F **hBranchError = (aOrB == 0) ? hBranchErrorA : hBranchErrorB;
@@ -1221,7 +1556,7 @@ void qualityControl(
 				
 				hCounts->Fill(channel, hError->GetEntries());
 				if(hError->GetEntries() < 1000) continue;
-				hError->Fit("gaus", "Q");
+				hError->Fit(fGaus, "Q0");
 				TF1 *fit = hError->GetFunction("gaus");
 				if(fit == NULL) continue;
 				float sigma = fit->GetParameter(2) * DAQ::Common::SYSTEM_PERIOD;
@@ -1263,133 +1598,301 @@ void qualityControl(
 			sprintf(plotFileName, "%s_%s.png", plotFilePrefix, modeString);
 			c->SaveAs(plotFileName);
 			
+			delete gResolution;
 		}
 	}
+	delete c;
+	pthread_mutex_unlock(&plotLock);
 
-	delete [] eventBuffer;
+	delete fGaus;
 }
 
 using namespace DAQ::Core;
 
+static const size_t WRITE_BUFFER_SIZE = 4*1024*1024 / sizeof(Event);
+static const size_t ARENA_INITIAL_SIZE = 1024*1024;
+
+// The sorted events of one ASIC group, for either linearity or leakage data.
+// Events are appended in blocks and end up either in a temporary file, 
+// written through a large buffer, or in an anonymous memory arena.
+class EventBucket {
+private:
+	char fName[1024];
+	bool useArena;
+	FILE *file;
+	Event *buffer;
+	size_t bufferUsed;
+	Event *arena;
+	size_t arenaUsed;
+	size_t arenaSize;
+	pthread_mutex_t lock;
+
+	void flush()
+	{
+		if(bufferUsed == 0) return;
+		size_t r = fwrite(buffer, sizeof(Event), bufferUsed, file);
+		if(r != bufferUsed) {
+			int e = errno;
+			fprintf(stderr, "Error writing to '%s' : %d %s\n", fName, e, strerror(e));
+			exit(1);
+		}
+		bufferUsed = 0;
+	};
+
+	void growArena(size_t minSize)
+	{
+		size_t newSize = arenaSize;
+		while(newSize < minSize) newSize *= 2;
+		void *p = mremap(arena, arenaSize * sizeof(Event), newSize * sizeof(Event), MREMAP_MAYMOVE);
+		if(p == MAP_FAILED) {
+			int e = errno;
+			fprintf(stderr, "Could not grow memory arena for '%s' to %lu MiB : %d %s\n", 
+				fName, (unsigned long)(newSize * sizeof(Event) / (1024*1024)), e, strerror(e));
+			exit(1);
+		}
+		arena = (Event *)p;
+		arenaSize = newSize;
+	};
+
+public:
+	EventBucket(const char *fName, bool useArena)
+		: useArena(useArena), file(NULL), buffer(NULL), bufferUsed(0), arena(NULL), arenaUsed(0), arenaSize(0)
+	{
+		strncpy(this->fName, fName, sizeof(this->fName));
+		if(useArena) {
+			arenaSize = ARENA_INITIAL_SIZE;
+			void *p = mmap(NULL, arenaSize * sizeof(Event), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+			if(p == MAP_FAILED) {
+				int e = errno;
+				fprintf(stderr, "Could not allocate memory arena for '%s' : %d %s\n", fName, e, strerror(e));
+				exit(1);
+			}
+			arena = (Event *)p;
+		}
+		else {
+			file = fopen(fName, "wb");
+			if(file == NULL) {
+				int e = errno;
+				fprintf(stderr, "Could not open '%s' for writing : %d %s\n", fName, e, strerror(e));
+				exit(1);
+			}
+			buffer = new Event[WRITE_BUFFER_SIZE];
+		}
+		pthread_mutex_init(&lock, NULL);
+	};
+
+	~EventBucket()
+	{
+		close();
+		if(arena != NULL) munmap(arena, arenaSize * sizeof(Event));
+		pthread_mutex_destroy(&lock);
+	};
+
+	void append(Event *events, size_t n)
+	{
+		pthread_mutex_lock(&lock);
+		if(useArena) {
+			if(arenaUsed + n > arenaSize) growArena(arenaUsed + n);
+			memcpy(arena + arenaUsed, events, n * sizeof(Event));
+			arenaUsed += n;
+		}
+		else {
+			while(n > 0) {
+				size_t c = WRITE_BUFFER_SIZE - bufferUsed;
+				c = c < n ? c : n;
+				memcpy(buffer + bufferUsed, events, c * sizeof(Event));
+				bufferUsed += c;
+				events += c;
+				n -= c;
+				if(bufferUsed == WRITE_BUFFER_SIZE) flush();
+			}
+		}
+		pthread_mutex_unlock(&lock);
+	};
+
+	void close()
+	{
+		if(file != NULL) {
+			flush();
+			fclose(file);
+			file = NULL;
+		}
+		delete [] buffer;
+		buffer = NULL;
+	};
+
+	// Hands the arena over to an EventFile, which will unmap it when done
+	void release(EventFile &f)
+	{
+		f.events = arena;
+		f.nEvents = arenaUsed;
+		f.mapSize = arenaSize * sizeof(Event);
+		arena = NULL;
+		arenaUsed = 0;
+		arenaSize = 0;
+	};
+	
+	size_t getMemorySize()
+	{
+		return arenaSize * sizeof(Event);
+	};
+};
+
 class EventWriter {
 private:
 	char *outputFilePrefix;
 	int nAsicsPerFile;
-	char **linearityDataFilesNames;
-	FILE **linearityDataFiles;
-	char **leakageDataFilesNames;
-	FILE **leakageDataFiles;
+	bool useArena;
+	int nFiles;
+	EventBucket **linearityBuckets;
+	EventBucket **leakageBuckets;
 	FILE *tmpListFile;
+	// Protects bucket creation, blocks from several steps and workers are sorted concurrently
+	pthread_mutex_t lock;
+
+	void createBuckets(int fileID)
+	{
+		pthread_mutex_lock(&lock);
+		if(linearityBuckets[fileID] == NULL) {
+			char fName[1024];
+			sprintf(fName, "%s_%d_linearity.tmp", outputFilePrefix, fileID);
+			EventBucket *linearity = new EventBucket(fName, useArena);
+			sprintf(fName, "%s_%d_leakage.tmp", outputFilePrefix, fileID);
+			leakageBuckets[fileID] = new EventBucket(fName, useArena);
+			// Lock-free readers test linearityBuckets, so it is published last
+			__atomic_store_n(&linearityBuckets[fileID], linearity, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&lock);
+	};
 	
 public:
-	EventWriter(char *outputFilePrefix, int nAsicsPerFile)
+	EventWriter(char *outputFilePrefix, int nAsicsPerFile, bool useArena)
 	{
 		this->outputFilePrefix = outputFilePrefix;
 		this->nAsicsPerFile = nAsicsPerFile;
-		linearityDataFilesNames = new char *[MAX_N_ASIC/nAsicsPerFile];
-		linearityDataFiles = new FILE *[MAX_N_ASIC/nAsicsPerFile];
-		leakageDataFilesNames = new char *[MAX_N_ASIC/nAsicsPerFile];
-		leakageDataFiles = new FILE *[MAX_N_ASIC/nAsicsPerFile];
-		for(int n = 0; n < MAX_N_ASIC/nAsicsPerFile; n++)
+		this->useArena = useArena;
+		nFiles = (MAX_N_ASIC + nAsicsPerFile - 1) / nAsicsPerFile;
+		linearityBuckets = new EventBucket *[nFiles];
+		leakageBuckets = new EventBucket *[nFiles];
+		for(int n = 0; n < nFiles; n++)
 		{
-			linearityDataFilesNames[n] = NULL;
-			linearityDataFiles[n] = NULL;
-			leakageDataFilesNames[n] = NULL;
-			leakageDataFiles[n] = NULL;
+			linearityBuckets[n] = NULL;
+			leakageBuckets[n] = NULL;
 		}
+		pthread_mutex_init(&lock, NULL);
 		
-		// Create the temporary list file
-		char fName[1024];
-		sprintf(fName, "%s_list.tmp", outputFilePrefix);
-		tmpListFile = fopen(fName, "w");
-		if(tmpListFile == NULL) {
-			fprintf(stderr, "Could not open '%s' for writing: %s\n", fName, strerror(errno));
-			exit(1);
+		tmpListFile = NULL;
+		if(!useArena) {
+			// Create the temporary list file
+			char fName[1024];
+			sprintf(fName, "%s_list.tmp", outputFilePrefix);
+			tmpListFile = fopen(fName, "w");
+			if(tmpListFile == NULL) {
+				fprintf(stderr, "Could not open '%s' for writing: %s\n", fName, strerror(errno));
+				exit(1);
+			}
 		}
 	};
 	
+	~EventWriter()
+	{
+		for(int fileID = 0; fileID < nFiles; fileID++) {
+			delete linearityBuckets[fileID];
+			delete leakageBuckets[fileID];
+		}
+		delete [] linearityBuckets;
+		delete [] leakageBuckets;
+		pthread_mutex_destroy(&lock);
+	};
+	
 	void handleEvents(bool isT, bool isLinearity, float step1, float step2, EventBuffer<RawHit> *buffer)
 	{
 		int tOrE = isT ? 0 : 1;
 		
+		// Partition the block by file (counting sort), so that each bucket gets one append per block
 		int N = buffer->getSize();
+		int *eventFileID = new int[N];
+		unsigned *fileStart = new unsigned[nFiles+1];
+		for(int n = 0; n <= nFiles; n++) 
+			fileStart[n] = 0;
+
 		for (int i = 0; i < N; i++) {
 			RawHit &hit = buffer->get(i);
+			eventFileID[i] = -1;
 			if(hit.time < 0) continue;
 			
 			if(isT && (hit.d.tofpet.tcoarse == 0) && (hit.d.tofpet.ecoarse == 0)) continue; // Patch for bad events
-
+			
+			int fileID = (hit.channelID / 64) / nAsicsPerFile;
+			eventFileID[i] = fileID;
+			fileStart[fileID+1] += 1;
+		}
+		for(int n = 0; n < nFiles; n++)
+			fileStart[n+1] += fileStart[n];
+		
+		Event *events = new Event[fileStart[nFiles] > 0 ? fileStart[nFiles] : 1];
+		unsigned *fileEnd = new unsigned[nFiles];
+		for(int n = 0; n < nFiles; n++)
+			fileEnd[n] = fileStart[n];
+		
+		for (int i = 0; i < N; i++) {
+			int fileID = eventFileID[i];
+			if(fileID == -1) continue;
+			
+			RawHit &hit = buffer->get(i);
 			unsigned gid = (hit.channelID << 3) | (tOrE << 2) | (hit.d.tofpet.tac & 0x3);
 			
-			Event event;
+			Event &event = events[fileEnd[fileID]++];
 			event.gid = gid;
 			event.coarse = isT ? hit.d.tofpet.tcoarse : hit.d.tofpet.ecoarse;
 			event.fine = isT ? hit.d.tofpet.tfine : hit.d.tofpet.efine;
 			event.tacIdleTime = hit.d.tofpet.tacIdleTime;
 			event.phase = step1;
 			event.interval = step2;
-
-			int fileID = (hit.channelID / 64) / nAsicsPerFile;
+		}
+		
+		for(int fileID = 0; fileID < nFiles; fileID++) {
+			unsigned n = fileEnd[fileID] - fileStart[fileID];
+			if(n == 0) continue;
 			
-			if(linearityDataFiles[fileID] == NULL) {
-				char *fName = new char[1024];
-				sprintf(fName, "%s_%d_linearity.tmp", outputFilePrefix, fileID);
-				FILE *f = fopen(fName, "wb");
-				if(f == NULL) {
-					int e = errno;
-					fprintf(stderr, "Could not open '%s' for writing : %d %s\n", fName, e, strerror(e));
-					exit(1);
-				}
-				
-				linearityDataFilesNames[fileID] = fName;
-				linearityDataFiles[fileID] = f;
-			}
-
-			if(leakageDataFiles[fileID] == NULL) {
-				char *fName = new char[1024];
-				sprintf(fName, "%s_%d_leakage.tmp", outputFilePrefix, fileID);
-				FILE *f = fopen(fName, "wb");
-				if(f == NULL) {
-					int e = errno;
-					fprintf(stderr, "Could not open '%s' for writing : %d %s\n", fName, e, strerror(e));
-					exit(1);
-				}
-				
-				leakageDataFilesNames[fileID] = fName;
-				leakageDataFiles[fileID] = f;
-			}
-
-			FILE **ff = isLinearity ? linearityDataFiles : leakageDataFiles;
-			char **nn = isLinearity ? linearityDataFilesNames : leakageDataFilesNames;
-			FILE *f = ff[fileID];
-			assert(f != NULL);
-
-			int r = fwrite(&event, sizeof(event), 1, f);
-			if( r != 1) {
-				int e = errno;
-				fprintf(stderr, "Error writing to '%s' : %d %s\n", 
-					nn[fileID], e, strerror(e));
-				exit(1);
-			}
+			// Pairs with the release store in createBuckets, so the buckets are seen fully built
+			if(__atomic_load_n(&linearityBuckets[fileID], __ATOMIC_ACQUIRE) == NULL) 
+				createBuckets(fileID);
+			
+			EventBucket *bucket = isLinearity ? linearityBuckets[fileID] : leakageBuckets[fileID];
+			bucket->append(events + fileStart[fileID], n);
 		}
+
+		delete [] fileEnd;
+		delete [] events;
+		delete [] fileStart;
+		delete [] eventFileID;
 	};
 	
-	void close()
+	void close(std::vector<SortedGroup> &groups)
 	{
-		for(unsigned long fileID = 0; fileID <= (MAX_N_ASIC/nAsicsPerFile); fileID++) {
-			if(linearityDataFiles[fileID] != NULL) {
-				fprintf(tmpListFile, "%d %d %d\n", fileID, fileID*nAsicsPerFile, (fileID+1)*nAsicsPerFile);
+		for(int fileID = 0; fileID < nFiles; fileID++) {
+			if(linearityBuckets[fileID] == NULL) continue;
 
-				fclose(linearityDataFiles[fileID]);
-				fclose(leakageDataFiles[fileID]);
-			}
-			linearityDataFiles[fileID] = NULL;
-			leakageDataFiles[fileID] = NULL;
+			linearityBuckets[fileID]->close();
+			leakageBuckets[fileID]->close();
 			
-			delete [] linearityDataFilesNames[fileID];
-			delete [] leakageDataFilesNames[fileID];
+			if(useArena) {
+				SortedGroup g;
+				g.fileID = fileID;
+				g.asicStart = fileID*nAsicsPerFile;
+				g.asicEnd = (fileID+1)*nAsicsPerFile;
+				linearityBuckets[fileID]->release(g.linearityData);
+				leakageBuckets[fileID]->release(g.leakageData);
+				groups.push_back(g);
+			}
+			else {
+				fprintf(tmpListFile, "%d %d %d\n", fileID, fileID*nAsicsPerFile, (fileID+1)*nAsicsPerFile);
+			}
 		}
-		fclose(tmpListFile);
+		if(tmpListFile != NULL) 
+			fclose(tmpListFile);
+		tmpListFile = NULL;
 	};
 };
 
@@ -1400,7 +1903,7 @@ private:
 	float step1, step2;
 public:
 	WriteHelper(EventWriter *eventWriter, bool isT, bool isLinearity, float step1, float step2, EventSink<RawHit> *sink) :
-		OverlappedEventHandler<RawHit, RawHit>(sink, true),
+		OverlappedEventHandler<RawHit, RawHit>(sink),
 		isT(isT), isLinearity(isLinearity), step1(step1), step2(step2),
 		eventWriter(eventWriter)
 	{
@@ -1412,9 +1915,47 @@ public:
 	};
 };
 
-void sortData(char *inputFilePrefix, char *outputFilePrefix, int nAsicsPerFile)
+// Sorts the steps of one scan, several at a time
+class SortScheduler : public StepScheduler {
+private:
+	DAQ::TOFPET::RawScanner *scanner;
+	char *prefix;
+	EventWriter *eventWriter;
+	bool isT, isLinearity;
+public:
+	SortScheduler(DAQ::TOFPET::RawScanner *scanner, char *prefix, int maxActiveSteps, EventWriter *eventWriter, bool isT, bool isLinearity) :
+		StepScheduler(scanner->getNSteps(), maxActiveSteps),
+		scanner(scanner), prefix(prefix), eventWriter(eventWriter), isT(isT), isLinearity(isLinearity)
+	{
+	};
+
+protected:
+	void processStep(int step) {
+		unsigned long long eventsBegin;
+		unsigned long long eventsEnd;
+		float step1;
+		float step2;
+		scanner->getStep(step, step1, step2, eventsBegin, eventsEnd);
+		
+		if(eventsBegin == eventsEnd) return;
+		
+		DAQ::TOFPET::RawReader *reader = new DAQ::TOFPET::RawReaderV3(
+			prefix, SYSTEM_PERIOD,  eventsBegin, eventsEnd , 0, false,
+			new WriteHelper(eventWriter, isT, isLinearity, step1, step2,
+			new NullSink<RawHit>()
+		));
+		reader->wait();
+		delete reader;
+	};
+
+	// Events are written as each step is processed, there's nothing left to commit
+	void commitStep(int step) {
+	};
+};
+
+void sortData(char *inputFilePrefix, char *outputFilePrefix, int nAsicsPerFile, int maxActiveSteps, bool useArena, std::vector<SortedGroup> &groups)
 {
-	EventWriter * eventWriter = new EventWriter(outputFilePrefix, nAsicsPerFile);
+	EventWriter * eventWriter = new EventWriter(outputFilePrefix, nAsicsPerFile, useArena);
 	
 	char prefix[1024];
 	for(int i1 = 0; i1 < 2; i1++) {
@@ -1426,27 +1967,14 @@ void sortData(char *inputFilePrefix, char *outputFilePrefix, int nAsicsPerFile)
 			DAQ::TOFPET::RawScanner *scanner = new DAQ::TOFPET::RawScannerV3(prefix);
 			printf("Sorting from %s\n", prefix);
 			
-			for(int step = 0; step < scanner->getNSteps(); step++) {
-				unsigned long long eventsBegin;
-				unsigned long long eventsEnd;
-				float step1;
-				float step2;
-				scanner->getStep(step, step1, step2, eventsBegin, eventsEnd);
-				
-				if(eventsBegin == eventsEnd) continue;
-				
-				DAQ::TOFPET::RawReader *reader = new DAQ::TOFPET::RawReaderV3(
-					prefix, SYSTEM_PERIOD,  eventsBegin, eventsEnd , 0, false,
-					new WriteHelper(eventWriter, isT, isLinearity, step1, step2,
-					new NullSink<RawHit>()
-				));
-				reader->wait();
-				delete reader;
-			}
+			SortScheduler *scheduler = new SortScheduler(scanner, prefix, maxActiveSteps, eventWriter, isT, isLinearity);
+			scheduler->run();
+			delete scheduler;
+			delete scanner;
 		}
 	}
 	
-	eventWriter->close();
+	eventWriter->close(groups);
 	delete eventWriter;
 	
 }
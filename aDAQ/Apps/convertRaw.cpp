@@ -0,0 +1,313 @@
+/*
+ * Converts raw data between the .raw2, .raw3, .rawE and .rawC formats.
+ * Several steps are read at a time while the output is written in step order,
+ * the number of events read for each step is checked against the input index
+ * and the output index is rewritten from the events actually written.
+ */
+#include <Common/Constants.hpp>
+#include <TOFPET/RawV3.hpp>
+#include <TOFPET/RawV2.hpp>
+#include <TOFPET/RawC.hpp>
+#include <ENDOTOFPET/Raw.hpp>
+#include <Core/StepScheduler.hpp>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <deque>
+#include <vector>
+
+using namespace DAQ;
+using namespace DAQ::Core;
+using namespace DAQ::TOFPET;
+using namespace std;
+
+// Buffers a step may hold while waiting for the previous steps to be written
+static const unsigned maxPendingBuffers = 16;
+
+static bool validFormat(char format)
+{
+	return format != 0 && strchr("23EC", format) != NULL;
+}
+
+static RawScanner *openScanner(char format, char *prefix)
+{
+	if(format == '2') return new RawScannerV2(prefix);
+	else if(format == '3') return new RawScannerV3(prefix);
+	else if(format == 'E') return new ENDOTOFPET::RawScannerE(prefix);
+	else return new RawScannerC(prefix);
+}
+
+static RawReader *openReader(char format, char *prefix, unsigned long long eventsBegin, unsigned long long eventsEnd, EventSink<RawHit> *sink)
+{
+	if(format == '2') return new RawReaderV2(prefix, SYSTEM_PERIOD, eventsBegin, eventsEnd, sink);
+	else if(format == '3') return new RawReaderV3(prefix, SYSTEM_PERIOD, eventsBegin, eventsEnd, -1, false, sink);
+	else if(format == 'E') return new ENDOTOFPET::RawReaderE(prefix, SYSTEM_PERIOD, eventsBegin, eventsEnd, sink);
+	else return new RawReaderC(prefix, SYSTEM_PERIOD, eventsBegin, eventsEnd, sink);
+}
+
+static RawWriter *openWriter(char format, char *prefix, long long acqStartTime)
+{
+	if(format == '2') return new RawWriterV2(prefix);
+	else if(format == '3') return new RawWriterV3(prefix);
+	else if(format == 'E') return new ENDOTOFPET::RawWriterE(prefix, acqStartTime);
+	else return new RawWriterC(prefix);
+}
+
+// The acquisition start time recorded at the beginning of a .rawE file, or 0
+static long long readAcqStartTime(char *prefix)
+{
+	char fileName[512];
+	sprintf(fileName, "%s.rawE", prefix);
+	FILE *f = fopen(fileName, "rb");
+	if(f == NULL) return 0;
+	ENDOTOFPET::StartTime startTime;
+	long long t = 0;
+	if(fread(&startTime, sizeof(startTime), 1, f) == 1 && startTime.code == 0x00)
+		t = startTime.time;
+	fclose(f);
+	return t;
+}
+
+class Converter;
+
+class StepSink : public EventSink<RawHit> {
+public:
+	StepSink(Converter *converter, int step)
+		: converter(converter), step(step) {
+	};
+
+	void pushEvents(EventBuffer<RawHit> *buffer);
+	void pushT0(double t0) { };
+	void finish() { };
+	void report() { };
+private:
+	Converter *converter;
+	int step;
+};
+
+// Reads several steps at a time, writing them out in step order
+class Converter : public StepScheduler {
+public:
+	Converter(int nSteps, int maxActiveSteps, RawScanner *scanner, char inputFormat, char *inputFilePrefix,
+		char outputFormat, RawWriter *writer)
+		: StepScheduler(nSteps, maxActiveSteps),
+		  inputFormat(inputFormat), inputFilePrefix(inputFilePrefix), outputFormat(outputFormat), writer(writer),
+		  nMismatchedSteps(0), nEventsWritten(0), steps(nSteps)
+	{
+		for(int n = 0; n < nSteps; n++) {
+			StepInfo &si = steps[n];
+			scanner->getStep(n, si.step1, si.step2, si.eventsBegin, si.eventsEnd);
+			si.opened = false;
+			si.nRead = 0;
+			si.nWritten = 0;
+		}
+	};
+
+	void writeEvents(int step, EventBuffer<RawHit> *buffer) {
+		StepInfo &si = steps[step];
+		si.nRead += buffer->getSize();
+
+		// V2 and V3 only have room for TOFPET data
+		if(outputFormat == '2' || outputFormat == '3') {
+			for(unsigned i = 0; i < buffer->getSize(); i++) {
+				if(buffer->get(i).feType != RawHit::TOFPET) {
+					fprintf(stderr, "Step %d has non TOFPET hits, which can't be written in format %c\n", step + 1, outputFormat);
+					exit(1);
+				}
+			}
+		}
+
+		lockOutput();
+		if(!isHead(step) && si.pending.size() >= maxPendingBuffers) {
+			unlockOutput();
+			waitHead(step);
+			lockOutput();
+		}
+		if(isHead(step)) {
+			writePending(si);
+			write(si, buffer);
+		}
+		else {
+			si.pending.push_back(buffer);
+		}
+		unlockOutput();
+	};
+
+	int getNMismatchedSteps() { return nMismatchedSteps; };
+	unsigned long long getNEventsWritten() { return nEventsWritten; };
+
+protected:
+	void processStep(int step) {
+		StepInfo &si = steps[step];
+		if(si.eventsBegin == si.eventsEnd) return;
+		printf("Step %3d of %3d: %f %f (%llu to %llu)\n", step + 1, (int)steps.size(), si.step1, si.step2, si.eventsBegin, si.eventsEnd);
+
+		RawReader *reader = openReader(inputFormat, inputFilePrefix, si.eventsBegin, si.eventsEnd, new StepSink(this, step));
+		reader->wait();
+		delete reader;
+	};
+
+	void commitStep(int step) {
+		StepInfo &si = steps[step];
+		writePending(si);
+		if(!si.opened) {
+			writer->openStep(si.step1, si.step2);
+			si.opened = true;
+		}
+		writer->closeStep();
+		nEventsWritten += si.nWritten;
+
+		unsigned long long nIndexed = si.eventsEnd - si.eventsBegin;
+		if(si.nRead != nIndexed || si.nWritten != si.nRead) {
+			fprintf(stderr, "Step %3d: input index lists %llu events, %llu were read and %llu written\n",
+				step + 1, nIndexed, si.nRead, si.nWritten);
+			nMismatchedSteps++;
+		}
+	};
+
+private:
+	struct StepInfo {
+		float step1;
+		float step2;
+		unsigned long long eventsBegin;
+		unsigned long long eventsEnd;
+		bool opened;
+		unsigned long long nRead;
+		unsigned long long nWritten;
+		deque<EventBuffer<RawHit> *> pending;
+	};
+
+	// Called with the output lock held, for the head step only
+	void write(StepInfo &si, EventBuffer<RawHit> *buffer) {
+		if(!si.opened) {
+			writer->openStep(si.step1, si.step2);
+			si.opened = true;
+		}
+		si.nWritten += writer->addEventBuffer(LLONG_MIN, LLONG_MAX, buffer);
+		delete buffer;
+	};
+
+	void writePending(StepInfo &si) {
+		while(!si.pending.empty()) {
+			EventBuffer<RawHit> *buffer = si.pending.front();
+			si.pending.pop_front();
+			write(si, buffer);
+		}
+	};
+
+	char inputFormat;
+	char *inputFilePrefix;
+	char outputFormat;
+	RawWriter *writer;
+	int nMismatchedSteps;
+	unsigned long long nEventsWritten;
+	vector<StepInfo> steps;
+};
+
+void StepSink::pushEvents(EventBuffer<RawHit> *buffer)
+{
+	converter->writeEvents(step, buffer);
+}
+
+void displayHelp(char * program)
+{
+	fprintf(stderr, "usage: %s [options] rawfiles_prefix output_prefix\n", program);
+	fprintf(stderr, "\noptional arguments:\n");
+	fprintf(stderr,  "  --help \t\t\t Show this help message and exit \n");
+	fprintf(stderr,  "  --input-format=FORMAT\t\t Format of the input files: 2, 3, E or C (default is 3)\n");
+	fprintf(stderr,  "  --output-format=FORMAT\t Format of the output files: 2, 3, E or C (default is C)\n");
+	fprintf(stderr,  "  --parallel-steps=N\t\t Number of steps processed concurrently (default is 4)\n");
+	fprintf(stderr, "\nformats:\n");
+	fprintf(stderr, "  2, 3 \t\t\t\t TOFPET .raw2/.idx2 and .raw3/.idx3\n");
+	fprintf(stderr, "  E \t\t\t\t ENDOTOFPET .rawE/.idxE\n");
+	fprintf(stderr, "  C \t\t\t\t Compact .rawC/.idxC\n");
+	fprintf(stderr, "\npositional arguments:\n");
+	fprintf(stderr, "  rawfiles_prefix \t\t Path to raw data files prefix\n");
+	fprintf(stderr, "  output_prefix \t\t Path to converted data files prefix\n");
+};
+
+void displayUsage( char * program)
+{
+	fprintf(stderr, "usage: %s [options] rawfiles_prefix output_prefix\n", program);
+};
+
+int main(int argc, char *argv[])
+{
+	static struct option longOptions[] = {
+		{ "help", no_argument, 0, 0 },
+		{ "input-format", required_argument, 0, 0 },
+		{ "output-format", required_argument, 0, 0 },
+		{ "parallel-steps", required_argument, 0, 0 },
+		{ NULL, 0, 0, 0 }
+	};
+
+	char inputFormat = '3';
+	char outputFormat = 'C';
+	int maxActiveSteps = 4;
+
+	while(1) {
+		int optionIndex = 0;
+		int c = getopt_long(argc, argv, "", longOptions, &optionIndex);
+		if(c == -1) break;
+
+		if(optionIndex == 0) {
+			displayHelp(argv[0]);
+			return(1);
+		}
+		else if(optionIndex == 1) {
+			inputFormat = strlen(optarg) == 1 ? optarg[0] : 0;
+		}
+		else if(optionIndex == 2) {
+			outputFormat = strlen(optarg) == 1 ? optarg[0] : 0;
+		}
+		else if(optionIndex == 3) {
+			maxActiveSteps = atoi(optarg);
+		}
+		else {
+			displayUsage(argv[0]);
+			fprintf(stderr, "\n%s: error: Unknown option!\n", argv[0]);
+			return(1);
+		}
+	}
+
+	if(argc - optind < 2) {
+		displayUsage(argv[0]);
+		fprintf(stderr, "\n%s: error: too few positional arguments!\n", argv[0]);
+		return(1);
+	}
+	else if(argc - optind > 2) {
+		displayUsage(argv[0]);
+		fprintf(stderr, "\n%s: error: too many positional arguments!\n", argv[0]);
+		return(1);
+	}
+	if(!validFormat(inputFormat) || !validFormat(outputFormat)) {
+		fprintf(stderr, "\n%s: error: formats must be one of 2, 3, E or C\n", argv[0]);
+		return(1);
+	}
+
+	char *inputFilePrefix = argv[optind+0];
+	char *outputFilePrefix = argv[optind+1];
+	if(inputFormat == outputFormat && strcmp(inputFilePrefix, outputFilePrefix) == 0) {
+		fprintf(stderr, "\n%s: error: output would overwrite the input files\n", argv[0]);
+		return(1);
+	}
+
+	RawScanner *scanner = openScanner(inputFormat, inputFilePrefix);
+	long long acqStartTime = inputFormat == 'E' ? readAcqStartTime(inputFilePrefix) : 0;
+	RawWriter *writer = openWriter(outputFormat, outputFilePrefix, acqStartTime);
+
+	int nSteps = scanner->getNSteps();
+	Converter *converter = new Converter(nSteps, maxActiveSteps, scanner, inputFormat, inputFilePrefix, outputFormat, writer);
+	converter->run();
+
+	int nMismatchedSteps = converter->getNMismatchedSteps();
+	fprintf(stderr, "convertRaw:: %d steps, %llu events written\n", nSteps, converter->getNEventsWritten());
+	if(nMismatchedSteps > 0)
+		fprintf(stderr, "convertRaw:: %d steps did not match the input index; the output index lists the events written\n", nMismatchedSteps);
+
+	delete converter;
+	delete writer;
+	delete scanner;
+	return nMismatchedSteps > 0 ? 1 : 0;
+}
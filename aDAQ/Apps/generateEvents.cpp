@@ -0,0 +1,300 @@
+/*
+ * Writes synthetic data from Core/EventGenerator, without a detector, in one of the formats
+ * the acquisition produces: RawEventV3 (.raw3/.idx3), ENDOTOFPET (.rawE/.idxE),
+ * raw frames as written by writeRaw R (.rawf) or a daqd frame ring file (.shm)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <SHM.hpp>
+#include <Common/Constants.hpp>
+#include <Common/Utils.hpp>
+#include <Common/SystemInformation.hpp>
+#include <Core/Event.hpp>
+#include <Core/EventGenerator.hpp>
+#include <Core/RawHitWriter.hpp>
+#include <TOFPET/RawV3.hpp>
+#include <ENDOTOFPET/Raw.hpp>
+
+using namespace std;
+using namespace DAQ;
+using namespace DAQ::Core;
+using namespace DAQ::Common;
+
+static double wallTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9 * ts.tv_nsec;
+}
+
+void displayHelp(char * program)
+{
+	EventGenerator::Config config = EventGenerator::defaultConfig();
+	fprintf(stderr, "usage: %s [options] output_prefix\n", program);
+	fprintf(stderr, "\noptional arguments:\n");
+	fprintf(stderr,  "  --help \t\t\t Show this help message and exit \n");
+	fprintf(stderr,  "  --format=FORMAT\t\t raw3, rawE, rawf or shm (default is raw3)\n");
+	fprintf(stderr,  "  --frames=N\t\t\t Number of frames to generate (default is 10000)\n");
+	fprintf(stderr,  "  --steps=N\t\t\t Split the frames into N steps, tagged step1 = 0..N-1 (default is 1)\n");
+	fprintf(stderr,  "  --coincidence-rate=HZ\t\t Back to back pairs (default is %g)\n", config.coincidenceRate);
+	fprintf(stderr,  "  --singles-rate=HZ\t\t Unpaired gammas (default is %g)\n", config.singlesRate);
+	fprintf(stderr,  "  --dark-rate=HZ\t\t Dark counts in each channel (default is %g)\n", config.darkCountRate);
+	fprintf(stderr,  "  --photofraction=F\t\t Fraction of gammas in the photopeak (default is %g)\n", config.photoFraction);
+	fprintf(stderr,  "  --multihit=P\t\t\t Probability of a hit spilling into the next crystal (default is %g)\n", config.multiHitProbability);
+	fprintf(stderr,  "  --lost-frames=P\t\t Probability of a frame being flagged lost (default is %g)\n", config.lostFrameProbability);
+	fprintf(stderr,  "  --missing-frames=P\t\t Probability of a frame going missing (default is %g)\n", config.missingFrameProbability);
+	fprintf(stderr,  "  --stic-fraction=F\t\t Fraction of ASICs which are STiC, not for raw3 (default is %g)\n", config.sticFraction);
+	fprintf(stderr,  "  --seed=N\t\t\t Random generator seed (default is %llu)\n", (unsigned long long)config.seed);
+	fprintf(stderr,  "  --channel-map=FILE\t\t Channel map (default is the crystal map from config.txt)\n");
+	fprintf(stderr,  "  --trigger-map=FILE\t\t Trigger map, giving the regions in coincidence (default is all pairs of regions)\n");
+	fprintf(stderr, "\npositional arguments:\n");
+	fprintf(stderr, "  output_prefix \t\t Output file prefix\n");
+};
+
+void displayUsage( char * program)
+{
+	fprintf(stderr, "usage: %s [options] output_prefix\n", program);
+};
+
+int main(int argc, char *argv[])
+{
+	static struct option longOptions[] = {
+		{ "help", no_argument, 0, 0 },
+		{ "format", required_argument, 0, 0 },
+		{ "frames", required_argument, 0, 0 },
+		{ "steps", required_argument, 0, 0 },
+		{ "coincidence-rate", required_argument, 0, 0 },
+		{ "singles-rate", required_argument, 0, 0 },
+		{ "dark-rate", required_argument, 0, 0 },
+		{ "photofraction", required_argument, 0, 0 },
+		{ "multihit", required_argument, 0, 0 },
+		{ "lost-frames", required_argument, 0, 0 },
+		{ "missing-frames", required_argument, 0, 0 },
+		{ "stic-fraction", required_argument, 0, 0 },
+		{ "seed", required_argument, 0, 0 },
+		{ "channel-map", required_argument, 0, 0 },
+		{ "trigger-map", required_argument, 0, 0 },
+		{ NULL, 0, 0, 0 }
+	};
+
+	EventGenerator::Config config = EventGenerator::defaultConfig();
+	string format = "raw3";
+	long long nFrames = 10000;
+	int nSteps = 1;
+	const char *channelMapFileName = NULL;
+	const char *triggerMapFileName = NULL;
+
+	while(1) {
+		int optionIndex = 0;
+		int c = getopt_long(argc, argv, "", longOptions, &optionIndex);
+		if(c == -1) break;
+
+		if(optionIndex == 0) {
+			displayHelp(argv[0]);
+			return(1);
+		}
+		else if(optionIndex == 1) {
+			format = optarg;
+		}
+		else if(optionIndex == 2) {
+			nFrames = atoll(optarg);
+		}
+		else if(optionIndex == 3) {
+			nSteps = atoi(optarg);
+		}
+		else if(optionIndex == 4) {
+			config.coincidenceRate = atof(optarg);
+		}
+		else if(optionIndex == 5) {
+			config.singlesRate = atof(optarg);
+		}
+		else if(optionIndex == 6) {
+			config.darkCountRate = atof(optarg);
+		}
+		else if(optionIndex == 7) {
+			config.photoFraction = atof(optarg);
+		}
+		else if(optionIndex == 8) {
+			config.multiHitProbability = atof(optarg);
+		}
+		else if(optionIndex == 9) {
+			config.lostFrameProbability = atof(optarg);
+		}
+		else if(optionIndex == 10) {
+			config.missingFrameProbability = atof(optarg);
+		}
+		else if(optionIndex == 11) {
+			config.sticFraction = atof(optarg);
+		}
+		else if(optionIndex == 12) {
+			config.seed = strtoull(optarg, NULL, 0);
+		}
+		else if(optionIndex == 13) {
+			channelMapFileName = optarg;
+		}
+		else if(optionIndex == 14) {
+			triggerMapFileName = optarg;
+		}
+		else {
+			displayUsage(argv[0]);
+			fprintf(stderr, "\n%s: error: Unknown option!\n", argv[0]);
+			return(1);
+		}
+	}
+
+	if(argc - optind != 1) {
+		displayUsage(argv[0]);
+		fprintf(stderr, "\n%s: error: expected exactly one positional argument!\n", argv[0]);
+		return(1);
+	}
+	if(format != "raw3" && format != "rawE" && format != "rawf" && format != "shm") {
+		fprintf(stderr, "\n%s: error: --format must be one of raw3, rawE, rawf or shm\n", argv[0]);
+		return(1);
+	}
+	if(nFrames < 1 || nSteps < 1 || nSteps > nFrames) {
+		fprintf(stderr, "\n%s: error: --frames and --steps must be positive, with at least one frame per step\n", argv[0]);
+		return(1);
+	}
+	if(config.coincidenceRate < 0 || config.singlesRate < 0 || config.darkCountRate < 0) {
+		fprintf(stderr, "\n%s: error: rates must not be negative\n", argv[0]);
+		return(1);
+	}
+	if(format == "raw3" && config.sticFraction > 0) {
+		fprintf(stderr, "\n%s: error: raw3 files can only hold TOFPET data, use rawE, rawf or shm for STiC\n", argv[0]);
+		return(1);
+	}
+	if(format == "shm" && nSteps != 1) {
+		fprintf(stderr, "\n%s: error: shm output has no steps\n", argv[0]);
+		return(1);
+	}
+	char *outputPrefix = argv[optind];
+
+	SystemInformation *systemInformation = new SystemInformation();
+	systemInformation->loadMapFile(channelMapFileName != NULL ? channelMapFileName : getCrystalMapFileName());
+	if(triggerMapFileName != NULL)
+		systemInformation->loadTriggerMapFile(triggerMapFileName);
+	EventGenerator *generator = new EventGenerator(systemInformation, config);
+
+	const long long T = SYSTEM_PERIOD * 1E12;
+	AbstractRawHitWriter *writer = NULL;
+	FILE *rawFrameFile = NULL;
+	FrameRingFileWriter *ringWriter = NULL;
+	vector<uint64_t> words;
+	if(format == "raw3") {
+		writer = new TOFPET::RawWriterV3(outputPrefix);
+	}
+	else if(format == "rawE") {
+		writer = new ENDOTOFPET::RawWriterE(outputPrefix, 0);
+	}
+	else if(format == "rawf") {
+		string fileName = string(outputPrefix) + ".rawf";
+		rawFrameFile = fopen(fileName.c_str(), "wb");
+		if(rawFrameFile == NULL) {
+			fprintf(stderr, "Could not open '%s' for writing\n", fileName.c_str());
+			return(1);
+		}
+	}
+	else {
+		uint32_t flags = 0;
+#ifndef __NO_CHANNEL_IDLE_TIME__
+		flags |= DAQd::SHMHasIdleTime;
+#endif
+#ifdef __ENDOTOFPET__
+		flags |= DAQd::SHMHasFeType;
+#endif
+		ringWriter = new FrameRingFileWriter((string(outputPrefix) + ".shm").c_str(), nFrames, flags);
+	}
+
+	EventGenerator::Frame frame;
+	long long nEvents = 0;
+	long long nMissingFrames = 0;
+	unsigned long long nBytes = 0;
+	double t0 = wallTime();
+	for(int step = 0; step < nSteps; step++) {
+		long long firstFrame = nFrames * step / nSteps;
+		long long lastFrame = nFrames * (step + 1) / nSteps;
+		if(writer != NULL)
+			writer->openStep(step, 0);
+
+		EventBuffer<RawHit> *outBuffer = NULL;
+		long long lastMaxFrameID = firstFrame;
+		for(long long n = firstFrame; n < lastFrame; n++) {
+			if(!generator->nextFrame(frame)) {
+				nMissingFrames++;
+				continue;
+			}
+			nEvents += frame.hits.size();
+
+			if(rawFrameFile != NULL) {
+				unsigned nWords = EventGenerator::packFrame(frame, 0, words);
+				fwrite(&words[0], sizeof(uint64_t), nWords, rawFrameFile);
+			}
+			else if(ringWriter != NULL) {
+				ringWriter->addFrame(frame);
+			}
+			else {
+				if(outBuffer == NULL)
+					outBuffer = new EventBuffer<RawHit>(EVENT_BLOCK_SIZE, NULL);
+				for(unsigned i = 0; i < frame.hits.size(); i++) {
+					outBuffer->getWriteSlot() = frame.hits[i];
+					outBuffer->pushWriteSlot();
+				}
+			}
+
+			// Same block boundaries as writeRaw
+			if(outBuffer != NULL && (outBuffer->getSize() >= (EVENT_BLOCK_SIZE - DAQd::MaxDataFrameSize) || n == lastFrame - 1)) {
+				long long tMin = lastMaxFrameID * 1024 * T;
+				long long tMax = (frame.frameID + 1) * 1024 * T - 1;
+				writer->addEventBuffer(tMin, tMax, outBuffer);
+				delete outBuffer;
+				outBuffer = NULL;
+				lastMaxFrameID = frame.frameID;
+			}
+		}
+		if(outBuffer != NULL) {
+			// The last frames of the step went missing
+			writer->addEventBuffer(lastMaxFrameID * 1024 * T, lastFrame * 1024 * T - 1, outBuffer);
+			delete outBuffer;
+		}
+		if(writer != NULL)
+			writer->closeStep();
+	}
+
+	if(rawFrameFile != NULL && fclose(rawFrameFile) != 0) {
+		fprintf(stderr, "Error writing raw frame file\n");
+		return(1);
+	}
+	delete ringWriter;
+	delete writer;
+	double elapsed = wallTime() - t0;
+
+	vector<string> outputFiles;
+	if(format == "raw3") {
+		outputFiles.push_back(".raw3");
+		outputFiles.push_back(".idx3");
+	}
+	else if(format == "rawE") {
+		outputFiles.push_back(".rawE");
+		outputFiles.push_back(".idxE");
+	}
+	else {
+		outputFiles.push_back("." + format);
+	}
+	for(unsigned i = 0; i < outputFiles.size(); i++) {
+		struct stat st;
+		if(stat((outputPrefix + outputFiles[i]).c_str(), &st) == 0)
+			nBytes += st.st_size;
+	}
+	fprintf(stderr, "generateEvents:: %lld frames (%lld missing), %lld events in %.3f s (%.3g events/s, %.1f MB/s)\n",
+		nFrames, nMissingFrames, nEvents, elapsed, nEvents / elapsed, nBytes / elapsed / 1E6);
+
+	delete generator;
+	delete systemInformation;
+	return 0;
+}
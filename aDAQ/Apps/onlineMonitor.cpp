@@ -0,0 +1,643 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <SHM.hpp>
+#include <vector>
+#include <string>
+#include <Common/Constants.hpp>
+#include <Common/Utils.hpp>
+#include <Common/DaqdConnection.hpp>
+#include <Core/Event.hpp>
+#include <Core/CoarseSorter.hpp>
+#include <Core/CrystalPositions.hpp>
+#include <Core/NaiveGrouper.hpp>
+#include <Core/CoincidenceGrouper.hpp>
+#include <TOFPET/P2.hpp>
+#include <TOFPET/P2Extract.hpp>
+#include <STICv3/sticv3Handler.hpp>
+
+using namespace std;
+using namespace DAQ;
+using namespace DAQ::Core;
+using namespace DAQ::Common;
+using namespace DAQ::TOFPET;
+
+const long long T = (long long)(SYSTEM_PERIOD * 1E12);
+
+// A frame decoded into the current block, kept until the block is known not to have been lapped
+struct BlockFrame {
+	// Frames from the start of the block
+	unsigned offset;
+	long long frameID;
+	unsigned long long position;
+	// Index of the frame's first event in the output buffer
+	size_t eventStart;
+	bool lost;
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void handleStopSignal(int)
+{
+	stopRequested = 1;
+}
+
+static double wallTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9 * ts.tv_nsec;
+}
+
+/*
+ * Rolling statistics, kept as a ring of per-interval accumulators.
+ * Rates are normalized to the data time covered by the processed buffers,
+ * not to wall time, so they are not biased by processing latency.
+ */
+class OnlineStatistics {
+public:
+	OnlineStatistics(int nHistory, float ctrRange, float ctrBinWidth)
+	: nHistory(nHistory), current(0), nPublished(0)
+	{
+		ctrBinWidth = ctrBinWidth * 1E12;
+		this->ctrBinWidth = ctrBinWidth;
+		ctrNBins = 2 * int(ceil(ctrRange * 1E12 / ctrBinWidth));
+		ctrMin = - (ctrNBins / 2) * ctrBinWidth;
+		intervals.resize(nHistory);
+		for(int i = 0; i < nHistory; i++)
+			clearInterval(intervals[i]);
+	};
+
+	void addFrames(long long nFrames, long long nLostFrames, long long nSkippedFrames) {
+		Interval &interval = intervals[current];
+		interval.nFrames += nFrames;
+		interval.nLostFrames += nLostFrames;
+		interval.nSkippedFrames += nSkippedFrames;
+	};
+
+	void addSingles(long long n, long long dataTime) {
+		Interval &interval = intervals[current];
+		interval.nSingles += n;
+		interval.singlesTime += dataTime;
+	};
+
+	void addCoincidences(long long n, long long dataTime) {
+		Interval &interval = intervals[current];
+		interval.nCoincidences += n;
+		interval.coincidencesTime += dataTime;
+	};
+
+	void fillCTR(long long deltaT) {
+		long long bin = (deltaT - ctrMin) / ctrBinWidth;
+		if(deltaT < ctrMin || bin >= ctrNBins) return;
+		intervals[current].ctr[bin] += 1;
+	};
+
+	void publish(double elapsed, const char *outputPrefix) {
+		Interval sum;
+		clearInterval(sum);
+		for(int i = 0; i < nHistory; i++) {
+			Interval &interval = intervals[i];
+			sum.nFrames += interval.nFrames;
+			sum.nLostFrames += interval.nLostFrames;
+			sum.nSkippedFrames += interval.nSkippedFrames;
+			sum.nSingles += interval.nSingles;
+			sum.singlesTime += interval.singlesTime;
+			sum.nCoincidences += interval.nCoincidences;
+			sum.coincidencesTime += interval.coincidencesTime;
+			for(int j = 0; j < ctrNBins; j++)
+				sum.ctr[j] += interval.ctr[j];
+		}
+
+		float singlesRate = sum.singlesTime > 0 ? sum.nSingles / (1E-12 * sum.singlesTime) : 0;
+		float coincidencesRate = sum.coincidencesTime > 0 ? sum.nCoincidences / (1E-12 * sum.coincidencesTime) : 0;
+		long long nCTR = 0;
+		float fwhm = estimateFWHM(sum.ctr, nCTR);
+
+		fprintf(stdout, "onlineMonitor:: %8.1f s | %8lld frames (%5.1f%% lost, %lld skipped) | singles %10.1f Hz | coincidences %10.1f Hz | CTR FWHM %6.0f ps (%lld entries)\n",
+			elapsed,
+			sum.nFrames, sum.nFrames > 0 ? 100.0 * sum.nLostFrames / sum.nFrames : 0.0, sum.nSkippedFrames,
+			singlesRate, coincidencesRate, fwhm, nCTR);
+		fflush(stdout);
+
+		if(outputPrefix != NULL) {
+			char fName[1024];
+			sprintf(fName, "%s.rates", outputPrefix);
+			FILE *ratesFile = fopen(fName, nPublished == 0 ? "w" : "a");
+			if(ratesFile != NULL) {
+				fprintf(ratesFile, "%f\t%lld\t%lld\t%lld\t%f\t%f\t%f\t%lld\n",
+					elapsed, sum.nFrames, sum.nLostFrames, sum.nSkippedFrames,
+					singlesRate, coincidencesRate, fwhm, nCTR);
+				fclose(ratesFile);
+			}
+
+			// Write to a temporary file and rename it, so that readers never see a partial histogram
+			char tmpName[1024];
+			sprintf(fName, "%s.ctr", outputPrefix);
+			sprintf(tmpName, "%s.ctr.tmp", outputPrefix);
+			FILE *ctrFile = fopen(tmpName, "w");
+			if(ctrFile != NULL) {
+				for(int j = 0; j < ctrNBins; j++)
+					fprintf(ctrFile, "%lld\t%u\n", ctrMin + j * ctrBinWidth + ctrBinWidth / 2, sum.ctr[j]);
+				fclose(ctrFile);
+				rename(tmpName, fName);
+			}
+		}
+
+		// Rotate: the oldest interval is recycled for the next one
+		current = (current + 1) % nHistory;
+		clearInterval(intervals[current]);
+		nPublished += 1;
+	};
+
+private:
+	struct Interval {
+		long long nFrames;
+		long long nLostFrames;
+		long long nSkippedFrames;
+		long long nSingles;
+		long long singlesTime;
+		long long nCoincidences;
+		long long coincidencesTime;
+		vector<uint32_t> ctr;
+	};
+
+	int nHistory;
+	int current;
+	long long nPublished;
+	long long ctrBinWidth;
+	long long ctrMin;
+	int ctrNBins;
+	vector<Interval> intervals;
+
+	void clearInterval(Interval &interval) {
+		interval.nFrames = 0;
+		interval.nLostFrames = 0;
+		interval.nSkippedFrames = 0;
+		interval.nSingles = 0;
+		interval.singlesTime = 0;
+		interval.nCoincidences = 0;
+		interval.coincidencesTime = 0;
+		interval.ctr.assign(ctrNBins, 0);
+	};
+
+	// FWHM from the half maximum crossings, linearly interpolated between bins
+	float estimateFWHM(vector<uint32_t> &h, long long &nEntries) {
+		nEntries = 0;
+		int peak = 0;
+		for(int j = 0; j < ctrNBins; j++) {
+			nEntries += h[j];
+			if(h[j] > h[peak]) peak = j;
+		}
+		if(nEntries < 10) return 0;
+
+		float half = 0.5 * h[peak];
+		int left = peak;
+		while(left > 0 && h[left-1] > half) left--;
+		int right = peak;
+		while(right < ctrNBins-1 && h[right+1] > half) right++;
+		if(left == 0 || right == ctrNBins-1) return 0;
+
+		float xLeft = left - (h[left] - half) / float(h[left] - h[left-1]);
+		float xRight = right + (h[right] - half) / float(h[right] - h[right+1]);
+		return (xRight - xLeft) * ctrBinWidth;
+	};
+};
+
+/*
+ * Pass-through sink which counts the mapped single hits
+ */
+class SinglesCounter : public EventSink<Hit>, public EventSource<Hit> {
+public:
+	SinglesCounter(OnlineStatistics *statistics, EventSink<Hit> *sink)
+	: EventSource<Hit>(sink), statistics(statistics)
+	{
+	};
+
+	void pushEvents(EventBuffer<Hit> *buffer) {
+		if(buffer == NULL) return;
+
+		long long tMin = buffer->getTMin();
+		long long tMax = buffer->getTMax();
+		long long n = 0;
+		unsigned nEvents = buffer->getSize();
+		for(unsigned i = 0; i < nEvents; i++) {
+			Hit &hit = buffer->get(i);
+			if(hit.time < tMin || hit.time >= tMax) continue;
+			n += 1;
+		}
+		statistics->addSingles(n, tMax - tMin + 1);
+
+		sink->pushEvents(buffer);
+	};
+
+	void pushT0(double t0) { sink->pushT0(t0); };
+	void finish() { sink->finish(); };
+	void report() { sink->report(); };
+
+private:
+	OnlineStatistics *statistics;
+};
+
+/*
+ * Final sink: counts coincidences and fills the CTR histogram
+ */
+class CoincidenceMonitor : public EventSink<Coincidence> {
+public:
+	CoincidenceMonitor(OnlineStatistics *statistics)
+	: statistics(statistics), lastBuffer(NULL)
+	{
+	};
+
+	~CoincidenceMonitor() {
+		delete lastBuffer;
+	};
+
+	void pushEvents(EventBuffer<Coincidence> *buffer) {
+		if(buffer == NULL) return;
+
+		long long n = 0;
+		unsigned nEvents = buffer->getSize();
+		for(unsigned i = 0; i < nEvents; i++) {
+			Coincidence &c = buffer->get(i);
+			Hit &hit1 = *c.photons[0]->hits[0];
+			Hit &hit2 = *c.photons[1]->hits[0];
+			n += 1;
+			if(hit1.badEvent || hit2.badEvent) continue;
+			statistics->fillCTR(hit1.time - hit2.time);
+		}
+		statistics->addCoincidences(n, buffer->getTMax() - buffer->getTMin() + 1);
+
+		// Like NullSink, keep the last buffer since the next one may point into its parents
+		delete lastBuffer;
+		lastBuffer = buffer;
+	};
+
+	void pushT0(double) { };
+	void finish() { };
+	void report() { };
+
+private:
+	OnlineStatistics *statistics;
+	AbstractEventBuffer *lastBuffer;
+};
+
+
+
+void displayHelp(char * program)
+{
+	fprintf(stderr, "usage: %s [options] setup_file\n", program);
+	fprintf(stderr, "\noptional arguments:\n");
+	fprintf(stderr,  "  --help \t\t\t Show this help message and exit \n");
+	fprintf(stderr,  "  --socket-name=NAME\t\t daqd control socket (default is /tmp/d.sock)\n");
+	fprintf(stderr,  "  --output=PREFIX\t\t Also publish the statistics to PREFIX.rates (appended) and PREFIX.ctr (rewritten)\n");
+	fprintf(stderr,  "  --interval=INTERVAL\t\t Publishing interval, in seconds (default is 1)\n");
+	fprintf(stderr,  "  --history=N\t\t\t Number of intervals in the rolling statistics (default is 10)\n");
+	fprintf(stderr,  "  --release\t\t\t Use the shared daqd read pointer instead of a lossy consumer; use only when no writeRaw is running\n");
+	fprintf(stderr,  "  --cWindow=CWINDOW\t\t Maximum delta time (in seconds) for two events to be considered in coincidence (default is 20E-9s)\n");
+	fprintf(stderr,  "  --minEnergy=MINENERGY\t\t The minimum energy (in keV) of an event to be considered a valid coincidence (default is 150)\n");
+	fprintf(stderr,  "  --maxEnergy=MAXENERGY\t\t The maximum energy (in keV) of an event to be considered a valid coincidence (default is 3000)\n");
+	fprintf(stderr,  "  --gWindow=gWINDOW\t\t Maximum delta time (in seconds) inside a given multi-hit group (default is 100E-9s)\n");
+	fprintf(stderr,  "  --gMaxHits=gMAXHITS\t\t Maximum number of hits inside a given multi-hit group (default is 16)\n");
+	fprintf(stderr,  "  --ctr-bin=WIDTH\t\t CTR histogram bin width, in picoseconds (default is 25)\n");
+	fprintf(stderr, "\npositional arguments:\n");
+	fprintf(stderr, "  setup_file \t\t\t File containing paths to tdc calibration file(s) (required), tQ correction file(s) (optional) and Energy calibration file(s) (optional), or none\n");
+};
+
+void displayUsage( char * program)
+{
+	fprintf(stderr, "usage: %s [options] setup_file\n", program);
+};
+
+int main(int argc, char *argv[])
+{
+	static struct option longOptions[] = {
+		{ "help", no_argument, 0, 0 },
+		{ "socket-name", required_argument, 0, 0 },
+		{ "output", required_argument, 0, 0 },
+		{ "interval", required_argument, 0, 0 },
+		{ "history", required_argument, 0, 0 },
+		{ "release", no_argument, 0, 0 },
+		{ "cWindow", required_argument, 0, 0 },
+		{ "minEnergy", required_argument, 0, 0 },
+		{ "maxEnergy", required_argument, 0, 0 },
+		{ "gWindow", required_argument, 0, 0 },
+		{ "gMaxHits", required_argument, 0, 0 },
+		{ "ctr-bin", required_argument, 0, 0 },
+		{ NULL, 0, 0, 0 }
+	};
+
+	const char *socketName = "/tmp/d.sock";
+	const char *outputPrefix = NULL;
+	float publishInterval = 1.0;
+	int nHistory = 10;
+	bool releaseFrames = false;
+	float cWindow = 20E-9; // s
+	float gWindow = 100E-9; // s
+	int maxHits = GammaPhoton::maxHits;
+	float minEnergy = 150; // keV or ns (if energy=tot)
+	float maxEnergy = 3000; // keV or ns (if energy=tot)
+	float ctrBinWidth = 25E-12; // s
+
+	while(1) {
+		int optionIndex = 0;
+		int c = getopt_long(argc, argv, "", longOptions, &optionIndex);
+		if(c == -1) break;
+
+		if(optionIndex == 0) {
+			displayHelp(argv[0]);
+			return(1);
+		}
+		else if(optionIndex == 1) {
+			socketName = optarg;
+		}
+		else if(optionIndex == 2) {
+			outputPrefix = optarg;
+		}
+		else if(optionIndex == 3) {
+			publishInterval = atof(optarg);
+		}
+		else if(optionIndex == 4) {
+			nHistory = atoi(optarg);
+		}
+		else if(optionIndex == 5) {
+			releaseFrames = true;
+		}
+		else if(optionIndex == 6) {
+			cWindow = atof(optarg);
+		}
+		else if(optionIndex == 7) {
+			minEnergy = atof(optarg);
+		}
+		else if(optionIndex == 8) {
+			maxEnergy = atof(optarg);
+		}
+		else if(optionIndex == 9) {
+			gWindow = atof(optarg);
+		}
+		else if(optionIndex == 10) {
+			maxHits = atoi(optarg);
+		}
+		else if(optionIndex == 11) {
+			ctrBinWidth = 1E-12 * atof(optarg);
+		}
+		else {
+			displayUsage(argv[0]);
+			fprintf(stderr, "\n%s: error: Unknown option!\n", argv[0]);
+			return(1);
+		}
+	}
+
+	if(argc - optind < 1) {
+		displayUsage(argv[0]);
+		fprintf(stderr, "\n%s: error: too few positional arguments!\n", argv[0]);
+		return(1);
+	}
+	else if(argc - optind > 1) {
+		displayUsage(argv[0]);
+		fprintf(stderr, "\n%s: error: too many positional arguments!\n", argv[0]);
+		return(1);
+	}
+	if(publishInterval <= 0 || nHistory < 1 || ctrBinWidth <= 0) {
+		fprintf(stderr, "\n%s: error: --interval, --history and --ctr-bin must be positive\n", argv[0]);
+		return(1);
+	}
+
+	char *setupFileName = argv[optind];
+
+	DAQ::TOFPET::P2 *P2 = new TOFPET::P2(SYSTEM_NCRYSTALS);
+	if (strcmp(setupFileName, "none") == 0) {
+		P2->setAll(2.0);
+		printf("BIG FAT WARNING: no calibration\n");
+	}
+	else {
+		P2->loadFiles(setupFileName, true, false, 0, 0);
+	}
+
+	DAQ::Common::SystemInformation *systemInformation = new DAQ::Core::SystemInformation();
+	systemInformation->loadMapFile(Common::getCrystalMapFileName());
+
+	DaqdConnection *daqd = new DaqdConnection(socketName);
+	DAQd::SHM *shm = new DAQd::SHM(daqd->getSharedMemoryName());
+
+	// Follow the ring as a lossy consumer, so that writeRaw is never held back
+	// With --release we drive the shared read pointer instead
+	bool ownCursor = true;
+	if(!releaseFrames && daqd->registerConsumer(true) <= 0) {
+		fprintf(stderr, "WARNING: daqd did not register a consumer, following the ring passively\n");
+		ownCursor = false;
+	}
+
+	OnlineStatistics *statistics = new OnlineStatistics(nHistory, cWindow, ctrBinWidth);
+
+	float gRadius = 20; // mm
+	EventSink<RawHit> *sink = new CoarseSorter(
+		new P2Extract(P2, false, 0.0, 0.20, true,
+		new CrystalPositions(systemInformation,
+		new SinglesCounter(statistics,
+		new NaiveGrouper(gRadius, gWindow, minEnergy, maxEnergy, maxHits,
+		new CoincidenceGrouper(cWindow,
+		new CoincidenceMonitor(statistics)
+		))))));
+
+	signal(SIGINT, handleStopSignal);
+	signal(SIGTERM, handleStopSignal);
+
+	// Blocks are pushed into the pipeline at least this often, to keep latency low
+	const double maxBlockLatency = 0.1;
+
+	unsigned bs = shm->getSizeInFrames();
+	bool haveCursor = false;
+	unsigned cursor = 0;
+	long long lastFrameID = -1;
+	EventBuffer<RawHit> *outBuffer = NULL;
+	long long bufferMinFrameID = -1;
+	long long bufferMaxFrameID = -1;
+	double bufferStartTime = 0;
+	std::vector<BlockFrame> blockFrames;
+
+	double t0 = wallTime();
+	double nextPublish = t0 + publishInterval;
+
+	while(!stopRequested) {
+		unsigned wrPointer, rdPointer;
+		uint32_t frameSequence = shm->getFrameSequence();
+		daqd->getPointers(wrPointer, rdPointer);
+		wrPointer %= (2*bs);
+		rdPointer %= (2*bs);
+
+		unsigned occupancy = (wrPointer + 2*bs - rdPointer) % (2*bs);
+		unsigned cursorOffset = (cursor + 2*bs - rdPointer) % (2*bs);
+		if(ownCursor) {
+			// daqd keeps our cursor, moving it forward if we fell behind
+			// (a backwards move is an acquisition restart, not a skip)
+			unsigned skipped = (rdPointer + 2*bs - cursor) % (2*bs);
+			if(haveCursor && skipped <= bs)
+				statistics->addFrames(0, 0, skipped);
+			cursor = rdPointer;
+			haveCursor = true;
+		}
+		else if(!haveCursor || cursorOffset > occupancy) {
+			// The cursor must lie within [rdPointer, wrPointer]; frames before rdPointer
+			// have been released and may be overwritten at any moment.
+			// If we fell out of the window, resume from the newest frame.
+			if(haveCursor)
+				statistics->addFrames(0, 0, occupancy);
+			cursor = wrPointer;
+			haveCursor = true;
+			lastFrameID = -1;
+		}
+
+		unsigned blockStart = cursor;
+		long long nFrames = 0;
+		long long nLostFrames = 0;
+		// Events decoded before this block were already checked
+		size_t blockEventStart = outBuffer != NULL ? outBuffer->getSize() : 0;
+		blockFrames.clear();
+		while(cursor != wrPointer) {
+			unsigned index = cursor % bs;
+			long long frameID = shm->getFrameID(index);
+
+			if(frameID <= lastFrameID) {
+				// daqd restarted the acquisition: flush what belongs to the previous one
+				if(outBuffer != NULL && outBuffer->getSize() > 0) {
+					outBuffer->setTMin(bufferMinFrameID * 1024 * T);
+					outBuffer->setTMax((bufferMaxFrameID+1) * 1024 * T - 1);
+					sink->pushEvents(outBuffer);
+					outBuffer = NULL;
+					blockEventStart = 0;
+					blockFrames.clear();
+				}
+			}
+			lastFrameID = frameID;
+
+			if(outBuffer == NULL) {
+				outBuffer = new EventBuffer<RawHit>(EVENT_BLOCK_SIZE, NULL);
+				bufferMinFrameID = frameID;
+				bufferStartTime = wallTime();
+			}
+			bufferMaxFrameID = frameID;
+
+			BlockFrame frame = { unsigned(nFrames), frameID, shm->getFramePosition(index), outBuffer->getSize(), false };
+
+			int nEvents = shm->getNEvents(index);
+			for (int n = 0; n < nEvents; n++) {
+#ifdef __ENDOTOFPET__
+				int feType = shm->getEventType(index, n);
+#else
+				const int feType = 0;
+#endif
+				// Only TOFPET hits are followed by the online pipeline
+				if(feType != 0) continue;
+
+				RawHit &p = outBuffer->getWriteSlot();
+				p.feType = RawHit::TOFPET;
+				unsigned tCoarse = shm->getTCoarse(index, n);
+				unsigned eCoarse = shm->getECoarse(index, n);
+				p.time = (1024LL * frameID + tCoarse) * T;
+				p.timeEnd = (1024LL * frameID + eCoarse) * T;
+				if((p.timeEnd - p.time) < -256*T) p.timeEnd += (1024LL * T);
+				p.channelID = 64 * shm->getAsicID(index, n) + shm->getChannelID(index, n);
+				p.d.tofpet.tac = shm->getTACID(index, n);
+				p.d.tofpet.tcoarse = tCoarse;
+				p.d.tofpet.ecoarse = eCoarse;
+				p.d.tofpet.tfine =  shm->getTFine(index, n);
+				p.d.tofpet.efine = shm->getEFine(index, n);
+				p.channelIdleTime = shm->getChannelIdleTime(index, n);
+				p.d.tofpet.tacIdleTime = shm->getTACIdleTime(index, n);
+				outBuffer->pushWriteSlot();
+			}
+
+			frame.lost = shm->getFrameLost(index);
+			blockFrames.push_back(frame);
+			nFrames += 1;
+			if(frame.lost) nLostFrames += 1;
+			cursor = (cursor + 1) % (2*bs);
+		}
+
+		if(nFrames > 0) {
+			// We do not hold the frames: if the writer lapped us while we were
+			// decoding, the frames it reached may be corrupted and are discarded.
+			// They are overwritten oldest first, so they are at the start of the block.
+			unsigned nLapped = 0;
+			if(!releaseFrames) {
+				unsigned wrPointer2, rdPointer2;
+				daqd->getPointers(wrPointer2, rdPointer2);
+				unsigned advance = (wrPointer2 % (2*bs) + 2*bs - blockStart) % (2*bs);
+				while(nLapped < blockFrames.size()) {
+					BlockFrame &f = blockFrames[nLapped];
+					if(advance - f.offset <= bs && !shm->isOverwritten(f.position))
+						break;
+					if(f.lost) nLostFrames -= 1;
+					nLapped += 1;
+				}
+			}
+			
+			if(nLapped > 0) {
+				// Keep the events decoded before this block and those of the frames which are still good
+				size_t lappedEnd = nLapped < blockFrames.size() ? blockFrames[nLapped].eventStart : outBuffer->getSize();
+				EventBuffer<RawHit> *kept = new EventBuffer<RawHit>(EVENT_BLOCK_SIZE, NULL);
+				for(size_t i = 0; i < blockEventStart; i++)
+					kept->push(outBuffer->get(i));
+				for(size_t i = lappedEnd; i < outBuffer->getSize(); i++)
+					kept->push(outBuffer->get(i));
+				if(blockEventStart == 0 && nLapped < blockFrames.size())
+					bufferMinFrameID = blockFrames[nLapped].frameID;
+				delete outBuffer;
+				outBuffer = kept;
+				if(outBuffer->getSize() == 0) {
+					delete outBuffer;
+					outBuffer = NULL;
+				}
+				haveCursor = nLapped < blockFrames.size();
+			}
+			statistics->addFrames(nFrames - nLapped, nLostFrames, nLapped);
+
+			if(ownCursor)
+				daqd->setReadPointer(cursor);
+		}
+
+		double now = wallTime();
+		if(outBuffer != NULL && (
+			outBuffer->getSize() >= (EVENT_BLOCK_SIZE - DAQd::MaxDataFrameSize) ||
+			(now - bufferStartTime) >= maxBlockLatency
+		)) {
+			outBuffer->setTMin(bufferMinFrameID * 1024 * T);
+			outBuffer->setTMax((bufferMaxFrameID+1) * 1024 * T - 1);
+			sink->pushEvents(outBuffer);
+			outBuffer = NULL;
+		}
+
+		if(now >= nextPublish) {
+			statistics->publish(now - t0, outputPrefix);
+			nextPublish += publishInterval;
+			if(nextPublish < now) nextPublish = now + publishInterval;
+		}
+
+		if(nFrames == 0)
+			shm->waitForFrames(frameSequence, 10000);
+	}
+
+	if(outBuffer != NULL) {
+		outBuffer->setTMin(bufferMinFrameID * 1024 * T);
+		outBuffer->setTMax((bufferMaxFrameID+1) * 1024 * T - 1);
+		sink->pushEvents(outBuffer);
+		outBuffer = NULL;
+	}
+	sink->finish();
+	statistics->publish(wallTime() - t0, outputPrefix);
+
+	delete sink;
+	delete statistics;
+	delete shm;
+	delete daqd;
+	delete systemInformation;
+	delete P2;
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * Drives writeRaw from a running daqd the same way atb.py's acquire() does,
+ * so that the acquisition path can be run end to end without Python or hardware
+ * (e.g. daqd --daq-type REPLAY --replay-file FILE.rawf)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <SHM.hpp>
+#include <string>
+#include <Common/Constants.hpp>
+#include <Common/BlockHeader.hpp>
+#include <Common/DaqdConnection.hpp>
+
+using namespace std;
+using namespace DAQ;
+using namespace DAQ::Common;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void handleStopSignal(int)
+{
+	stopRequested = 1;
+}
+
+static double wallTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9 * ts.tv_nsec;
+}
+
+static void writeAll(int fd, void *buffer, size_t n)
+{
+	char *p = (char *)buffer;
+	while(n > 0) {
+		ssize_t r = write(fd, p, n);
+		if(r <= 0) {
+			fprintf(stderr, "Error writing to writeRaw\n");
+			exit(1);
+		}
+		p += r; n -= r;
+	}
+}
+
+static void readAll(int fd, void *buffer, size_t n)
+{
+	char *p = (char *)buffer;
+	while(n > 0) {
+		ssize_t r = read(fd, p, n);
+		if(r <= 0) {
+			fprintf(stderr, "Error reading from writeRaw\n");
+			exit(1);
+		}
+		p += r; n -= r;
+	}
+}
+
+// Runs one step in writeRaw, which follows daqd's pointers itself
+static StepReply runStep(int toWriter, int fromWriter, float step1, float step2, float stepTime, float idleTimeout)
+{
+	StepCommand command;
+	command.step1 = step1;
+	command.step2 = step2;
+	command.acquisitionTime = stepTime;
+	command.idleTimeout = idleTimeout;
+	writeAll(toWriter, &command, sizeof(command));
+
+	StepReply reply;
+	readAll(fromWriter, &reply, sizeof(reply));
+	return reply;
+}
+
+void displayHelp(char * program)
+{
+	fprintf(stderr, "usage: %s [options] output_prefix\n", program);
+	fprintf(stderr, "\noptional arguments:\n");
+	fprintf(stderr,  "  --help \t\t\t Show this help message and exit \n");
+	fprintf(stderr,  "  --socket-name=NAME\t\t daqd control socket (default is /tmp/d.sock)\n");
+	fprintf(stderr,  "  --writer=MODE\t\t\t writeRaw output mode: T, E, R or N (default is T)\n");
+	fprintf(stderr,  "  --time=SECONDS\t\t Data time to acquire in each step (default is 1)\n");
+	fprintf(stderr,  "  --steps=N\t\t\t Number of steps, tagged step1 = 0..N-1 (default is 1)\n");
+	fprintf(stderr,  "  --idle-timeout=SECONDS\t End the step if no frames arrive for this long (default is 2)\n");
+	fprintf(stderr,  "  --writeRaw=PATH\t\t writeRaw executable (default is writeRaw next to this program)\n");
+	fprintf(stderr, "\npositional arguments:\n");
+	fprintf(stderr, "  output_prefix \t\t Output file prefix, passed on to writeRaw\n");
+};
+
+void displayUsage( char * program)
+{
+	fprintf(stderr, "usage: %s [options] output_prefix\n", program);
+};
+
+int main(int argc, char *argv[])
+{
+	static struct option longOptions[] = {
+		{ "help", no_argument, 0, 0 },
+		{ "socket-name", required_argument, 0, 0 },
+		{ "writer", required_argument, 0, 0 },
+		{ "time", required_argument, 0, 0 },
+		{ "steps", required_argument, 0, 0 },
+		{ "idle-timeout", required_argument, 0, 0 },
+		{ "writeRaw", required_argument, 0, 0 },
+		{ NULL, 0, 0, 0 }
+	};
+
+	const char *socketName = "/tmp/d.sock";
+	const char *writerMode = "T";
+	float stepTime = 1.0;
+	int nSteps = 1;
+	float idleTimeout = 2.0;
+	string writeRawPath = string(dirname(strdup(argv[0]))) + "/writeRaw";
+
+	while(1) {
+		int optionIndex = 0;
+		int c = getopt_long(argc, argv, "", longOptions, &optionIndex);
+		if(c == -1) break;
+
+		if(optionIndex == 0) {
+			displayHelp(argv[0]);
+			return(1);
+		}
+		else if(optionIndex == 1) {
+			socketName = optarg;
+		}
+		else if(optionIndex == 2) {
+			writerMode = optarg;
+		}
+		else if(optionIndex == 3) {
+			stepTime = atof(optarg);
+		}
+		else if(optionIndex == 4) {
+			nSteps = atoi(optarg);
+		}
+		else if(optionIndex == 5) {
+			idleTimeout = atof(optarg);
+		}
+		else if(optionIndex == 6) {
+			writeRawPath = optarg;
+		}
+		else {
+			displayUsage(argv[0]);
+			fprintf(stderr, "\n%s: error: Unknown option!\n", argv[0]);
+			return(1);
+		}
+	}
+
+	if(argc - optind != 1) {
+		displayUsage(argv[0]);
+		fprintf(stderr, "\n%s: error: expected exactly one positional argument!\n", argv[0]);
+		return(1);
+	}
+	if(strlen(writerMode) != 1 || strchr("TERN", writerMode[0]) == NULL) {
+		fprintf(stderr, "\n%s: error: --writer must be one of T, E, R or N\n", argv[0]);
+		return(1);
+	}
+	if(stepTime <= 0 || nSteps < 1 || idleTimeout <= 0) {
+		fprintf(stderr, "\n%s: error: --time, --steps and --idle-timeout must be positive\n", argv[0]);
+		return(1);
+	}
+	char *outputPrefix = argv[optind];
+
+	DaqdConnection *daqd = new DaqdConnection(socketName);
+	string shmName = daqd->getSharedMemoryName();
+	DAQd::SHM *shm = new DAQd::SHM(shmName);
+
+	// Start writeRaw with no coincidence filter, as atb.py does when the hardware trigger is on
+	int toWriter[2], fromWriter[2];
+	if(pipe(toWriter) != 0 || pipe(fromWriter) != 0) {
+		fprintf(stderr, "Could not create pipes to writeRaw\n");
+		return(1);
+	}
+	char shmSize[32];
+	sprintf(shmSize, "%llu", shm->getSizeInBytes());
+	pid_t writerPID = fork();
+	if(writerPID == 0) {
+		dup2(toWriter[0], 0);
+		dup2(fromWriter[1], 1);
+		close(toWriter[0]); close(toWriter[1]);
+		close(fromWriter[0]); close(fromWriter[1]);
+		execl(writeRawPath.c_str(), writeRawPath.c_str(),
+			shmName.c_str(), shmSize, writerMode, outputPrefix,
+			"0", "0", "0", "0", "none", "none", "0", socketName,
+			(char *)NULL);
+		fprintf(stderr, "Could not execute '%s'\n", writeRawPath.c_str());
+		_exit(1);
+	}
+	close(toWriter[0]);
+	close(fromWriter[1]);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, handleStopSignal);
+	signal(SIGTERM, handleStopSignal);
+
+	const double frameLength = 1024 * SYSTEM_PERIOD;
+	daqd->setAcquisitionMode(2);
+
+	long long nTotalFrames = 0;
+	double t0 = wallTime();
+	for(int step = 0; step < nSteps && !stopRequested; step++) {
+		StepReply reply = runStep(toWriter[1], fromWriter[0], step, 0, stepTime, idleTimeout);
+		nTotalFrames += reply.nFrames;
+		fprintf(stderr, "replayAcquire:: step %d: %lld frames, %.3f s of data\n",
+			step, (long long)reply.nFrames,
+			reply.startFrameID == -1 ? 0.0 : (reply.lastFrameID - reply.startFrameID + 1) * frameLength);
+	}
+	double elapsed = wallTime() - t0;
+
+	daqd->setAcquisitionMode(0);
+	close(toWriter[1]);
+	close(fromWriter[0]);
+	waitpid(writerPID, NULL, 0);
+
+	DAQd::FrameCounters counters;
+	daqd->getFrameCounters(counters);
+	fprintf(stderr, "replayAcquire:: %lld frames in %.3f s (%.0f frames/s)\n", nTotalFrames, elapsed, nTotalFrames / elapsed);
+	fprintf(stderr, "replayAcquire:: daqd received %llu, flagged lost %llu, missing %llu, malformed %llu, dropped %llu (empty lost) %llu (ring full), resyncs %llu\n",
+		(unsigned long long)counters.framesReceived, (unsigned long long)counters.framesFlaggedLost,
+		(unsigned long long)counters.framesMissing, (unsigned long long)counters.framesMalformed,
+		(unsigned long long)counters.framesDroppedEmptyLost, (unsigned long long)counters.framesDroppedRingFull,
+		(unsigned long long)counters.resyncs);
+
+	delete shm;
+	delete daqd;
+	return 0;
+}
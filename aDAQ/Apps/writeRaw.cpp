@@ -10,40 +10,175 @@
 #include <sys/stat.h>
 #include <boost/lexical_cast.hpp>
 #include <SHM.hpp>
+#include <SticCoarse.hpp>
 #include <TFile.h>
 #include <TTree.h>
 #include <vector>
 #include <algorithm>
 #include <functional>
+#include <time.h>
 #include <Common/Constants.hpp>
 #include <Common/Utils.hpp>
+#include <Common/BlockHeader.hpp>
+#include <Common/DaqdConnection.hpp>
 #include <Core/Event.hpp>
 #include <Core/CoarseSorter.hpp>
 #include <Core/CoincidenceFilter.hpp>
 #include <Core/RawHitWriter.hpp>
 #include <TOFPET/RawV3.hpp>
 #include <ENDOTOFPET/Raw.hpp>
-#include <STICv3/sticv3Handler.hpp>
 
 using namespace std;
 using namespace DAQ;
 using namespace DAQ::Core;
+using DAQ::Common::BlockHeader;
+using DAQ::Common::StepCommand;
+using DAQ::Common::StepReply;
+using DAQ::Common::DaqdConnection;
 
 const long long T = (long long)(SYSTEM_PERIOD * 1E12);
+// Frames are copied out of the ring as they are decoded, so daqd can have them
+// back long before the block is done; release them in batches of this many
+static const unsigned ReleaseInterval = 32;
 
-struct BlockHeader  {
-	float step1;
-	float step2;	
-	uint32_t wrPointer;
-	uint32_t rdPointer;
-	int32_t endOfStep;
+static double wallTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9 * ts.tv_nsec;
+}
+
+// Where the blocks of frames to decode come from and where their read pointer goes
+class BlockSource {
+public:
+	virtual ~BlockSource() {};
+	// Fills in the next block; returns false when there are no more
+	virtual bool nextBlock(BlockHeader &blockHeader) = 0;
+	// Called once the block has been decoded up to rdPointer
+	// lastFrameID is the ID of the last frame decoded, or -1 if there was none; 
+	// the frames have been released by then, so the ring must not be read for it
+	virtual void blockDone(BlockHeader &blockHeader, unsigned rdPointer, long long lastFrameID) = 0;
+};
+
+// Blocks are handed over on stdin by whoever drives daqd, see BlockHeader
+class PipeBlockSource : public BlockSource {
+public:
+	virtual bool nextBlock(BlockHeader &blockHeader) {
+		return fread(&blockHeader, sizeof(blockHeader), 1, stdin) == 1;
+	};
+	virtual void blockDone(BlockHeader &blockHeader, unsigned rdPointer, long long lastFrameID) {
+		fwrite(&rdPointer, sizeof(uint32_t), 1, stdout);
+		fflush(stdout);
+	};
 };
 
+// writeRaw drives daqd itself and only gets a StepCommand on stdin for each step
+// The step runs the way atb.py's acquire() used to, starting with the first frame
+// available and ending once acquisitionTime worth of frame IDs have been decoded
+class StepBlockSource : public BlockSource {
+public:
+	StepBlockSource(DaqdConnection *daqd, DAQd::SHM *shm)
+		: daqd(daqd), shm(shm), inStep(false), stepDone(false) {
+		bs = shm->getSizeInFrames();
+	};
 
+	virtual bool nextBlock(BlockHeader &blockHeader) {
+		if(!inStep) {
+			if(fread(&command, sizeof(command), 1, stdin) != 1)
+				return false;
+			inStep = true;
+			stepDone = false;
+			startFrameID = lastFrameID = -1;
+			nFrames = 0;
+			lastActivity = lastReport = wallTime();
+		}
+		blockHeader.step1 = command.step1;
+		blockHeader.step2 = command.step2;
+
+		unsigned wrPointer, rdPointer;
+		uint32_t ringGeneration;
+		while(true) {
+			uint32_t frameSequence = shm->getFrameSequence();
+			// Frames may only be released with the generation read before the pointers
+			ringGeneration = shm->getRingGeneration();
+			daqd->getPointers(wrPointer, rdPointer);
+			wrPointer %= (2*bs);
+			rdPointer %= (2*bs);
+			if(stepDone || wrPointer != rdPointer)
+				break;
+			if(command.idleTimeout > 0 && wallTime() - lastActivity > command.idleTimeout) {
+				fprintf(stderr, "writeRaw:: no frames for %.1f s, ending step\n", command.idleTimeout);
+				stepDone = true;
+				break;
+			}
+			// Wake up now and then to check for the idle timeout
+			shm->waitForFrames(frameSequence, 100000);
+		}
+
+		if(stepDone) {
+			blockHeader.wrPointer = rdPointer;
+			blockHeader.rdPointer = rdPointer;
+			blockHeader.endOfStep = 1;
+			blockHeader.ringGeneration = ringGeneration;
+			return true;
+		}
+		if(startFrameID == -1) {
+			startFrameID = shm->getFrameID(rdPointer % bs);
+			stopFrameID = startFrameID + (long long)(command.acquisitionTime / (1024 * SYSTEM_PERIOD));
+		}
+		blockHeader.wrPointer = wrPointer;
+		blockHeader.rdPointer = rdPointer;
+		blockHeader.endOfStep = 0;
+		blockHeader.ringGeneration = ringGeneration;
+		return true;
+	};
+
+	virtual void blockDone(BlockHeader &blockHeader, unsigned rdPointer, long long blockLastFrameID) {
+		daqd->setReadPointer(rdPointer);
+		if(blockHeader.endOfStep != 0) {
+			StepReply reply;
+			reply.nFrames = nFrames;
+			reply.startFrameID = startFrameID;
+			reply.lastFrameID = lastFrameID;
+			fwrite(&reply, sizeof(reply), 1, stdout);
+			fflush(stdout);
+			inStep = false;
+			return;
+		}
+
+		nFrames += (rdPointer + 2*bs - blockHeader.rdPointer) % (2*bs);
+		if(blockLastFrameID != -1)
+			lastFrameID = blockLastFrameID;
+		double now = wallTime();
+		lastActivity = now;
+		if(lastFrameID >= stopFrameID)
+			stepDone = true;
+		if(now - lastReport > 1.0) {
+			fprintf(stderr, "writeRaw:: acquired %.1f of %.1f seconds of data\n",
+				(lastFrameID - startFrameID + 1) * 1024 * SYSTEM_PERIOD, command.acquisitionTime);
+			lastReport = now;
+		}
+	};
+
+private:
+	DaqdConnection *daqd;
+	DAQd::SHM *shm;
+	unsigned bs;
+	StepCommand command;
+	bool inStep;
+	bool stepDone;
+	long long startFrameID;
+	long long stopFrameID;
+	long long lastFrameID;
+	long long nFrames;
+	double lastActivity;
+	double lastReport;
+};
 
 int main(int argc, char *argv[])
 {
-	assert(argc == 12);
+	// An optional 13th argument is daqd's socket, see StepBlockSource
+	assert(argc == 12 || argc == 13);
 	char *shmObjectPath = argv[1];
 	unsigned long dataFrameSharedMemorySize = boost::lexical_cast<unsigned long>(argv[2]);	
 	char outputType = argv[3][0];
@@ -65,6 +200,15 @@ int main(int argc, char *argv[])
 	FILE *rawFrameFile = NULL;
 
 	DAQd::SHM *shm = new DAQd::SHM(shmObjectPath);
+	DaqdConnection *daqd = NULL;
+	BlockSource *blockSource = NULL;
+	if(argc == 13) {
+		daqd = new DaqdConnection(argv[12]);
+		blockSource = new StepBlockSource(daqd, shm);
+	}
+	else {
+		blockSource = new PipeBlockSource();
+	}
 		
 	AbstractRawHitWriter *writer = NULL;
 	bool pipeWriterIsNull = true;
@@ -109,7 +253,7 @@ int main(int argc, char *argv[])
 	long long lastFrameID = -1;
 	long long stepFirstFrameID = -1;
 
-	while(fread(&blockHeader, sizeof(blockHeader), 1, stdin) == 1) {
+	while(blockSource->nextBlock(blockHeader)) {
 
 		step1 = blockHeader.step1;
 		step2 = blockHeader.step2;
@@ -140,6 +284,9 @@ int main(int argc, char *argv[])
 		unsigned bs = shm->getSizeInFrames();
 		unsigned rdPointer = blockHeader.rdPointer % (2*bs);
 		unsigned wrPointer = blockHeader.wrPointer % (2*bs);
+		uint32_t ringGeneration = blockHeader.ringGeneration;
+		unsigned nUnreleased = 0;
+		long long blockLastFrameID = -1;
 		while(rdPointer != wrPointer) {
 			unsigned index = rdPointer % bs;
 			
@@ -164,18 +311,19 @@ int main(int argc, char *argv[])
 			}
 
 			lastFrameID = frameID;
+			blockLastFrameID = frameID;
 			minFrameID = minFrameID < frameID ? minFrameID : frameID;
 			maxFrameID = maxFrameID > frameID ? maxFrameID : frameID;
 			
 			// Simply dump the raw data frame
 			int frameSize = shm->getFrameSize(index);
 			if (rawFrameFile != NULL) {
-				DAQd::DataFrame *dataFrame = shm->getDataFrame(index);
-				fwrite((void *)dataFrame->data, sizeof(uint64_t), frameSize, rawFrameFile);
+				fwrite((void *)shm->getFrameData(index), sizeof(uint64_t), frameSize, rawFrameFile);
 			}
 
 			int nEvents = shm->getNEvents(index);
 			bool frameLost = shm->getFrameLost(index);
+			int sticFrameOffset = DAQd::SticCoarse::frameOffset(frameID);
 			
 			if(outBuffer == NULL) {
 				outBuffer = new EventBuffer<RawHit>(EVENT_BLOCK_SIZE, NULL);
@@ -210,8 +358,8 @@ int main(int argc, char *argv[])
 					unsigned eCoarse = shm->getECoarse(index, n);
 					// Compensate for LFSR's 2^16-1 period
 					// and wrap at frame's 6.4 us period
-					int ctCoarse = STICv3::Sticv3Handler::compensateCoarse(tCoarse, frameID) % 4096;
-					int ceCoarse = STICv3::Sticv3Handler::compensateCoarse(eCoarse, frameID) % 4096;
+					int ctCoarse = DAQd::SticCoarse::compensate(tCoarse, sticFrameOffset) % 4096;
+					int ceCoarse = DAQd::SticCoarse::compensate(eCoarse, sticFrameOffset) % 4096;
 					p.time = 1024LL * frameID * T + ctCoarse * T/4;
 					p.timeEnd = 1024LL * frameID * T + ceCoarse * T/4;
 					if((p.timeEnd - p.time) < -256*T) p.timeEnd += (1024LL * T);
@@ -257,7 +405,13 @@ int main(int argc, char *argv[])
 			stepGoodFrames += 1;
 			
 			rdPointer = (rdPointer+1) % (2*bs);
-		}		
+			if(++nUnreleased == ReleaseInterval) {
+				shm->releaseFrames(ringGeneration, rdPointer);
+				nUnreleased = 0;
+			}
+		}
+		if(nUnreleased > 0)
+			shm->releaseFrames(ringGeneration, rdPointer);
 		
 		if(blockHeader.endOfStep != 0) {
 			if(sink != NULL) {
@@ -296,12 +450,13 @@ int main(int argc, char *argv[])
 			stepFirstFrameID = -1;
 		}
 
-		fwrite(&rdPointer, sizeof(uint32_t), 1, stdout);
-		fflush(stdout);
+		blockSource->blockDone(blockHeader, rdPointer, blockLastFrameID);
 
 	
 	}
 
+	delete blockSource;
+	delete daqd;
 	delete writer;
 	delete systemInformation;
 	if(rawFrameFile != NULL)
@@ -0,0 +1,167 @@
+#include "AsyncFileWriter.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace DAQ::Common;
+
+AsyncFileWriter::AsyncFileWriter(const char *fileName, size_t blockSize, unsigned nBlocks)
+	: fileName(fileName), blockSize(blockSize), position(0), nWriting(0), die(false), hadError(false)
+{
+	fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd == -1) {
+		int e = errno;
+		fprintf(stderr, "Could not open '%s' for writing : %d %s\n", fileName, e, strerror(e));
+		exit(1);
+	}
+
+	// One block being filled and at least one being written
+	if(nBlocks < 2) nBlocks = 2;
+	for(unsigned i = 0; i < nBlocks; i++) {
+		Block *block = new Block();
+		block->data = (char *)malloc(blockSize);
+		block->capacity = blockSize;
+		block->used = 0;
+		allBlocks.push_back(block);
+		freeBlocks.push_back(block);
+	}
+	current = freeBlocks.front();
+	freeBlocks.pop_front();
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&condBlockFull, NULL);
+	pthread_cond_init(&condBlockFree, NULL);
+	pthread_create(&thread, NULL, run, (void *)this);
+}
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+	flush();
+	pthread_mutex_lock(&lock);
+	die = true;
+	pthread_cond_signal(&condBlockFull);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	close(fd);
+
+	for(unsigned i = 0; i < allBlocks.size(); i++) {
+		free(allBlocks[i]->data);
+		delete allBlocks[i];
+	}
+	pthread_cond_destroy(&condBlockFree);
+	pthread_cond_destroy(&condBlockFull);
+	pthread_mutex_destroy(&lock);
+}
+
+char *AsyncFileWriter::reserve(size_t size)
+{
+	if(current->used + size > current->capacity) {
+		if(current->used > 0)
+			submit();
+		// A single reservation larger than a block gets a block of its own size
+		if(size > current->capacity) {
+			current->data = (char *)realloc(current->data, size);
+			current->capacity = size;
+		}
+	}
+	return current->data + current->used;
+}
+
+void AsyncFileWriter::commit(size_t size)
+{
+	current->used += size;
+	position += size;
+}
+
+void AsyncFileWriter::write(const void *data, size_t size)
+{
+	char *p = reserve(size);
+	memcpy(p, data, size);
+	commit(size);
+}
+
+void AsyncFileWriter::flush()
+{
+	if(current->used > 0)
+		submit();
+	pthread_mutex_lock(&lock);
+	while(!fullBlocks.empty() || nWriting > 0)
+		pthread_cond_wait(&condBlockFree, &lock);
+	bool failed = hadError;
+	pthread_mutex_unlock(&lock);
+	if(failed) {
+		fprintf(stderr, "Could not write all data to '%s'\n", fileName.c_str());
+		exit(1);
+	}
+}
+
+unsigned long long AsyncFileWriter::getPosition()
+{
+	return position;
+}
+
+// Hands the current block to the writer thread and takes a free one in its place
+void AsyncFileWriter::submit()
+{
+	pthread_mutex_lock(&lock);
+	fullBlocks.push_back(current);
+	pthread_cond_signal(&condBlockFull);
+	while(freeBlocks.empty())
+		pthread_cond_wait(&condBlockFree, &lock);
+	current = freeBlocks.front();
+	freeBlocks.pop_front();
+	pthread_mutex_unlock(&lock);
+	current->used = 0;
+}
+
+void AsyncFileWriter::writeBlock(Block *block)
+{
+	char *p = block->data;
+	size_t n = block->used;
+	while(n > 0) {
+		ssize_t r = ::write(fd, p, n);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0) {
+			int e = errno;
+			if(!hadError)
+				fprintf(stderr, "AsyncFileWriter:: error writing to '%s' : %d %s\n", fileName.c_str(), e, strerror(e));
+			hadError = true;
+			return;
+		}
+		p += r;
+		n -= r;
+	}
+}
+
+void *AsyncFileWriter::run(void *arg)
+{
+	AsyncFileWriter *w = (AsyncFileWriter *)arg;
+
+	pthread_mutex_lock(&w->lock);
+	while(true) {
+		if(w->fullBlocks.empty()) {
+			if(w->die) break;
+			pthread_cond_wait(&w->condBlockFull, &w->lock);
+			continue;
+		}
+
+		Block *block = w->fullBlocks.front();
+		w->fullBlocks.pop_front();
+		w->nWriting++;
+		pthread_mutex_unlock(&w->lock);
+
+		w->writeBlock(block);
+
+		pthread_mutex_lock(&w->lock);
+		w->nWriting--;
+		block->used = 0;
+		w->freeBlocks.push_back(block);
+		pthread_cond_broadcast(&w->condBlockFree);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
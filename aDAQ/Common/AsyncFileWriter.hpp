@@ -0,0 +1,67 @@
+#ifndef __DAQ__COMMON__ASYNCFILEWRITER_HPP__DEFINED__
+#define __DAQ__COMMON__ASYNCFILEWRITER_HPP__DEFINED__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace DAQ { namespace Common {
+
+	/*! Writes a file in large blocks from a thread of its own.
+	 * The caller encodes into the current block (reserve() then commit(), or write())
+	 * and full blocks are handed to the writer thread, which writes each of them with one write().
+	 * At most nBlocks blocks are in use, so a caller running ahead of the disk will wait for a free one.
+	 */
+	class AsyncFileWriter {
+	public:
+		AsyncFileWriter(const char *fileName, size_t blockSize = 4*1024*1024, unsigned nBlocks = 4);
+		// Writes out any pending data and closes the file
+		~AsyncFileWriter();
+
+		// Returns room for size bytes at the end of the current block
+		char *reserve(size_t size);
+		// Appends size bytes, previously reserved, to the current block
+		void commit(size_t size);
+		void write(const void *data, size_t size);
+
+		// Waits until all data committed so far is in the file
+		// Exits if any write failed, so that no caller goes on as if the data was there
+		void flush();
+
+		// Bytes committed so far
+		unsigned long long getPosition();
+
+	private:
+		struct Block {
+			char *data;
+			size_t capacity;
+			size_t used;
+		};
+
+		int fd;
+		std::string fileName;
+		size_t blockSize;
+		unsigned long long position;
+		Block *current;
+
+		std::vector<Block *> allBlocks;
+		std::deque<Block *> freeBlocks;
+		std::deque<Block *> fullBlocks;
+		unsigned nWriting;
+		bool die;
+		bool hadError;
+
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t condBlockFull;
+		pthread_cond_t condBlockFree;
+
+		void submit();
+		void writeBlock(Block *block);
+		static void *run(void *arg);
+	};
+
+}}
+#endif
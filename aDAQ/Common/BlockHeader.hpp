@@ -0,0 +1,44 @@
+#ifndef __DAQ__COMMON__BLOCKHEADER_HPP__DEFINED__
+#define __DAQ__COMMON__BLOCKHEADER_HPP__DEFINED__
+
+#include <stdint.h>
+
+namespace DAQ { namespace Common {
+
+/*
+ * Request read by writeRaw from its stdin: process the frames in [rdPointer, wrPointer)
+ * writeRaw answers with the uint32_t read pointer to hand back to daqd
+ * endOfStep != 0 closes the step
+ * ringGeneration is the frame ring's generation (see SHMHeader), read before the pointers were obtained
+ */
+struct BlockHeader  {
+	float step1;
+	float step2;	
+	uint32_t wrPointer;
+	uint32_t rdPointer;
+	int32_t endOfStep;
+	uint32_t ringGeneration;
+};
+
+/*
+ * Request read by writeRaw from its stdin when it drives daqd itself (daqd socket given):
+ * acquire acquisitionTime seconds of data, tagged (step1, step2), and close the step
+ * idleTimeout > 0 ends the step early if no frames arrive for that long
+ * writeRaw answers with a StepReply
+ */
+struct StepCommand {
+	float step1;
+	float step2;
+	float acquisitionTime;
+	float idleTimeout;
+};
+
+// startFrameID and lastFrameID are -1 if no frames arrived
+struct StepReply {
+	int64_t nFrames;
+	int64_t startFrameID;
+	int64_t lastFrameID;
+};
+
+}}
+#endif
@@ -0,0 +1,118 @@
+#include "DaqdConnection.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <Protocol.hpp>
+
+using namespace DAQ::Common;
+
+DaqdConnection::DaqdConnection(const char *socketName)
+{
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(s == -1) {
+		perror("Could not create socket");
+		exit(1);
+	}
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socketName, sizeof(address.sun_path) - 1);
+	if(connect(s, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		fprintf(stderr, "Could not connect to daqd at '%s'\n", socketName);
+		perror("Error");
+		exit(1);
+	}
+}
+
+DaqdConnection::~DaqdConnection()
+{
+	close(s);
+}
+
+std::string DaqdConnection::getSharedMemoryName()
+{
+	struct { uint16_t type; uint16_t length; } request = { DAQd::commandGetDataFrameSharedMemoryName, sizeof(request) };
+	sendAll(&request, sizeof(request));
+
+	struct { uint16_t length; uint64_t sizes[3]; } header;
+	recvAll(&header, sizeof(header));
+
+	char name[1024];
+	int nameLength = header.length - sizeof(header);
+	if(nameLength <= 0 || nameLength >= (int)sizeof(name)) {
+		fprintf(stderr, "Invalid shared memory name length (%d) from daqd\n", nameLength);
+		exit(1);
+	}
+	recvAll(name, nameLength);
+	name[nameLength] = 0;
+	return std::string(name);
+}
+
+void DaqdConnection::getPointers(unsigned &wrPointer, unsigned &rdPointer)
+{
+	struct { uint16_t type; uint16_t length; } request = { DAQd::commandGetDataFrameWriteReadPointer, sizeof(request) };
+	sendAll(&request, sizeof(request));
+
+	struct { uint16_t length; uint32_t wrPointer; uint32_t rdPointer; } reply;
+	recvAll(&reply, sizeof(reply));
+	wrPointer = reply.wrPointer;
+	rdPointer = reply.rdPointer;
+}
+
+void DaqdConnection::setReadPointer(unsigned rdPointer)
+{
+	struct { uint16_t type; uint16_t length; uint32_t rdPointer; } request = { DAQd::commandSetDataFrameReadPointer, sizeof(request), rdPointer };
+	sendAll(&request, sizeof(request));
+
+	uint32_t reply;
+	recvAll(&reply, sizeof(reply));
+}
+
+int DaqdConnection::registerConsumer(bool lossy)
+{
+	struct { uint16_t type; uint16_t length; uint32_t mode; } request = { DAQd::commandRegisterDataFrameConsumer, sizeof(request), lossy ? 1U : 0U };
+	sendAll(&request, sizeof(request));
+
+	int32_t reply;
+	recvAll(&reply, sizeof(reply));
+	return reply;
+}
+
+void DaqdConnection::setAcquisitionMode(unsigned mode)
+{
+	struct { uint16_t type; uint16_t length; uint16_t mode; } request = { DAQd::commandAcqOnOff, sizeof(request), (uint16_t)mode };
+	sendAll(&request, sizeof(request));
+
+	uint16_t reply;
+	recvAll(&reply, sizeof(reply));
+}
+
+void DaqdConnection::getFrameCounters(DAQd::FrameCounters &counters)
+{
+	struct { uint16_t type; uint16_t length; } request = { DAQd::commandGetFrameCounters, sizeof(request) };
+	sendAll(&request, sizeof(request));
+
+	struct { uint16_t length; DAQd::FrameCounters counters; } reply;
+	recvAll(&reply, sizeof(reply));
+	counters = reply.counters;
+}
+
+void DaqdConnection::sendAll(void *buffer, size_t n)
+{
+	if(send(s, buffer, n, MSG_NOSIGNAL) != (ssize_t)n) {
+		fprintf(stderr, "Lost connection to daqd\n");
+		exit(1);
+	}
+}
+
+void DaqdConnection::recvAll(void *buffer, size_t n)
+{
+	if(recv(s, buffer, n, MSG_WAITALL) != (ssize_t)n) {
+		fprintf(stderr, "Lost connection to daqd\n");
+		exit(1);
+	}
+}
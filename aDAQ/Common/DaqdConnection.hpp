@@ -0,0 +1,37 @@
+#ifndef __DAQ__COMMON__DAQDCONNECTION_HPP__DEFINED__
+#define __DAQ__COMMON__DAQDCONNECTION_HPP__DEFINED__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <SHM.hpp>
+
+namespace DAQ { namespace Common {
+
+/*
+ * Client side of daqd's control socket
+ * Any communication error is fatal
+ */
+class DaqdConnection {
+public:
+	DaqdConnection(const char *socketName);
+	~DaqdConnection();
+
+	std::string getSharedMemoryName();
+	void getPointers(unsigned &wrPointer, unsigned &rdPointer);
+	void setReadPointer(unsigned rdPointer);
+	// Returns the consumer ID, or -1 if daqd could not register one
+	int registerConsumer(bool lossy);
+	// 0 stops the acquisition
+	void setAcquisitionMode(unsigned mode);
+	void getFrameCounters(DAQd::FrameCounters &counters);
+
+private:
+	int s;
+
+	void sendAll(void *buffer, size_t n);
+	void recvAll(void *buffer, size_t n);
+};
+
+}}
+#endif
@@ -7,21 +7,38 @@
 
 using namespace DAQ::Common;
 
+static const int regionMapSize = (MAX_TRIGGER_REGIONS * MAX_TRIGGER_REGIONS + 31) / 32;
+
 SystemInformation::SystemInformation()
 {
+	channelIndex = new uint16_t[SYSTEM_NCHANNELS];
 	for(int channel = 0; channel < SYSTEM_NCHANNELS; channel++) {
-		channelInformation[channel] = { -1, -1, -1, NAN, NAN, NAN };
+		channelIndex[channel] = 0;
 	}
+	ChannelInformation unmapped = { -1, -1, -1, NAN, NAN, NAN };
+	channelInformation.push_back(unmapped);
 	
+	regionMap = new uint32_t[regionMapSize];
 	for(int n1 = 0; n1 < DAQ::Common::MAX_TRIGGER_REGIONS; n1++) {
 		for(int n2 = 0; n2 < DAQ::Common::MAX_TRIGGER_REGIONS; n2++) {
-			regionMap[n1 * DAQ::Common::MAX_TRIGGER_REGIONS + n2] = n1 != n2;
+			setRegionMap(n1, n2, n1 != n2);
 		}
 	}
 }
 
 SystemInformation::~SystemInformation()
 {
+	delete [] channelIndex;
+	delete [] regionMap;
+}
+
+void SystemInformation::setRegionMap(int region1, int region2, bool allowed)
+{
+	unsigned n = region1 * DAQ::Common::MAX_TRIGGER_REGIONS + region2;
+	if(allowed)
+		regionMap[n / 32] |= (1U << (n % 32));
+	else
+		regionMap[n / 32] &= ~(1U << (n % 32));
 }
 
 void SystemInformation::loadMapFile(const char *fname) 
@@ -56,7 +73,14 @@ void SystemInformation::loadMapFile(const char *fname)
 			exit(1);
 		}
 		
-		channelInformation[channel] = { region, xi, yi, x, y, z };
+		ChannelInformation ci = { region, xi, yi, x, y, z };
+		if(channelIndex[channel] == 0) {
+			channelIndex[channel] = channelInformation.size();
+			channelInformation.push_back(ci);
+		}
+		else {
+			channelInformation[channelIndex[channel]] = ci;
+		}
 		nLoaded++;
 	}
 	
@@ -76,8 +100,8 @@ void SystemInformation::loadTriggerMapFile(const char *fname)
 		exit(1);
 	}
 	
-	for(int n = 0; n < MAX_TRIGGER_REGIONS*MAX_TRIGGER_REGIONS; n++)
-		regionMap[n] = false;
+	for(int n = 0; n < regionMapSize; n++)
+		regionMap[n] = 0;
 	
 	int region1, region2;
 	int nLoaded = 0;
@@ -90,8 +114,8 @@ void SystemInformation::loadTriggerMapFile(const char *fname)
 			fprintf(stderr, "Bad region ID %d on line %d\n", region2, nLoaded+1);
 			exit(1);
 		}
-		regionMap[region1 * DAQ::Common::MAX_TRIGGER_REGIONS + region2] = true;
-		regionMap[region2 * DAQ::Common::MAX_TRIGGER_REGIONS + region1] = true;
+		setRegionMap(region1, region2, true);
+		setRegionMap(region2, region1, true);
 		
 		nLoaded++;
 	}
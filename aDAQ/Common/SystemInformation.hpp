@@ -2,6 +2,8 @@
 #define __DAQ_CORE_SYSTEMINFORMATION_HPP__DEFINED__
 
 #include <Common/Constants.hpp>
+#include <stdint.h>
+#include <vector>
 
 namespace DAQ { namespace Common {
 
@@ -23,18 +25,31 @@ public:
 	void loadTriggerMapFile(const char *fname);
 
 	bool isCoincidenceAllowed(int region1, int region2) {
-		return regionMap[region1 * DAQ::Common::MAX_TRIGGER_REGIONS + region2];
+		unsigned n = region1 * DAQ::Common::MAX_TRIGGER_REGIONS + region2;
+		return (regionMap[n / 32] >> (n % 32)) & 1;
 	};
 
 	bool isMultihitAllowed(int region1, int region2) {
 		return region1 == region2;
 	};
 
-	ChannelInformation &getChannelInformation(int channelID) { return channelInformation[channelID]; };
+	// Unmapped channels share an entry with region -1, which must not be changed
+	ChannelInformation &getChannelInformation(int channelID) { 
+		unsigned index = (unsigned)channelID < (unsigned)DAQ::Common::SYSTEM_NCHANNELS ? channelIndex[channelID] : 0;
+		return channelInformation[index]; 
+	};
+	
+	int getNMappedChannels() { return channelInformation.size() - 1; };
 
 private:
-	ChannelInformation channelInformation[DAQ::Common::SYSTEM_NCHANNELS];
-	bool regionMap[DAQ::Common::MAX_TRIGGER_REGIONS * DAQ::Common::MAX_TRIGGER_REGIONS];
+	// Mapped channels are compacted, so lookups for a typical system stay in cache
+	// (SYSTEM_NCHANNELS must fit into 16 bits)
+	uint16_t *channelIndex;
+	std::vector<ChannelInformation> channelInformation;
+	
+	// One bit for each pair of regions
+	uint32_t *regionMap;
+	void setRegionMap(int region1, int region2, bool allowed);
 };
 
 }}
@@ -0,0 +1,355 @@
+#include "EventGenerator.hpp"
+#include <Common/Constants.hpp>
+#include <SticCoarse.hpp>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <algorithm>
+
+using namespace DAQ::Common;
+using namespace DAQ::Core;
+using namespace std;
+
+static const double frameLength = 1024 * SYSTEM_PERIOD;
+
+EventGenerator::Config EventGenerator::defaultConfig()
+{
+	Config config;
+	config.coincidenceRate = 100E3;
+	config.singlesRate = 1E6;
+	config.darkCountRate = 0;
+	config.photoFraction = 0.7;
+	config.photopeakToT = 300E-9;
+	config.multiHitProbability = 0.1;
+	config.lostFrameProbability = 0;
+	config.missingFrameProbability = 0;
+	config.sticFraction = 0;
+	config.seed = 1;
+	return config;
+}
+
+EventGenerator::EventGenerator(SystemInformation *systemInformation, Config &config)
+	: config(config), frameID(0), systemInformation(systemInformation),
+	  regionChannels(MAX_TRIGGER_REGIONS),
+	  neighbourChannel(SYSTEM_NCHANNELS, -1),
+	  sticAsic(SYSTEM_NCHANNELS / 64, false),
+	  channelState(SYSTEM_NCHANNELS)
+{
+	rngState = config.seed != 0 ? config.seed : 0x9E3779B97F4A7C15ULL;
+
+	for(int channelID = 0; channelID < SYSTEM_NCHANNELS; channelID++) {
+		SystemInformation::ChannelInformation &ci = systemInformation->getChannelInformation(channelID);
+		if(ci.region < 0) continue;
+		allChannels.push_back(channelID);
+		if(regionChannels[ci.region].empty()) regions.push_back(ci.region);
+		regionChannels[ci.region].push_back(channelID);
+		crystalAt[(((long long)ci.region) << 40) | (((long long)ci.xi & 0xFFFFF) << 20) | (ci.yi & 0xFFFFF)] = channelID;
+	}
+	if(allChannels.empty()) {
+		fprintf(stderr, "EventGenerator:: the channel map has no channels\n");
+		exit(1);
+	}
+	sort(regions.begin(), regions.end());
+
+	for(unsigned i = 0; i < allChannels.size(); i++) {
+		int channelID = allChannels[i];
+		SystemInformation::ChannelInformation &ci = systemInformation->getChannelInformation(channelID);
+		int n = findCrystal(ci.region, ci.xi + 1, ci.yi);
+		if(n < 0) n = findCrystal(ci.region, ci.xi, ci.yi + 1);
+		neighbourChannel[channelID] = n;
+	}
+
+	for(unsigned i = 0; i < regions.size(); i++)
+		for(unsigned j = i + 1; j < regions.size(); j++)
+			if(systemInformation->isCoincidenceAllowed(regions[i], regions[j]))
+				regionPairs.push_back(make_pair(regions[i], regions[j]));
+
+	for(unsigned asic = 0; asic < sticAsic.size(); asic++)
+		sticAsic[asic] = uniform() < config.sticFraction;
+
+	for(unsigned channelID = 0; channelID < channelState.size(); channelID++) {
+		ChannelState &state = channelState[channelID];
+		state.lastHit = 0;
+		for(int tac = 0; tac < 4; tac++)
+			state.tacLastHit[tac] = 0;
+		state.nextTAC = 0;
+	}
+}
+
+// xorshift64*
+uint64_t EventGenerator::random()
+{
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return rngState * 2685821657736338717ULL;
+}
+
+double EventGenerator::uniform()
+{
+	return (random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double EventGenerator::gaussian()
+{
+	double u1 = uniform();
+	double u2 = uniform();
+	return sqrt(-2.0 * log(u1 > 0 ? u1 : 1E-300)) * cos(2 * M_PI * u2);
+}
+
+unsigned EventGenerator::poisson(double mean)
+{
+	if(mean <= 0) return 0;
+	if(mean > 500) {
+		double n = floor(mean + sqrt(mean) * gaussian() + 0.5);
+		return n > 0 ? (unsigned)n : 0;
+	}
+	double l = exp(-mean), p = 1.0;
+	unsigned k = 0;
+	do { k++; p *= uniform(); } while(p > l);
+	return k - 1;
+}
+
+int EventGenerator::findCrystal(int region, int xi, int yi)
+{
+	map<long long, int>::iterator it = crystalAt.find((((long long)region) << 40) | (((long long)xi & 0xFFFFF) << 20) | (yi & 0xFFFFF));
+	return it != crystalAt.end() ? it->second : -1;
+}
+
+void EventGenerator::addHit(int channelID, double time, float tot)
+{
+	// Keep hits inside the frame they were generated for
+	if(time < 0) time = 0;
+	if(time > 1023.99) time = 1023.99;
+	PendingHit p = { time, tot, channelID };
+	pending.push_back(p);
+}
+
+void EventGenerator::addGamma(int channelID, double time)
+{
+	float totPeak = config.photopeakToT / SYSTEM_PERIOD;
+	float tot = uniform() < config.photoFraction ?
+		totPeak * (1 + 0.03 * gaussian()) :
+		totPeak * (0.15 + 0.75 * uniform());
+	addHit(channelID, time, tot);
+
+	for(int n = 1; n < GammaPhoton::maxHits && uniform() < config.multiHitProbability; n++) {
+		channelID = neighbourChannel[channelID];
+		if(channelID < 0) break;
+		addHit(channelID, time + 0.2 * uniform(), totPeak * (0.1 + 0.3 * uniform()));
+	}
+}
+
+bool EventGenerator::nextFrame(Frame &frame)
+{
+	frame.frameID = frameID;
+	frame.lost = false;
+	frame.hits.clear();
+	pending.clear();
+
+	unsigned nPairs = regionPairs.empty() ? 0 : poisson(config.coincidenceRate * frameLength);
+	for(unsigned n = 0; n < nPairs; n++) {
+		pair<int, int> &regionPair = regionPairs[random() % regionPairs.size()];
+		bool swap = random() & 1;
+		int region1 = swap ? regionPair.second : regionPair.first;
+		int region2 = swap ? regionPair.first : regionPair.second;
+		vector<int> &channels1 = regionChannels[region1];
+		int channel1 = channels1[random() % channels1.size()];
+		SystemInformation::ChannelInformation &ci = systemInformation->getChannelInformation(channel1);
+		int channel2 = findCrystal(region2, ci.xi, ci.yi);
+		if(channel2 < 0) {
+			vector<int> &channels2 = regionChannels[region2];
+			channel2 = channels2[random() % channels2.size()];
+		}
+		double time = 1024 * uniform();
+		addGamma(channel1, time);
+		// About 300 ps of time resolution
+		addGamma(channel2, time + 0.05 * gaussian());
+	}
+
+	unsigned nSingles = poisson(config.singlesRate * frameLength);
+	for(unsigned n = 0; n < nSingles; n++) {
+		addGamma(allChannels[random() % allChannels.size()], 1024 * uniform());
+	}
+
+	unsigned nDarks = poisson(config.darkCountRate * allChannels.size() * frameLength);
+	for(unsigned n = 0; n < nDarks; n++) {
+		addHit(allChannels[random() % allChannels.size()], 1024 * uniform(), 1 + 7 * uniform());
+	}
+
+	stable_sort(pending.begin(), pending.end());
+	frame.hits.resize(pending.size());
+	for(unsigned n = 0; n < pending.size(); n++)
+		makeHit(pending[n], frame.hits[n]);
+
+	if(uniform() < config.lostFrameProbability) {
+		frame.lost = true;
+		frame.hits.resize(random() % (frame.hits.size() + 1));
+	}
+
+	// The front end state moves on even when a frame is not delivered
+	frameID++;
+	if(uniform() < config.missingFrameProbability) {
+		frame.hits.clear();
+		return false;
+	}
+	return true;
+}
+
+void EventGenerator::makeHit(PendingHit &p, RawHit &hit)
+{
+	long long T = SYSTEM_PERIOD * 1E12;
+	long long clock = (long long)floor(p.time);
+	long long absoluteClock = 1024LL * frameID + clock;
+	int asic = p.channelID / 64;
+
+	ChannelState &state = channelState[p.channelID];
+	// Idle times are stored in units of 8192 clocks in 15 bits by the raw writers
+	long long maxIdleTime = 0x7FFFLL * 8192;
+	long long channelIdleTime = absoluteClock - state.lastHit;
+	hit.channelID = p.channelID;
+	hit.channelIdleTime = channelIdleTime < maxIdleTime ? channelIdleTime : maxIdleTime;
+	state.lastHit = absoluteClock;
+
+	if(!sticAsic[asic]) {
+		int tot = (int)(p.tot + 0.5);
+		tot = tot < 1 ? 1 : (tot > 767 ? 767 : tot);
+		unsigned tac = state.nextTAC;
+		state.nextTAC = (state.nextTAC + 1) % 4;
+		long long tacIdleTime = absoluteClock - state.tacLastHit[tac];
+		state.tacLastHit[tac] = absoluteClock;
+
+		hit.feType = RawHit::TOFPET;
+		hit.d.tofpet.tac = tac;
+		hit.d.tofpet.tcoarse = clock;
+		hit.d.tofpet.ecoarse = (clock + tot) % 1024;
+		// The TDC fine counters measure the time to the next clock edges
+		hit.d.tofpet.tfine = 128 + (int)(256 * (1 - (p.time - clock)));
+		hit.d.tofpet.efine = 128 + (int)(256 * uniform());
+		hit.d.tofpet.tacIdleTime = tacIdleTime < maxIdleTime ? tacIdleTime : maxIdleTime;
+		hit.time = absoluteClock * T;
+		hit.timeEnd = (1024LL * frameID + hit.d.tofpet.ecoarse) * T;
+	}
+	else {
+		// STiC counts at 4x the system clock, with its counter reset every 256 frames
+		int quarter = (int)floor(4 * p.time);
+		int tot = (int)(4 * p.tot + 0.5);
+		tot = tot < 1 ? 1 : (tot > 3071 ? 3071 : tot);
+		int counterBase = DAQd::SticCoarse::frameOffset(frameID);
+
+		hit.feType = RawHit::STIC;
+		hit.d.stic.tcoarse = (counterBase + quarter) % DAQd::SticCoarse::Period;
+		hit.d.stic.ecoarse = (counterBase + quarter + tot) % DAQd::SticCoarse::Period;
+		hit.d.stic.tfine = (int)(32 * (4 * p.time - quarter)) & 0x1F;
+		hit.d.stic.efine = random() & 0x1F;
+		hit.d.stic.tBadHit = false;
+		hit.d.stic.eBadHit = false;
+		hit.time = 1024LL * frameID * T + quarter * T/4;
+		hit.timeEnd = 1024LL * frameID * T + ((quarter + tot) % 4096) * T/4;
+	}
+	if((hit.timeEnd - hit.time) < -256*T) hit.timeEnd += (1024LL * T);
+}
+
+unsigned EventGenerator::packFrame(Frame &frame, uint32_t flags, vector<uint64_t> &words)
+{
+	unsigned nWords = 2 + frame.hits.size();
+	unsigned nPacked = DAQd::packedFrameWords(nWords, flags);
+	words.assign(nPacked, 0);
+
+	words[0] = (uint64_t(nWords) << 36) | (frame.frameID & 0xFFFFFFFFFULL);
+	words[1] = frame.hits.size() | (frame.lost ? 0x10000 : 0);
+	for(unsigned n = 0; n < frame.hits.size(); n++) {
+		RawHit &hit = frame.hits[n];
+		unsigned asic = hit.channelID / 64;
+		uint64_t idWord = (asic % 16) | (((asic / 256) & 0x1F) << 6) | (((asic / 16) % 16) << 11);
+		uint64_t word = idWord << 48;
+		if(hit.feType == RawHit::TOFPET) {
+			word |= uint64_t(hit.d.tofpet.tcoarse & 0x3FF) << 38;
+			word |= uint64_t(hit.d.tofpet.tfine & 0x3FF) << 28;
+			word |= uint64_t(hit.d.tofpet.ecoarse & 0x3FF) << 18;
+			word |= uint64_t(hit.d.tofpet.efine & 0x3FF) << 8;
+			word |= uint64_t(hit.channelID % 64) << 2;
+			word |= uint64_t(hit.d.tofpet.tac & 0x3);
+		}
+		else {
+			word |= uint64_t(hit.channelID % 64) << 42;
+			word |= uint64_t(hit.d.stic.tBadHit ? 1 : 0) << 41;
+			word |= uint64_t(DAQd::SticCoarse::encode(hit.d.stic.tcoarse)) << 26;
+			word |= uint64_t(hit.d.stic.tfine & 0x1F) << 21;
+			word |= uint64_t(hit.d.stic.eBadHit ? 1 : 0) << 20;
+			word |= uint64_t(DAQd::SticCoarse::encode(hit.d.stic.ecoarse)) << 5;
+			word |= uint64_t(hit.d.stic.efine & 0x1F);
+		}
+		words[2 + n] = word;
+	}
+
+	unsigned offset = nWords;
+	if(flags & DAQd::SHMHasIdleTime) {
+		for(unsigned n = 0; n < frame.hits.size(); n++) {
+			RawHit &hit = frame.hits[n];
+			words[offset + 2 + n] = hit.channelIdleTime;
+			words[offset + nWords + 2 + n] = hit.feType == RawHit::TOFPET ? hit.d.tofpet.tacIdleTime : 0;
+		}
+		offset += 2 * nWords;
+	}
+	if(flags & DAQd::SHMHasFeType) {
+		int8_t *feType = (int8_t *)&words[offset];
+		for(unsigned n = 0; n < frame.hits.size(); n++)
+			feType[2 + n] = frame.hits[n].feType == RawHit::TOFPET ? 0 : 1;
+	}
+	return nPacked;
+}
+
+FrameRingFileWriter::FrameRingFileWriter(const char *fileName, unsigned nFrames, uint32_t flags)
+	: flags(flags), nFrames(nFrames), dataSize(0)
+{
+	file = fopen(fileName, "wb");
+	if(file == NULL) {
+		int e = errno;
+		fprintf(stderr, "Could not open '%s' for writing : %d %s\n", fileName, e, strerror(e));
+		exit(1);
+	}
+	slots.reserve(nFrames);
+	slotsSize = ((nFrames * sizeof(DAQd::FrameSlot)) + 4095) & ~4095ULL;
+	fseek(file, DAQd::SHMHeaderSize + slotsSize, SEEK_SET);
+}
+
+FrameRingFileWriter::~FrameRingFileWriter()
+{
+	vector<char> headerBuffer(DAQd::SHMHeaderSize, 0);
+	DAQd::SHMHeader *header = (DAQd::SHMHeader *)&headerBuffer[0];
+	header->flags = flags;
+	header->nSlots = slots.size();
+	header->slotsOffset = DAQd::SHMHeaderSize;
+	header->dataOffset = DAQd::SHMHeaderSize + slotsSize;
+	header->dataSize = dataSize;
+	header->writePosition = dataSize;
+	memcpy(header->magic, DAQd::SHMMagic, sizeof(DAQd::SHMMagic));
+
+	fseek(file, 0, SEEK_SET);
+	fwrite(&headerBuffer[0], 1, headerBuffer.size(), file);
+	fwrite(&slots[0], sizeof(DAQd::FrameSlot), slots.size(), file);
+	if(fclose(file) != 0) {
+		int e = errno;
+		fprintf(stderr, "FrameRingFileWriter:: error writing frame ring : %d %s\n", e, strerror(e));
+		exit(1);
+	}
+}
+
+void FrameRingFileWriter::addFrame(EventGenerator::Frame &frame)
+{
+	if(slots.size() >= nFrames) {
+		fprintf(stderr, "FrameRingFileWriter:: more than %u frames\n", nFrames);
+		exit(1);
+	}
+	unsigned nPacked = EventGenerator::packFrame(frame, flags, words);
+	DAQd::FrameSlot slot = { dataSize, 2 + (uint32_t)frame.hits.size(), 0 };
+	slots.push_back(slot);
+	if(fwrite(&words[0], sizeof(uint64_t), nPacked, file) != nPacked) {
+		int e = errno;
+		fprintf(stderr, "FrameRingFileWriter:: error writing frame ring : %d %s\n", e, strerror(e));
+		exit(1);
+	}
+	dataSize += sizeof(uint64_t) * nPacked;
+}
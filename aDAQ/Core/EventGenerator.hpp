@@ -0,0 +1,120 @@
+#ifndef __DAQ__CORE__EVENTGENERATOR_HPP__DEFINED__
+#define __DAQ__CORE__EVENTGENERATOR_HPP__DEFINED__
+
+#include "Event.hpp"
+#include <Common/SystemInformation.hpp>
+#include <SHM.hpp>
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <map>
+
+namespace DAQ { namespace Core {
+
+	/*! Generates synthetic TOFPET and STiC data, frame by frame, for tests and benchmarks
+	 * without a detector. For a given channel map, trigger map and configuration the output
+	 * depends only on the seed.
+	 *
+	 * - Back to back 511 keV pairs hit two regions allowed to be in coincidence by the trigger map,
+	 *   at the crystal with the same (xi, yi) in the second region when there is one
+	 * - Unpaired 511 keV gammas and per channel dark counts
+	 * - Each hit may spill into the next crystal of the same region (multi-hit)
+	 * - TOFPET channels use their 4 TACs in turn; channel and TAC idle times are tracked
+	 * - Frames may be flagged lost (keeping only part of their events) or go missing
+	 */
+	class EventGenerator {
+	public:
+		struct Config {
+			double coincidenceRate;		// back to back pairs, Hz
+			double singlesRate;		// unpaired gammas, Hz
+			double darkCountRate;		// per channel, Hz
+			float photoFraction;		// fraction of gammas depositing the full 511 keV
+			float photopeakToT;		// ToT of a 511 keV hit, s
+			float multiHitProbability;	// probability of a hit spilling into the next crystal
+			float lostFrameProbability;
+			float missingFrameProbability;
+			float sticFraction;		// fraction of ASICs which are STiC
+			uint64_t seed;
+		};
+		static Config defaultConfig();
+
+		struct Frame {
+			long long frameID;
+			bool lost;
+			std::vector<RawHit> hits;	// in time order
+		};
+
+		EventGenerator(DAQ::Common::SystemInformation *systemInformation, Config &config);
+
+		// Fills in the next frame; returns false if the frame went missing, in which case it has no hits
+		bool nextFrame(Frame &frame);
+
+		// Frame words as daqd stores them in a frame ring (see DAQd::packedFrameWords());
+		// flags select which of the idle times and front end types follow the data words
+		static unsigned packFrame(Frame &frame, uint32_t flags, std::vector<uint64_t> &words);
+
+		// Random numbers from the generator's seeded sequence
+		uint64_t random();
+		double uniform();
+		double gaussian();
+		unsigned poisson(double mean);
+
+	private:
+		Config config;
+		uint64_t rngState;
+		long long frameID;
+
+		DAQ::Common::SystemInformation *systemInformation;
+		std::vector<int> allChannels;
+		std::vector<int> regions;
+		std::vector<std::vector<int> > regionChannels;
+		std::vector<std::pair<int, int> > regionPairs;
+		std::map<long long, int> crystalAt;	// by (region, xi, yi)
+		std::vector<int> neighbourChannel;	// next crystal in the same region, or -1
+		std::vector<bool> sticAsic;
+
+		struct ChannelState {
+			long long lastHit;		// in clocks
+			long long tacLastHit[4];
+			unsigned nextTAC;
+		};
+		std::vector<ChannelState> channelState;
+
+		// Hits of the frame being generated, before they are put in time order
+		struct PendingHit {
+			double time;			// in clocks, since the start of the frame
+			float tot;			// in clocks
+			int channelID;
+			bool operator< (const PendingHit &rhs) const { return time < rhs.time; };
+		};
+		std::vector<PendingHit> pending;
+
+		void addHit(int channelID, double time, float tot);
+		void addGamma(int channelID, double time);
+		int findCrystal(int region, int xi, int yi);
+		void makeHit(PendingHit &p, RawHit &hit);
+	};
+
+	/*! Writes frames into a file with the layout of a daqd frame ring,
+	 * which DAQd::SHM can open in place of daqd's shared memory.
+	 * The ring has one slot for each frame added, up to nFrames,
+	 * and the file is complete once the writer is deleted.
+	 */
+	class FrameRingFileWriter {
+	public:
+		FrameRingFileWriter(const char *fileName, unsigned nFrames, uint32_t flags);
+		~FrameRingFileWriter();
+		void addFrame(EventGenerator::Frame &frame);
+
+	private:
+		FILE *file;
+		uint32_t flags;
+		unsigned nFrames;
+		std::vector<DAQd::FrameSlot> slots;
+		unsigned long long slotsSize;
+		unsigned long long dataSize;
+		std::vector<uint64_t> words;
+	};
+
+}}
+#endif
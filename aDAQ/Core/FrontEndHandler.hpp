@@ -0,0 +1,27 @@
+#ifndef __DAQ__CORE__FRONTENDHANDLER_HPP__DEFINED__
+#define __DAQ__CORE__FRONTENDHANDLER_HPP__DEFINED__
+
+#include "Event.hpp"
+#include "EventBuffer.hpp"
+
+namespace DAQ { namespace Core {
+
+	static const unsigned nFrontEndTypes = RawHit::DSIPM + 1;
+
+	/*! Converts the raw hits of one front end type into hits.
+	 * Handlers are registered by type with ENDOTOFPET::Extract, which sorts each block by type 
+	 * and hands every handler only the hits of its own type, all in one call.
+	 */
+	class FrontEndHandler {
+	public:
+		virtual ~FrontEndHandler() {};
+
+		// Handles the raw hits inBuffer->get(index[0..n-1]); a hit which passes is written to
+		// out[index[k]] and flagged in passed[index[k]]. Returns the number of hits passed.
+		virtual u_int32_t handleBlock(EventBuffer<RawHit> *inBuffer, const unsigned *index, unsigned n, Hit *out, bool *passed) = 0;
+
+		virtual void printReport() = 0;
+	};
+
+}}
+#endif
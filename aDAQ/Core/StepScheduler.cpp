@@ -0,0 +1,109 @@
+#include "StepScheduler.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace DAQ::Core;
+using namespace std;
+
+StepScheduler::StepScheduler(int nSteps, int maxActiveSteps, ThreadPool *pool)
+	: nSteps(nSteps), maxActiveSteps(maxActiveSteps > 0 ? maxActiveSteps : 1), pool(pool),
+	  nextStep(0), headStep(0), stepDone(nSteps, false)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_mutex_init(&outputLock, NULL);
+	pthread_cond_init(&condStepCommitted, NULL);
+}
+
+StepScheduler::~StepScheduler()
+{
+	pthread_cond_destroy(&condStepCommitted);
+	pthread_mutex_destroy(&outputLock);
+	pthread_mutex_destroy(&lock);
+}
+
+void StepScheduler::run()
+{
+	// Hold a client reference so the pool's workers survive 
+	// the gaps between one step's pipeline and the next
+	pool->clientIncrease();
+
+	int nThreads = maxActiveSteps < nSteps ? maxActiveSteps : nSteps;
+	vector<pthread_t> threads(nThreads);
+	for(int i = 0; i < nThreads; i++) {
+		if(pthread_create(&threads[i], NULL, worker, (void *)this) != 0) {
+			fprintf(stderr, "StepScheduler: could not create thread\n");
+			exit(1);
+		}
+	}
+	for(int i = 0; i < nThreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pool->clientDecrease();
+}
+
+void StepScheduler::lockOutput()
+{
+	pthread_mutex_lock(&outputLock);
+}
+
+void StepScheduler::unlockOutput()
+{
+	pthread_mutex_unlock(&outputLock);
+}
+
+// Must be called with the output lock held
+bool StepScheduler::isHead(int step)
+{
+	return step == headStep;
+}
+
+// Must be called without the output lock held
+void StepScheduler::waitHead(int step)
+{
+	pthread_mutex_lock(&lock);
+	while(headStep < step) {
+		pthread_cond_wait(&condStepCommitted, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void *StepScheduler::worker(void *arg)
+{
+	StepScheduler *s = (StepScheduler *)arg;
+	while(true) {
+		pthread_mutex_lock(&s->lock);
+		// Do not run too far ahead of the oldest uncommitted step, 
+		// so that buffered output stays bounded
+		while(s->nextStep < s->nSteps && s->nextStep >= s->headStep + s->maxActiveSteps) {
+			pthread_cond_wait(&s->condStepCommitted, &s->lock);
+		}
+		if(s->nextStep >= s->nSteps) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		int step = s->nextStep++;
+		pthread_mutex_unlock(&s->lock);
+
+		s->processStep(step);
+		s->finishStep(step);
+	}
+	return NULL;
+}
+
+void StepScheduler::finishStep(int step)
+{
+	pthread_mutex_lock(&outputLock);
+	pthread_mutex_lock(&lock);
+	stepDone[step] = true;
+	while(headStep < nSteps && stepDone[headStep]) {
+		int h = headStep;
+		pthread_mutex_unlock(&lock);
+		commitStep(h);
+		pthread_mutex_lock(&lock);
+		headStep++;
+		pthread_cond_broadcast(&condStepCommitted);
+	}
+	pthread_mutex_unlock(&lock);
+	pthread_mutex_unlock(&outputLock);
+}
@@ -0,0 +1,56 @@
+#ifndef __DAQ_CORE_STEPSCHEDULER_HPP__DEFINED__
+#define __DAQ_CORE_STEPSCHEDULER_HPP__DEFINED__
+
+#include <vector>
+#include <pthread.h>
+#include <Core/ThreadPool.hpp>
+
+namespace DAQ { namespace Core {
+
+	// Runs the per-step pipelines of a scan concurrently, 
+	// while committing their output in step order.
+	// Usage:
+	// 1. Override processStep() to build, run and wait for the pipeline of one step.
+	//    It is called from scheduler threads, for up to maxActiveSteps steps at a time.
+	// 2. Override commitStep() to finalize the output of one step.
+	//    It is called with the output lock held, strictly in step order.
+	// 3. Sinks writing into shared output must hold lockOutput()/unlockOutput().
+	//    While holding it, isHead(step) tells if the step is the oldest uncommitted one,
+	//    in which case it may write directly instead of buffering.
+	//    To keep buffered output bounded, a sink may instead call waitHead(step), 
+	//    without holding the output lock, and write directly afterwards.
+	class StepScheduler {
+	public:
+		StepScheduler(int nSteps, int maxActiveSteps, ThreadPool *pool = GlobalThreadPool);
+		virtual ~StepScheduler();
+
+		void run();
+		
+		void lockOutput();
+		void unlockOutput();
+		bool isHead(int step);
+		void waitHead(int step);
+
+	protected:
+		virtual void processStep(int step) = 0;
+		virtual void commitStep(int step) = 0;
+
+	private:
+		int nSteps;
+		int maxActiveSteps;
+		ThreadPool *pool;
+
+		int nextStep;
+		int headStep;
+		std::vector<bool> stepDone;
+
+		pthread_mutex_t lock;
+		pthread_mutex_t outputLock;
+		pthread_cond_t condStepCommitted;
+
+		void finishStep(int step);
+		static void *worker(void *arg);
+	};
+
+}}
+#endif
@@ -24,6 +24,7 @@ ThreadPool::ThreadPool(unsigned maxWorkers)
 	maxQueueSize = maxQueueSize > 0 ? maxQueueSize : 1;
 	
 	die = true;
+	pthread_mutex_init(&clientLock, NULL);
 	pthread_mutex_init(&lock, NULL);
 	pthread_cond_init(&condJobQueued, NULL);
 	pthread_cond_init(&condJobStarted, NULL);
@@ -41,32 +42,45 @@ ThreadPool::~ThreadPool()
 	pthread_cond_destroy(&condJobStarted);
 	pthread_cond_destroy(&condJobQueued);
 	pthread_mutex_destroy(&lock);
+	pthread_mutex_destroy(&clientLock);
 }
 
+// Clients may come and go from different threads 
+// (ex: several step pipelines running concurrently)
 void ThreadPool::clientIncrease()
 {
+	pthread_mutex_lock(&clientLock);
 	nClients ++;
-	if(nClients > 1) return;
+	if(nClients > 1) {
+		pthread_mutex_unlock(&clientLock);
+		return;
+	}
 	
 	die = false;
 	for(int i = 0; i < maxWorkers; i++) {
 		workers.push_back(new Worker(this));
 	}	
+	pthread_mutex_unlock(&clientLock);
 }
 
 void ThreadPool::clientDecrease()
 {
+	pthread_mutex_lock(&clientLock);
 	nClients = nClients > 1 ? nClients - 1 : 0;
-	if(nClients > 0) return;
+	if(nClients > 0) {
+		pthread_mutex_unlock(&clientLock);
+		return;
+	}
 	
-	die = true;
 	pthread_mutex_lock(&lock);
+	die = true;
 	pthread_cond_broadcast(&condJobQueued);
 	pthread_mutex_unlock(&lock);
 	for(unsigned i = 0; i <  workers.size(); i++) {
 		delete workers[i];
 	}
 	workers = vector<Worker *>();
+	pthread_mutex_unlock(&clientLock);
 }
 
 bool ThreadPool::isFull()
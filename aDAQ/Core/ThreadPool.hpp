@@ -68,6 +68,7 @@ namespace DAQ { namespace Core {
 		unsigned maxQueueSize;
 		
 		bool die;
+		pthread_mutex_t clientLock;
 		pthread_mutex_t lock;
 		pthread_cond_t condJobQueued;
 		pthread_cond_t condJobStarted;
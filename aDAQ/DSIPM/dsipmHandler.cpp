@@ -6,32 +6,68 @@ using namespace DAQ::DSIPM;
 
 DsipmHandler::DsipmHandler() 
 {
-	
+	nEvent = 0;
+	nNoWidth = 0;
+	nPassed = 0;
 }
 
-bool DsipmHandler::handleEvent(RawHit &raw, Hit &pulse)
+DsipmHandler::~DsipmHandler()
 {
-	// if event is good return true
-	// if event is not good (see example below), return false
-   
-	
-	if(raw.feType != RawHit::DSIPM) return false;
-
+}
 
-	// extract data from rawHit as you see fit
+inline bool DsipmHandler::extract(RawHit &raw, Hit &pulse)
+{
+	if(raw.feType != RawHit::DSIPM) return false;
+	// A hit which ends before it starts has no usable energy
+	if(raw.timeEnd <= raw.time) return false;
 
+	pulse.raw = &raw;
+	pulse.time = raw.time;
+	pulse.timeEnd = raw.timeEnd;
+	pulse.energy = 1E-3*(pulse.timeEnd - pulse.time);
+	pulse.badEvent = false;
+	return true;
+}
 
+bool DsipmHandler::handleEvent(RawHit &raw, Hit &pulse)
+{
+	// if event is good return true
+	// if event is not good, return false
+	atomicAdd(nEvent, 1);
+	if(!extract(raw, pulse)) {
+		if(raw.feType == RawHit::DSIPM) atomicAdd(nNoWidth, 1);
+		return false;
+	}
+	atomicAdd(nPassed, 1);
 	return true; 
-
 }
 
+u_int32_t DsipmHandler::handleBlock(EventBuffer<RawHit> *inBuffer, const unsigned *index, unsigned n, Hit *out, bool *passed)
+{
+	u_int32_t lNoWidth = 0;
+	u_int32_t lPassed = 0;
+	for(unsigned k = 0; k < n; k++) {
+		unsigned i = index[k];
+		RawHit &raw = inBuffer->get(i);
+		passed[i] = extract(raw, out[i]);
+		if(passed[i])
+			lPassed++;
+		else if(raw.feType == RawHit::DSIPM)
+			lNoWidth++;
+	}
+	atomicAdd(nEvent, n);
+	atomicAdd(nNoWidth, lNoWidth);
+	atomicAdd(nPassed, lPassed);
+	return lPassed;
+}
 
 void DsipmHandler::printReport()
 {
         printf(">> DSIPM::dsipmHandler report\n");
         printf(" events received\n");
-		//...
-		//...
-     
-	
+	printf("  %10u\n", nEvent);
+	printf(" events discarded\n");
+	printf("  %10u (%4.1f%%) no width\n", nNoWidth, 100.0*nNoWidth/nEvent);
+	printf(" events passed\n");
+        printf("  %10u (%4.1f%%)\n", nPassed, 100.0*nPassed/nEvent);
 }
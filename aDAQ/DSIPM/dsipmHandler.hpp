@@ -1,28 +1,32 @@
 #ifndef __DAQ_DSIPM__DSIPMHANDLER_HPP__DEFINED__
 #define __DAQ_DSIPM__DSIPMHANDLER_HPP__DEFINED__
 
-#include <Core/Event.hpp> // This one will surely be needed...
-
-
-//Template for a sticv3handler class
+#include <Core/Event.hpp>
+#include <Core/FrontEndHandler.hpp>
+#include <Common/Instrumentation.hpp>
 
 namespace DAQ { namespace DSIPM {
 	using namespace std;
+	using namespace DAQ::Common;
 	using namespace DAQ::Core;
 	
-	class DsipmHandler{
+	// dSiPM hits carry no front end specific data yet (RawHit::d.dsipm is empty),
+	// so they are taken from the raw hit's time and time end, as already calibrated
+	class DsipmHandler : public FrontEndHandler {
 	public:
-		DsipmHandler(); // construct handler with whatever variables you may need
+		DsipmHandler();
 		~DsipmHandler();
 		void printReport(); //report at the end of handling events
 
 		bool handleEvent(RawHit &raw, Hit &Hit); 		
-		  
+		virtual u_int32_t handleBlock(EventBuffer<RawHit> *inBuffer, const unsigned *index, unsigned n, Hit *out, bool *passed);
 
 	private:
-		
-		//whatever variables you may need
-		
+		bool extract(RawHit &raw, Hit &pulse);
+
+		u_int32_t nEvent;
+		u_int32_t nNoWidth;
+		u_int32_t nPassed;
 	};
 }}
 #endif
@@ -1,5 +1,7 @@
 #include "Extract.hpp"
 #include <stdio.h>
+#include <string.h>
+#include <assert.h>
 
 using namespace DAQ::Common;
 using namespace DAQ::Core;
@@ -9,14 +11,22 @@ using namespace DAQ::DSIPM;
 using namespace DAQ::ENDOTOFPET;
 
 Extract::Extract(DAQ::TOFPET::P2Extract *tofpetH, DAQ::STICv3::Sticv3Handler *sticv3H, DAQ::DSIPM::DsipmHandler *dsipmH,  EventSink<Hit> *sink) :
-	tofpetH(tofpetH), sticv3H(sticv3H), dsipmH(dsipmH), 
 	OverlappedEventHandler<RawHit, Hit>(sink)
 {
 	nEvent = 0;
 	nPassed = 0;
+	for(unsigned t = 0; t < nFrontEndTypes; t++)
+		handlers[t] = NULL;
+	registerHandler(RawHit::TOFPET, tofpetH);
+	registerHandler(RawHit::STIC, sticv3H);
+	registerHandler(RawHit::DSIPM, dsipmH);
 }
 
-
+void Extract::registerHandler(RawHit::Type feType, FrontEndHandler *handler)
+{
+	assert(feType < nFrontEndTypes);
+	handlers[feType] = handler;
+}
 
 EventBuffer<Hit> * Extract::handleEvents (EventBuffer<RawHit> *inBuffer)
 {
@@ -27,58 +37,67 @@ EventBuffer<Hit> * Extract::handleEvents (EventBuffer<RawHit> *inBuffer)
 	outBuffer->setTMin(tMin);
 	outBuffer->setTMax(tMax);	
 
+	// Counting sort of the hits in [tMin, tMax) by front end type, keeping their order within each type
+	unsigned typeBegin[nFrontEndTypes + 1];
+	for(unsigned t = 0; t <= nFrontEndTypes; t++)
+		typeBegin[t] = 0;
+	for(unsigned i = 0; i < nEvents; i++) {
+		RawHit &raw = inBuffer->get(i);
+		if(raw.time < tMin || raw.time >= tMax) continue;
+		if(unsigned(raw.feType) >= nFrontEndTypes) continue;
+		typeBegin[raw.feType + 1]++;
+	}
+	for(unsigned t = 0; t < nFrontEndTypes; t++)
+		typeBegin[t + 1] += typeBegin[t];
+	u_int32_t lEvent = typeBegin[nFrontEndTypes];
+
+	vector<unsigned> index(lEvent);
+	unsigned typeEnd[nFrontEndTypes];
+	for(unsigned t = 0; t < nFrontEndTypes; t++)
+		typeEnd[t] = typeBegin[t];
+	for(unsigned i = 0; i < nEvents; i++) {
+		RawHit &raw = inBuffer->get(i);
+		if(raw.time < tMin || raw.time >= tMax) continue;
+		if(unsigned(raw.feType) >= nFrontEndTypes) continue;
+		index[typeEnd[raw.feType]++] = i;
+	}
 
-	u_int32_t lEvent = 0;
+	// Handlers write each hit at its input position in the output buffer, 
+	// which is then compacted in place so that the hits keep their time order
+	Hit *slots = &outBuffer->get(0);
+	bool *passed = new bool[nEvents];
+	memset(passed, 0, nEvents * sizeof(bool));
 	u_int32_t lPassed = 0;
+	for(unsigned t = 0; t < nFrontEndTypes; t++) {
+		unsigned n = typeBegin[t + 1] - typeBegin[t];
+		if(handlers[t] == NULL || n == 0) continue;
+		lPassed += handlers[t]->handleBlock(inBuffer, &index[typeBegin[t]], n, slots, passed);
+	}
 
 	for(unsigned i = 0; i < nEvents; i++) {
-		
-		
-		RawHit &raw = inBuffer->get(i);
-	   	if(raw.time < tMin || raw.time >= tMax)continue; 
-		lEvent++;  
+		if(!passed[i]) continue;
 		Hit &p = outBuffer->getWriteSlot();
-		if (raw.feType == RawHit::TOFPET &&  tofpetH != NULL){
-			if (tofpetH->handleEvent(raw, p)){
-				outBuffer->pushWriteSlot();
-				lPassed++;
-			}
-		}
-		else if (raw.feType == RawHit::STIC &&  sticv3H != NULL){
-			if (sticv3H->handleEvent(raw, p)){
-				outBuffer->pushWriteSlot();
-				lPassed++;
-			}
-		}
-		else if (raw.feType == RawHit::DSIPM && dsipmH != NULL){
-			if (dsipmH->handleEvent(raw, p)){
-				outBuffer->pushWriteSlot();	
-				lPassed++;
-			}
-		}
-  
+		if(&p != &slots[i]) p = slots[i];
+		outBuffer->pushWriteSlot();
 	}
+	delete [] passed;
+
 	atomicAdd(nEvent, lEvent);
 	atomicAdd(nPassed, lPassed);
 
 	return outBuffer;
 }
 
-	void Extract::report()
+void Extract::report()
 {
         printf(">> ENDOTOFPET::Extract report\n");
         printf(" events received\n");
         printf("  %10u\n", nEvent);
         printf(" events passed\n");
         printf("  %10u (%4.1f%%)\n", nPassed, 100.0*nPassed/nEvent);
-		if (tofpetH != NULL){
-			tofpetH->printReport();
-		}
-		if (sticv3H != NULL){
-			sticv3H->printReport();
-		}
-		if (dsipmH != NULL){
-			dsipmH->printReport();
-		}	
+	for(unsigned t = 0; t < nFrontEndTypes; t++) {
+		if(handlers[t] != NULL)
+			handlers[t]->printReport();
+	}
 	OverlappedEventHandler<RawHit, Hit>::report();
 }
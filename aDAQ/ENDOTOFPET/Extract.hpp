@@ -3,6 +3,7 @@
 #include <vector>
 #include <Core/Event.hpp>
 #include <Core/OverlappedEventHandler.hpp>
+#include <Core/FrontEndHandler.hpp>
 #include <Common/Instrumentation.hpp>
 #include <TOFPET/P2Extract.hpp>
 #include <STICv3/sticv3Handler.hpp>
@@ -16,10 +17,16 @@ namespace DAQ { namespace ENDOTOFPET {
 		using namespace DAQ::STICv3;
 		using namespace DAQ::DSIPM;
 	
+		/*! Converts raw hits into hits with a handler for each front end type.
+		 * Each block is sorted by type first, so that every handler gets all of its hits in one call.
+		 */
 		class Extract : public OverlappedEventHandler<RawHit, Hit> {
 		public:
 			Extract(DAQ::TOFPET::P2Extract *tofpetH, DAQ::STICv3::Sticv3Handler *sticv3H, DAQ::DSIPM::DsipmHandler *dsipmH,  EventSink<Hit> *sink);
 			
+			// Sets the handler for a front end type, replacing any previous one; NULL drops that type's hits
+			void registerHandler(RawHit::Type feType, FrontEndHandler *handler);
+
 			virtual void report();
 		
 		protected:
@@ -29,9 +36,7 @@ namespace DAQ { namespace ENDOTOFPET {
 		   		
 			
 		private:
-			DAQ::TOFPET::P2Extract *tofpetH;
-			DAQ::STICv3::Sticv3Handler *sticv3H ;
-			DAQ::DSIPM::DsipmHandler *dsipmH;
+			FrontEndHandler *handlers[nFrontEndTypes];
 
 			volatile u_int32_t nEvent;
 			volatile u_int32_t nPassed;
@@ -9,7 +9,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include <Common/Constants.hpp>
-#include <STICv3/sticv3Handler.hpp>
+#include <Common/AsyncFileWriter.hpp>
+#include <Core/ThreadPool.hpp>
+#include <SticCoarse.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <deque>
+#include <map>
 
 using namespace std;
 using namespace DAQ::Core;
@@ -19,12 +27,12 @@ using namespace DAQ::Common;
 static const unsigned outBlockSize = EVENT_BLOCK_SIZE;
 
 RawReaderE::RawReaderE(char *dataFilePrefix, float T,  unsigned long long eventsBegin, unsigned long long eventsEnd,EventSink<RawHit> *sink)
-	: EventSource<RawHit>(sink), dataFile(dataFile), T(T)
+	: EventSource<RawHit>(sink), data(NULL), T(T)
 {
 	char dataFileName[512];
 	sprintf(dataFileName, "%s.rawE", dataFilePrefix);
-	dataFile = fopen(dataFileName, "rb");
-	if(dataFile == NULL) {
+	dataFile = open(dataFileName, O_RDONLY);
+	if(dataFile == -1) {
 		int e = errno;
 		fprintf(stderr, "Could not open '%s for reading' : %d %s\n", dataFileName, e, strerror(e));
 		exit(e);
@@ -36,180 +44,253 @@ RawReaderE::RawReaderE(char *dataFilePrefix, float T,  unsigned long long events
 
 RawReaderE::~RawReaderE()
 {
+	close(dataFile);
 }
 
-
-struct SortEntry {
-	short tCoarse;
-	RawHit *event;	
+// Record sizes, by code
+static const unsigned recordSize[] = {
+	sizeof(StartTime),
+	sizeof(FrameHeader),
+	sizeof(RawTOFPET),
+	sizeof(RawSTICv3)
+};
+static const unsigned maxCode = 0x03;
+
+// Blocks being decoded ahead of the one being pushed to the sink
+static const unsigned maxBlocksInFlight = 32;
+
+// Records have different sizes, so a step can only be found by walking the file from a known point.
+// Readers remember where hits start every seekInterval hits and at the end of their step,
+// so that the readers of later steps of the same file don't walk it from the start again
+struct SeekPoint {
+	unsigned long long offset;
+	long long frameID;
+	long long acqStartTime;
 };
-static bool operator< (SortEntry lhs, SortEntry rhs) { return lhs.tCoarse < rhs.tCoarse; }
+static const unsigned long long seekInterval = 1024*1024;
+static pthread_mutex_t seekPointsLock = PTHREAD_MUTEX_INITIALIZER;
+// By data file (device, inode and size), then by hit index
+static map<string, map<unsigned long long, SeekPoint> > seekPoints;
+
+static string getSeekKey(struct stat &st)
+{
+	char key[128];
+	sprintf(key, "%llu:%llu:%llu", 
+		(unsigned long long)st.st_dev, (unsigned long long)st.st_ino, (unsigned long long)st.st_size);
+	return string(key);
+}
 
+void *RawReaderE::decodeBlock(void *arg)
+{
+	Block &block = *(Block *)arg;
+	char *data = block.reader->data;
+	long long pT = block.reader->T * 1E12;
+	long long frameID = block.frameID;
+	int sticFrameOffset = DAQd::SticCoarse::frameOffset(frameID);
+	long long tMax = 0;
+
+	EventBuffer<RawHit> *outBuffer = new EventBuffer<RawHit>(block.nHits, NULL);
+	unsigned long long offset = block.begin;
+	while(offset < block.end) {
+		uint8_t code = data[offset];
+		char *record = data + offset;
+		offset += recordSize[code];
+
+		if(code == 0x01) {
+			frameID = ((FrameHeader *)record)->frameID;
+			sticFrameOffset = DAQd::SticCoarse::frameOffset(frameID);
+			continue;
+		}
+		else if(code == 0x02) {
+			RawTOFPET &rawEvent = *(RawTOFPET *)record;
+			if(rawEvent.channelID >= SYSTEM_NCHANNELS)
+				continue;
 
+			RawHit &p = outBuffer->getWriteSlot();
+			// Carefull with the float/double/integer conversions here..
+			p.time = (1024LL * frameID + rawEvent.tCoarse) * pT;
+			p.timeEnd = (1024LL * frameID + rawEvent.eCoarse) * pT;
+			if((p.timeEnd - p.time) < -256*pT) p.timeEnd += (1024LL * pT);
+			p.channelID = rawEvent.channelID;
+			p.channelIdleTime = rawEvent.channelIdleTime;
+			p.feType = RawHit::TOFPET;
+			p.d.tofpet.tac = rawEvent.tac;
+			p.d.tofpet.tcoarse = rawEvent.tCoarse;
+			p.d.tofpet.ecoarse = rawEvent.eCoarse;
+			p.d.tofpet.tfine =  rawEvent.tFine;
+			p.d.tofpet.efine = rawEvent.eFine;
+			p.d.tofpet.tacIdleTime = rawEvent.tacIdleTime;
+
+			if(p.time > tMax)
+				tMax = p.time;
+			outBuffer->pushWriteSlot();
+		}
+		else if(code == 0x03) {
+			RawSTICv3 &rawEvent = *(RawSTICv3 *)record;
+			if(rawEvent.channelID >= SYSTEM_NCHANNELS)
+				continue;
+
+			RawHit &p = outBuffer->getWriteSlot();
+			// Compensate LFSR's 2^16-1 period
+			// and wrap at frame's 6.4 us period
+			int ctCoarse = DAQd::SticCoarse::compensate(rawEvent.tCoarse, sticFrameOffset) % 4096;
+			int ceCoarse = DAQd::SticCoarse::compensate(rawEvent.eCoarse, sticFrameOffset) % 4096;
+			p.time = 1024LL * frameID * pT + ctCoarse * pT/4;
+			p.timeEnd = 1024LL * frameID * pT + ceCoarse * pT/4;
+			if((p.timeEnd - p.time) < -256*pT) p.timeEnd += (1024LL * pT);
+			p.channelID = rawEvent.channelID;
+			p.channelIdleTime = rawEvent.channelIdleTime;
+			p.feType = RawHit::STIC;
+			p.d.stic.tcoarse = rawEvent.tCoarse;
+			p.d.stic.ecoarse = rawEvent.eCoarse;
+			p.d.stic.tfine =  rawEvent.tFine;
+			p.d.stic.efine = rawEvent.eFine;
+			p.d.stic.tBadHit = rawEvent.tBadHit;
+			p.d.stic.eBadHit = rawEvent.eBadHit;
+
+			if(p.time > tMax)
+				tMax = p.time;
+			outBuffer->pushWriteSlot();
+		}
+	}
+
+	block.buffer = outBuffer;
+	block.tMax = tMax;
+	return NULL;
+}
 
 void RawReaderE::run()
 {
-
-	unsigned nWraps = 0;
-	
-	EventBuffer<RawHit> *outBuffer = NULL;
-	
-	int nEventsInFrame = 0;
-	
 	long long tMax = 0, lastTMax = 0;
-	long long FrameID;
 	
 	sink->pushT0(0);
 	
 	fprintf(stderr, "Reading %llu to %llu\n", eventsBegin, eventsEnd);
 
-	uint8_t code;
+	struct stat st;
+	if(fstat(dataFile, &st) != 0) {
+		int e = errno;
+		fprintf(stderr, "Could not stat data file : %d %s\n", e, strerror(e));
+		exit(e);
+	}
+	unsigned long long dataSize = st.st_size;
+	if(dataSize > 0) {
+		void *m = mmap(NULL, dataSize, PROT_READ, MAP_SHARED, dataFile, 0);
+		if(m == MAP_FAILED) {
+			int e = errno;
+			fprintf(stderr, "Could not map data file : %d %s\n", e, strerror(e));
+			exit(e);
+		}
+		madvise(m, dataSize, MADV_SEQUENTIAL);
+		data = (char *)m;
+	}
+
+	// First pass: walk the records by their sizes only, keeping hits eventsBegin to eventsEnd,
+	// cutting a block every outBlockSize - 512 hits and noting the frame in effect 
+	// where each block starts, so that blocks decode independently
+	vector<Block> blocks;
+	Block block = { this, 0, 0, 0, 0, NULL, 0 };
+	long long frameID = 0;
+	long long events = 0;
+	unsigned long long hitIndex = 0;
+	unsigned long long p = 0;
+	AcqStartTime = 0;
 	
-	long long events=0;
-	int bytes;
-	while (fread(&code, 1, 1, dataFile) == 1) {
-		  events++;
-		  
-		  
-		  if(code>0x03){
-				fprintf(stderr, "Impossible code: %u, at event %ld\n\n", code, events);
+	// Start from the closest known point before eventsBegin
+	string seekKey = getSeekKey(st);
+	map<unsigned long long, SeekPoint> newSeekPoints;
+	pthread_mutex_lock(&seekPointsLock);
+	map<unsigned long long, SeekPoint> &fileSeekPoints = seekPoints[seekKey];
+	map<unsigned long long, SeekPoint>::iterator sp = fileSeekPoints.upper_bound(eventsBegin);
+	if(sp != fileSeekPoints.begin()) {
+		--sp;
+		hitIndex = sp->first;
+		p = sp->second.offset;
+		frameID = sp->second.frameID;
+		AcqStartTime = sp->second.acqStartTime;
+		block.begin = p;
+		block.frameID = frameID;
+	}
+	pthread_mutex_unlock(&seekPointsLock);
+	
+	while(p < dataSize) {
+		uint8_t code = data[p];
+		events++;
+		if(code > maxCode) {
+			fprintf(stderr, "Impossible code: %u, at event %lld\n\n", code, events);
+			break;
+		}
+		if(p + recordSize[code] > dataSize) {
+			fprintf(stderr, "Truncated record, at event %lld\n\n", events);
+			break;
+		}
+
+		if(code == 0x00)
+			AcqStartTime = ((StartTime *)(data + p))->time;
+		else if(code == 0x01)
+			frameID = ((FrameHeader *)(data + p))->frameID;
+		else {
+			if(hitIndex == eventsEnd)
 				break;
-		  }
-		  fseek(dataFile, -1, SEEK_CUR);
-		
-		
-			
-		  switch(code){
-		  case 0:{
-				StartTime rawStartTime;
-				bytes= fread(&rawStartTime, sizeof(StartTime), 1, dataFile);
-				AcqStartTime=rawStartTime.time;
-				//fprintf(stderr, "rawStartTime=%d %d\n",rawStartTime.code,rawStartTime.time);
-				continue;
-		  }
-		  case 1:{
-				FrameHeader rawFrameHeader;
-				bytes=fread(&rawFrameHeader, sizeof(FrameHeader), 1, dataFile);
-				CurrentFrameID=rawFrameHeader.frameID;
-				//fprintf(stderr, "Current frameID= %d %lld %lld\n", rawFrameHeader.code,rawFrameHeader.frameID,rawFrameHeader.drift   );
-				continue;
-		  }
-		  case 2:{
-				RawTOFPET rawEvent;
-		
-				bytes=fread(&rawEvent, sizeof(RawTOFPET), 1, dataFile);
-				//fprintf(stderr, "tof.struct=%d\n %d\n %d\n %ld\n %ld\n %ld\n %lld\n %lld\n \n\n", rawEvent.code, rawEvent.tac, rawEvent.channelID,rawEvent.tCoarse,  rawEvent.eCoarse, rawEvent.tFine , rawEvent.eFine , rawEvent.tacIdleTime , rawEvent.channelIdleTime );
-				if(outBuffer == NULL) {
-					  outBuffer = new EventBuffer<RawHit>(outBlockSize, NULL);
-				}
-				
-			
-				RawHit &p = outBuffer->getWriteSlot();
-				
-
-
-				// Carefull with the float/double/integer conversions here..
-				long long pT = T * 1E12;
-				p.time = (1024LL * CurrentFrameID + rawEvent.tCoarse) * pT;
-				p.timeEnd = (1024LL * CurrentFrameID + rawEvent.eCoarse) * pT;
-				if((p.timeEnd - p.time) < -256*pT) p.timeEnd += (1024LL * pT);
-				p.channelID = rawEvent.channelID;
-				p.channelIdleTime = rawEvent.channelIdleTime;
-				p.feType = RawHit::TOFPET;
-				p.d.tofpet.tac = rawEvent.tac;
-				p.d.tofpet.tcoarse = rawEvent.tCoarse;
-				p.d.tofpet.ecoarse = rawEvent.eCoarse;
-				p.d.tofpet.tfine =  rawEvent.tFine;
-				p.d.tofpet.efine = rawEvent.eFine;
-				p.d.tofpet.tacIdleTime = rawEvent.tacIdleTime;
-
-				//printf("DBG T frameID = %20lld tCoarse = %6u time = %20lld\n", CurrentFrameID, rawEvent.tCoarse, p.time);
-
-				
-				if(p.channelID >= SYSTEM_NCHANNELS)
-					  continue;
-				
-				if(p.time > tMax)
-					  tMax = p.time;
-				
-				outBuffer->pushWriteSlot();
-				
-				if(outBuffer->getSize() >= (outBlockSize - 512)) {
-					  outBuffer->setTMin(lastTMax);
-					  outBuffer->setTMax(tMax);		
-					  sink->pushEvents(outBuffer);
-					  outBuffer = NULL;
-				}
-				continue;
-		  }
-		  case 3:{
-				RawSTICv3 rawEvent2;
-				
-				fread(&rawEvent2, sizeof(RawSTICv3), 1, dataFile);
-				
-				if(outBuffer == NULL) {
-					  outBuffer = new EventBuffer<RawHit>(outBlockSize, NULL);
-				}
-				
-				
-				RawHit &p = outBuffer->getWriteSlot();
-			
-				unsigned tCoarse = rawEvent2.tCoarse;
-				unsigned eCoarse = rawEvent2.eCoarse;
-				// Compensate LFSR's 2^16-1 period
-				// and wrap at frame's 6.4 us period
-				int ctCoarse = STICv3::Sticv3Handler::compensateCoarse(tCoarse, CurrentFrameID) % 4096;
-				int ceCoarse = STICv3::Sticv3Handler::compensateCoarse(eCoarse, CurrentFrameID) % 4096;
-			
-				long long pT = T * 1E12;
-				p.time = 1024LL * CurrentFrameID * pT + ctCoarse * pT/4;
-				p.timeEnd = 1024LL * CurrentFrameID * pT + ceCoarse * pT/4;
-				if((p.timeEnd - p.time) < -256*pT) p.timeEnd += (1024LL * pT);
-				p.channelID = rawEvent2.channelID;
-				p.channelIdleTime = rawEvent2.channelIdleTime;
-				
-				
-				p.feType = RawHit::STIC;
-				p.d.stic.tcoarse = rawEvent2.tCoarse;
-				p.d.stic.ecoarse = rawEvent2.eCoarse;
-				p.d.stic.tfine =  rawEvent2.tFine;
-				p.d.stic.efine = rawEvent2.eFine;
-				p.d.stic.tBadHit = rawEvent2.tBadHit;
-				p.d.stic.eBadHit = rawEvent2.eBadHit;
-				
-				//printf("DBG S frameID = %20lld tCoarse = %6u time = %20lld\n", CurrentFrameID, tCoarse >> 2, p.time);
-		
-	  
-				
-				if(p.channelID >= SYSTEM_NCHANNELS)
-					  continue;
-				
-				if(p.time > tMax)
-					  tMax = p.time;
-				
-				outBuffer->pushWriteSlot();
-				
-				if(outBuffer->getSize() >= (outBlockSize - 512)) {
-					  outBuffer->setTMin(lastTMax);
-					  outBuffer->setTMax(tMax);		
-					  sink->pushEvents(outBuffer);
-					  outBuffer = NULL;
-				}
-				continue;
-		  }
-				
-		  }
-		
-		
+			if(hitIndex % seekInterval == 0) {
+				SeekPoint point = { p, frameID, AcqStartTime };
+				newSeekPoints[hitIndex] = point;
+			}
+			if(hitIndex++ < eventsBegin) {
+				block.begin = p + recordSize[code];
+				block.frameID = frameID;
+			}
+			else
+				block.nHits++;
+		}
+		p += recordSize[code];
+
+		if(block.nHits >= (outBlockSize - 512)) {
+			block.end = p;
+			blocks.push_back(block);
+			block.begin = p;
+			block.frameID = frameID;
+			block.nHits = 0;
+		}
+	}
+	if(block.nHits > 0) {
+		block.end = p;
+		blocks.push_back(block);
 	}
+	SeekPoint endPoint = { p, frameID, AcqStartTime };
+	newSeekPoints[hitIndex] = endPoint;
+	pthread_mutex_lock(&seekPointsLock);
+	seekPoints[seekKey].insert(newSeekPoints.begin(), newSeekPoints.end());
+	pthread_mutex_unlock(&seekPointsLock);
+
+	// Second pass: decode blocks in the thread pool and push them to the sink in file order
+	ThreadPool *pool = GlobalThreadPool;
+	pool->clientIncrease();
+	deque<ThreadPool::Job *> jobs;
+	unsigned nQueued = 0;
+	for(unsigned i = 0; i < blocks.size(); i++) {
+		while(nQueued < blocks.size() && nQueued < i + maxBlocksInFlight) {
+			jobs.push_back(pool->queueJob(decodeBlock, &blocks[nQueued]));
+			nQueued++;
+		}
+		ThreadPool::Job *job = jobs.front();
+		jobs.pop_front();
+		job->wait();
+		delete job;
+
+		Block &b = blocks[i];
+		if(b.tMax > tMax)
+			tMax = b.tMax;
+		b.buffer->setTMin(lastTMax);
+		b.buffer->setTMax(tMax);
+		sink->pushEvents(b.buffer);
+		b.buffer = NULL;
+	}
+	pool->clientDecrease();
 
-	
-	if(outBuffer != NULL) {
-		outBuffer->setTMin(lastTMax);
-		outBuffer->setTMax(tMax);		
-		sink->pushEvents(outBuffer);
-		outBuffer = NULL;
-		
+	if(data != NULL) {
+		munmap(data, dataSize);
+		data = NULL;
 	}
 	
 	sink->finish();
@@ -274,12 +355,7 @@ RawWriterE::RawWriterE(char *fileNamePrefix, long long acqStartTime)
 
 	sprintf(dataFileName, "%s.rawE", fileNamePrefix);
 	sprintf(indexFileName, "%s.idxE", fileNamePrefix);
-	outputDataFile = fopen(dataFileName, "wb");
-	if(outputDataFile == NULL) {
-		int e = errno;
-		fprintf(stderr, "Could not open '%s for writing' : %d %s\n", dataFileName, e, strerror(e));
-		exit(e);
-	}
+	outputDataFile = new AsyncFileWriter(dataFileName);
 	
 	outputIndexFile = fopen(indexFileName, "w");
 	if(outputIndexFile == NULL) {
@@ -290,9 +366,9 @@ RawWriterE::RawWriterE(char *fileNamePrefix, long long acqStartTime)
 	
 	DAQ::ENDOTOFPET::StartTime StartTimeOut = {
 			                0x00,
-							acqStartTime,
+							uint64_t(acqStartTime),
 	};
-	fwrite(&StartTimeOut, sizeof(StartTimeOut), 1, outputDataFile);
+	outputDataFile->write(&StartTimeOut, sizeof(StartTimeOut));
 	stepBegin = 0;
 	stepEnd=0;
 	currentFrameID=0;
@@ -300,29 +376,37 @@ RawWriterE::RawWriterE(char *fileNamePrefix, long long acqStartTime)
 
 RawWriterE::~RawWriterE()
 {
- 	fclose(outputDataFile);
+ 	delete outputDataFile;
  	fclose(outputIndexFile);
 }
 
 void RawWriterE::openStep(float step1, float step2)
 {
-	this->step1 = 0;
-	this->step2 = 0;
-	//stepBegin = ftell(outputDataFile) / sizeof(DAQ::TOFPET::RawEventV3);
+	this->step1 = step1;
+	this->step2 = step2;
+	stepBegin = stepEnd;
 }
 
 void RawWriterE::closeStep()
 {
-
+	outputDataFile->flush();
 	fprintf(outputIndexFile, "%f %f %ld %ld\n", step1, step2, stepBegin, stepEnd);
-	fflush(outputDataFile);
 	fflush(outputIndexFile);
 }
 
+// Worst case size of the records for one hit: a frame header and the larger hit record
+static const unsigned maxHitRecordsSize = sizeof(FrameHeader) + 
+	(sizeof(RawTOFPET) > sizeof(RawSTICv3) ? sizeof(RawTOFPET) : sizeof(RawSTICv3));
+
 u_int32_t RawWriterE::addEventBuffer(long long tMin, long long tMax, EventBuffer<RawHit> *inBuffer)
 {
 	u_int32_t lSingleRead = 0;
 	unsigned N = inBuffer->getSize();
+	
+	// Encode the whole buffer in place in the writer's current block;
+	// a frame header is only written when the frame changes
+	char *outStart = outputDataFile->reserve(N * maxHitRecordsSize);
+	char *out = outStart;
 	for(unsigned i = 0; i < N; i++) {
 		RawHit &p = inBuffer->get(i);
 		if((p.time < tMin) || (p.time >= tMax)) continue;
@@ -335,44 +419,48 @@ u_int32_t RawWriterE::addEventBuffer(long long tMin, long long tMax, EventBuffer
 				frameID,
 				0,
 			};				
-			fwrite(&FrHeaderOut, sizeof(DAQ::ENDOTOFPET::FrameHeader), 1, outputDataFile);
+			memcpy(out, &FrHeaderOut, sizeof(FrHeaderOut));
+			out += sizeof(FrHeaderOut);
 			currentFrameID=frameID;
 		}	
 		
 		if (p.feType == RawHit::TOFPET) {
 				DAQ::ENDOTOFPET::RawTOFPET eventOut = {
 				0x02,
-				p.d.tofpet.tac,
-				p.channelID,
-				p.d.tofpet.tcoarse,
-				p.d.tofpet.ecoarse,
-				p.d.tofpet.tfine,
-				p.d.tofpet.efine,
-				p.d.tofpet.tacIdleTime,
-				p.channelIdleTime
+				uint8_t(p.d.tofpet.tac),
+				uint16_t(p.channelID),
+				uint16_t(p.d.tofpet.tcoarse),
+				uint16_t(p.d.tofpet.ecoarse),
+				uint16_t(p.d.tofpet.tfine),
+				uint16_t(p.d.tofpet.efine),
+				uint64_t(p.d.tofpet.tacIdleTime),
+				uint64_t(p.channelIdleTime)
 			};
 			
-			fwrite(&eventOut, sizeof(eventOut), 1, outputDataFile);	     
+			memcpy(out, &eventOut, sizeof(eventOut));
+			out += sizeof(eventOut);
 		}
 		
-		else if (p.feType == RawHit::STIC) {					\
+		else if (p.feType == RawHit::STIC) {
 			DAQ::ENDOTOFPET::RawSTICv3 eventOut = {
 				0x03,
-				p.channelID,
-				p.d.stic.tcoarse,
-				p.d.stic.ecoarse,
-				p.d.stic.tfine,
-				p.d.stic.efine,
+				uint16_t(p.channelID),
+				uint16_t(p.d.stic.tcoarse),
+				uint16_t(p.d.stic.ecoarse),
+				uint8_t(p.d.stic.tfine),
+				uint8_t(p.d.stic.efine),
 				p.d.stic.tBadHit,
 				p.d.stic.eBadHit,
-				p.channelIdleTime};
+				uint64_t(p.channelIdleTime)};
 			
-			fwrite(&eventOut, sizeof(eventOut), 1, outputDataFile);	     
+			memcpy(out, &eventOut, sizeof(eventOut));
+			out += sizeof(eventOut);
 		}
 
 		stepEnd++;
 
 		lSingleRead++;
 	}
+	outputDataFile->commit(out - outStart);
 	return lSingleRead;
 }
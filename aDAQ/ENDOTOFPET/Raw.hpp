@@ -1,6 +1,7 @@
 #ifndef __DAQ__ENDOTOFPET__RAW_HPP__DEFINED__
 #define __DAQ__ENDOTOFPET__RAW_HPP__DEFINED__
 #include <Common/Task.hpp>
+#include <Common/AsyncFileWriter.hpp>
 #include <Core/EventSourceSink.hpp>
 #include <Core/RawHitWriter.hpp>
 #include <Core/Event.hpp>
@@ -65,7 +66,7 @@ namespace DAQ { namespace ENDOTOFPET {
 			virtual u_int32_t addEventBuffer(long long tMin, long long tMax, EventBuffer<RawHit> *inBuffer);
 			
 		private:
-			FILE *outputDataFile;
+			AsyncFileWriter *outputDataFile;
 			FILE *outputIndexFile;
 			float step1;
 			float step2;
@@ -102,9 +103,21 @@ namespace DAQ { namespace ENDOTOFPET {
 			virtual void run();
 				  
 		private:
+			// A run of records decoded as one job; frameID is the frame in effect at begin
+			struct Block {
+				RawReaderE *reader;
+				unsigned long long begin;
+				unsigned long long end;
+				long long frameID;
+				unsigned nHits;
+				EventBuffer<RawHit> *buffer;
+				long long tMax;
+			};
+			static void *decodeBlock(void *arg);
+
 			long long AcqStartTime;
-			long long CurrentFrameID;
-			FILE *dataFile;
+			int dataFile;
+			char *data;
 			double T;
 			unsigned long eventsBegin;
 			unsigned long eventsEnd;
@@ -1,5 +1,6 @@
 #include "sticv3Handler.hpp"
 #include <Common/SystemInformation.hpp>
+#include <SticCoarse.hpp>
 #include <stdio.h>
 
 using namespace DAQ::Core;
@@ -8,31 +9,58 @@ using namespace DAQ::Common;
 
 Sticv3Handler::Sticv3Handler() 
 {
+	nEvent=0;
 	nPassed=0;
 }
 
- bool Sticv3Handler::handleEvent(RawHit &raw, Hit &pulse)
+Sticv3Handler::~Sticv3Handler()
 {
-	// if event is good return true
-	// if event is not good (see examples below), return false
-	
-	atomicAdd(nEvent, 1);
-	if(raw.feType != RawHit::STIC) return false;
+}
 
+inline void Sticv3Handler::extract(RawHit &raw, Hit &pulse)
+{
         pulse.raw = &raw;
 	long long T = SYSTEM_PERIOD * 1E12;
         // WARNING: rounding sensitive!
         pulse.time = raw.time + (raw.d.stic.tfine * T / (4*32));
 	pulse.timeEnd = raw.timeEnd - (raw.d.stic.efine * T / (4*32));
         pulse.energy = 1E-3*(pulse.timeEnd - pulse.time);
+	pulse.badEvent = false;
 		
 	//printf("%lld %lld %f\n", pulse.time, pulse.timeEnd, pulse.energy);
+}
+
+ bool Sticv3Handler::handleEvent(RawHit &raw, Hit &pulse)
+{
+	// if event is good return true
+	// if event is not good (see examples below), return false
+	
+	atomicAdd(nEvent, 1);
+	if(raw.feType != RawHit::STIC) return false;
+
+	extract(raw, pulse);
 	   
 	atomicAdd(nPassed, 1);
 	return true; 
 
 }
 
+u_int32_t Sticv3Handler::handleBlock(EventBuffer<RawHit> *inBuffer, const unsigned *index, unsigned n, Hit *out, bool *passed)
+{
+	u_int32_t lPassed = 0;
+	for(unsigned k = 0; k < n; k++) {
+		unsigned i = index[k];
+		RawHit &raw = inBuffer->get(i);
+		passed[i] = raw.feType == RawHit::STIC;
+		if(!passed[i]) continue;
+		extract(raw, out[i]);
+		lPassed++;
+	}
+	atomicAdd(nEvent, n);
+	atomicAdd(nPassed, lPassed);
+	return lPassed;
+}
+
 
 void Sticv3Handler::printReport()
 {
@@ -46,12 +74,5 @@ void Sticv3Handler::printReport()
 
 int Sticv3Handler::compensateCoarse(unsigned coarse, unsigned long long frameID)
 {
-	int coarse_i = coarse;
-	long long clocksElapsed = (frameID % 256) *1024*4ULL;	// Periodic reset every 256 frames
-	long long wrapNumber	= clocksElapsed / 32767;
-	long long wrapRemainder	= clocksElapsed % 32767;
-	if(coarse_i < wrapRemainder) coarse_i += 32767;
-		coarse_i -= wrapRemainder;
-
-	return coarse_i;
+	return DAQd::SticCoarse::compensate(coarse, frameID);
 }
@@ -1,6 +1,7 @@
 #ifndef __DAQ_STICV3__STICV3HANDLER_HPP__DEFINED__
 #define __DAQ_STICV3__STICV3HANDLER_HPP__DEFINED__
 #include <Core/Event.hpp> 
+#include <Core/FrontEndHandler.hpp>
 #include <Common/Instrumentation.hpp>
 
 //Template for a sticv3handler class
@@ -10,7 +11,7 @@ namespace DAQ { namespace STICv3 {
 	using namespace DAQ::Common;
 	using namespace DAQ::Core;
 	
-	class Sticv3Handler{
+	class Sticv3Handler : public FrontEndHandler {
 	public:
 		Sticv3Handler(); // construct handler with whatever variables you may need
 		~Sticv3Handler();
@@ -18,11 +19,14 @@ namespace DAQ { namespace STICv3 {
 		void printReport(); //report at the end of handling events
 
 		bool handleEvent(RawHit &rawHit, Hit &Hit); 
+		virtual u_int32_t handleBlock(EventBuffer<RawHit> *inBuffer, const unsigned *index, unsigned n, Hit *out, bool *passed);
 
 		static int compensateCoarse(unsigned coarse, unsigned long long frameID);
 
 
 	private:
+		void extract(RawHit &raw, Hit &pulse);
+
 		u_int32_t nPassed;
 		u_int32_t nEvent;
 		//whatever variables you may need
@@ -10,27 +10,38 @@ using namespace DAQ::TOFPET;
 static const int nTAC = 4*2;
 
 LUT::LUT(int nChannels)
-	: nChannels(nChannels)
+	: nChannels(nChannels), channelSlot(nChannels, 0)
 {
-	tableSize = nChannels * nTAC;
-	table = new TAC[tableSize];
-	for(int i = 0; i < tableSize; i++) {
-		table[i].t0 = 0;
-		for(int j = 0; j < nEntries; j++) {
-			table[i].table[j] = 0;
-		}
+	// Slot 0
+	TAC empty;
+	empty.t0 = 0;
+	for(int j = 0; j < nEntries; j++) {
+		empty.table[j] = 0;
 	}
+	table.assign(nTAC, empty);
 }
 
 LUT::~LUT()
 {
-	delete [] table;
 }
 
+int LUT::createSlot(int channel)
+{
+	assert(channel >= 0 && channel < nChannels);
+	if(channelSlot[channel] == 0) {
+		channelSlot[channel] = table.size() / nTAC;
+		table.resize(table.size() + nTAC, table[0]);
+	}
+	return channelSlot[channel];
+}
 
+// Sets the value for every channel, so all of them become active
 void LUT::setAll(float v)
 {
-	for(int i = 0; i < tableSize; i++) {
+	for(int channel = 0; channel < nChannels; channel++)
+		createSlot(channel);
+	
+	for(unsigned i = 0; i < table.size(); i++) {
 		table[i].t0 = 0;
 		for(int j = 0; j < nEntries; j++) {
 			table[i].table[j] = v;
@@ -39,14 +50,14 @@ void LUT::setAll(float v)
 		
 }
 
-int LUT::getIndex(int channel, int tac, bool isT)
+int LUT::getIndex(int slot, int tac, bool isT)
 {
-	int index = channel;
+	int index = slot;
 	index = index*4 + tac;
 	index = index*2 + (isT ? 0 : 1);
 	
 	assert(index >= 0);
-	assert(index < tableSize);
+	assert(index < int(table.size()));
 	
 	
 	return index;
@@ -57,7 +68,7 @@ void LUT::setQ(int channel, int tac, bool isT, int adc, float Q)
 	if(adc < 0) adc = 0;
 	if(adc >= nEntries) adc = nEntries - 1;
 	
-	int index = getIndex(channel, tac, isT);
+	int index = getIndex(createSlot(channel), tac, isT);
 	TAC &te = table[index];
 	te.table[adc] = Q;
 }
@@ -67,21 +78,21 @@ float LUT::getQ(int channel, int tac, bool isT, int adc)
 	if(adc < 0) adc = 0;
 	if(adc >= nEntries) adc = nEntries - 1;
 		
-	int index = getIndex(channel, tac, isT);
+	int index = getIndex(getSlot(channel), tac, isT);
 	TAC &te = table[index];
 	return te.table[adc];
 }
 
 void LUT::setT0(int channel, int tac, bool isT, float t0)
 {
-	int index = getIndex(channel, tac, isT);
+	int index = getIndex(createSlot(channel), tac, isT);
 	TAC &te = table[index];
 	te.t0 = t0;
 }
 
 float LUT::getT0(int channel, int tac, bool isT)
 {
-	int index = getIndex(channel, tac, isT);
+	int index = getIndex(getSlot(channel), tac, isT);
 	TAC &te = table[index];
 	return te.t0;
 }
@@ -119,7 +130,10 @@ bool LUT::isNormal(int channel, int tac, bool isT, int adc, int coarse)
 void LUT::storeFile(int start, int end, const char *fName)
 {
 	FILE *f = fopen(fName, "w");
-	fwrite(table+start*nTAC, sizeof(TAC), (end-start)*nTAC, f);
+	for(int channel = start; channel < end; channel++) {
+		int slot = getSlot(channel);
+		fwrite(&table[getIndex(slot, 0, true)], sizeof(TAC), nTAC, f);
+	}
 	fclose(f);
 	
 }
@@ -127,14 +141,17 @@ void LUT::storeFile(int start, int end, const char *fName)
 void LUT::loadFile(int start, int end, const char *fName)
 {
 	FILE *f = fopen(fName, "r");
-	fread(table+start*nTAC, sizeof(TAC), (end-start)*nTAC, f);
+	for(int channel = start; channel < end; channel++) {
+		int slot = createSlot(channel);
+		fread(&table[getIndex(slot, 0, true)], sizeof(TAC), nTAC, f);
+	}
 	fclose(f);
 	
 }
 
 void LUT::loadFiles(const char *mapFileName)
 {
-	int N = tableSize / (64*nTAC);
+	int N = nChannels / 64;
 	FILE * mapFile = fopen(mapFileName, "r");
 	char lutFileName[1024];
 	for(int n = 0; n < N; n++) {
@@ -1,8 +1,12 @@
 #ifndef __DAQ__TDC__LUT_HPP__DEFINED__
 #define __DAQ__TDC__LUT_HPP__DEFINED__
 
+#include <vector>
+
 namespace DAQ { namespace TOFPET {
 	
+	// Tables are only allocated for channels which are set or loaded, 
+	// other channels read as zero
 	class LUT {
 	public:
 		LUT(int nChannels);
@@ -21,7 +25,14 @@ namespace DAQ { namespace TOFPET {
 		void setAll(float v);
 	private:
 		int  nChannels;
-		int getIndex(int channel, int tac, bool isT);
+		int getIndex(int slot, int tac, bool isT);
+		
+		// Slot 0 is never written and stands for all inactive channels
+		std::vector<int> channelSlot;
+		int getSlot(int channel) { 
+			return (channel >= 0 && channel < nChannels) ? channelSlot[channel] : 0;
+		};
+		int createSlot(int channel);
 		
 		static const int nEntries = 1024;
 		struct TAC {			
@@ -29,8 +40,7 @@ namespace DAQ { namespace TOFPET {
 			float table[1024];
 		};
 		
-		int tableSize;
-		TAC *table;
+		std::vector<TAC> table;
 		
 	};
 }}
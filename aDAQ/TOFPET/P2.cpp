@@ -8,6 +8,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <algorithm>
 #include <boost/regex.hpp>
 
 using namespace std;
@@ -16,72 +24,157 @@ using namespace DAQ::TOFPET;
 
 // Number of TACs per channel
 static const int nTAC = 4*2;
+// TQ entries per channel, T and E for 6 ToT bins
+static const int nTQ = 2*6;
+// ToT entries per channel
+static const int nToT = 1024;
 
-P2::P2(int nChannels)
-	: nChannels(nChannels)
+static const size_t pageSize = 4096;
+static size_t pageAlign(size_t size)
 {
-	tableSize = nChannels * nTAC;
-	TQtableSize = nChannels * 2 * 6; 
-	totTableSize = nChannels * 1024; 
+	return (size + pageSize - 1) & ~(pageSize - 1);
+}
 
+// First page of the table block, the channel to slot map and the tables follow on their own pages
+struct CacheHeader {
+	char magic[8];
+	uint64_t key;
+	uint32_t nChannels;
+	uint32_t nSlots;
+	uint32_t slotCapacity;
+	uint64_t blockSize;
+	uint32_t do_TQcorr;
+	uint32_t useEnergyCal;
+};
+static const char cacheMagic[8] = { 'D', 'A', 'Q', 'P', '2', 'C', '0', '2' };
 
+P2::P2(int nChannels)
+	: nChannels(nChannels)
+{
 	do_TQcorr = false;
 	useEnergyCal= false;
+	defaultQ = 0;
 
-	table = new TAC[tableSize];
-	TQtable = new TQ[TQtableSize];
-	ToTtable = new ToTcal[totTableSize];
-	timeOffset = new float[nChannels];
+	nSlots = 1;
+	slotCapacity = 64;
+	blockSize = getBlockSize(nChannels, slotCapacity);
+	block = allocateBlock(blockSize);
+	setupTables();
+	
+	stateKey = 0xcbf29ce484222325ULL ^ nChannels;
+}
 
-	nBins_tqT= new float[nChannels];
-	nBins_tqE= new float[nChannels];
-	for(int i = 0; i < nChannels; i++){
-		nBins_tqT[i]=0;
-		nBins_tqE[i]=0;	
-	}
+P2::~P2()
+{
+	munmap(block, blockSize);
+}
 
-	
-	for(int i = 0; i < tableSize; i++) {
-		table[i].t0 = 0;
-		table[i].shape.tB = 0;
-		table[i].shape.m = 0;
-		table[i].shape.p2 = 0;
-		table[i].leakage.tQ = 0;
-		table[i].leakage.a0 = 0;
-		table[i].leakage.a1 = 0;
-		table[i].leakage.a2 = 0;
+size_t P2::getBlockSize(int nChannels, int slotCapacity)
+{
+	return pageSize
+		+ pageAlign(sizeof(int32_t) * nChannels)
+		+ pageAlign(sizeof(TAC) * nTAC * slotCapacity)
+		+ pageAlign(sizeof(TQ) * nTQ * slotCapacity)
+		+ pageAlign(sizeof(ToTcal) * nToT * slotCapacity)
+		+ 3 * pageAlign(sizeof(float) * slotCapacity);
+}
+
+// Anonymous memory is zero filled, which is the uncalibrated state for all tables
+// and maps all channels to slot 0
+char *P2::allocateBlock(size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(p == MAP_FAILED) {
+		int e = errno;
+		fprintf(stderr, "Could not allocate %lu MiB for calibration tables : %d %s\n", 
+			(unsigned long)(size / (1024*1024)), e, strerror(e));
+		exit(1);
 	}
+	return (char *)p;
+}
 
+void P2::setupTables()
+{
+	char *p = block + pageSize;
+	channelSlot = (int32_t *)p;
+	p += pageAlign(sizeof(int32_t) * nChannels);
+	table = (TAC *)p;
+	p += pageAlign(sizeof(TAC) * nTAC * slotCapacity);
+	TQtable = (TQ *)p;
+	p += pageAlign(sizeof(TQ) * nTQ * slotCapacity);
+	ToTtable = (ToTcal *)p;
+	p += pageAlign(sizeof(ToTcal) * nToT * slotCapacity);
+	timeOffset = (float *)p;
+	p += pageAlign(sizeof(float) * slotCapacity);
+	nBins_tqT = (float *)p;
+	p += pageAlign(sizeof(float) * slotCapacity);
+	nBins_tqE = (float *)p;
+}
 
-	defaultQ = 0;
-	for(int i = 0; i < TQtableSize; i++) {
-		TQtable[i].nbins=0;
-		TQtable[i].channel=0;
-		TQtable[i].isT=true;
-		for(int j = 0; j < 320; j++) {
-			TQtable[i].tcorr[j] = 0;
-		}
-	}
+// Grows the tables to hold at least n slots
+void P2::reserveSlots(int n)
+{
+	if(n <= slotCapacity) return;
 	
-	for(int i = 0; i < nChannels; i++) {
-	 	for(int j = 0; j < 1024; j++) {
-			ToTtable[i*1024+j].channel=0;
-	 		ToTtable[i*1024+j].tot=0;
-	 		ToTtable[i*1024+j].energy=0;
-	 	}
-	}
+	int newCapacity = slotCapacity;
+	while(newCapacity < n) newCapacity *= 2;
+	
+	size_t newSize = getBlockSize(nChannels, newCapacity);
+	char *newBlock = allocateBlock(newSize);
 	
-	for(int i = 0; i < nChannels; i++) timeOffset[i]=0;
+	char *oldBlock = block;
+	size_t oldSize = blockSize;
+	TAC *oldTable = table;
+	TQ *oldTQtable = TQtable;
+	ToTcal *oldToTtable = ToTtable;
+	float *oldTimeOffset = timeOffset;
+	float *oldNBinsT = nBins_tqT;
+	float *oldNBinsE = nBins_tqE;
+	
+	block = newBlock;
+	blockSize = newSize;
+	slotCapacity = newCapacity;
+	setupTables();
+	
+	memcpy(channelSlot, oldBlock + pageSize, sizeof(int32_t) * nChannels);
+	memcpy(table, oldTable, sizeof(TAC) * nTAC * nSlots);
+	memcpy(TQtable, oldTQtable, sizeof(TQ) * nTQ * nSlots);
+	memcpy(ToTtable, oldToTtable, sizeof(ToTcal) * nToT * nSlots);
+	memcpy(timeOffset, oldTimeOffset, sizeof(float) * nSlots);
+	memcpy(nBins_tqT, oldNBinsT, sizeof(float) * nSlots);
+	memcpy(nBins_tqE, oldNBinsE, sizeof(float) * nSlots);
+	
+	munmap(oldBlock, oldSize);
 }
 
-P2::~P2()
+int P2::createSlot(int channel)
 {
-	delete [] table;
-	delete [] TQtable;
-	delete [] ToTtable;
-	delete [] timeOffset;
+	if(channel < 0 || channel >= nChannels) {
+		printf("P2:: channel %d is out of range\n", channel);
+		return 0;
+	}
+	if(channelSlot[channel] == 0) {
+		reserveSlots(nSlots + 1);
+		channelSlot[channel] = nSlots;
+		nSlots += 1;
+	}
+	return channelSlot[channel];
 }
 
+void P2::activateChannels(int start, int end)
+{
+	start = start > 0 ? start : 0;
+	end = end < nChannels ? end : nChannels;
+	
+	// Grow once for the whole range
+	int n = 0;
+	for(int channel = start; channel < end; channel++)
+		if(channelSlot[channel] == 0) n++;
+	reserveSlots(nSlots + n);
+	
+	for(int channel = start; channel < end; channel++)
+		createSlot(channel);
+}
 
 void P2::setAll(float v)
 {
@@ -89,55 +182,42 @@ void P2::setAll(float v)
 		
 }
 
-int P2::getIndex(int channel, int tac, bool isT)
+int P2::getIndex(int slot, int tac, bool isT)
 {
-	int index = channel;
+	int index = slot;
 	index = index*4 + tac;
 	index = index*2 + (isT ? 0 : 1);
 	
 	if (index <0)index=0;
-	if (index >= tableSize){
-		printf("index=%d, channel=%d, tac=%d\n", index, channel, tac);
-		index=tableSize-1;
+	if (index >= nSlots * nTAC){
+		printf("index=%d, slot=%d, tac=%d\n", index, slot, tac);
+		index=0;
 	}
-	assert(index >= 0);
-	assert(index < tableSize);
-	
-	
 	return index;
 }
 
-int P2::getIndexTQ(int channel, bool isT, int totbin)
+int P2::getIndexTQ(int slot, bool isT, int totbin)
 {
-	int index = channel*12 + 6*(isT ? 0 : 1) + totbin;
-	if(index>=TQtableSize)index=TQtableSize-1;
-	if(index<0)index=0;
-	//assert(index >= 0);
-	//assert(index < TQtableSize);
-	
-	
-	return index;
+	if(totbin < 0) totbin = 0;
+	if(totbin > 5) totbin = 5;
+	return slot*nTQ + 6*(isT ? 0 : 1) + totbin;
 }
 
-long P2::getIndexTOT(int channel, float tot)
+long P2::getIndexTOT(int slot, float tot)
 {
-	if(tot<0) return long(channel*1024); 
-	long index = channel*1024 + int(tot/0.5);
-	
-	if(index>=totTableSize)index=totTableSize-1;
-	if(index<0)index=0;
-	
-	//	assert(index >= 0);
-	//assert(index < totTableSize);
-	
-	return index;
+	if(tot<0) return long(slot*nToT); 
+	long bin = long(tot/0.5);
+	if(bin >= nToT) bin = nToT - 1;
+	return slot*nToT + bin;
 }
 
 
 void P2::setShapeParameters(int channel, int tac, bool isT, float tB, float m, float p2)
 {
-	int index = getIndex(channel, tac, isT);
-	TAC &te = table[index];
+	stateKey = 0;
+	int slot = createSlot(channel);
+	if(slot == 0) return;
+	TAC &te = table[getIndex(slot, tac, isT)];
 	te.shape.tB = tB;
 	te.shape.m = m;
 	te.shape.p2 = p2;
@@ -145,8 +225,10 @@ void P2::setShapeParameters(int channel, int tac, bool isT, float tB, float m, f
 
 void P2::setLeakageParameters(int channel, int tac, bool isT, float tQ, float a0, float a1, float a2)
 {
-	int index = getIndex(channel, tac, isT);
-	TAC &te = table[index];
+	stateKey = 0;
+	int slot = createSlot(channel);
+	if(slot == 0) return;
+	TAC &te = table[getIndex(slot, tac, isT)];
 	te.leakage.tQ = tQ;
 	te.leakage.a0 = a0;
 	te.leakage.a1 = a1;
@@ -158,7 +240,7 @@ void P2::setLeakageParameters(int channel, int tac, bool isT, float tQ, float a0
 float P2::getQtac(int channel, int tac, bool isT, int adc, long long tacIdleTime)
 {
   
-	int index = getIndex(channel, tac, isT);
+	int index = getIndex(getSlot(channel), tac, isT);
 	TAC &te = table[index];
 
 	// Uncalibrated channel, return half way value
@@ -185,7 +267,7 @@ float P2::getQmodulationCorrected(float tQ, int channel, bool isT, float coarseT
 
 	if (coarseToT < 0) totbin = 0;
 	if (coarseToT > 300)totbin = 5;
-	int TQindex = getIndexTQ(channel, isT, totbin);
+	int TQindex = getIndexTQ(getSlot(channel), isT, totbin);
 	TQ &TQe = TQtable[TQindex];
 	
 	float start = isT ? 1.0 : 1.0;
@@ -228,14 +310,16 @@ float P2::getQ(int channel, int tac, bool isT, int adc, long long tacIdleTime, f
 }
 void P2::setT0(int channel, int tac, bool isT, float t0)
 {
-	int index = getIndex(channel, tac, isT);
-	TAC &te = table[index];
+	stateKey = 0;
+	int slot = createSlot(channel);
+	if(slot == 0) return;
+	TAC &te = table[getIndex(slot, tac, isT)];
 	te.t0 = t0;
 }
 
 float P2::getT0(int channel, int tac, bool isT)
 {
-	int index = getIndex(channel, tac, isT);
+	int index = getIndex(getSlot(channel), tac, isT);
 	TAC &te = table[index];
 	return te.t0;
 }
@@ -243,7 +327,7 @@ float P2::getT0(int channel, int tac, bool isT)
 
 float P2::getT(int channel, int tac, bool isT, int adc, int coarse, long long tacIdleTime, float coarseToT)
 {
-	int index = getIndex(channel, tac, isT);
+	int index = getIndex(getSlot(channel), tac, isT);
 	TAC &te = table[index];
 
 	float q = getQ(channel, tac, isT, adc, tacIdleTime, coarseToT);	
@@ -254,28 +338,28 @@ float P2::getT(int channel, int tac, bool isT, int adc, int coarse, long long ta
 		  (3.0 - q);	
 	if(te.shape.m == 0)f = (coarse % 2 == 0) ? 1.5 : 2.5;
 	float t = coarse + f;
-	return t + getT0(channel, tac, isT);
+	return t + te.t0;
 }
 
 float P2::getEnergy(int channel, float tot)
 {
-	float energy;
-	long index = getIndexTOT(channel, tot);
+	if(!useEnergyCal) return tot;
+	
+	int slot = getSlot(channel);
+	long index = getIndexTOT(slot, tot);
 	ToTcal &ToTe = ToTtable[index];
-	ToTcal &ToTe1 = ToTtable[index+1];
-	if(useEnergyCal){
-		if(ToTe1.channel==channel) energy= ToTe.energy+(ToTe1.energy-ToTe.energy)/0.5*(tot-ToTe.tot);
-		else energy= ToTe.energy;
-		//		if(energy>1000)printf("ToTe.energy=%f tot=%f energy=%f\n",ToTe.energy, tot, energy );
+	// Interpolate with the next entry, if this channel has it
+	if(index+1 < long(slot+1)*nToT && ToTtable[index+1].channel==channel) {
+		ToTcal &ToTe1 = ToTtable[index+1];
+		return ToTe.energy+(ToTe1.energy-ToTe.energy)/0.5*(tot-ToTe.tot);
 	}
-	else energy=tot;
-
-	return energy;
+	else 
+		return ToTe.energy;
 }
 
 bool P2::isNormal(int channel, int tac, bool isT, int adc, int coarse, long long tacIdleTime, float coarseToT)
 {
-	int index = getIndex(channel, tac, isT);
+	int index = getIndex(getSlot(channel), tac, isT);
 	TAC &te = table[index];
 	float q = getQ(channel, tac, isT, adc, tacIdleTime, coarseToT);
 	if((q >= 1.00 && q <= 3.00) || te.shape.m == 0) return true;
@@ -288,7 +372,7 @@ void P2::storeFile(int start, int end, const char *fName)
 	for(int channel = start; channel < end; channel++)
 		for(int isT = 0; isT < 2; isT++)
 			for(int tac = 0; tac < 4; tac++) {
-				int index = getIndex(channel, tac, isT == 0);
+				int index = getIndex(getSlot(channel), tac, isT == 0);
 				TAC &te = table[index];
 				if(te.shape.m==0) continue;
 				else if(f==NULL) {
@@ -332,6 +416,7 @@ static void normalizeLine(char *line) {
 
 void P2::loadTDCFile(int start, int end, const char *fName)
 {
+	stateKey = 0;
 	FILE *f = fopen(fName, "r");
 	if(f == NULL) {
 		int e = errno;
@@ -349,8 +434,10 @@ void P2::loadTDCFile(int start, int end, const char *fName)
 				 &te.leakage.tQ, &te.leakage.a0, &te.leakage.a1, &te.leakage.a2
 				 ) == 11)
 		{
-			tOrE == 'T' ? nBins_tqT[start+channel]+=te.shape.m/2.0 :  nBins_tqE[start+channel]+=te.shape.m/2.0;
-			int index = getIndex(start+channel, tac, tOrE == 'T');
+			int slot = createSlot(start+channel);
+			if(slot == 0) continue;
+			tOrE == 'T' ? nBins_tqT[slot]+=te.shape.m/2.0 :  nBins_tqE[slot]+=te.shape.m/2.0;
+			int index = getIndex(slot, tac, tOrE == 'T');
 			table[index] = te;
 		}
 	
@@ -360,6 +447,7 @@ void P2::loadTDCFile(int start, int end, const char *fName)
 }
 void P2::loadTQFile(int start, int end, const char *fName)
 {
+	stateKey = 0;
 	FILE *f = fopen(fName, "r");
 	if(f == NULL) {
 		int e = errno;
@@ -373,10 +461,13 @@ void P2::loadTQFile(int start, int end, const char *fName)
 	int channel;
 	while(line_elems > 2){
 		line_elems=fscanf(f, "%5d\t%s\t%d\t%d\t%*f\t%f",&col1, col2, &col3, &col4, &col6);
+	  if(line_elems != 5) break;
 	  isT = (col2[0] == 'T') ? true : false;
 	  channel= col1;   ///col1+start;
 	  // printf("channel=%d %d %d\n", channel, start, col1);
-	  int TQindex = getIndexTQ(channel, isT, col3);
+	  int slot = createSlot(channel);
+	  if(slot == 0 || col4 < 0 || col4 >= 320) continue;
+	  int TQindex = getIndexTQ(slot, isT, col3);
 	  TQ &TQe = TQtable[TQindex];
 
 	  TQe.channel=col1;
@@ -394,6 +485,7 @@ void P2::loadTQFile(int start, int end, const char *fName)
 
 void P2::loadTOTFile(int start, int end, const char *fName)
 {
+	stateKey = 0;
 	FILE *f = fopen(fName, "r");
 	if(f == NULL) {
 		int e = errno;
@@ -404,7 +496,9 @@ void P2::loadTOTFile(int start, int end, const char *fName)
 	float col2;
 	float col3;
 	while(fscanf(f, "%d\t%f\t%f\n",&col1, &col2, &col3) == 3 ){
-		long totIndex=getIndexTOT(col1,col2);
+		int slot = createSlot(col1);
+		if(slot == 0) continue;
+		long totIndex=getIndexTOT(slot,col2);
 		ToTcal &totCale = ToTtable[totIndex];
 		totCale.channel=col1;
 		totCale.tot=col2;
@@ -416,6 +510,7 @@ void P2::loadTOTFile(int start, int end, const char *fName)
 
 void P2::loadOffsetFile(int start, int end, const char *fName)
 {
+	stateKey = 0;
 	FILE *f = fopen(fName, "r");
 	if(f == NULL) {
 		int e = errno;
@@ -425,7 +520,9 @@ void P2::loadOffsetFile(int start, int end, const char *fName)
 	int col1;
 	float col2;
 	while(fscanf(f, "%d\t%f\n",&col1, &col2) == 2){
-		timeOffset[start+col1]=col2;
+		int slot = createSlot(start+col1);
+		if(slot == 0) continue;
+		timeOffset[slot]=col2;
 	}
 	fclose(f);
 	
@@ -442,7 +539,17 @@ static void copySubMatch(char *dst, const char *start, const char *end)
 	*dst = '\0';
 }
 
-void P2::loadFiles(const char *mapFileName, bool loadTQ, bool multistep, float step1, float step2)
+static void resolvePath(std::string &path, const char *fileName, const char *baseName)
+{
+	if(strcmp(fileName, "none") == 0) 
+		path = "";
+	else if(fileName[0] != '/') 
+		path = std::string(baseName) + "/" + fileName;
+	else
+		path = fileName;
+}
+
+void P2::readSetupFile(const char *mapFileName, bool multistep, float step1, float step2, std::vector<SetupEntry> &entries)
 {
 	FILE * mapFile = fopen(mapFileName, "r");
 	if(mapFile == NULL) {
@@ -458,16 +565,9 @@ void P2::loadFiles(const char *mapFileName, bool loadTQ, bool multistep, float s
 	strncpy(baseName, dirname((char *)fileNameCopy), 1024);
 
 	char lutFileName[1024];
-	char lutFilePath[1024];
-	
 	char tqFileName[1024];
-	char tqFilePath[1024];
-
 	char totFileName[1024];
-	char totFilePath[1024];
-
 	char offsetFileName[1024];
-	char offsetFilePath[1024];
 
 	char suffix[1024];
 	int start, end;
@@ -520,68 +620,288 @@ void P2::loadFiles(const char *mapFileName, bool loadTQ, bool multistep, float s
 			strcpy(offsetFileName, "none");
 		
 	
-		if(strcmp(tqFileName, "none")!=0){
-			if(multistep==true){
-				sprintf(suffix,".stp1_%f_stp2_%f",step1, step2);
-				strcat(tqFileName,suffix); 
-			}
-				
-			if(tqFileName[0] != '/') {
-				sprintf(tqFilePath, "%s/%s", baseName, tqFileName );
-			}
-			else {
-				sprintf(tqFilePath, "%s", tqFileName);
-			}
+		if(strcmp(tqFileName, "none")!=0 && multistep==true){
+			sprintf(suffix,".stp1_%f_stp2_%f",step1, step2);
+			strcat(tqFileName,suffix); 
 		}
 
-		if(strcmp(totFileName, "none")!=0){
-			if(totFileName[0] != '/') {
-				sprintf(totFilePath, "%s/%s", baseName, totFileName );
-			}
-			else {
-				sprintf(totFilePath, "%s", totFileName);
-			}
-		}
-		if(strcmp(offsetFileName, "none")!=0){			
-			if(offsetFileName[0] != '/') {
-				sprintf(offsetFilePath, "%s/%s", baseName, offsetFileName );
-			}
-			else {
-				sprintf(offsetFilePath, "%s", offsetFileName);
-			}
-		}
-		
+		SetupEntry entry;
+		entry.start = start;
+		entry.end = end;
+		resolvePath(entry.tdcFile, lutFileName, baseName);
+		resolvePath(entry.tqFile, tqFileName, baseName);
+		resolvePath(entry.totFile, totFileName, baseName);
+		resolvePath(entry.offsetFile, offsetFileName, baseName);
+		entries.push_back(entry);
+	}
 
-		if(lutFileName[0] != '/') {
-			sprintf(lutFilePath, "%s/%s", baseName, lutFileName );
-		}
-		else {
-			sprintf(lutFilePath, "%s", lutFileName);
+	fclose(mapFile);
+}
+
+// FNV-1a
+static uint64_t hashBytes(uint64_t h, const void *data, size_t size)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for(size_t i = 0; i < size; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+// Files are identified by name, size and modification time, so they are not read to build the key
+static uint64_t hashFile(uint64_t h, const std::string &fileName)
+{
+	h = hashBytes(h, fileName.c_str(), fileName.size() + 1);
+	struct stat st;
+	if(stat(fileName.c_str(), &st) != 0) {
+		memset(&st, 0, sizeof(st));
+	}
+	uint64_t id[5] = { 
+		(uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size, 
+		(uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec 
+	};
+	return hashBytes(h, id, sizeof(id));
+}
+
+void P2::loadFiles(const char *mapFileName, bool loadTQ, bool multistep, float step1, float step2)
+{
+	std::vector<SetupEntry> entries;
+	readSetupFile(mapFileName, multistep, step1, step2, entries);
+	
+	// The cache key covers the current tables and everything which is going to be loaded
+	uint64_t key = 0;
+	if(stateKey != 0) {
+		key = hashBytes(stateKey, &loadTQ, sizeof(loadTQ));
+		for(unsigned n = 0; n < entries.size(); n++) {
+			SetupEntry &entry = entries[n];
+			key = hashBytes(key, &entry.start, sizeof(entry.start));
+			key = hashBytes(key, &entry.end, sizeof(entry.end));
+			key = hashFile(key, entry.tdcFile);
+			if(loadTQ) key = hashFile(key, entry.tqFile);
+			key = hashFile(key, entry.totFile);
+			key = hashFile(key, entry.offsetFile);
 		}
+		key = key != 0 ? key : 1;
+	}
+	
+	if(key != 0 && loadCache(key)) {
+		stateKey = key;
+		return;
+	}
+	
+	// The setup file maps which channels are in use
+	for(unsigned n = 0; n < entries.size(); n++) {
+		activateChannels(entries[n].start, entries[n].end);
+	}
+	
+	for(unsigned n = 0; n < entries.size(); n++) {
+		SetupEntry &entry = entries[n];
+		int start = entry.start;
+		int end = entry.end;
 		
-		if(strcmp(lutFileName, "none")!=0){
+		if(entry.tdcFile != ""){
 			printf("P2:: loading TDC calibrations...\n");
-			printf("P2:: loading '%s' into [%d..%d[\n", lutFilePath, start, end);
-			loadTDCFile(start, end, lutFilePath);
+			printf("P2:: loading '%s' into [%d..%d[\n", entry.tdcFile.c_str(), start, end);
+			loadTDCFile(start, end, entry.tdcFile.c_str());
 		}
-		if(strcmp(tqFileName, "none")!=0 and loadTQ==true){
+		if(entry.tqFile != "" and loadTQ==true){
 			printf("P2:: loading TQ calibrations...\n");
-			printf("P2:: loading '%s' into [%d..%d[\n", tqFilePath, start, end);
-			loadTQFile(start, end, tqFilePath);
+			printf("P2:: loading '%s' into [%d..%d[\n", entry.tqFile.c_str(), start, end);
+			loadTQFile(start, end, entry.tqFile.c_str());
 			do_TQcorr = true;
 		}
-		if(strcmp(totFileName, "none")!=0){
+		if(entry.totFile != ""){
 			printf("P2:: loading Energy calibrations...\n");
-			printf("P2:: loading '%s' into [%d..%d[\n", totFilePath, start, end);
-			loadTOTFile(start, end, totFilePath);
+			printf("P2:: loading '%s' into [%d..%d[\n", entry.totFile.c_str(), start, end);
+			loadTOTFile(start, end, entry.totFile.c_str());
 			useEnergyCal=true;
 		}
-		if(strcmp(offsetFileName, "none")!=0){
+		if(entry.offsetFile != ""){
 			printf("P2:: loading timeOffset calibrations...\n");
-			printf("P2:: loading '%s' into [%d..%d[\n",  offsetFilePath, start, end);
-			loadOffsetFile(start, end, offsetFilePath);
+			printf("P2:: loading '%s' into [%d..%d[\n",  entry.offsetFile.c_str(), start, end);
+			loadOffsetFile(start, end, entry.offsetFile.c_str());
 		}	       
 	}
+	
+	if(key != 0) {
+		storeCache(key);
+		stateKey = key;
+	}
+}
 
-	fclose(mapFile);
+// Cache files go into $DAQ_P2_CACHE (caching is disabled if it's set to "none")
+// or into a per user directory in /tmp.
+// Only the most recently used maxCacheFiles files are kept, older ones are removed by storeCache();
+// the whole directory may also be removed at any time.
+static const unsigned maxCacheFiles = 32;
+
+static bool getCacheDirName(char *dirName)
+{
+	const char *env = getenv("DAQ_P2_CACHE");
+	if(env != NULL) {
+		if(strlen(env) == 0 || strcmp(env, "none") == 0) return false;
+		strncpy(dirName, env, 1024);
+		dirName[1023] = 0;
+		return true;
+	}
+	
+	// The name is predictable, so it must not be used unless it's a private directory of ours
+	sprintf(dirName, "/tmp/daq-p2cache-%u", (unsigned)getuid());
+	if(mkdir(dirName, 0700) != 0 && errno != EEXIST) return false;
+	struct stat st;
+	if(lstat(dirName, &st) != 0 || !S_ISDIR(st.st_mode) || 
+	   st.st_uid != getuid() || (st.st_mode & 0777) != 0700) {
+		static bool warned = false;
+		if(!warned) fprintf(stderr, "WARNING: '%s' is not a private directory, calibration cache disabled\n", dirName);
+		warned = true;
+		return false;
+	}
+	return true;
+}
+
+static bool getCacheFileName(uint64_t key, char *fName)
+{
+	char dirName[1024];
+	if(!getCacheDirName(dirName)) return false;
+	sprintf(fName, "%s/p2_%016llx.cache", dirName, (unsigned long long)key);
+	return true;
+}
+
+// Removes the least recently used cache files beyond maxCacheFiles
+static void pruneCache()
+{
+	char dirName[1024];
+	if(!getCacheDirName(dirName)) return;
+	DIR *dir = opendir(dirName);
+	if(dir == NULL) return;
+	
+	std::vector<std::pair<time_t, std::string> > files;
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL) {
+		size_t l = strlen(entry->d_name);
+		if(strncmp(entry->d_name, "p2_", 3) != 0 || l < 6 || strcmp(entry->d_name + l - 6, ".cache") != 0)
+			continue;
+		std::string fName = std::string(dirName) + "/" + entry->d_name;
+		struct stat st;
+		if(lstat(fName.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid())
+			continue;
+		files.push_back(std::make_pair(st.st_mtime, fName));
+	}
+	closedir(dir);
+	
+	if(files.size() <= maxCacheFiles) return;
+	std::sort(files.begin(), files.end());
+	for(unsigned n = 0; n < files.size() - maxCacheFiles; n++)
+		unlink(files[n].second.c_str());
+}
+
+bool P2::loadCache(uint64_t key)
+{
+	char fName[1200];
+	if(!getCacheFileName(key, fName)) return false;
+	
+	int fd = open(fName, O_RDONLY);
+	if(fd == -1) return false;
+	
+	// Only trust our own files
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid() || 
+	   (size_t)st.st_size < pageSize) {
+		close(fd);
+		return false;
+	}
+	size_t size = st.st_size;
+	
+	// Private mapping, so the tables can still be changed without touching the cache
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) return false;
+	
+	CacheHeader *header = (CacheHeader *)p;
+	if(memcmp(header->magic, cacheMagic, sizeof(cacheMagic)) != 0 || header->key != key || 
+	   header->nChannels != (uint32_t)nChannels || header->blockSize != size ||
+	   header->nSlots < 1 || header->nSlots > header->slotCapacity ||
+	   getBlockSize(nChannels, header->slotCapacity) != size) {
+		munmap(p, size);
+		return false;
+	}
+	
+	// Mark it as recently used, so it's not pruned
+	utimes(fName, NULL);
+	
+	munmap(block, blockSize);
+	block = (char *)p;
+	blockSize = size;
+	nSlots = header->nSlots;
+	slotCapacity = header->slotCapacity;
+	setupTables();
+	do_TQcorr = header->do_TQcorr != 0;
+	useEnergyCal = header->useEnergyCal != 0;
+	printf("P2:: loaded calibrations from '%s'\n", fName);
+	return true;
+}
+
+static bool isZeroPage(const char *p)
+{
+	const uint64_t *q = (const uint64_t *)p;
+	for(size_t i = 0; i < pageSize/sizeof(uint64_t); i++)
+		if(q[i] != 0) return false;
+	return true;
+}
+
+void P2::storeCache(uint64_t key)
+{
+	char fName[1200];
+	if(!getCacheFileName(key, fName)) return;
+	
+	CacheHeader *header = (CacheHeader *)block;
+	memset(header, 0, sizeof(CacheHeader));
+	memcpy(header->magic, cacheMagic, sizeof(cacheMagic));
+	header->key = key;
+	header->nChannels = nChannels;
+	header->nSlots = nSlots;
+	header->slotCapacity = slotCapacity;
+	header->blockSize = blockSize;
+	header->do_TQcorr = do_TQcorr ? 1 : 0;
+	header->useEnergyCal = useEnergyCal ? 1 : 0;
+	
+	// Write into a temporary file and rename it, so other processes never see a partial cache
+	char tmpName[1300];
+	sprintf(tmpName, "%s.%d.tmp", fName, (int)getpid());
+	int fd = open(tmpName, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if(fd == -1) {
+		int e = errno;
+		fprintf(stderr, "WARNING: Could not write calibration cache '%s' : %d %s\n", tmpName, e, strerror(e));
+		return;
+	}
+	
+	// Tables are mostly empty, zero pages are left as holes in the file
+	bool ok = true;
+	for(size_t offset = 0; ok && offset < blockSize; offset += pageSize) {
+		if(isZeroPage(block + offset)) continue;
+		ok = pwrite(fd, block + offset, pageSize, offset) == (ssize_t)pageSize;
+	}
+	ok = ok && ftruncate(fd, blockSize) == 0;
+	ok = (close(fd) == 0) && ok;
+	ok = ok && rename(tmpName, fName) == 0;
+	if(!ok) {
+		int e = errno;
+		fprintf(stderr, "WARNING: Could not write calibration cache '%s' : %d %s\n", fName, e, strerror(e));
+		unlink(tmpName);
+	}
+	else {
+		pruneCache();
+	}
+}
+
+bool P2::isStepDependent(const char *mapFileName)
+{
+	// Only the TQ files get a step suffix
+	std::vector<SetupEntry> entries;
+	readSetupFile(mapFileName, false, 0, 0, entries);
+	for(unsigned n = 0; n < entries.size(); n++) {
+		if(entries[n].tqFile != "") return true;
+	}
+	return false;
 }
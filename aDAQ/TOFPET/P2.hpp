@@ -1,13 +1,25 @@
 #ifndef __DAQ__TDC__P2_HPP__DEFINED__
 #define __DAQ__TDC__P2_HPP__DEFINED__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+
 namespace DAQ { namespace TOFPET {
 	
+	// Calibration tables for channel IDs 0 to nChannels-1.
+	// Tables are only allocated for active channels, which are compacted through a channel to slot map.
+	// Channels become active when a setup file maps them or when their parameters are set,
+	// inactive channels read as uncalibrated.
 	class P2 {
 	public:
 		P2(int nChannels);
 		~P2();
 		
+		void activateChannels(int start, int end);
+		int getNActiveChannels() { return nSlots - 1; };
+		
 		void setT0(int channel, int tac, bool isT, float t0);
 		float getT0(int channel, int tac, bool isT);
 		void setShapeParameters(int channel, int tac, bool isT, float tB, float m, float p2);
@@ -19,24 +31,62 @@ namespace DAQ { namespace TOFPET {
 		bool isNormal(int channel, int tac, bool isT, int adc, int coarse, long long tacIdleTime, float coarseToT);
 		float getT(int channel, int tac, bool isT, int adc, int coarse, long long tacIdleTime, float coarseToT);
 		float getEnergy(int channel, float tot);
+		float getTimeOffset(int channel) { return timeOffset[getSlot(channel)]; };
+		// Number of tQ bins, as used by the TQ calibration
+		float getNBinsTQ(int channel, bool isT) { return isT ? nBins_tqT[getSlot(channel)] : nBins_tqE[getSlot(channel)]; };
 		void loadTDCFile(int start, int end, const char *fileName);
 		void loadTQFile(int start, int end, const char *fileName);
 		void loadTOTFile(int start, int end, const char *fileName);
 		void loadOffsetFile(int start, int end, const char *fileName);
 		void storeFile(int start, int end, const char *fileName);
+		// Loads the tables listed in a setup file.
+		// The resulting tables are kept in a binary cache (see loadCache()), 
+		// so text files are only parsed again when they change.
 		void loadFiles(const char *mapFileName, bool loadTQ, bool multistep, float step1, float step2 );
+		// True if loadFiles() with multistep would load different tables for each step
+		static bool isStepDependent(const char *mapFileName);
 		
 		void setAll(float v);
 
-		float *nBins_tqT;   
-		float *nBins_tqE;  
-		
-		float *timeOffset;
 	private:
 		int  nChannels;
-		int getIndex(int channel, int tac, bool isT);
-		int getIndexTQ(int channel, bool isT, int totbin);
-		long getIndexTOT(int channel, float tot);
+		
+		// Slot 0 is never written and stands for all inactive channels
+		int nSlots;
+		int slotCapacity;
+		int32_t *channelSlot;
+		int getSlot(int channel) { 
+			return (channel >= 0 && channel < nChannels) ? channelSlot[channel] : 0; 
+		};
+		int createSlot(int channel);
+		void reserveSlots(int n);
+		
+		struct SetupEntry {
+			int start;
+			int end;
+			std::string tdcFile;
+			std::string tqFile;
+			std::string totFile;
+			std::string offsetFile;
+		};
+		static void readSetupFile(const char *mapFileName, bool multistep, float step1, float step2, std::vector<SetupEntry> &entries);
+		
+		// All tables live in a single block, which is either anonymous memory 
+		// or a private mapping of a cache file
+		char *block;
+		size_t blockSize;
+		static size_t getBlockSize(int nChannels, int slotCapacity);
+		static char *allocateBlock(size_t size);
+		void setupTables();
+		
+		// Identifies the sequence of loadFiles() calls which produced the current tables,
+		// 0 if tables have been changed in some other way
+		uint64_t stateKey;
+		bool loadCache(uint64_t key);
+		void storeCache(uint64_t key);
+		int getIndex(int slot, int tac, bool isT);
+		int getIndexTQ(int slot, bool isT, int totbin);
+		long getIndexTOT(int slot, float tot);
 		struct TAC {			
 			float t0;
 			struct {
@@ -70,14 +120,13 @@ namespace DAQ { namespace TOFPET {
 		float defaultQ;
 		bool do_TQcorr;
 		bool useEnergyCal;
-		int tableSize;
-		int TQtableSize;
-		long totTableSize;
-     
 		
 		TAC *table;
 		TQ *TQtable;
 		ToTcal *ToTtable;
+		float *timeOffset;
+		float *nBins_tqT;   
+		float *nBins_tqE;  
 	};
 }}
 #endif
@@ -18,14 +18,21 @@ P2Extract::P2Extract(DAQ::TOFPET::P2 *lut, bool killZeroToT, float tDenormalTole
 	nNotNormal = 0;
 }
 
- bool P2Extract::handleEvent(RawHit &raw, Hit &pulse)
+// Hit counts of a block, added to the totals once per block
+struct P2Extract::Counts {
+	u_int32_t nEvent;
+	u_int32_t nZeroToT;
+	u_int32_t nNotNormal;
+	u_int32_t nPassed;
+};
+
+inline bool P2Extract::extract(RawHit &raw, Hit &pulse, Counts &counts)
 {
 	// if event is true return good
-	// if event is not good, use atomicIncrement() and return false
+	// if event is not good, count it and return false
 	
 	//if(raw.time < tMin || raw.time >= tMax) return false;
-	//atomicAdd(nEvent, 1);
-	atomicAdd(nEvent, 1);
+	counts.nEvent++;
 	if(raw.feType != RawHit::TOFPET) return false;
 
 	short tCoarse = raw.d.tofpet.tcoarse;
@@ -39,7 +46,7 @@ P2Extract::P2Extract(DAQ::TOFPET::P2 *lut, bool killZeroToT, float tDenormalTole
 		
 	// WARNING: reduces data, but may discard darks as well
 	if(killZeroToT && coarseToT == 0) {
-	   	atomicAdd(nZeroToT, 1);
+		counts.nZeroToT++;
 		return false;
 	}
 		
@@ -66,7 +73,7 @@ P2Extract::P2Extract(DAQ::TOFPET::P2 *lut, bool killZeroToT, float tDenormalTole
 	
 	pulse.badEvent = false;
 	if(pulse.tofpet_TQT < (1.0 - tDenormalTolerance) || pulse.tofpet_TQT > (3.0 + tDenormalTolerance) ||  pulse.tofpet_TQE < (1.0 - eDenormalTolerance) || pulse.tofpet_TQE > (3.0 + eDenormalTolerance)) {
-		atomicAdd(nNotNormal, 1);
+		counts.nNotNormal++;
 		pulse.badEvent = true;
 		pulse.time = raw.time;
 		pulse.timeEnd = raw.timeEnd;
@@ -74,16 +81,43 @@ P2Extract::P2Extract(DAQ::TOFPET::P2 *lut, bool killZeroToT, float tDenormalTole
 	}
 	else {
 		// WARNING: rounding sensitive!
-		pulse.time = raw.time + (long long)((f_T * T) + lut->timeOffset[raw.channelID]*1e12);
-		pulse.timeEnd = raw.timeEnd + (long long)((f_E * T) + lut->timeOffset[raw.channelID]*1e12);
+		pulse.time = raw.time + (long long)((f_T * T) + lut->getTimeOffset(raw.channelID)*1e12);
+		pulse.timeEnd = raw.timeEnd + (long long)((f_E * T) + lut->getTimeOffset(raw.channelID)*1e12);
 	}
 	
 	pulse.energy = lut->getEnergy(raw.channelID, 1E-3*(pulse.timeEnd - pulse.time));
 
-	atomicAdd(nPassed, 1); 
+	counts.nPassed++;
 	return true; 
 }
 
+void P2Extract::addCounts(Counts &counts)
+{
+	atomicAdd(nEvent, counts.nEvent);
+	atomicAdd(nZeroToT, counts.nZeroToT);
+	atomicAdd(nNotNormal, counts.nNotNormal);
+	atomicAdd(nPassed, counts.nPassed);
+}
+
+bool P2Extract::handleEvent(RawHit &raw, Hit &pulse)
+{
+	Counts counts = { 0, 0, 0, 0 };
+	bool r = extract(raw, pulse, counts);
+	addCounts(counts);
+	return r;
+}
+
+u_int32_t P2Extract::handleBlock(EventBuffer<RawHit> *inBuffer, const unsigned *index, unsigned n, Hit *out, bool *passed)
+{
+	Counts counts = { 0, 0, 0, 0 };
+	for(unsigned k = 0; k < n; k++) {
+		unsigned i = index[k];
+		passed[i] = extract(inBuffer->get(i), out[i], counts);
+	}
+	addCounts(counts);
+	return counts.nPassed;
+}
+
 EventBuffer<Hit> * P2Extract::handleEvents (EventBuffer<RawHit> *inBuffer)
 {
 	long long tMin = inBuffer->getTMin();
@@ -93,16 +127,17 @@ EventBuffer<Hit> * P2Extract::handleEvents (EventBuffer<RawHit> *inBuffer)
 	outBuffer->setTMin(tMin);
 	outBuffer->setTMax(tMax);		
 	
-
+	Counts counts = { 0, 0, 0, 0 };
 	for(unsigned i = 0; i < nEvents; i++) {
                         
 		RawHit &raw = inBuffer->get(i);
 		if(raw.time < tMin || raw.time >= tMax)continue; 
 		Hit &p = outBuffer->getWriteSlot();
-		if (handleEvent(raw, p)){
+		if (extract(raw, p, counts)){
 			outBuffer->pushWriteSlot();
 		}	
 	}
+	addCounts(counts);
 	return outBuffer;
 }
 
@@ -4,6 +4,7 @@
 #include <vector>
 #include <Core/Event.hpp>
 #include <Core/OverlappedEventHandler.hpp>
+#include <Core/FrontEndHandler.hpp>
 #include <Common/Instrumentation.hpp>
 #include <TOFPET/P2.hpp>
 
@@ -12,11 +13,12 @@ namespace DAQ { namespace TOFPET {
 	using namespace DAQ::Common;
 	using namespace DAQ::Core;
 	
-	class P2Extract : public OverlappedEventHandler<RawHit, Hit> {
+	class P2Extract : public OverlappedEventHandler<RawHit, Hit>, public FrontEndHandler {
 	public:
 		P2Extract(DAQ::TOFPET::P2 *lut, bool killZeroToT, float tDenormalTolerance, float eDenormalTolerance, bool killDenormal, EventSink<Hit> *sink);
 		
 		bool handleEvent(RawHit &raw, Hit &Hit);
+		virtual u_int32_t handleBlock(EventBuffer<RawHit> *inBuffer, const unsigned *index, unsigned n, Hit *out, bool *passed);
 
 		virtual void report();
 
@@ -29,6 +31,10 @@ namespace DAQ { namespace TOFPET {
 		  
 
 	private:
+		struct Counts;
+		bool extract(RawHit &raw, Hit &pulse, Counts &counts);
+		void addCounts(Counts &counts);
+
 		DAQ::TOFPET::P2 *lut;
 		
 		bool killZeroToT;
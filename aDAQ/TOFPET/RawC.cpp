@@ -0,0 +1,418 @@
+#include "RawC.hpp"
+#include <Common/Constants.hpp>
+#include <Core/ThreadPool.hpp>
+#include <SticCoarse.hpp>
+
+#include <deque>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace DAQ::Core;
+using namespace DAQ::TOFPET;
+
+static const unsigned outBlockSize = EVENT_BLOCK_SIZE;
+
+// Blocks being decoded ahead of the one being pushed to the sink
+static const unsigned maxBlocksInFlight = 32;
+
+// Worst case size of one hit's record: a 10 byte varint for each 64 bit field,
+// 5 bytes for the channel and 3 bytes for each 16 bit field
+static const unsigned maxHitRecordSize = 10 + 1 + 5 + 4*3 + 2*10;
+
+static const uint8_t idleTimeScaled = 0x10;
+static const long long idleTimeScale = 8192;
+
+static inline uint64_t zigzag(long long v)
+{
+	return (uint64_t(v) << 1) ^ uint64_t(v >> 63);
+}
+
+static inline long long unzigzag(uint64_t v)
+{
+	return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+static inline char *putVarint(char *out, uint64_t v)
+{
+	while(v >= 0x80) {
+		*out++ = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	*out++ = v;
+	return out;
+}
+
+static inline const char *getVarint(const char *in, uint64_t &v)
+{
+	v = 0;
+	int shift = 0;
+	uint8_t b;
+	do {
+		b = *in++;
+		v |= uint64_t(b & 0x7F) << shift;
+		shift += 7;
+	} while(b & 0x80);
+	return in;
+}
+
+RawWriterC::RawWriterC(char *fileNamePrefix)
+{
+	char dataFileName[512];
+	char indexFileName[512];
+	sprintf(dataFileName, "%s.rawC", fileNamePrefix);
+	sprintf(indexFileName, "%s.idxC", fileNamePrefix);
+
+	outputDataFile = new AsyncFileWriter(dataFileName);
+
+	outputIndexFile = fopen(indexFileName, "w");
+	if(outputIndexFile == NULL) {
+		int e = errno;
+		fprintf(stderr, "Could not open '%s' for writing : %d %s\n", indexFileName, e, strerror(e));
+		exit(1);
+	}
+
+	stepBegin = 0;
+	stepEnd = 0;
+}
+
+RawWriterC::~RawWriterC()
+{
+	delete outputDataFile;
+	fclose(outputIndexFile);
+}
+
+void RawWriterC::openStep(float step1, float step2)
+{
+	this->step1 = step1;
+	this->step2 = step2;
+	stepBegin = stepEnd;
+}
+
+void RawWriterC::closeStep()
+{
+	outputDataFile->flush();
+	fprintf(outputIndexFile, "%f %f %llu %llu\n", step1, step2, stepBegin, stepEnd);
+	fflush(outputIndexFile);
+}
+
+u_int32_t RawWriterC::addEventBuffer(long long tMin, long long tMax, EventBuffer<RawHit> *inBuffer)
+{
+	unsigned N = inBuffer->getSize();
+	long long T = SYSTEM_PERIOD * 1E12;
+
+	// Encode the whole buffer as one chunk, in place in the writer's current block
+	char *outStart = outputDataFile->reserve(sizeof(RawChunkHeaderC) + N * maxHitRecordSize);
+	char *out = outStart + sizeof(RawChunkHeaderC);
+	RawChunkHeaderC header = { 0, 0, 0 };
+	long long lastFrameID = -1;
+	for(unsigned i = 0; i < N; i++) {
+		RawHit &p = inBuffer->get(i);
+		if((p.time < tMin) || (p.time >= tMax)) continue;
+		long long frameID = p.time / (1024L * T);
+		if(lastFrameID == -1) {
+			header.frameID = frameID;
+			lastFrameID = frameID;
+		}
+		out = putVarint(out, zigzag(frameID - lastFrameID));
+		lastFrameID = frameID;
+
+		long long tacIdleTime = p.feType == RawHit::TOFPET ? p.d.tofpet.tacIdleTime : 0;
+		uint8_t flags = p.feType & 0x03;
+		if(p.feType == RawHit::TOFPET)
+			flags |= (p.d.tofpet.tac & 0x03) << 2;
+		else if(p.feType == RawHit::STIC)
+			flags |= (p.d.stic.tBadHit ? 0x04 : 0x00) | (p.d.stic.eBadHit ? 0x08 : 0x00);
+		if(p.channelIdleTime % idleTimeScale == 0 && tacIdleTime % idleTimeScale == 0)
+			flags |= idleTimeScaled;
+		long long scale = (flags & idleTimeScaled) ? idleTimeScale : 1;
+		*out++ = flags;
+		out = putVarint(out, uint32_t(p.channelID));
+
+		if(p.feType == RawHit::TOFPET) {
+			out = putVarint(out, uint16_t(p.d.tofpet.tcoarse));
+			out = putVarint(out, uint16_t(p.d.tofpet.ecoarse));
+			out = putVarint(out, uint16_t(p.d.tofpet.tfine));
+			out = putVarint(out, uint16_t(p.d.tofpet.efine));
+			out = putVarint(out, zigzag(p.channelIdleTime / scale));
+			out = putVarint(out, zigzag(tacIdleTime / scale));
+		}
+		else if(p.feType == RawHit::STIC) {
+			out = putVarint(out, uint16_t(p.d.stic.tcoarse));
+			out = putVarint(out, uint16_t(p.d.stic.ecoarse));
+			out = putVarint(out, uint16_t(p.d.stic.tfine));
+			out = putVarint(out, uint16_t(p.d.stic.efine));
+			out = putVarint(out, zigzag(p.channelIdleTime / scale));
+		}
+		else {
+			out = putVarint(out, zigzag(p.channelIdleTime / scale));
+			out = putVarint(out, zigzag(p.time - 1024LL * frameID * T));
+			out = putVarint(out, zigzag(p.timeEnd - 1024LL * frameID * T));
+		}
+		header.nHits++;
+	}
+
+	if(header.nHits == 0)
+		return 0;
+
+	header.size = out - outStart - sizeof(RawChunkHeaderC);
+	memcpy(outStart, &header, sizeof(header));
+	outputDataFile->commit(out - outStart);
+	stepEnd += header.nHits;
+	return header.nHits;
+}
+
+
+RawScannerC::RawScannerC(char *indexFilePrefix) :
+	steps(vector<Step>())
+{
+	float step1;
+	float step2;
+	unsigned long long stepBegin;
+	unsigned long long stepEnd;
+
+	char indexFileName[512];
+	sprintf(indexFileName, "%s.idxC", indexFilePrefix);
+	indexFile = fopen(indexFileName, "rb");
+	if(indexFile == NULL) {
+		int e = errno;
+		fprintf(stderr, "Could not open '%s for reading' : %d %s\n", indexFileName, e, strerror(e));
+		exit(e);
+	}
+
+	while(fscanf(indexFile, "%f %f %llu %llu\n", &step1, &step2, &stepBegin, &stepEnd) == 4) {
+		Step step = { step1, step2, stepBegin, stepEnd };
+		steps.push_back(step);
+	}
+}
+
+RawScannerC::~RawScannerC()
+{
+	fclose(indexFile);
+}
+
+int RawScannerC::getNSteps()
+{
+	return steps.size();
+}
+
+void RawScannerC::getStep(int stepIndex, float &step1, float &step2, unsigned long long &eventsBegin, unsigned long long &eventsEnd)
+{
+	Step &step = steps[stepIndex];
+	step1 = step.step1;
+	step2 = step.step2;
+	eventsBegin = step.eventsBegin;
+	eventsEnd = step.eventsEnd;
+}
+
+
+RawReaderC::RawReaderC(char *dataFilePrefix, float T, unsigned long long eventsBegin, unsigned long long eventsEnd, EventSink<RawHit> *sink)
+	: EventSource<RawHit>(sink), eventsBegin(eventsBegin), eventsEnd(eventsEnd), data(NULL), T(T)
+{
+	char dataFileName[512];
+	sprintf(dataFileName, "%s.rawC", dataFilePrefix);
+	dataFile = open(dataFileName, O_RDONLY);
+	if(dataFile == -1) {
+		int e = errno;
+		fprintf(stderr, "Could not open '%s for reading' : %d %s\n", dataFileName, e, strerror(e));
+		exit(e);
+	}
+	start();
+}
+
+RawReaderC::~RawReaderC()
+{
+	close(dataFile);
+}
+
+void *RawReaderC::decodeBlock(void *arg)
+{
+	Block &block = *(Block *)arg;
+	const char *data = block.reader->data;
+	long long pT = block.reader->T * 1E12;
+	long long tMax = 0;
+	unsigned hitsEnd = block.skip + block.nHits;
+	unsigned hitIndex = 0;
+
+	EventBuffer<RawHit> *outBuffer = new EventBuffer<RawHit>(block.nHits, NULL);
+	unsigned long long offset = block.begin;
+	while(offset < block.end && hitIndex < hitsEnd) {
+		RawChunkHeaderC header;
+		memcpy(&header, data + offset, sizeof(header));
+		const char *in = data + offset + sizeof(header);
+		offset += sizeof(header) + header.size;
+
+		long long frameID = header.frameID;
+		int sticFrameOffset = DAQd::SticCoarse::frameOffset(frameID);
+		for(unsigned i = 0; i < header.nHits && hitIndex < hitsEnd; i++, hitIndex++) {
+			uint64_t v;
+			in = getVarint(in, v);
+			if(v != 0) {
+				frameID += unzigzag(v);
+				sticFrameOffset = DAQd::SticCoarse::frameOffset(frameID);
+			}
+			uint8_t flags = *in++;
+			long long scale = (flags & idleTimeScaled) ? idleTimeScale : 1;
+			RawHit::Type feType = RawHit::Type(flags & 0x03);
+
+			RawHit &p = outBuffer->getWriteSlot();
+			in = getVarint(in, v); p.channelID = v;
+			p.feType = feType;
+			if(feType == RawHit::TOFPET) {
+				in = getVarint(in, v); p.d.tofpet.tcoarse = v;
+				in = getVarint(in, v); p.d.tofpet.ecoarse = v;
+				in = getVarint(in, v); p.d.tofpet.tfine = v;
+				in = getVarint(in, v); p.d.tofpet.efine = v;
+				in = getVarint(in, v); p.channelIdleTime = unzigzag(v) * scale;
+				in = getVarint(in, v); p.d.tofpet.tacIdleTime = unzigzag(v) * scale;
+				p.d.tofpet.tac = (flags >> 2) & 0x03;
+				// Carefull with the float/double/integer conversions here..
+				p.time = (1024LL * frameID + uint16_t(p.d.tofpet.tcoarse)) * pT;
+				p.timeEnd = (1024LL * frameID + uint16_t(p.d.tofpet.ecoarse)) * pT;
+				if((p.timeEnd - p.time) < -256*pT) p.timeEnd += (1024LL * pT);
+			}
+			else if(feType == RawHit::STIC) {
+				in = getVarint(in, v); p.d.stic.tcoarse = v;
+				in = getVarint(in, v); p.d.stic.ecoarse = v;
+				in = getVarint(in, v); p.d.stic.tfine = v;
+				in = getVarint(in, v); p.d.stic.efine = v;
+				in = getVarint(in, v); p.channelIdleTime = unzigzag(v) * scale;
+				p.d.stic.tBadHit = (flags & 0x04) != 0;
+				p.d.stic.eBadHit = (flags & 0x08) != 0;
+				// Compensate LFSR's 2^16-1 period
+				// and wrap at frame's 6.4 us period
+				int ctCoarse = DAQd::SticCoarse::compensate(uint16_t(p.d.stic.tcoarse), sticFrameOffset) % 4096;
+				int ceCoarse = DAQd::SticCoarse::compensate(uint16_t(p.d.stic.ecoarse), sticFrameOffset) % 4096;
+				p.time = 1024LL * frameID * pT + ctCoarse * pT/4;
+				p.timeEnd = 1024LL * frameID * pT + ceCoarse * pT/4;
+				if((p.timeEnd - p.time) < -256*pT) p.timeEnd += (1024LL * pT);
+			}
+			else {
+				in = getVarint(in, v); p.channelIdleTime = unzigzag(v) * scale;
+				in = getVarint(in, v); p.time = 1024LL * frameID * pT + unzigzag(v);
+				in = getVarint(in, v); p.timeEnd = 1024LL * frameID * pT + unzigzag(v);
+			}
+
+			if(hitIndex < block.skip)
+				continue;
+			if(p.time > tMax)
+				tMax = p.time;
+			outBuffer->pushWriteSlot();
+		}
+	}
+
+	block.buffer = outBuffer;
+	block.tMax = tMax;
+	return NULL;
+}
+
+void RawReaderC::run()
+{
+	long long tMax = 0, lastTMax = 0;
+
+	sink->pushT0(0);
+
+	fprintf(stderr, "Reading %llu to %llu\n", eventsBegin, eventsEnd);
+
+	struct stat st;
+	if(fstat(dataFile, &st) != 0) {
+		int e = errno;
+		fprintf(stderr, "Could not stat data file : %d %s\n", e, strerror(e));
+		exit(e);
+	}
+	unsigned long long dataSize = st.st_size;
+	if(dataSize > 0) {
+		void *m = mmap(NULL, dataSize, PROT_READ, MAP_SHARED, dataFile, 0);
+		if(m == MAP_FAILED) {
+			int e = errno;
+			fprintf(stderr, "Could not map data file : %d %s\n", e, strerror(e));
+			exit(e);
+		}
+		madvise(m, dataSize, MADV_SEQUENTIAL);
+		data = (char *)m;
+	}
+
+	// First pass: walk the chunk headers only, skipping chunks before eventsBegin
+	// and grouping the following ones into blocks of about outBlockSize hits
+	vector<Block> blocks;
+	Block block = { this, 0, 0, 0, 0, NULL, 0 };
+	unsigned long long hitIndex = 0;
+	unsigned long long p = 0;
+	while(p < dataSize && hitIndex < eventsEnd) {
+		RawChunkHeaderC header;
+		if(p + sizeof(header) > dataSize) {
+			fprintf(stderr, "Truncated chunk header, at hit %llu\n\n", hitIndex);
+			break;
+		}
+		memcpy(&header, data + p, sizeof(header));
+		if(p + sizeof(header) + header.size > dataSize) {
+			fprintf(stderr, "Truncated chunk, at hit %llu\n\n", hitIndex);
+			break;
+		}
+
+		unsigned long long chunkBegin = hitIndex;
+		unsigned long long chunkEnd = hitIndex + header.nHits;
+		hitIndex = chunkEnd;
+		if(chunkEnd <= eventsBegin) {
+			p += sizeof(header) + header.size;
+			continue;
+		}
+
+		if(block.end == block.begin) {
+			block.begin = p;
+			block.skip = chunkBegin < eventsBegin ? eventsBegin - chunkBegin : 0;
+		}
+		p += sizeof(header) + header.size;
+		block.end = p;
+		block.nHits += (chunkEnd < eventsEnd ? chunkEnd : eventsEnd) - (chunkBegin > eventsBegin ? chunkBegin : eventsBegin);
+
+		if(block.nHits >= (outBlockSize - 512)) {
+			blocks.push_back(block);
+			block.begin = block.end = p;
+			block.skip = 0;
+			block.nHits = 0;
+		}
+	}
+	if(block.nHits > 0) {
+		blocks.push_back(block);
+	}
+
+	// Second pass: decode blocks in the thread pool and push them to the sink in file order
+	ThreadPool *pool = GlobalThreadPool;
+	pool->clientIncrease();
+	deque<ThreadPool::Job *> jobs;
+	unsigned nQueued = 0;
+	for(unsigned i = 0; i < blocks.size(); i++) {
+		while(nQueued < blocks.size() && nQueued < i + maxBlocksInFlight) {
+			jobs.push_back(pool->queueJob(decodeBlock, &blocks[nQueued]));
+			nQueued++;
+		}
+		ThreadPool::Job *job = jobs.front();
+		jobs.pop_front();
+		job->wait();
+		delete job;
+
+		Block &b = blocks[i];
+		if(b.tMax > tMax)
+			tMax = b.tMax;
+		b.buffer->setTMin(lastTMax);
+		b.buffer->setTMax(tMax);
+		lastTMax = tMax;
+		sink->pushEvents(b.buffer);
+		b.buffer = NULL;
+	}
+	pool->clientDecrease();
+
+	if(data != NULL) {
+		munmap(data, dataSize);
+		data = NULL;
+	}
+
+	sink->finish();
+	sink->report();
+}
@@ -0,0 +1,101 @@
+#ifndef __TOFPET__RAWC_HPP__DEFINED__
+#define __TOFPET__RAWC_HPP__DEFINED__
+#include <Common/Task.hpp>
+#include <Common/AsyncFileWriter.hpp>
+#include <TOFPET/Raw.hpp>
+#include <Core/EventSourceSink.hpp>
+#include <Core/Event.hpp>
+#include <Core/RawHitWriter.hpp>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace DAQ { namespace TOFPET {
+	using namespace ::DAQ::Common;
+	using namespace ::DAQ::Core;
+	using namespace std;
+
+	/*
+	 * Compact raw format (.rawC, .idxC), for TOFPET and STiC hits alike.
+	 * The data file is a sequence of chunks, each one a header followed by nHits variable length records:
+	 * zigzag varint	: frameID - frameID of the previous hit (the header's frameID for the first hit)
+	 * byte			: feType (bits 0-1), TOFPET tac or STiC tBadHit/eBadHit (bits 2-3),
+	 *			  idle times stored in units of 8192 clocks (bit 4)
+	 * varint		: channelID
+	 * varint		: tCoarse, eCoarse, tFine, eFine (TOFPET and STiC)
+	 * zigzag varint	: channelIdleTime, then tacIdleTime (TOFPET only)
+	 * zigzag varint	: time and timeEnd relative to the frame start (DSIPM only)
+	 * Chunks decode on their own, so readers can skip to a step by chunk sizes and decode chunks in parallel.
+	 * The index lists steps in hits, as for the other formats.
+	 */
+	struct RawChunkHeaderC {
+		uint32_t size;
+		uint32_t nHits;
+		uint64_t frameID;
+	}__attribute__((__packed__));
+
+	class RawWriterC : public RawWriter {
+	public:
+		RawWriterC(char *fileNamePrefix);
+		virtual ~RawWriterC();
+		virtual void openStep(float step1, float step2);
+		virtual void closeStep();
+		virtual u_int32_t addEventBuffer(long long tMin, long long tMax, EventBuffer<RawHit> *inBuffer);
+	private:
+		AsyncFileWriter *outputDataFile;
+		FILE *outputIndexFile;
+		float step1;
+		float step2;
+		unsigned long long stepBegin;
+		unsigned long long stepEnd;
+	};
+
+	class RawScannerC : public RawScanner {
+	public:
+		RawScannerC(char *indexFilePrefix);
+		~RawScannerC();
+
+		int getNSteps();
+		void getStep(int stepIndex, float &step1, float &step2, unsigned long long &eventsBegin, unsigned long long &eventsEnd);
+	private:
+		struct Step {
+			float step1;
+			float step2;
+			unsigned long long eventsBegin;
+			unsigned long long eventsEnd;
+		};
+		FILE * indexFile;
+		vector<Step> steps;
+	};
+
+	class RawReaderC : public RawReader, public EventSource<RawHit> {
+	public:
+		RawReaderC(char *dataFilePrefix, float T, unsigned long long eventsBegin, unsigned long long eventsEnd, EventSink<RawHit> *sink);
+		~RawReaderC();
+
+		virtual void run();
+
+	private:
+		// A run of whole chunks decoded as one job;
+		// hits before skip or from nHits on are not pushed
+		struct Block {
+			RawReaderC *reader;
+			unsigned long long begin;
+			unsigned long long end;
+			unsigned skip;
+			unsigned nHits;
+			EventBuffer<RawHit> *buffer;
+			long long tMax;
+		};
+		static void *decodeBlock(void *arg);
+
+		unsigned long long eventsBegin;
+		unsigned long long eventsEnd;
+		int dataFile;
+		char *data;
+		double T;
+	};
+
+}}
+#endif
@@ -8,6 +8,7 @@
 #include <limits.h>
 #include <iostream>
 #include <assert.h>
+#include <string.h>
 
 using namespace std;
 using namespace DAQ::Core;
@@ -39,78 +40,67 @@ struct SortEntry {
 };
 static bool operator< (SortEntry lhs, SortEntry rhs) { return lhs.tCoarse < rhs.tCoarse; }
 
-static const long long wrapPeriod = 1LL<<31 - 1;
+// RawEventV2::frameID is a uint32_t
+static const long long wrapPeriod = 1LL << 32;
 
 
-static bool isAfter(long long  frameID2, long long frameID1)
+// Brings frameID to within half a wrap period of the previous unwrapped frame ID,
+// so a glitched frame ID does not shift the frame IDs after it
+static long long unwrapFrameID(long long frameID, long long lastFrameID)
 {
-	if (frameID2 >= frameID1)
-		return true;
-	
-	if(frameID1 > 0.99 * wrapPeriod && frameID2 < 0.01 * wrapPeriod)
-		return true;
-	
-	return false;
+	long long u = lastFrameID - (lastFrameID % wrapPeriod) + frameID;
+	if(u - lastFrameID > wrapPeriod / 2)
+		u -= wrapPeriod;
+	else if(lastFrameID - u > wrapPeriod / 2)
+		u += wrapPeriod;
+	return u;
 }
-bool RawReaderV2::isOutlier(long long currentFrameID, FILE *dataFile, int entry, int N)
-{	
-	RawEventV2 rawEvent;
-	fseek(dataFile, entry * sizeof(RawEventV2), SEEK_SET);
-	fread(&rawEvent, sizeof(RawEventV2), 1, dataFile);
-	
-	if(rawEvent.frameID == currentFrameID) {
-/*		printf("C1: good!\n");*/
-		return false;
-	}
-	
-	if(rawEvent.frameID == currentFrameID + 1) {
-		return false;
-	}
-	
-	if(!isAfter(rawEvent.frameID, currentFrameID)) {
-//		printf("C2: outlier\n");
-		return true;
+
+// Events are written in frame order, so an event's frame ID lies between the median frame ID 
+// of the outlierWindow events before it and that of the outlierWindow events after it; 
+// glitched frame IDs fall outside. Checked in memory, one read block at a time.
+static const int outlierWindow = 32;
+
+// median[k] is the median of frameID[k .. k+outlierWindow-1]
+static void runningMedian(vector<long long> &frameID, vector<long long> &median)
+{
+	int n = frameID.size();
+	median.clear();
+	vector<long long> window;
+	window.reserve(outlierWindow + 1);
+	for(int j = 0; j < n; j++) {
+		window.insert(lower_bound(window.begin(), window.end(), frameID[j]), frameID[j]);
+		if(j >= outlierWindow) {
+			long long oldFrameID = frameID[j - outlierWindow];
+			window.erase(lower_bound(window.begin(), window.end(), oldFrameID));
+		}
+		if(j >= outlierWindow - 1)
+			median.push_back(window[outlierWindow / 2]);
 	}
-	
-	
-	long long thisFrameID = rawEvent.frameID;
-	
-	set<long long> frameList;
-	int j = entry;
-	while(j < eventsEnd && frameList.size() < N) {
-		
-		fseek(dataFile, j * sizeof(RawEventV2), SEEK_SET);		
-		fread(&rawEvent, sizeof(RawEventV2), 1, dataFile);
-		
-		frameList.insert(rawEvent.frameID);
-		j += 1;
+}
+
+// lastFrameID carries the unwrapped frame ID across read blocks, -1 before the first block
+static void findOutliers(RawEventV2 *events, int n, long long &lastFrameID, vector<bool> &outlier)
+{
+	vector<long long> frameID(n);
+	if(lastFrameID == -1 && n > 0)
+		lastFrameID = events[0].frameID;
+	for(int j = 0; j < n; j++) {
+		frameID[j] = unwrapFrameID(events[j].frameID, lastFrameID);
+		lastFrameID = frameID[j];
 	}
 	
-	bool frameOK = true;
-/*	for (set<long long>::iterator it = frameList.begin(); it != frameList.end(); it++) {
-		bool c = isAfter(*it, thisFrameID) && (*it - thisFrameID) < 100*N;
-		if(!c) { 
-			printf("Fail check for %lld vs %lld\n", thisFrameID, *it); 
-			
-		}
-		frameOK &= c;
-	}*/
+	vector<long long> median;
+	runningMedian(frameID, median);
 	
-	set<long long>::iterator it1 = frameList.begin();
-	set<long long>::iterator it2 = it1;
-	it1++;
-	for(; it1 != frameList.end(); it1++, it2++) {
-		bool c = isAfter(*it1, *it2);
-/*		if(!c) { 
-			printf("Fail check for %lld vs %lld\n", *it2, *it1);
-		}*/
-		frameOK &= c;
-		
+	outlier.assign(n, false);
+	for(int j = 0; j < n; j++) {
+		// Near the ends of the block only one side can be checked
+		if(j >= outlierWindow && frameID[j] < median[j - outlierWindow])
+			outlier[j] = true;
+		if(j + outlierWindow < n && median[j + 1] < frameID[j])
+			outlier[j] = true;
 	}
-	
-	fseek(dataFile, entry * sizeof(RawEventV2), SEEK_SET);
-	return !frameOK;
-	
 }
 
 void RawReaderV2::run()
@@ -134,6 +124,9 @@ void RawReaderV2::run()
 	
 	int maxReadBlock = 1024*1024;
 	RawEventV2 *rawEvents = new RawEventV2[maxReadBlock];
+	vector<bool> outlier;
+	unsigned long long nOutliers = 0;
+	long long lastFrameID = -1;
 
 	unsigned long long readPointer = eventsBegin;
 	while (readPointer < eventsEnd) {
@@ -144,9 +137,14 @@ void RawReaderV2::run()
 		readPointer += r;
 	
 		//printf("events extracted= %lld\n",readPointer);
+		findOutliers(rawEvents, r, lastFrameID, outlier);
 	
 		for(int j = 0; j < r; j++) {
 			RawEventV2 &rawEvent = rawEvents[j];
+			if(outlier[j]) {
+				nOutliers++;
+				continue;
+			}
 
 			if(outBuffer == NULL) {
 				outBuffer = new EventBuffer<RawHit>(outBlockSize, NULL);
@@ -208,6 +206,10 @@ void RawReaderV2::run()
 	fprintf(stderr, "RawReaderV2 report\n");
 	fprintf(stderr, "\t%16lld minFrameID\n", minFrameID);
 	fprintf(stderr, "\t%16lld maxFrameID\n", maxFrameID);
+	fprintf(stderr, "\t%16llu frame ID outliers\n", nOutliers);
+	// convertRaw counts the events of each step, so it will flag this step as not matching the index
+	if(nOutliers > 0)
+		fprintf(stderr, "\tOutliers are dropped: this step has %llu events fewer than its index says\n", nOutliers);
 	sink->report();
 }
 
@@ -257,16 +259,15 @@ RawWriterV2::RawWriterV2(char *fileNamePrefix)
 	sprintf(dataFileName, "%s.raw2", fileNamePrefix);
 	sprintf(indexFileName, "%s.idx2", fileNamePrefix);
 
-	outputDataFile = fopen(dataFileName, "wb");
+	outputDataFile = new AsyncFileWriter(dataFileName);
 	outputIndexFile = fopen(indexFileName, "w");
-	assert(outputDataFile != NULL);
 	assert(outputIndexFile != NULL);
 	stepBegin = 0;
 }
 
 RawWriterV2::~RawWriterV2()
 {
- 	fclose(outputDataFile);
+ 	delete outputDataFile;
  	fclose(outputIndexFile);
 }
 
@@ -274,32 +275,44 @@ void RawWriterV2::openStep(float step1, float step2)
 {
 	this->step1 = step1;
 	this->step2 = step2;
-	stepBegin = ftell(outputDataFile) / sizeof(DAQ::TOFPET::RawEventV2);
+	stepBegin = outputDataFile->getPosition() / sizeof(DAQ::TOFPET::RawEventV2);
 }
 
 void RawWriterV2::closeStep()
 {
-	long stepEnd = ftell(outputDataFile) / sizeof(DAQ::TOFPET::RawEventV2);	
+	long stepEnd = outputDataFile->getPosition() / sizeof(DAQ::TOFPET::RawEventV2);	
+	outputDataFile->flush();
 	fprintf(outputIndexFile, "%f %f %ld %ld\n", step1, step2, stepBegin, stepEnd);
-	fflush(outputDataFile);
 	fflush(outputIndexFile);
 }
 
-void RawWriterV2::addEvent(RawHit &p)
+u_int32_t RawWriterV2::addEventBuffer(long long tMin, long long tMax, EventBuffer<RawHit> *inBuffer)
 {
-	long long T = SYSTEM_PERIOD * 1E12;
-	uint32_t frameID = p.time / (1024L * T);
-	DAQ::TOFPET::RawEventV2 eventOut = {
-		frameID,
-		uint16_t(p.channelID / 64),
-		uint16_t(p.channelID % 64),
-		p.d.tofpet.tac,
-		p.d.tofpet.tcoarse,
-		p.d.tofpet.ecoarse,
-		p.d.tofpet.tfine,
-		p.d.tofpet.efine,
-		p.channelIdleTime,
-		p.d.tofpet.tacIdleTime
-	};
-	fwrite(&eventOut, sizeof(eventOut), 1, outputDataFile);
+	u_int32_t lSingleRead = 0;
+	unsigned N = inBuffer->getSize();
+	
+	// Encode the whole buffer in place in the writer's current block
+	DAQ::TOFPET::RawEventV2 *out = (DAQ::TOFPET::RawEventV2 *)outputDataFile->reserve(N * sizeof(DAQ::TOFPET::RawEventV2));
+	for(unsigned i = 0; i < N; i++) {
+		RawHit &p = inBuffer->get(i);
+		if((p.time < tMin) || (p.time >= tMax)) continue;
+		long long T = SYSTEM_PERIOD * 1E12;
+		uint32_t frameID = p.time / (1024L * T);
+		DAQ::TOFPET::RawEventV2 eventOut = {
+			frameID,
+			uint16_t(p.channelID / 64),
+			uint16_t(p.channelID % 64),
+			uint16_t(p.d.tofpet.tac),
+			uint16_t(p.d.tofpet.tcoarse),
+			uint16_t(p.d.tofpet.ecoarse),
+			uint16_t(p.d.tofpet.tfine),
+			uint16_t(p.d.tofpet.efine),
+			p.channelIdleTime,
+			p.d.tofpet.tacIdleTime
+		};
+		memcpy(out + lSingleRead, &eventOut, sizeof(eventOut));
+		lSingleRead++;
+	}
+	outputDataFile->commit(lSingleRead * sizeof(DAQ::TOFPET::RawEventV2));
+	return lSingleRead;
 }
@@ -1,6 +1,7 @@
 #ifndef __TOFPET__RAWV2_HPP__DEFINED__
 #define __TOFPET__RAWV2_HPP__DEFINED__
 #include <Common/Task.hpp>
+#include <Common/AsyncFileWriter.hpp>
 #include <TOFPET/Raw.hpp>
 #include <Core/EventSourceSink.hpp>
 #include <Core/Event.hpp>
@@ -35,9 +36,9 @@ namespace DAQ { namespace TOFPET {
 		virtual ~RawWriterV2();
 		virtual void openStep(float step1, float step2);
 		virtual void closeStep();
-		virtual void addEvent(RawHit &p);
+		virtual u_int32_t addEventBuffer(long long tMin, long long tMax, EventBuffer<RawHit> *inBuffer);
 	private:
-		FILE *outputDataFile;
+		AsyncFileWriter *outputDataFile;
 		FILE *outputIndexFile;
 		float step1;
 		float step2;
@@ -77,7 +78,6 @@ namespace DAQ { namespace TOFPET {
 		unsigned long eventsEnd;
 		FILE *dataFile;
 		double T;
-		bool isOutlier(long long currentFrameID, FILE *dataFile, int entry, int N);
 	};
 	
 }}
@@ -0,0 +1,187 @@
+#include "TQHistograms.hpp"
+#include "P2.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+using namespace DAQ::TOFPET;
+
+static const float tQMinimum = 1.0;
+static const float tQMaximum = 3.0;
+static const float ToTMaximum = 300.0;
+static const int defaultNBins = 300;
+
+static const char stateMagic[8] = { 'T', 'Q', 'H', 'I', 'S', 'T', '0', '1' };
+
+TQHistograms::TQHistograms(P2 *lut, int nChannels)
+	: nChannels(nChannels)
+{
+	nBinsT = new int[nChannels];
+	nBinsE = new int[nChannels];
+	data = new uint32_t *[nChannels];
+	for(int channel = 0; channel < nChannels; channel++) {
+		int nT = lut != NULL ? int(lut->getNBinsTQ(channel, true)) : 0;
+		int nE = lut != NULL ? int(lut->getNBinsTQ(channel, false)) : 0;
+		nBinsT[channel] = nT > 0 ? nT : defaultNBins;
+		nBinsE[channel] = nE > 0 ? nE : defaultNBins;
+		data[channel] = NULL;
+	}
+}
+
+TQHistograms::~TQHistograms()
+{
+	for(int channel = 0; channel < nChannels; channel++)
+		delete [] data[channel];
+	delete [] data;
+	delete [] nBinsT;
+	delete [] nBinsE;
+}
+
+uint32_t *TQHistograms::allocate(int channel)
+{
+	if(data[channel] == NULL) {
+		int size = nRows * (nBinsT[channel] + 2 + nBinsE[channel] + 2);
+		data[channel] = new uint32_t[size];
+		memset(data[channel], 0, size * sizeof(uint32_t));
+	}
+	return data[channel];
+}
+
+uint32_t *TQHistograms::getRow(int channel, bool isT, int row)
+{
+	uint32_t *p = data[channel];
+	if(!isT) p += nRows * (nBinsT[channel] + 2);
+	int n = isT ? nBinsT[channel] : nBinsE[channel];
+	return p + row * (n + 2);
+}
+
+// Same binning as TAxis::FindBin, NaN goes into overflow
+static int findBin(double x, double min, double max, int n)
+{
+	if(x < min) return 0;
+	if(!(x < max)) return n + 1;
+	int bin = 1 + int(n * (x - min) / (max - min));
+	return bin < n + 1 ? bin : n;
+}
+
+void TQHistograms::fill(int channel, bool isT, float tQ, float ToT)
+{
+	if(channel < 0 || channel >= nChannels) return;
+	allocate(channel);
+	int n = isT ? nBinsT[channel] : nBinsE[channel];
+	int row = findBin(ToT, 0, ToTMaximum, nToTBins);
+	int bin = findBin(tQ, tQMinimum, tQMaximum, n);
+	getRow(channel, isT, row)[bin] += 1;
+}
+
+bool TQHistograms::add(TQHistograms *other)
+{
+	if(other->nChannels != nChannels) return false;
+	for(int channel = 0; channel < nChannels; channel++) {
+		if(other->data[channel] == NULL) continue;
+		if(other->nBinsT[channel] != nBinsT[channel] || other->nBinsE[channel] != nBinsE[channel]) 
+			return false;
+		
+		uint32_t *dst = allocate(channel);
+		uint32_t *src = other->data[channel];
+		int size = nRows * (nBinsT[channel] + 2 + nBinsE[channel] + 2);
+		for(int i = 0; i < size; i++)
+			dst[i] += src[i];
+	}
+	return true;
+}
+
+bool TQHistograms::hasChannel(int channel)
+{
+	return channel >= 0 && channel < nChannels && data[channel] != NULL;
+}
+
+int TQHistograms::getNBins(int channel, bool isT)
+{
+	return isT ? nBinsT[channel] : nBinsE[channel];
+}
+
+double TQHistograms::getBinContent(int channel, bool isT, int totBin, int bin)
+{
+	if(data[channel] == NULL) return 0;
+	return double(getRow(channel, isT, totBin+1)[bin]) + double(getRow(channel, isT, totBin+2)[bin]);
+}
+
+double TQHistograms::getIntegral(int channel, bool isT, int totBin)
+{
+	double sum = 0;
+	int n = getNBins(channel, isT);
+	for(int bin = 1; bin <= n; bin++)
+		sum += getBinContent(channel, isT, totBin, bin);
+	return sum;
+}
+
+// State file: a header, then for each allocated channel 
+// its number, T and E bin counts and raw bin contents
+bool TQHistograms::save(const char *fileName)
+{
+	FILE *f = fopen(fileName, "wb");
+	if(f == NULL) {
+		int e = errno;
+		fprintf(stderr, "Could not open '%s' for writing : %d %s\n", fileName, e, strerror(e));
+		return false;
+	}
+	
+	bool ok = fwrite(stateMagic, sizeof(stateMagic), 1, f) == 1;
+	for(int channel = 0; ok && channel < nChannels; channel++) {
+		if(data[channel] == NULL) continue;
+		int32_t header[3] = { channel, nBinsT[channel], nBinsE[channel] };
+		int size = nRows * (nBinsT[channel] + 2 + nBinsE[channel] + 2);
+		ok = fwrite(header, sizeof(header), 1, f) == 1 
+			&& fwrite(data[channel], sizeof(uint32_t), size, f) == (size_t)size;
+	}
+	ok = (fclose(f) == 0) && ok;
+	if(!ok) {
+		fprintf(stderr, "Error writing to '%s'\n", fileName);
+	}
+	return ok;
+}
+
+bool TQHistograms::load(const char *fileName)
+{
+	FILE *f = fopen(fileName, "rb");
+	if(f == NULL) {
+		int e = errno;
+		fprintf(stderr, "Could not open '%s' for reading : %d %s\n", fileName, e, strerror(e));
+		return false;
+	}
+
+	char magic[sizeof(stateMagic)];
+	if(fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, stateMagic, sizeof(magic)) != 0) {
+		fprintf(stderr, "'%s' is not a tQ histogram state file\n", fileName);
+		fclose(f);
+		return false;
+	}
+	
+	bool ok = true;
+	int32_t header[3];
+	while(ok && fread(header, sizeof(header), 1, f) == 1) {
+		int channel = header[0];
+		if(channel < 0 || channel >= nChannels || header[1] != nBinsT[channel] || header[2] != nBinsE[channel]) {
+			fprintf(stderr, "'%s' : channel %d does not match the current calibration binning\n", fileName, channel);
+			ok = false;
+			break;
+		}
+		
+		int size = nRows * (nBinsT[channel] + 2 + nBinsE[channel] + 2);
+		uint32_t *buffer = new uint32_t[size];
+		if(fread(buffer, sizeof(uint32_t), size, f) != (size_t)size) {
+			fprintf(stderr, "'%s' is truncated\n", fileName);
+			ok = false;
+		}
+		else {
+			uint32_t *dst = allocate(channel);
+			for(int i = 0; i < size; i++)
+				dst[i] += buffer[i];
+		}
+		delete [] buffer;
+	}
+	fclose(f);
+	return ok;
+}
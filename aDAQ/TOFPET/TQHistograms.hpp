@@ -0,0 +1,49 @@
+#ifndef __DAQ__TOFPET__TQHISTOGRAMS_HPP__DEFINED__
+#define __DAQ__TOFPET__TQHISTOGRAMS_HPP__DEFINED__
+
+#include <stdint.h>
+
+namespace DAQ { namespace TOFPET {
+
+	class P2;
+
+	// tQ vs ToT histograms for each channel, for the T and E branches.
+	// Bins follow ROOT's convention (bin 0 is underflow, bin N+1 is overflow)
+	// and channels are only allocated once they receive data.
+	// A store is not thread safe: workers should fill their own store and add() them at the end.
+	class TQHistograms {
+	public:
+		// tQ goes from 1 to 3 and ToT from 0 to 300 ns, in nToTBins bins
+		static const int nToTBins = 6;
+
+		TQHistograms(P2 *lut, int nChannels);
+		~TQHistograms();
+
+		void fill(int channel, bool isT, float tQ, float ToT);
+		// Adds all histograms from another store, with the same binning
+		bool add(TQHistograms *other);
+
+		// Adds the histograms saved in a state file
+		bool load(const char *fileName);
+		bool save(const char *fileName);
+
+		bool hasChannel(int channel);
+		int getNBins(int channel, bool isT);
+		// Content of a tQ bin, for ToT bins totBin+1 and totBin+2 (as the 2D histogram projection)
+		double getBinContent(int channel, bool isT, int totBin, int bin);
+		// Integral of tQ bins 1 to N, for ToT bins totBin+1 and totBin+2
+		double getIntegral(int channel, bool isT, int totBin);
+
+	private:
+		static const int nRows = nToTBins + 2;
+		int nChannels;
+		int *nBinsT;
+		int *nBinsE;
+		uint32_t **data;
+
+		uint32_t *allocate(int channel);
+		uint32_t *getRow(int channel, bool isT, int row);
+	};
+
+}}
+#endif
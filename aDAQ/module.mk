@@ -9,7 +9,7 @@ CPPFLAGS := $(CPPFLAGS) -I.
 
 CPPFLAGS := $(CPPFLAGS)
 
-LIBS := $(LIBS) $(GLIBS) -L$(shell root-config --libdir --libs) $(shell root-config --auxlibs) -lMinuit -lboost_filesystem -lboost_regex -lboost_system
+LIBS := $(LIBS) $(GLIBS) -L$(shell root-config --libdir --libs) $(shell root-config --auxlibs) -lMinuit -lMinuit2 -lboost_filesystem -lboost_regex -lboost_system
 CPPFLAGS := $(CPPFLAGS) -I$(shell root-config --incdir --cflags)
 
 CPPFLAGS := $(CPPFLAGS) -I../daqd/
@@ -316,6 +316,23 @@ class ClockNotOK(Exception):
         return "Clock not locked at port %d, slave %d" % (self.__portID, self.__slaveID)
 
 
+# TOFPET ASIC commands
+tofpetCommandInfo = {
+    # commandID: (code,   ch,   read, data length)
+    "wrChCfg": (0b0000, True, False, 53),
+    "rdChCfg": (0b0001, True, True, 53),
+    "wrChTCfg": (0b0010, True, False, 1),
+    "rdChTCfg": (0b0011, True, True, 1),
+    "rdChDark": (0b0100, True, True, 10),
+
+    "wrGlobalCfg": (0b1000, False, False, 26 + 14 * 6),
+    "rdGlobalCfg": (0b1001, False, True, 26 + 14 * 6),
+    "wrGlobalTCfg": (0b1100, False, False, 7),
+    "rdGlobalTCfg": (0b1101, False, True, 7),
+    "wrTestPulse": (0b1010, False, False, 10 + 8 + 8)
+}
+
+
 # A class that contains all methods related to connection, control and data transmission to/from the
 # system via the "daqd" interface
 # noinspection PySimplifyBooleanCheck
@@ -536,6 +553,23 @@ class ATB:
         rxBad = binToInt(grayToBin(intToBin(rxBad, 48)))
         return tx, rx, rxBad
 
+    # Returns daqd's frame counters, which tell frames lost in the hardware
+    # (flagged lost, missing frame IDs) apart from frames dropped by daqd
+    def getFrameCounters(self):
+        template = "@HH"
+        n = struct.calcsize(template)
+        data = struct.pack(template, 0x15, n)
+        self.__socket.send(data)
+
+        names = ["framesReceived", "framesFlaggedLost", "framesMissing", "framesMalformed",
+                 "framesDroppedEmptyLost", "framesDroppedRingFull", "resyncs",
+                 "ringHighWaterFrames", "ringHighWaterBytes"]
+        template = "@H" + "Q" * len(names)
+        n = struct.calcsize(template)
+        data = self.__recvAll(n)
+        values = struct.unpack(template, data)
+        return dict(zip(names, values[1:]))
+
     # Returns a 3 element tuple with the number of transmitted, received, and error packets for a given FEB/D
     # @param portID  DAQ port ID where the FEB/D is connected
     # @param slaveID Slave ID on the FEB/D chain
@@ -741,6 +775,65 @@ class ATB:
 
         return reply
 
+    # Reads exactly n bytes from the daqd socket
+    def __recvAll(self, n):
+        data = ""
+        while len(data) < n:
+            chunk = self.__socket.recv(n - len(data))
+            if chunk == "":
+                raise socket.error("daqd closed the connection")
+            data = data + chunk
+        return data
+
+    # Sends several commands to the FPGA in one daqd request. daqd keeps several of them
+    # in flight and matches the replies by serial number, saving one round trip per command.
+    # @param commands List of (portID, slaveID, commandType, payload)
+    # @param maxTries The maximum number of attempts to send a command without obtaining a valid reply
+    # @return The list of replies, in the same order as commands
+    def sendCommands(self, commands, maxTries=10):
+        maxBatchSize = 256
+        replies = [None for c in commands]
+        pending = range(len(commands))
+        nTries = 0
+        while len(pending) > 0 and nTries < maxTries:
+            nTries = nTries + 1
+            if nTries > 5:
+                print "Timeout sending %d commands. Retry %d of %d" % (len(pending), nTries, maxTries)
+
+            stillPending = []
+            for k in range(0, len(pending), maxBatchSize):
+                batch = pending[k:k + maxBatchSize]
+                body = struct.pack("@H", len(batch))
+                for i in batch:
+                    portID, slaveID, commandType, payload = commands[i]
+                    sn = self.__lastSN
+                    self.__lastSN = (sn + 1) & 0x7FFF
+                    rawFrame = str(bytearray(
+                        [portID & 0xFF, slaveID & 0xFF, (sn >> 8) & 0xFF, (sn >> 0) & 0xFF, commandType]) + payload)
+                    body = body + struct.pack("@H", len(rawFrame)) + rawFrame
+
+                template1 = "@HH"
+                n = struct.calcsize(template1) + len(body)
+                self.__socket.send(struct.pack(template1, 0x14, n) + body)
+
+                nReplies, = struct.unpack("@H", self.__recvAll(2))
+                assert nReplies == len(batch)
+                for i in batch:
+                    nn, = struct.unpack("@H", self.__recvAll(2))
+                    data = self.__recvAll(nn)
+                    if nn < 4:
+                        stillPending.append(i)
+                        continue
+                    replies[i] = bytearray(data[3:])
+
+            pending = stillPending
+
+        if len(pending) > 0:
+            portID, slaveID, commandType, payload = commands[pending[0]]
+            raise CommandErrorTimeout(portID, slaveID)
+
+        return replies
+
     # Writes in the FPGA register (Clock frequency, etc...)
     # @param regNum Identification of the register to be written
     # @param regValue The value to be written
@@ -773,22 +866,7 @@ class ATB:
     # @param value The actual value to be transmitted to the ASIC if it applies to the command type
     # @param If the command is destined to a specific channel, this parameter sets its ID.
     def __doTOFPETAsicCommand(self, asicID, command, value=None, channel=None):
-        commandInfo = {
-            # commandID: (code,   ch,   read, data length)
-            "wrChCfg": (0b0000, True, False, 53),
-            "rdChCfg": (0b0001, True, True, 53),
-            "wrChTCfg": (0b0010, True, False, 1),
-            "rdChTCfg": (0b0011, True, True, 1),
-            "rdChDark": (0b0100, True, True, 10),
-
-            "wrGlobalCfg": (0b1000, False, False, 26 + 14 * 6),
-            "rdGlobalCfg": (0b1001, False, True, 26 + 14 * 6),
-            "wrGlobalTCfg": (0b1100, False, False, 7),
-            "rdGlobalTCfg": (0b1101, False, True, 7),
-            "wrTestPulse": (0b1010, False, False, 10 + 8 + 8)
-        }
-
-        commandCode, isChannel, isRead, dataLength = commandInfo[command]
+        isRead = command[0:2] == "rd"
 
         # Avoid re-uploading this configuration if it's already in the chip
         cacheKey = (command, asicID, channel)
@@ -800,6 +878,81 @@ class ATB:
             except KeyError:
                 pass
 
+        portID, slaveID, cmd = self.__buildTOFPETAsicCommand(asicID, command, value=value, channel=channel)
+        reply = self.sendCommand(portID, slaveID, 0x00, cmd)
+        status, data = self.__checkTOFPETAsicReply(asicID, command, reply)
+
+        if isRead:
+            return status, data
+        else:
+            # Check what we wrote
+            readCommand = 'rd' + command[2:]
+            readStatus, readValue = self.__doTOFPETAsicCommand(asicID, readCommand, channel=channel)
+            if readValue != value:
+                raise tofpet.ConfigurationErrorBadRead(portID, slaveID, asicID % 16, value, readValue)
+
+            self.__asicConfigCache[cacheKey] = bitarray(value)
+            return status, None
+
+    # Writes several configuration words to one ASIC, sending all the writes and then all the
+    # read backs as pipelined command batches. Entries which fail are retried with doTOFPETAsicCommand.
+    # @param asicID Identification of the ASIC that will receive the commands
+    # @param writes List of (command, channel, value), with command being one of the "wr" commands
+    def doTOFPETAsicWrites(self, asicID, writes):
+        # Skip what's already in the chip
+        todo = []
+        for command, channel, value in writes:
+            cacheKey = (command, asicID, channel)
+            if self.__asicConfigCache.get(cacheKey) != value:
+                todo.append((command, channel, value))
+
+        if len(todo) == 0:
+            return
+
+        failed = []
+        try:
+            commands = []
+            for command, channel, value in todo:
+                portID, slaveID, cmd = self.__buildTOFPETAsicCommand(asicID, command, value=value, channel=channel)
+                commands.append((portID, slaveID, 0x00, cmd))
+            replies = self.sendCommands(commands)
+
+            written = []
+            for (command, channel, value), reply in zip(todo, replies):
+                try:
+                    self.__checkTOFPETAsicReply(asicID, command, reply)
+                    written.append((command, channel, value))
+                except tofpet.ConfigurationError:
+                    failed.append((command, channel, value))
+
+            commands = []
+            for command, channel, value in written:
+                portID, slaveID, cmd = self.__buildTOFPETAsicCommand(asicID, 'rd' + command[2:], channel=channel)
+                commands.append((portID, slaveID, 0x00, cmd))
+            replies = self.sendCommands(commands)
+
+            for (command, channel, value), reply in zip(written, replies):
+                try:
+                    readStatus, readValue = self.__checkTOFPETAsicReply(asicID, 'rd' + command[2:], reply)
+                except tofpet.ConfigurationError:
+                    readValue = None
+                if readValue != value:
+                    failed.append((command, channel, value))
+                else:
+                    self.__asicConfigCache[(command, asicID, channel)] = bitarray(value)
+
+        except CommandErrorTimeout:
+            # Fall back to one command at a time for whatever is not confirmed
+            failed = [w for w in todo if self.__asicConfigCache.get((w[0], asicID, w[1])) != w[2]]
+
+        for command, channel, value in failed:
+            self.doTOFPETAsicCommand(asicID, command, value=value, channel=channel)
+
+    # Encodes a TOFPET ASIC command
+    # @return A tuple (portID, slaveID, command bytes)
+    def __buildTOFPETAsicCommand(self, asicID, command, value=None, channel=None):
+        commandCode, isChannel, isRead, dataLength = tofpetCommandInfo[command]
+
         byte0 = [(commandCode << 4) + (asicID & 0x0F)]
         if isChannel:
 
@@ -818,9 +971,15 @@ class ATB:
 
         cmd = bytearray(byte0 + byte1 + byteX)
 
+        portID, slaveID, lAsicID = self.asicIDGlobalToTuple(asicID)
+        return portID, slaveID, cmd
+
+    # Checks the reply to a TOFPET ASIC command
+    # @return A tuple (status, data), data being None for write commands
+    def __checkTOFPETAsicReply(self, asicID, command, reply):
+        commandCode, isChannel, isRead, dataLength = tofpetCommandInfo[command]
         portID, slaveID, lAsicID = self.asicIDGlobalToTuple(asicID)
 
-        reply = self.sendCommand(portID, slaveID, 0x00, cmd)
         if len(reply) < 2:
             raise tofpet.ConfigurationErrorBadReply(2, len(reply))
         status = reply[1]
@@ -846,13 +1005,6 @@ class ATB:
             # print data
             return status, data[0:dataLength]
         else:
-            # Check what we wrote
-            readCommand = 'rd' + command[2:]
-            readStatus, readValue = self.__doTOFPETAsicCommand(asicID, readCommand, channel=channel)
-            if readValue != value:
-                raise tofpet.ConfigurationErrorBadRead(portID, slaveID, asicID % 16, value, readValue)
-
-            self.__asicConfigCache[cacheKey] = bitarray(value)
             return status, None
 
     # Turns on LDO for STICv3 FEB/A boards
@@ -1516,7 +1668,8 @@ class ATB:
                "%e" % cWindow, "%e" % self.config.triggerMinimumToT,
                "%e" % self.config.triggerPreWindow, "%e" % self.config.triggerPostWindow,
                self.__tempChannelMapFile.name, self.__tempTriggerMapFile.name,
-               "%e" % self.config.cutToT
+               "%e" % self.config.cutToT,
+               self.__socketPath
                ]
         self.__acquisitionPipe = Popen(cmd, bufsize=1, stdin=PIPE, stdout=PIPE, close_fds=True)
 
@@ -1533,76 +1686,24 @@ class ATB:
     def acquire(self, step1, step2, acquisitionTime):
         # print "Python:: acquiring %f %f"  % (step1, step2)
         (pin, pout) = (self.__acquisitionPipe.stdin, self.__acquisitionPipe.stdout)
-        nRequiredFrames = int(acquisitionTime / self.__frameLength)
 
-        template1 = "@ffIIi"
-        template2 = "@I"
-        n1 = struct.calcsize(template1)
+        # writeRaw follows daqd's pointers and decodes the frames itself, see StepCommand in aDAQ/Common/BlockHeader.hpp
+        template1 = "@ffff"
+        template2 = "@qqq"
         n2 = struct.calcsize(template2)
 
         self.doSync()
-        wrPointer, rdPointer = (0, 0)
-        while wrPointer == rdPointer:
-            wrPointer, rdPointer = self.__getDataFrameWriteReadPointer()
-
-        bs = self.__dshm.getSizeInFrames()
-        index = rdPointer % bs
-        startFrame = self.__dshm.getFrameID(index)
-        stopFrame = startFrame + nRequiredFrames
-
         t0 = time()
-        nBlocks = 0
-        currentFrame = startFrame
-        nFrames = 0
-        lastUpdateFrame = currentFrame
-        while currentFrame < stopFrame:
-            wrPointer, rdPointer = self.__getDataFrameWriteReadPointer()
-            while wrPointer == rdPointer:
-                wrPointer, rdPointer = self.__getDataFrameWriteReadPointer()
-
-            nFramesInBlock = abs(wrPointer - rdPointer)
-            if nFramesInBlock > bs:
-                nFramesInBlock = 2 * bs - nFramesInBlock
-
-            # Do not feed more than bs/2 frame blocks to writeRaw in a single call
-            # Because the entire frame block won't be freed until writeRaw is done, we can end up in a situation
-            # where writeRaw owns all frames and daqd has no buffer space, even if writeRaw has already processed
-            # some/most of the frame block
-            if nFramesInBlock > bs / 2:
-                wrPointer = (rdPointer + bs / 2) % (2 * bs)
-
-            data = struct.pack(template1, step1, step2, wrPointer, rdPointer, 0)
-            pin.write(data)
-            pin.flush()
-
-            data = pout.read(n2)
-            rdPointer, = struct.unpack(template2, data)
-
-            index = (rdPointer + bs - 1) % bs
-            currentFrame = self.__dshm.getFrameID(index)
-
-            self.__setDataFrameReadPointer(rdPointer)
-
-            nFrames = currentFrame - startFrame + 1
-            nBlocks += 1
-            if (currentFrame - lastUpdateFrame) * self.__frameLength > 0.1:
-                t1 = time()
-                stdout.write(
-                    "Python:: Acquired %d frames in %4.1f seconds, corresponding to %4.1f seconds of data (delay = %4.1f)\r" % (
-                        nFrames, t1 - t0, nFrames * self.__frameLength, (t1 - t0) - nFrames * self.__frameLength))
-                stdout.flush()
-                lastUpdateFrame = currentFrame
-        t1 = time()
-        print "Python:: Acquired %d frames in %4.1f seconds, corresponding to %4.1f seconds of data (delay = %4.1f)" % (
-            nFrames, time() - t0, nFrames * self.__frameLength, (t1 - t0) - nFrames * self.__frameLength)
-
-        data = struct.pack(template1, step1, step2, wrPointer, rdPointer, 1)
+        data = struct.pack(template1, step1, step2, acquisitionTime, 0)
         pin.write(data)
         pin.flush()
 
         data = pout.read(n2)
-        rdPointer, = struct.unpack(template2, data)
-        self.__setDataFrameReadPointer(rdPointer)
+        nDecodedFrames, startFrame, lastFrame = struct.unpack(template2, data)
+        t1 = time()
+        nFrames = lastFrame - startFrame + 1
+        print "Python:: Acquired %d frames in %4.1f seconds, corresponding to %4.1f seconds of data (delay = %4.1f)" % (
+            nFrames, t1 - t0, nFrames * self.__frameLength, (t1 - t0) - nFrames * self.__frameLength)
 
         return None
 
@@ -1716,10 +1817,9 @@ class ATB:
             if cc.getValue("vth_E") < thresholdClamp:
                 cc.setValue("vth_E", thresholdClamp)
 
-            self.doTOFPETAsicCommand(asic, "wrChCfg", channel=n, value=cc)
-
-        for n, cc in enumerate(ac.channelTConfig):
-            self.doTOFPETAsicCommand(asic, "wrChTCfg", channel=n, value=cc)
+        writes = [("wrChCfg", n, cc) for n, cc in enumerate(ac.channelConfig)]
+        writes += [("wrChTCfg", n, cc) for n, cc in enumerate(ac.channelTConfig)]
+        self.doTOFPETAsicWrites(asic, writes)
         # stdout.write("CH %2dT " %n);stdout.flush()
 
         portID, slaveID, lAsicID = self.asicIDGlobalToTuple(asic)
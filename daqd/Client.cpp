@@ -7,12 +7,13 @@ using namespace std;
 using namespace DAQd;
 
 Client::Client(int socket, FrameServer *frameServer)
-: socket(socket), frameServer(frameServer)
+: socket(socket), frameServer(frameServer), consumerID(0)
 {
 }
 
 Client::~Client()
 {
+	frameServer->unregisterConsumer(consumerID);
 	close(socket);
 }
 
@@ -22,7 +23,7 @@ int Client::handleRequest()
 {	
 	CmdHeader_t cmdHeader;
 	
-	int nBytesRead = recv(socket, socketBuffer, sizeof(cmdHeader), 0);
+	int nBytesRead = recv(socket, socketBuffer, sizeof(cmdHeader), MSG_WAITALL);
 	if(nBytesRead !=  sizeof(cmdHeader)) {
 		fprintf(stderr, "Could not read() %u bytes from client %d\n", sizeof(CmdHeader_t), socket);
 		return -1;
@@ -35,7 +36,7 @@ int Client::handleRequest()
 	
 	int nBytesNext = cmdHeader.length - sizeof(CmdHeader_t);
 	if(nBytesNext > 0) {
-		if(recv(socket, socketBuffer+sizeof(CmdHeader_t), nBytesNext, 0) != nBytesNext) {
+		if(recv(socket, socketBuffer+sizeof(CmdHeader_t), nBytesNext, MSG_WAITALL) != nBytesNext) {
 			fprintf(stderr, "Could not read() %d bytes from client %d\n", nBytesNext, socket);
 			return -1;
 		}
@@ -53,6 +54,8 @@ int Client::handleRequest()
 		actionStatus = doSetDataFrameReadPointer();
 	else if(cmdHeader.type == commandToFrontEnd)
 		actionStatus = doCommandToFrontEnd(nBytesNext);
+	else if(cmdHeader.type == commandToFrontEndBatch)
+		actionStatus = doCommandToFrontEndBatch(nBytesNext);
 	else if(cmdHeader.type == commandGetPortUp) 
 		actionStatus = doGetPortUp();
 	else if(cmdHeader.type == commandGetPortCounts) 
@@ -63,8 +66,12 @@ int Client::handleRequest()
 		actionStatus = doSetTrigger();
 	else if(cmdHeader.type == commandSetIdleTimeCalculation)
 		actionStatus = doSetIdleTimeCalculation();
-	else if(cmdHeader.type = commandSetGateEnable)
+	else if(cmdHeader.type == commandSetGateEnable)
 		actionStatus = doSetGateEnable();
+	else if(cmdHeader.type == commandRegisterDataFrameConsumer)
+		actionStatus = doRegisterDataFrameConsumer();
+	else if(cmdHeader.type == commandGetFrameCounters)
+		actionStatus = doGetFrameCounters();
 	
 	if(actionStatus == -1) {
 		fprintf(stderr, "Error handling client %d, command was %u\n", socket, unsigned(cmdHeader.type));
@@ -89,6 +96,57 @@ int Client::doCommandToFrontEnd(int commandLength)
 	return 0;
 }
 
+// Request: uint16 nCommands, then for each command an uint16 length and
+// the same bytes as commandToFrontEnd (portID, slaveID, SN, ...)
+// Reply: uint16 nCommands, then for each command an uint16 length (0 if it timed out) and the reply
+int Client::doCommandToFrontEndBatch(int commandLength)
+{
+	static const int MaxCommandSize = 256;
+	unsigned char *p = socketBuffer + sizeof(CmdHeader_t);
+	unsigned char *pEnd = p + commandLength;
+	
+	uint16_t nCommands;
+	if(p + sizeof(nCommands) > pEnd) return -1;
+	memcpy(&nCommands, p, sizeof(nCommands));
+	p += sizeof(nCommands);
+	
+	std::vector<char> buffers(nCommands * MaxCommandSize);
+	std::vector<FrontEndCommand> commands(nCommands);
+	for(int i = 0; i < nCommands; i++) {
+		uint16_t length;
+		if(p + sizeof(length) > pEnd) return -1;
+		memcpy(&length, p, sizeof(length));
+		p += sizeof(length);
+		if(length < 2 || length > MaxCommandSize || p + length > pEnd) return -1;
+		
+		FrontEndCommand &c = commands[i];
+		c.portID = p[0];
+		c.slaveID = p[1];
+		c.buffer = &buffers[i * MaxCommandSize];
+		c.bufferSize = MaxCommandSize;
+		c.commandLength = length - 2;
+		c.replyLength = 0;
+		memcpy(c.buffer, p + 2, c.commandLength);
+		p += length;
+	}
+	
+	if(nCommands > 0)
+		frameServer->sendCommandBatch(&commands[0], nCommands);
+	
+	std::vector<char> reply;
+	reply.insert(reply.end(), (char *)&nCommands, (char *)&nCommands + sizeof(nCommands));
+	for(int i = 0; i < nCommands; i++) {
+		FrontEndCommand &c = commands[i];
+		uint16_t trl = c.replyLength;
+		reply.insert(reply.end(), (char *)&trl, (char *)&trl + sizeof(trl));
+		reply.insert(reply.end(), c.buffer, c.buffer + c.replyLength);
+	}
+	
+	int status = send(socket, &reply[0], reply.size(), MSG_NOSIGNAL);
+	if(status < (int)reply.size()) return -1;
+	return 0;
+}
+
 int Client::doAcqOnOff()
 {
 
@@ -112,7 +170,7 @@ int Client::doGetDataFrameWriteReadPointer()
 	struct { uint16_t length; uint32_t wrPointer; uint32_t rdPointer; }  header;
 	header.length = sizeof(header);
 	header.wrPointer = frameServer->getDataFrameWritePointer();
-	header.rdPointer = frameServer->getDataFrameReadPointer();
+	header.rdPointer = frameServer->getDataFrameReadPointer(consumerID);
 
 	int status = send(socket, &header, sizeof(header), MSG_NOSIGNAL);
 	if(status < sizeof(header)) return -1;
@@ -123,7 +181,7 @@ int Client::doSetDataFrameReadPointer()
 {
 	uint32_t readPointer;
 	memcpy(&readPointer, socketBuffer + sizeof(CmdHeader_t), sizeof(readPointer));	
-	frameServer->setDataFrameReadPointer(readPointer);	
+	frameServer->setDataFrameReadPointer(consumerID, readPointer);
 	int status = send(socket, &readPointer, sizeof(readPointer), MSG_NOSIGNAL);
 	if(status < sizeof(readPointer)) return -1;
 	return 0;
@@ -136,8 +194,8 @@ int Client::doGetDataFrameSharedMemoryName()
 	
 	struct { uint16_t length;  uint64_t sizes[3]; } header;
 	header.length = sizeof(header) + strlen(name);
-	header.sizes[0] = sizeof(DataFrame);
-	header.sizes[1] = 0;
+	header.sizes[0] = frameServer->getDataFrameSharedMemorySize();
+	header.sizes[1] = frameServer->getDataFrameQueueSize();
 	header.sizes[2] = 0;
 	
 	int status = 0;
@@ -224,4 +282,32 @@ int Client::doSetGateEnable()
 	int status = send(socket, &reply, sizeof(reply), MSG_NOSIGNAL);
 	if(status < sizeof(reply)) return -1;
 	return 0;
-}
\ No newline at end of file
+}
+
+int Client::doRegisterDataFrameConsumer()
+{
+	uint32_t mode;
+	memcpy(&mode, socketBuffer + sizeof(CmdHeader_t), sizeof(mode));
+	
+	// Mode 0 registers a mandatory consumer, mode 1 a lossy one
+	// A client holds at most one consumer
+	frameServer->unregisterConsumer(consumerID);
+	int newConsumerID = frameServer->registerConsumer(mode == 1);
+	consumerID = newConsumerID > 0 ? newConsumerID : 0;
+
+	int32_t reply = newConsumerID;
+	int status = send(socket, &reply, sizeof(reply), MSG_NOSIGNAL);
+	if(status < (int)sizeof(reply)) return -1;
+	return 0;
+}
+
+int Client::doGetFrameCounters()
+{
+	struct { uint16_t length; FrameCounters counters; } reply;
+	reply.length = sizeof(reply);
+	frameServer->getFrameCounters(&reply.counters);
+	
+	int status = send(socket, &reply, sizeof(reply), MSG_NOSIGNAL);
+	if(status < (int)sizeof(reply)) return -1;
+	return 0;
+}
@@ -3,6 +3,7 @@
 
 #include "FrameServer.hpp"
 #include <map>
+#include <vector>
 
 namespace DAQd {
 	
@@ -17,18 +18,23 @@ private:
 	int socket;
 	unsigned char socketBuffer[16*1024];
 	FrameServer *frameServer;
+	// Consumer whose read pointer is used by this client; 0 is the shared legacy consumer
+	int consumerID;
 	
 	int doAcqOnOff();
 	int doGetDataFrameSharedMemoryName();
 	int doGetDataFrameWriteReadPointer();
 	int doSetDataFrameReadPointer();
 	int doCommandToFrontEnd(int commandLength);
+	int doCommandToFrontEndBatch(int commandLength);
 	int doGetPortUp();
 	int doGetPortCounts();
 	int doSetSorter();
 	int doSetTrigger();
 	int doSetIdleTimeCalculation();
 	int doSetGateEnable();
+	int doRegisterDataFrameConsumer();
+	int doGetFrameCounters();
 };
 
 }
@@ -29,18 +29,27 @@ const uint64_t IDLE_WORD = 0xFFFFFFFFFFFFFFFFULL;
 const uint64_t HEADER_WORD = 0xFFFFFFFFFFFFFFF5ULL;
 const uint64_t TRAILER_WORD = 0xFFFFFFFFFFFFFFFAULL;
 
-DAQFrameServer::DAQFrameServer(AbstractDAQCard *card, int nFEB, int *feTypeMap, int debugLevel)
-  : FrameServer(nFEB, feTypeMap, debugLevel), DP(card)
+DAQFrameServer::DAQFrameServer(AbstractDAQCard *card, int nFEB, int *feTypeMap, int debugLevel, const FrameRingConfig &ringConfig)
+  : FrameServer(nFEB, feTypeMap, debugLevel, ringConfig), DP(card)
 {
 	
 	printf("allocated DP object = %p\n", DP);
 	
 	startWorker();
+	
+	replyWorkerDie = false;
+	pthread_create(&replyWorker, NULL, runReplyWorker, (void*)this);
 }
 
 
 DAQFrameServer::~DAQFrameServer()
 {
+	replyWorkerDie = true;
+	pthread_mutex_lock(&replyLock);
+	pthread_cond_signal(&condPendingCommands);
+	pthread_mutex_unlock(&replyLock);
+	pthread_join(replyWorker, NULL);
+	
 	stopWorker();
 	printf("DAQFrameServer::~DAQFrameServer\n");
 	delete DP;	
@@ -59,62 +68,41 @@ void DAQFrameServer::stopAcquisition()
  	FrameServer::stopAcquisition();
 }
 
-int DAQFrameServer::sendCommand(int portID, int slaveID, char *buffer, int bufferSize, int commandLength)
+int DAQFrameServer::transmitCommand(int portID, int slaveID, char *buffer, int commandLength)
 {
-	uint16_t sentSN = (unsigned(buffer[0]) << 8) + unsigned(buffer[1]);	
-
-	boost::posix_time::ptime t1 = boost::posix_time::microsec_clock::local_time();
-	DP->sendCommand(portID, slaveID, buffer,bufferSize, commandLength);
-	
+	return DP->sendCommand(portID, slaveID, buffer, commandLength, commandLength) < 0 ? -1 : 0;
+}
 
-	boost::posix_time::ptime t2 = boost::posix_time::microsec_clock::local_time();
+void *DAQFrameServer::runReplyWorker(void *arg)
+{
+	DAQFrameServer *m = (DAQFrameServer *)arg;
+	return m->doReplyWork();
+}
 
-	int replyLength = 0;
-	int nLoops = 0;
+void *DAQFrameServer::doReplyWork()
+{
 	char replyBuffer[12*4];
-	do {
-		boost::posix_time::ptime tl = boost::posix_time::microsec_clock::local_time();
-		if((tl - t2).total_milliseconds() > CommandTimeout) break;
-
-		int status = DP->recvReply(replyBuffer, 12*4);
-		if (status < 0) {
-			continue; // Timed out and did not receive a reply
+	while(!replyWorkerDie) {
+		// Only poll the card while someone is waiting for a reply
+		pthread_mutex_lock(&replyLock);
+		if(pendingCommands.empty() && !replyWorkerDie) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100000000L; // 100 ms
+			ts.tv_sec += (ts.tv_nsec / 1000000000L);
+			ts.tv_nsec = (ts.tv_nsec % 1000000000L);
+			pthread_cond_timedwait(&condPendingCommands, &replyLock, &ts);
 		}
+		bool waiting = !pendingCommands.empty();
+		pthread_mutex_unlock(&replyLock);
+		if(!waiting) continue;
 		
-		if(status < 2) { // Received something weird
-			fprintf(stderr, "Received very short reply: %d bytes\n", status);
-			continue;
-		}
+		int status = DP->recvReply(replyBuffer, sizeof(replyBuffer));
+		if(status < 0) continue; // Timed out and did not receive a reply
 		
-		uint16_t recvSN = (unsigned(replyBuffer[0]) << 8) + replyBuffer[1];
-		if(sentSN != recvSN) {
-			fprintf(stderr, "Mismatched SN: sent %6hx, got %6hx\n", sentSN, recvSN);
-			continue;
-		}
-	
-		// Got what looks like a valid reply with the correct SN
-		replyLength = status;
-		memcpy(buffer, replyBuffer, replyLength);		
-	} while(replyLength == 0);	
-	
-	boost::posix_time::ptime t3 = boost::posix_time::microsec_clock::local_time();
-	
-	if (replyLength == 0 ) {
-		printf("Command reply timing: (t2 - t1) => %ld us, (t3 - t2) => %ld us, i = %d, status = %s\n", 
-			(t2 - t1).total_microseconds(), 
-			(t3 - t2).total_microseconds(),
-			nLoops,
-			replyLength > 0 ? "OK" : "FAIL"
-		);
+		dispatchReply(replyBuffer, status);
 	}
-	
-	return replyLength;
-}
-
-
-static bool isFull(unsigned writePointer, unsigned readPointer)
-{
-	return (writePointer != readPointer) && ((writePointer % MaxDataFrameQueueSize) == (readPointer % MaxDataFrameQueueSize));
+	return NULL;
 }
 
 void *DAQFrameServer::doWork()
@@ -124,12 +112,9 @@ void *DAQFrameServer::doWork()
 	printf("DP object is %p\n", DP);
 	DAQFrameServer *m = this;
 	
-	DataFrame *devNull = new DataFrame;
+	DataFrame *dataFrame = new DataFrame;
 	
 	
-	long nFramesFound = 0;
-	long nFramesPushed = 0;
-
 	const int maxSkippedLoops = 32*1024;
 	int skippedLoops = 0;
 	bool lastFrameWasBad = true;
@@ -151,6 +136,8 @@ void *DAQFrameServer::doWork()
 			//printf("DBG1 %016llx\n", headerWords[0]);
 			if(nWords != 1) { skippedLoops = 1000001; continue; }			
 			if(headerWords[0] != IDLE_WORD) { skippedLoops++; continue; }
+			// Back in sync after losing track of the data stream
+			if(frameCount > 0) counters->resyncs++;
 		}
 		lastFrameWasBad = false;
 
@@ -168,15 +155,12 @@ void *DAQFrameServer::doWork()
 		//printf("DBG3 %016llx\n", headerWords[0]);
 
 
-		unsigned long long frameSource = (headerWords[0] >> 54) & 0x400;
-		unsigned long long frameType = (headerWords[0] >> 51) & 0x7;
 		unsigned long long frameSize = (headerWords[0] >> 36) & 0x7FFF;
-		unsigned long long frameID = (headerWords[0] ) & 0xFFFFFFFFF;
 		unsigned long long nEvents = headerWords[1] & 0xFFFF;
 		bool frameLost = (headerWords[1] & 0x10000) != 0;
 
 		if(frameSize > MaxDataFrameSize) {
-			fprintf(stderr, "Excessive frame size: %u\n word (max is %u)", frameSize, MaxDataFrameSize);
+			fprintf(stderr, "Excessive frame size: %llu\n word (max is %u)", frameSize, MaxDataFrameSize);
 			lastFrameWasBad = true; skippedLoops = 1000007; continue;
 		}
 
@@ -185,16 +169,6 @@ void *DAQFrameServer::doWork()
 		bool dropLostFrame = (nEvents == 0) && frameLost &&  (frameCount % 128 != 0);
 		frameCount += 1;
 
-		DataFrame *dataFrame = devNull;
-		if (m->acquisitionMode != 0 && !dropLostFrame) {
-			// Get a free frame from the queue, if possible
-			// If not, just carry on with the devNull frame
-			pthread_mutex_lock(&m->lock);
-			if(!isFull(m->dataFrameWritePointer, m->dataFrameReadPointer)) {
-				dataFrame = &dataFrameSharedMemory[m->dataFrameWritePointer % MaxDataFrameQueueSize];
-			}
-			pthread_mutex_unlock(&m->lock);
-		}
 		if(die) break;
 		
 		
@@ -220,14 +194,15 @@ void *DAQFrameServer::doWork()
 		if (!m->parseDataFrame(dataFrame))
 			continue;
 
-		if(dataFrame != devNull) {
-			pthread_mutex_lock(&m->lock);
-			m->dataFrameWritePointer = (m->dataFrameWritePointer + 1)  % (2*MaxDataFrameQueueSize);
-			pthread_mutex_unlock(&m->lock);
-		}
+		// If the ring is full, the frame is dropped
+		if (m->acquisitionMode != 0 && dropLostFrame)
+			counters->framesDroppedEmptyLost++;
+		else if (m->acquisitionMode != 0) 
+			m->pushDataFrame(dataFrame);
 	}	
-	delete devNull;
+	delete dataFrame;
 	printf("DAQFrameServer::runWorker exiting...\n");
+	return NULL;
 }
 
 uint64_t DAQFrameServer::getPortUp()
@@ -28,11 +28,9 @@ public:
 class DAQFrameServer : public FrameServer
 {
 public:
-	DAQFrameServer(AbstractDAQCard *card, int nFEB, int *feTypeMap, int debugLevel);
+	DAQFrameServer(AbstractDAQCard *card, int nFEB, int *feTypeMap, int debugLevel, const FrameRingConfig &ringConfig);
 	virtual ~DAQFrameServer();	
 
-
-	int sendCommand(int portID, int slaveID, char *buffer, int bufferSize, int commandLength);
 	
 	virtual void startAcquisition(int mode);
 	virtual void stopAcquisition();
@@ -45,8 +43,14 @@ public:
 private:
 	AbstractDAQCard *DP;
 	
+	// Reads command replies from the card and hands them to dispatchReply()
+	volatile bool replyWorkerDie;
+	pthread_t replyWorker;
+	static void *runReplyWorker(void *);
+	void *doReplyWork();
+	
 protected:
-
+	int transmitCommand(int portID, int slaveID, char *buffer, int commandLength);
 	void * doWork();
 	
 };
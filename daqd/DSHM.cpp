@@ -72,6 +72,8 @@ BOOST_PYTHON_MODULE(DSHM)
 		.def("getTACID", &SHM::getTACID)
 		.def("getTACIdleTime", &SHM::getTACIdleTime)
 		.def("getChannelIdleTime", &SHM::getChannelIdleTime)
+		.def("getFrameSequence", &SHM::getFrameSequence)
+		.def("waitForFrames", &SHM::waitForFrames)
 		//.def("getRawFrame", &SHM::getRawFrame)
 		.def("getNumpyFrame", &frame2numpy)
 	;
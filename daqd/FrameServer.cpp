@@ -7,55 +7,140 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>  
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "boost/date_time/posix_time/posix_time.hpp"
 
 using namespace DAQd;
 
 static const char *shmObjectPath = "/daqd_shm";
 
-FrameServer::FrameServer(int nFEB, int *feTypeMap, int debugLevel)
+FrameServer::FrameServer(int nFEB, int *feTypeMap, int debugLevel, const FrameRingConfig &ringConfig)
 	: debugLevel(debugLevel)
 {
+	nFrameSlots = ringConfig.nFrames;
+	frameDataSize = (ringConfig.dataSize + 7) & ~7ULL;
+	notifyFrames = ringConfig.notifyFrames > 0 ? ringConfig.notifyFrames : 1;
+	notifyInterval = ringConfig.notifyInterval;
+	notifyPending = 0;
+	hasNotifier = false;
+	frameFlags = 0;
+#ifndef __NO_CHANNEL_IDLE_TIME__
+	frameFlags |= SHMHasIdleTime;
+#endif
+#ifdef __ENDOTOFPET__
+	frameFlags |= SHMHasFeType;
+#endif
+	if(nFrameSlots < 2 || frameDataSize < 2 * sizeof(uint64_t) * packedFrameWords(MaxDataFrameSize, frameFlags)) {
+		fprintf(stderr, "Frame ring is too small: %u frames, %llu bytes\n", nFrameSlots, (unsigned long long)frameDataSize);
+		exit(1);
+	}
 
+	unsigned long long slotsSize = ((nFrameSlots * sizeof(FrameSlot)) + 4095) & ~4095ULL;
+	dataFrameSharedMemorySize = SHMHeaderSize + slotsSize + frameDataSize;
 	
-	dataFrameSharedMemory_fd = shm_open(shmObjectPath, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if(ringConfig.hugePagesPath == NULL) {
+		dataFrameSharedMemoryName = shmObjectPath;
+		dataFrameSharedMemoryIsFile = false;
+		dataFrameSharedMemory_fd = shm_open(shmObjectPath, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	}
+	else {
+		// hugetlbfs files are always backed by huge pages, sizes must be a multiple of the page size
+		struct statfs fs;
+		if(statfs(ringConfig.hugePagesPath, &fs) != 0 || fs.f_type != HUGETLBFS_MAGIC) {
+			fprintf(stderr, "%s is not a hugetlbfs mount\n", ringConfig.hugePagesPath);
+			exit(1);
+		}
+		unsigned long long pageSize = fs.f_bsize;
+		dataFrameSharedMemorySize = ((dataFrameSharedMemorySize + pageSize - 1) / pageSize) * pageSize;
+
+		dataFrameSharedMemoryName = std::string(ringConfig.hugePagesPath) + shmObjectPath;
+		dataFrameSharedMemoryIsFile = true;
+		dataFrameSharedMemory_fd = open(dataFrameSharedMemoryName.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	}
 	if(dataFrameSharedMemory_fd < 0) {
 		perror("Error creating shared memory");
-		fprintf(stderr, "Check that no other instance is running and rm /dev/shm%s\n", shmObjectPath);
+		fprintf(stderr, "Check that no other instance is running and rm %s%s\n", 
+			dataFrameSharedMemoryIsFile ? "" : "/dev/shm", dataFrameSharedMemoryName.c_str());
 		exit(1);
 	}
 	
-	unsigned long dataFrameSharedMemorySize = MaxDataFrameQueueSize * sizeof(DataFrame);
-	ftruncate(dataFrameSharedMemory_fd, dataFrameSharedMemorySize);
+	if(ftruncate(dataFrameSharedMemory_fd, dataFrameSharedMemorySize) != 0) {
+		perror("Error sizing shared memory");
+		exit(1);
+	}
 	
-	dataFrameSharedMemory = (DataFrame *)mmap(NULL, 
+	dataFrameSharedMemory = (char *)mmap(NULL, 
 						  dataFrameSharedMemorySize, 
 						  PROT_READ | PROT_WRITE, 
 						  MAP_SHARED, 
 						  dataFrameSharedMemory_fd, 
 						  0);
-	if(dataFrameSharedMemory == NULL) {
+	if(dataFrameSharedMemory == MAP_FAILED) {
 		perror("Error mmaping() shared memory");
+		if(dataFrameSharedMemoryIsFile)
+			fprintf(stderr, "Check that enough huge pages are reserved (/proc/sys/vm/nr_hugepages)\n");
 		exit(1);
 	}
+#ifdef MADV_HUGEPAGE
+	// Best effort: only effective if shmem transparent huge pages are enabled
+	if(!dataFrameSharedMemoryIsFile)
+		madvise(dataFrameSharedMemory, dataFrameSharedMemorySize, MADV_HUGEPAGE);
+#endif
+
+	memset(dataFrameSharedMemory, 0, SHMHeaderSize);
+	shmHeader = (SHMHeader *)dataFrameSharedMemory;
+	frameSlots = (FrameSlot *)(dataFrameSharedMemory + SHMHeaderSize);
+	frameData = dataFrameSharedMemory + SHMHeaderSize + slotsSize;
+	shmHeader->flags = frameFlags;
+	shmHeader->nSlots = nFrameSlots;
+	shmHeader->slotsOffset = SHMHeaderSize;
+	shmHeader->dataOffset = SHMHeaderSize + slotsSize;
+	shmHeader->dataSize = frameDataSize;
+	shmHeader->writePosition = 0;
+	counters = &shmHeader->counters;
+	lastFrameID = -1;
+	// Magic goes in last, so that clients never see a partial header
+	__sync_synchronize();
+	memcpy(shmHeader->magic, SHMMagic, sizeof(SHMMagic));
+
+	printf("Frame ring has %u frames and %llu MiB of frame storage%s\n", 
+		nFrameSlots, (unsigned long long)(frameDataSize / (1024*1024)),
+		dataFrameSharedMemoryIsFile ? " (huge pages)" : "");
 
 	dataFrameWritePointer = 0;
+	stagedWritePointer = 0;
 	dataFrameReadPointer = 0;
+	for(int i = 0; i < MaxConsumers; i++) {
+		consumers[i].active = false;
+		consumers[i].lossy = false;
+		consumers[i].readPointer = 0;
+	}
+	consumers[0].active = true;
 	
 	pthread_mutex_init(&lock, NULL);
 	pthread_cond_init(&condCleanDataFrame, NULL);
 	pthread_cond_init(&condDirtyDataFrame, NULL);
-	pthread_cond_init(&condReplyQueue, NULL);
+	pthread_condattr_t notifyAttr;
+	pthread_condattr_init(&notifyAttr);
+	pthread_condattr_setclock(&notifyAttr, CLOCK_MONOTONIC);
+	pthread_cond_init(&condNotify, &notifyAttr);
+	pthread_condattr_destroy(&notifyAttr);
+	pthread_mutex_init(&replyLock, NULL);
+	pthread_cond_init(&condPendingCommands, NULL);
 	die = true;
 	acquisitionMode = 0;
 	hasWorker = false;
 	
-	printf("Size of frame is %u\n", sizeof(DataFrame));
 	
 	
 	this->feTypeMap = new int8_t[N_ASIC/16];
@@ -73,31 +158,6 @@ FrameServer::FrameServer(int nFEB, int *feTypeMap, int debugLevel)
 	for(int i = 0; i < N_ASIC * 64; i++) {
 		channelLastEventTime[i] = 0;
 	}	
-	
-	m_lut[ 0x7FFF ] = -1; // invalid state
-	uint16_t lfsr = 0x0000;
-	for ( int16_t n = 0; n < ( 1 << 15 ) - 1; ++n )
-	{
-		m_lut[ lfsr ] = n;
-		const uint8_t bits13_14 = lfsr >> 13;
-		uint8_t new_bit;
-		switch ( bits13_14 )
-		{ // new_bit = !(bit13 ^ bit14)
-			case 0x00:
-			case 0x03:
-				new_bit = 0x01;
-				break;
-			case 0x01:
-			case 0x02:
-				new_bit = 0x00;
-				break;
-		}// switch
-		lfsr = ( lfsr << 1 ) | new_bit; // add the new bit to the right
-		lfsr &= 0x7FFF; // throw away the 16th bit from the shift
-	}// for
-	assert ( lfsr == 0x0000 ); // after 2^15-1 steps we're back at 0
-// 	assert ( m_lut[ 0x7FFF ] == -1 ); // check that we didn't touch it	
-	
 }
 
 FrameServer::~FrameServer()
@@ -107,15 +167,177 @@ FrameServer::~FrameServer()
 	delete [] channelLastEventTime;
 	delete [] tacLastEventTime;
 
-	pthread_cond_destroy(&condReplyQueue);
+	pthread_cond_destroy(&condPendingCommands);
+	pthread_mutex_destroy(&replyLock);
+	pthread_cond_destroy(&condNotify);
 	pthread_cond_destroy(&condDirtyDataFrame);
 	pthread_cond_destroy(&condCleanDataFrame);
 	pthread_mutex_destroy(&lock);	
 	
-	unsigned long dataFrameSharedMemorySize = MaxDataFrameQueueSize * sizeof(DataFrame);
 	munmap(dataFrameSharedMemory, dataFrameSharedMemorySize);
-	shm_unlink(shmObjectPath);
+	close(dataFrameSharedMemory_fd);
+	if(dataFrameSharedMemoryIsFile)
+		unlink(dataFrameSharedMemoryName.c_str());
+	else
+		shm_unlink(shmObjectPath);
+	
+}
+
+int FrameServer::sendCommand(int portID, int slaveID, char *buffer, int bufferSize, int commandLength)
+{
+	FrontEndCommand command;
+	command.portID = portID;
+	command.slaveID = slaveID;
+	command.buffer = buffer;
+	command.bufferSize = bufferSize;
+	command.commandLength = commandLength;
+	command.replyLength = 0;
+	sendCommandBatch(&command, 1);
+	return command.replyLength;
+}
+
+int FrameServer::sendCommandBatch(FrontEndCommand *commands, int nCommands)
+{
+	pthread_cond_t cond;
+	pthread_cond_init(&cond, NULL);
+	pendingCommand_t *pending = new pendingCommand_t[nCommands];
+	
+	// Indexes of the commands sent but not yet answered
+	int inFlight[MaxCommandsInFlight];
+	int nInFlight = 0;
+	int nSent = 0;
+	int nReplies = 0;
+	int nTimedOut = 0;
+	
+	pthread_mutex_lock(&replyLock);
+	boost::posix_time::ptime lastProgress = boost::posix_time::microsec_clock::local_time();
+	while(nSent < nCommands || nInFlight > 0) {
+		// Keep the pipeline full
+		bool blocked = false;
+		while(nSent < nCommands && nInFlight < MaxCommandsInFlight) {
+			FrontEndCommand &c = commands[nSent];
+			c.replyLength = 0;
+			pendingCommand_t *p = &pending[nSent];
+			p->sn = (unsigned((unsigned char)c.buffer[0]) << 8) + (unsigned char)c.buffer[1];
+			p->done = false;
+			p->replyLength = 0;
+			p->cond = &cond;
+			// Register before sending, so that a quick reply is not missed
+			std::multimap<uint16_t, pendingCommand_t *>::iterator it = 
+				pendingCommands.insert(std::pair<uint16_t, pendingCommand_t *>(p->sn, p));
+			pthread_cond_signal(&condPendingCommands);
+			
+			pthread_mutex_unlock(&replyLock);
+			int r = transmitCommand(c.portID, c.slaveID, c.buffer, c.commandLength);
+			pthread_mutex_lock(&replyLock);
+			
+			if(r < 0) {
+				if(!p->done) pendingCommands.erase(it);
+				blocked = true;
+				break;
+			}
+			inFlight[nInFlight++] = nSent;
+			nSent++;
+		}
+		
+		// Collect the replies which have arrived
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
+		bool progress = false;
+		for(int k = 0; k < nInFlight; k++) {
+			pendingCommand_t *p = &pending[inFlight[k]];
+			if(!p->done) continue;
+			
+			FrontEndCommand &c = commands[inFlight[k]];
+			c.replyLength = p->replyLength < c.bufferSize ? p->replyLength : c.bufferSize;
+			memcpy(c.buffer, p->reply, c.replyLength);
+			nReplies++;
+			inFlight[k] = inFlight[--nInFlight];
+			k--;
+			progress = true;
+		}
+		if(progress) {
+			lastProgress = now;
+			continue;
+		}
+		
+		if((now - lastProgress).total_milliseconds() > CommandTimeout) {
+			// Give up on whatever is outstanding, but carry on with the rest of the batch
+			for(int k = 0; k < nInFlight; k++) {
+				pendingCommand_t *p = &pending[inFlight[k]];
+				std::pair<std::multimap<uint16_t, pendingCommand_t *>::iterator, 
+					std::multimap<uint16_t, pendingCommand_t *>::iterator> range = 
+					pendingCommands.equal_range(p->sn);
+				for(std::multimap<uint16_t, pendingCommand_t *>::iterator it = range.first; it != range.second; it++) {
+					if(it->second == p) {
+						pendingCommands.erase(it);
+						break;
+					}
+				}
+			}
+			nTimedOut += nInFlight;
+			nInFlight = 0;
+			// If the front end would not take a command, skip it
+			if(blocked) {
+				nSent++;
+				nTimedOut++;
+			}
+			lastProgress = now;
+			continue;
+		}
+		
+		// Wait for a reply, or a bit if the front end had no room for more commands
+		boost::posix_time::ptime deadline = blocked && nInFlight == 0 ? 
+			now + boost::posix_time::milliseconds(1) :
+			lastProgress + boost::posix_time::milliseconds(CommandTimeout + 1);
+		long waitNs = (deadline - now).total_nanoseconds();
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += waitNs / 1000000000L;
+		ts.tv_nsec += waitNs % 1000000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec = ts.tv_nsec % 1000000000L;
+		pthread_cond_timedwait(&cond, &replyLock, &ts);
+	}
+	pthread_mutex_unlock(&replyLock);
 	
+	if(nTimedOut > 0) {
+		fprintf(stderr, "WARNING: %d of %d commands timed out\n", nTimedOut, nCommands);
+	}
+	
+	delete [] pending;
+	pthread_cond_destroy(&cond);
+	return nReplies;
+}
+
+void FrameServer::dispatchReply(char *buffer, int size)
+{
+	if(size < 2) {
+		fprintf(stderr, "WARNING: Reply only had %d bytes\n", size);
+		return;
+	}
+	
+	uint16_t sn = (unsigned((unsigned char)buffer[0]) << 8) + (unsigned char)buffer[1];
+	pthread_mutex_lock(&replyLock);
+	std::multimap<uint16_t, pendingCommand_t *>::iterator it = pendingCommands.find(sn);
+	if(it != pendingCommands.end()) {
+		pendingCommand_t *p = it->second;
+		pendingCommands.erase(it);
+		p->replyLength = size < MaxReplySize ? size : MaxReplySize;
+		memcpy(p->reply, buffer, p->replyLength);
+		p->done = true;
+		pthread_cond_signal(p->cond);
+	}
+	else {
+		fprintf(stderr, "Unexpected reply with SN %6hx\n", sn);
+	}
+	pthread_mutex_unlock(&replyLock);
+}
+
+void FrameServer::getFrameCounters(FrameCounters *c)
+{
+	pthread_mutex_lock(&lock);
+	memcpy(c, (const void *)counters, sizeof(FrameCounters));
+	pthread_mutex_unlock(&lock);
 }
 
 void FrameServer::startAcquisition(int mode)
@@ -129,7 +351,11 @@ void FrameServer::startAcquisition(int mode)
 	
 	pthread_mutex_lock(&lock);
 	dataFrameWritePointer = 0;
+	stagedWritePointer = 0;
 	dataFrameReadPointer = 0;
+	for(int i = 0; i < MaxConsumers; i++)
+		consumers[i].readPointer = 0;
+	bumpRingGeneration();
 	acquisitionMode = 0;
 	pthread_cond_signal(&condCleanDataFrame);
 	pthread_mutex_unlock(&lock);
@@ -138,8 +364,15 @@ void FrameServer::startAcquisition(int mode)
 	
 	pthread_mutex_lock(&lock);
 	dataFrameWritePointer = 0;
+	stagedWritePointer = 0;
 	dataFrameReadPointer = 0;
+	for(int i = 0; i < MaxConsumers; i++)
+		consumers[i].readPointer = 0;
+	bumpRingGeneration();
 	acquisitionMode = mode;
+	counters->ringHighWaterFrames = 0;
+	counters->ringHighWaterBytes = 0;
+	lastFrameID = -1;
 	pthread_cond_signal(&condCleanDataFrame);
 	pthread_mutex_unlock(&lock);
 }
@@ -149,7 +382,11 @@ void FrameServer::stopAcquisition()
 	pthread_mutex_lock(&lock);
 	acquisitionMode = 0;
 	dataFrameWritePointer = 0;
+	stagedWritePointer = 0;
 	dataFrameReadPointer = 0;
+	for(int i = 0; i < MaxConsumers; i++)
+		consumers[i].readPointer = 0;
+	bumpRingGeneration();
 	pthread_cond_signal(&condCleanDataFrame);
 	pthread_mutex_unlock(&lock);	
 }
@@ -158,7 +395,104 @@ void FrameServer::stopAcquisition()
 
 const char *FrameServer::getDataFrameSharedMemoryName()
 {
-	return shmObjectPath;
+	return dataFrameSharedMemoryName.c_str();
+}
+
+unsigned long long FrameServer::getDataFrameSharedMemorySize()
+{
+	return dataFrameSharedMemorySize;
+}
+
+unsigned FrameServer::getDataFrameQueueSize()
+{
+	return nFrameSlots;
+}
+
+bool FrameServer::pushDataFrame(DataFrame *dataFrame, bool publish)
+{
+	unsigned nWords = (dataFrame->data[0] >> 36) & 0x7FFF;
+	uint64_t nBytes = sizeof(uint64_t) * packedFrameWords(nWords, frameFlags);
+	
+	pthread_mutex_lock(&lock);
+	takeReleasedReadPointer();
+	unsigned N = 2*nFrameSlots;
+	unsigned wrPointer = stagedWritePointer % N;
+	unsigned rdPointer = dataFrameReadPointer % N;
+	bool full = (wrPointer != rdPointer) && ((wrPointer % nFrameSlots) == (rdPointer % nFrameSlots));
+
+	// Storage is free from writePosition up to the oldest held frame
+	uint64_t writePosition = shmHeader->writePosition;
+	uint64_t readPosition = (wrPointer == rdPointer) ? writePosition : frameSlots[rdPointer % nFrameSlots].position;
+	uint64_t position = writePosition;
+	uint64_t offset = position % frameDataSize;
+	if(offset + nBytes > frameDataSize) 
+		position += frameDataSize - offset; // Frames do not wrap, skip the tail
+	if(position + nBytes > readPosition + frameDataSize)
+		full = true;
+	if(!full) {
+		shmHeader->writePosition = position + nBytes;
+		stagedWritePointer = (wrPointer + 1) % N;
+		
+		uint64_t occupancyFrames = (stagedWritePointer + N - rdPointer) % N;
+		uint64_t occupancyBytes = position + nBytes - readPosition;
+		if(occupancyFrames > counters->ringHighWaterFrames) 
+			counters->ringHighWaterFrames = occupancyFrames;
+		if(occupancyBytes > counters->ringHighWaterBytes) 
+			counters->ringHighWaterBytes = occupancyBytes;
+	}
+	pthread_mutex_unlock(&lock);
+	
+	if(full) {
+		counters->framesDroppedRingFull++;
+		return false;
+	}
+	// Lossy readers check writePosition after reading, so it must be visible before we overwrite anything
+	__sync_synchronize();
+	
+	uint64_t *p = (uint64_t *)(frameData + position % frameDataSize);
+	memcpy(p, dataFrame->data, nWords * sizeof(uint64_t));
+	p += nWords;
+#ifndef __NO_CHANNEL_IDLE_TIME__
+	memcpy(p, dataFrame->channelIdleTime, nWords * sizeof(uint64_t));
+	p += nWords;
+	memcpy(p, dataFrame->tacIdleTime, nWords * sizeof(uint64_t));
+	p += nWords;
+#endif
+#ifdef __ENDOTOFPET__
+	memcpy(p, dataFrame->feType, nWords);
+#endif
+
+	FrameSlot &slot = frameSlots[wrPointer % nFrameSlots];
+	slot.position = position;
+	slot.nWords = nWords;
+	
+	if(publish) 
+		publishDataFrames();
+	return true;
+}
+
+void FrameServer::publishDataFrames()
+{
+	pthread_mutex_lock(&lock);
+	if(dataFrameWritePointer != stagedWritePointer) {
+		unsigned N = 2*nFrameSlots;
+		unsigned nPublished = (stagedWritePointer + N - dataFrameWritePointer) % N;
+		dataFrameWritePointer = stagedWritePointer;
+		pthread_cond_signal(&condDirtyDataFrame);
+
+		if(notifyPending == 0) {
+			// Start of a batch, the notifier thread wakes consumers by the deadline if we don't
+			clock_gettime(CLOCK_MONOTONIC, &notifyDeadline);
+			notifyDeadline.tv_nsec += (notifyInterval % 1000000) * 1000;
+			notifyDeadline.tv_sec += notifyInterval / 1000000 + notifyDeadline.tv_nsec / 1000000000;
+			notifyDeadline.tv_nsec %= 1000000000;
+			pthread_cond_signal(&condNotify);
+		}
+		notifyPending += nPublished;
+		if(notifyPending >= notifyFrames)
+			notifyConsumers();
+	}
+	pthread_mutex_unlock(&lock);
 }
 
 unsigned FrameServer::getDataFrameWritePointer()
@@ -166,25 +500,150 @@ unsigned FrameServer::getDataFrameWritePointer()
 	pthread_mutex_lock(&lock);
 	unsigned r = dataFrameWritePointer;
 	pthread_mutex_unlock(&lock);
-	return r % (2*MaxDataFrameQueueSize);
+	return r % (2*nFrameSlots);
 }
 
 unsigned FrameServer::getDataFrameReadPointer()
+{
+	return getDataFrameReadPointer(0);
+}
+
+void FrameServer::setDataFrameReadPointer(unsigned ptr)
+{
+	setDataFrameReadPointer(0, ptr);
+}
+
+int FrameServer::registerConsumer(bool lossy)
 {
 	pthread_mutex_lock(&lock);
-	unsigned r = dataFrameReadPointer;
+	int consumerID = -1;
+	for(int i = 1; i < MaxConsumers; i++) {
+		if(consumers[i].active) continue;
+		// New consumers only see frames written from now on
+		consumers[i].active = true;
+		consumers[i].lossy = lossy;
+		consumers[i].readPointer = dataFrameWritePointer % (2*nFrameSlots);
+		consumerID = i;
+		break;
+	}
 	pthread_mutex_unlock(&lock);
-	return r % (2*MaxDataFrameQueueSize);
+	return consumerID;
 }
 
-void FrameServer::setDataFrameReadPointer(unsigned ptr)
+void FrameServer::unregisterConsumer(int consumerID)
 {
+	if(consumerID <= 0 || consumerID >= MaxConsumers) return;
+	
 	pthread_mutex_lock(&lock);
-	dataFrameReadPointer = ptr % (2*MaxDataFrameQueueSize);
+	consumers[consumerID].active = false;
+	updateDataFrameReadPointer();
 	pthread_cond_signal(&condCleanDataFrame);
 	pthread_mutex_unlock(&lock);
 }
 
+unsigned FrameServer::getDataFrameReadPointer(int consumerID)
+{
+	if(consumerID < 0 || consumerID >= MaxConsumers) return 0;
+
+	pthread_mutex_lock(&lock);
+	consumer_t &consumer = consumers[consumerID];
+	if(consumer.lossy) {
+		// A lossy consumer which fell behind the oldest held frame skips ahead to it
+		unsigned N = 2*nFrameSlots;
+		unsigned occupancy = (dataFrameWritePointer + N - dataFrameReadPointer) % N;
+		unsigned offset = (consumer.readPointer + N - dataFrameReadPointer) % N;
+		if(offset > occupancy)
+			consumer.readPointer = dataFrameReadPointer;
+	}
+	unsigned r = consumer.readPointer;
+	pthread_mutex_unlock(&lock);
+	return r % (2*nFrameSlots);
+}
+
+void FrameServer::setDataFrameReadPointer(int consumerID, unsigned ptr)
+{
+	if(consumerID < 0 || consumerID >= MaxConsumers) return;
+
+	pthread_mutex_lock(&lock);
+	consumers[consumerID].readPointer = ptr % (2*nFrameSlots);
+	if(!consumers[consumerID].lossy) {
+		updateDataFrameReadPointer();
+		pthread_cond_signal(&condCleanDataFrame);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void FrameServer::updateDataFrameReadPointer()
+{
+	// The slowest mandatory consumer is the one with the most frames pending
+	unsigned N = 2*nFrameSlots;
+	unsigned maxPending = 0;
+	unsigned r = dataFrameWritePointer % N;
+	for(int i = 0; i < MaxConsumers; i++) {
+		if(!consumers[i].active || consumers[i].lossy) continue;
+		unsigned pending = (dataFrameWritePointer + N - consumers[i].readPointer) % N;
+		if(pending >= maxPending) {
+			maxPending = pending;
+			r = consumers[i].readPointer;
+		}
+	}
+	dataFrameReadPointer = r;
+}
+
+void FrameServer::takeReleasedReadPointer()
+{
+	uint64_t released = shmHeader->releasedReadPointer;
+	if((released >> 32) != shmHeader->ringGeneration) return;
+
+	// Only ever move forward, within the frames already published
+	unsigned N = 2*nFrameSlots;
+	unsigned ptr = (released & 0xFFFFFFFF) % N;
+	unsigned readPointer = consumers[0].readPointer;
+	unsigned offset = (ptr + N - readPointer) % N;
+	unsigned pending = (dataFrameWritePointer + N - readPointer) % N;
+	if(offset == 0 || offset > pending) return;
+
+	consumers[0].readPointer = ptr;
+	updateDataFrameReadPointer();
+}
+
+void FrameServer::bumpRingGeneration()
+{
+	shmHeader->ringGeneration++;
+	__sync_synchronize();
+	notifyConsumers();
+}
+
+void FrameServer::notifyConsumers()
+{
+	notifyPending = 0;
+	__sync_fetch_and_add(&shmHeader->frameSequence, 1);
+	// Not FUTEX_PRIVATE_FLAG, the waiters are in other processes
+	syscall(SYS_futex, &shmHeader->frameSequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+void *FrameServer::runNotifier(void *arg)
+{
+	FrameServer *F = (FrameServer *)arg;
+	F->doNotify();
+	return NULL;
+}
+
+void FrameServer::doNotify()
+{
+	pthread_mutex_lock(&lock);
+	while(!die) {
+		if(notifyPending == 0) {
+			pthread_cond_wait(&condNotify, &lock);
+			continue;
+		}
+		int r = pthread_cond_timedwait(&condNotify, &lock, &notifyDeadline);
+		if(r == ETIMEDOUT && notifyPending > 0)
+			notifyConsumers();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
 void FrameServer::startWorker()
 {
 	printf("FrameServer::startWorker called...\n");
@@ -193,6 +652,8 @@ void FrameServer::startWorker()
 	die = false;
 	hasWorker = true;
 	pthread_create(&worker, NULL, runWorker, (void*)this);
+	hasNotifier = true;
+	pthread_create(&notifier, NULL, runNotifier, (void*)this);
 	
 
 	printf("FrameServer::startWorker exiting...\n");
@@ -208,12 +669,17 @@ void FrameServer::stopWorker()
 	pthread_mutex_lock(&lock);
 	pthread_cond_signal(&condCleanDataFrame);
 	pthread_cond_signal(&condDirtyDataFrame);
+	pthread_cond_signal(&condNotify);
 	pthread_mutex_unlock(&lock);
 
 	if(hasWorker) {
 		hasWorker = false;
 		pthread_join(worker, NULL);
 	}
+	if(hasNotifier) {
+		hasNotifier = false;
+		pthread_join(notifier, NULL);
+	}
 
 	printf("FrameServer::stopWorker exiting...\n");
 }
@@ -232,11 +698,18 @@ bool FrameServer::parseDataFrame(DataFrame *dataFrame)
 	unsigned nEvents = dataFrame->data[1] & 0xFFFF;
 	bool frameLost = (dataFrame->data[1] & 0x10000) != 0;
 	
+	counters->framesReceived++;
 	if (frameSize != 2 + nEvents) {
 		printf("Inconsistent size: got %4d words, expected %4d words(%d events).\n", 
 			frameSize, 2 + nEvents, nEvents);
+		counters->framesMalformed++;
 		return false;
 	}
+	if(frameLost) 
+		counters->framesFlaggedLost++;
+	if(lastFrameID >= 0 && (long long)frameID > lastFrameID + 1)
+		counters->framesMissing += frameID - lastFrameID - 1;
+	lastFrameID = frameID;
 	
 	// If TAC refresh is active we need to discard frames for which a TAC refresh happened
 	// Refresh (setting == 4) happens every 32 frames
@@ -314,6 +787,7 @@ int FrameServer::setCoincidenceTrigger(CoincidenceTriggerConfig *config)
 int FrameServer::setIdleTimeCalculation(unsigned mode)
 {
 	idleTimeMode = mode;
+	return 0;
 }
 
 int FrameServer::setGateEnable(unsigned mode)
@@ -2,7 +2,8 @@
 #define __FRAMESERVER_HPP__DEFINED__
 
 #include <pthread.h>
-#include <queue>
+#include <map>
+#include <string>
 
 #include "SHM.hpp"
 
@@ -18,9 +19,36 @@ struct CoincidenceTriggerConfig {
 	uint32_t mask[32];
 };
 
+// One command of a batch sent with FrameServer::sendCommandBatch
+struct FrontEndCommand {
+	int portID;
+	int slaveID;
+	char *buffer;		// command, starting with the SN; overwritten by the reply
+	int bufferSize;
+	int commandLength;
+	int replyLength;	// set to 0 if no reply was received
+};
+
+// Sizing of the shared memory frame ring, chosen at daqd start-up
+struct FrameRingConfig {
+	unsigned nFrames;		// index slots
+	unsigned long long dataSize;	// bytes of packed frame storage
+	const char *hugePagesPath;	// hugetlbfs mount to back the ring, or NULL for /dev/shm
+	// Consumers sleeping in SHM::waitForFrames() are woken once notifyFrames frames are
+	// published, or notifyInterval microseconds after the first of them at the latest
+	unsigned notifyFrames;
+	unsigned notifyInterval;
+
+	FrameRingConfig()
+	: nFrames(DefaultDataFrameQueueSize), dataSize(DefaultDataFrameRingSize), hugePagesPath(NULL),
+	  notifyFrames(64), notifyInterval(100)
+	{
+	};
+};
+
 class FrameServer {
 public:
-	FrameServer(int nFEB, int *feTypeMap, int debugLevel);
+	FrameServer(int nFEB, int *feTypeMap, int debugLevel, const FrameRingConfig &ringConfig);
         virtual ~FrameServer();	
 
 	// Sends a command and gets the reply
@@ -28,13 +56,33 @@ public:
 	// bufferSize is the max capacity of the size
 	// commandLength is the length of the command in
 	// return the reply length or -1 if error
-	virtual int sendCommand(int portID, int slaveID, char *buffer, int bufferSize, int commandLength) = 0;
+	virtual int sendCommand(int portID, int slaveID, char *buffer, int bufferSize, int commandLength);
+
+	// Sends several commands, keeping up to MaxCommandsInFlight of them
+	// outstanding and matching the replies by SN
+	// Sets replyLength for each command and returns the number of replies received
+	virtual int sendCommandBatch(FrontEndCommand *commands, int nCommands);
 	
 	virtual const char *getDataFrameSharedMemoryName();
+	virtual unsigned long long getDataFrameSharedMemorySize();
+	virtual unsigned getDataFrameQueueSize();
 	virtual unsigned getDataFrameWritePointer();
 	virtual unsigned getDataFrameReadPointer();
 	virtual void setDataFrameReadPointer(unsigned ptr);
-	
+
+	// Data frame consumers, each with its own read pointer
+	// Consumer 0 is the legacy read pointer, always present and mandatory
+	// The write pointer only advances past the slowest mandatory consumer,
+	// lossy consumers are moved forward when they fall behind
+	// registerConsumer returns the consumer ID or -1 if none is available
+	virtual int registerConsumer(bool lossy);
+	virtual void unregisterConsumer(int consumerID);
+	virtual unsigned getDataFrameReadPointer(int consumerID);
+	virtual void setDataFrameReadPointer(int consumerID, unsigned ptr);
+	
+	// Copies the frame loss and ring occupancy counters, also found in the SHM header
+	virtual void getFrameCounters(FrameCounters *c);
+
 	virtual void startAcquisition(int mode);
 	virtual void stopAcquisition();
 	
@@ -52,6 +100,8 @@ private:
 	
 protected:	
 	static const int CommandTimeout = 250; // ms
+	// Both the UDP service and the DAQ cards buffer 16 commands/replies
+	static const int MaxCommandsInFlight = 8;
 	
 	bool parseDataFrame(DataFrame *dataFrame);
 	
@@ -59,8 +109,42 @@ protected:
 	
 	int8_t *feTypeMap;
 	
+	std::string dataFrameSharedMemoryName;
+	bool dataFrameSharedMemoryIsFile;
 	int dataFrameSharedMemory_fd;
-	DataFrame *dataFrameSharedMemory;
+	unsigned long long dataFrameSharedMemorySize;
+	char *dataFrameSharedMemory;
+	SHMHeader *shmHeader;
+	FrameSlot *frameSlots;
+	char *frameData;
+	unsigned nFrameSlots;
+	uint64_t frameDataSize;
+	uint32_t frameFlags;
+	// Lives in the SHM header; only the worker thread updates it, except for
+	// the high water marks which are updated with the lock held
+	volatile FrameCounters *counters;
+	long long lastFrameID;
+
+	// Copies a parsed frame into the ring; returns false if the ring is full
+	// With publish = false the frame only becomes visible to consumers
+	// on the next publishDataFrames(), so a batch costs a single wake up
+	// Must only be called from the worker thread
+	bool pushDataFrame(DataFrame *dataFrame, bool publish = true);
+	void publishDataFrames();
+
+	// Wake-up of consumers in other processes, batched as set in FrameRingConfig
+	// The notifier thread wakes them when a partial batch is due
+	unsigned notifyFrames;
+	unsigned notifyInterval;
+	unsigned notifyPending;		// frames published since consumers were last woken
+	struct timespec notifyDeadline;
+	pthread_cond_t condNotify;
+	pthread_t notifier;
+	bool hasNotifier;
+	// Bumps the SHM frame sequence and wakes the consumers waiting on it; lock must be held
+	void notifyConsumers();
+	static void *runNotifier(void *);
+	void doNotify();
 	
 	static void *runWorker(void *);
 	virtual void * doWork() = 0;
@@ -76,22 +160,51 @@ protected:
 	pthread_cond_t condDirtyDataFrame;
 	unsigned dataFrameWritePointer;
 	unsigned dataFrameReadPointer;
+	unsigned stagedWritePointer;	// frames pushed but not yet published
+
+	static const int MaxConsumers = 16;
+	struct consumer_t {
+		bool active;
+		bool lossy;
+		unsigned readPointer;
+	};
+	consumer_t consumers[MaxConsumers];
+	// Recomputes dataFrameReadPointer from the mandatory consumers; lock must be held
+	void updateDataFrameReadPointer();
+	// Moves consumer 0 up to the read pointer released in the SHM header, if it is
+	// ahead and from the current ring generation; lock must be held
+	void takeReleasedReadPointer();
+	// Invalidates released read pointers from before a pointer reset
+	// and wakes consumers to look at the new pointers; lock must be held
+	void bumpRingGeneration();
 	
 	
 
-	struct reply_t {
-		int size;
-		char buffer[128];
+	// Sends a command to the front end without waiting for the reply
+	// Returns -1 if the command could not be sent right now
+	virtual int transmitCommand(int portID, int slaveID, char *buffer, int commandLength) = 0;
+
+	// Completion object for a command waiting for its reply
+	// dispatchReply() fills it, removes it from pendingCommands and signals cond
+	static const int MaxReplySize = 128;
+	struct pendingCommand_t {
+		uint16_t sn;
+		bool done;
+		int replyLength;
+		char reply[MaxReplySize];
+		pthread_cond_t *cond;
 	};
-	std::queue<reply_t *> replyQueue;
-	pthread_cond_t condReplyQueue;
+	std::multimap<uint16_t, pendingCommand_t *> pendingCommands;
+	pthread_mutex_t replyLock;
+	pthread_cond_t condPendingCommands;	// signaled when a command is added to pendingCommands
+
+	// Hands a reply received from the front end to the command waiting for it
+	void dispatchReply(char *buffer, int size);
 	
 	
 	uint64_t *tacLastEventTime;
 	uint64_t *channelLastEventTime;
 	
-	int16_t m_lut[ 1 << 15 ];
-	
 
 };
 
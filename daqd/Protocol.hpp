@@ -17,6 +17,9 @@ static const uint16_t commandSetSorter = 0x09;
 static const uint16_t commandSetTrigger = 0x10;
 static const uint16_t commandSetIdleTimeCalculation = 0x11;
 static const uint16_t commandSetGateEnable = 0x12;
+static const uint16_t commandRegisterDataFrameConsumer = 0x13;
+static const uint16_t commandToFrontEndBatch = 0x14;
+static const uint16_t commandGetFrameCounters = 0x15;
 
 }
 #endif
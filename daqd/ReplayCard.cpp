@@ -0,0 +1,191 @@
+#include "ReplayCard.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+using namespace DAQd;
+
+static const uint64_t IDLE_WORD = 0xFFFFFFFFFFFFFFFFULL;
+static const uint64_t HEADER_WORD = 0xFFFFFFFFFFFFFFF5ULL;
+static const uint64_t TRAILER_WORD = 0xFFFFFFFFFFFFFFFAULL;
+
+// A frame is 1024 clocks at 160 MHz
+static const double FrameDuration = 1024 / 160E6;
+
+ReplayCard::ReplayCard(const char *fileName, double speed, int nLoops)
+: speed(speed), nLoops(nLoops), acquisitionOn(false), restartRequested(true), 
+  nextFrame(0), loop(0), streamPosition(0), nCommands(0)
+{
+	FILE *f = fopen(fileName, "rb");
+	if(f == NULL) {
+		fprintf(stderr, "ERROR: Could not open '%s' for reading\n", fileName);
+		exit(1);
+	}
+	
+	uint64_t header[2];
+	while(fread(header, sizeof(uint64_t), 2, f) == 2) {
+		unsigned frameSize = (header[0] >> 36) & 0x7FFF;
+		if(frameSize < 2 || frameSize > MaxDataFrameSize) {
+			fprintf(stderr, "ERROR: Bad frame size %u in '%s'\n", frameSize, fileName);
+			exit(1);
+		}
+		size_t start = fileWords.size();
+		fileWords.resize(start + frameSize);
+		fileWords[start + 0] = header[0];
+		fileWords[start + 1] = header[1];
+		if(fread(&fileWords[start + 2], sizeof(uint64_t), frameSize - 2, f) != frameSize - 2) {
+			fileWords.resize(start);
+			break;
+		}
+		frameStart.push_back(start);
+	}
+	fclose(f);
+	
+	if(frameStart.empty()) {
+		fprintf(stderr, "ERROR: '%s' has no frames\n", fileName);
+		exit(1);
+	}
+	
+	firstFrameID = fileWords[frameStart.front()] & 0xFFFFFFFFFULL;
+	unsigned long long lastFrameID = fileWords[frameStart.back()] & 0xFFFFFFFFFULL;
+	fileFrameIDSpan = lastFrameID - firstFrameID + 1;
+	printf("Replaying %u frames (%.3f s of data) from '%s'\n", 
+		(unsigned)frameStart.size(), fileFrameIDSpan * FrameDuration, fileName);
+	
+	pthread_mutex_init(&replyLock, NULL);
+	pthread_cond_init(&condReply, NULL);
+}
+
+ReplayCard::~ReplayCard()
+{
+	pthread_cond_destroy(&condReply);
+	pthread_mutex_destroy(&replyLock);
+}
+
+bool ReplayCard::loadNextFrame()
+{
+	if(restartRequested) {
+		restartRequested = false;
+		nextFrame = 0;
+		loop = 0;
+		startTime = boost::posix_time::microsec_clock::local_time();
+	}
+	
+	if(!acquisitionOn) return false;
+	
+	if(nextFrame >= frameStart.size()) {
+		if(nLoops > 0 && loop + 1 >= nLoops) return false;
+		nextFrame = 0;
+		loop++;
+	}
+	
+	const uint64_t *frame = &fileWords[frameStart[nextFrame]];
+	unsigned frameSize = (frame[0] >> 36) & 0x7FFF;
+	unsigned long long frameID = (frame[0] & 0xFFFFFFFFFULL) + loop * fileFrameIDSpan;
+	
+	if(speed > 0) {
+		// Hold the frame until its original time, scaled by speed
+		double due = (frameID - firstFrameID) * FrameDuration / speed;
+		double now = (boost::posix_time::microsec_clock::local_time() - startTime).total_microseconds() * 1E-6;
+		if(now < due) {
+			if(due - now > 50E-6) usleep(due - now > 1E-3 ? 1000 : (due - now) * 1E6);
+			return false;
+		}
+	}
+	
+	streamWords.resize(frameSize + 3);
+	streamWords[0] = IDLE_WORD;
+	streamWords[1] = HEADER_WORD;
+	memcpy(&streamWords[2], frame, frameSize * sizeof(uint64_t));
+	streamWords[2] = (frame[0] & ~0xFFFFFFFFFULL) | (frameID & 0xFFFFFFFFFULL);
+	streamWords[frameSize + 2] = TRAILER_WORD;
+	streamPosition = 0;
+	nextFrame++;
+	return true;
+}
+
+int ReplayCard::getWords(uint64_t *buffer, int count)
+{
+	int r = 0;
+	while(r < count) {
+		if(streamPosition >= streamWords.size() && !loadNextFrame()) {
+			// Nothing to send right now, fill with idle words
+			// This only happens between frames, where daqd reads one word at a time
+			if(!acquisitionOn || nextFrame >= frameStart.size()) usleep(1000);
+			buffer[r++] = IDLE_WORD;
+			continue;
+		}
+		
+		int n = streamWords.size() - streamPosition;
+		n = n < count - r ? n : count - r;
+		memcpy(buffer + r, &streamWords[streamPosition], n * sizeof(uint64_t));
+		streamPosition += n;
+		r += n;
+	}
+	return r;
+}
+
+int ReplayCard::sendCommand(int, int, char *buffer, int, int commandLength)
+{
+	if(commandLength < 2) return -1;
+	
+	// SN, command type echo and a zero status
+	std::vector<char> reply(16, 0);
+	reply[0] = buffer[0];
+	reply[1] = buffer[1];
+	reply[2] = commandLength > 2 ? buffer[2] : 0;
+	
+	pthread_mutex_lock(&replyLock);
+	replyQueue.push(reply);
+	nCommands++;
+	pthread_cond_signal(&condReply);
+	pthread_mutex_unlock(&replyLock);
+	return 0;
+}
+
+int ReplayCard::recvReply(char *buffer, int bufferSize)
+{
+	pthread_mutex_lock(&replyLock);
+	if(replyQueue.empty()) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 10000000L; // 10 ms
+		ts.tv_sec += (ts.tv_nsec / 1000000000L);
+		ts.tv_nsec = (ts.tv_nsec % 1000000000L);
+		pthread_cond_timedwait(&condReply, &replyLock, &ts);
+	}
+	
+	int replyLength = -1;
+	if(!replyQueue.empty()) {
+		std::vector<char> &reply = replyQueue.front();
+		replyLength = (int)reply.size() < bufferSize ? reply.size() : bufferSize;
+		memcpy(buffer, &reply[0], replyLength);
+		replyQueue.pop();
+	}
+	pthread_mutex_unlock(&replyLock);
+	return replyLength;
+}
+
+int ReplayCard::setAcquistionOnOff(bool enable)
+{
+	// Each acquisition plays the file from the start
+	if(enable) restartRequested = true;
+	acquisitionOn = enable;
+	return 0;
+}
+
+uint64_t ReplayCard::getPortUp()
+{
+	return 1;
+}
+
+uint64_t ReplayCard::getPortCounts(int channel, int whichCount)
+{
+	if(channel != 0) return 0;
+	// TX and RX count the commands, there are never bad packets
+	// Counts are Gray coded, like the hardware's
+	uint64_t n = whichCount < 2 ? nCommands : 0;
+	return n ^ (n >> 1);
+}
@@ -0,0 +1,58 @@
+#ifndef __REPLAYCARD_HPP__DEFINED__
+#define __REPLAYCARD_HPP__DEFINED__
+
+#include <stdint.h>
+#include <queue>
+#include <vector>
+#include <pthread.h>
+#include "boost/date_time/posix_time/posix_time.hpp"
+#include "DAQFrameServer.hpp"
+
+namespace DAQd {
+
+/*
+ * A DAQ card which plays back the frames of a .rawf file (see writeRaw, R mode)
+ * Frames are served with the same framing as the PCIe cards, at the original
+ * rate times speed (or as fast as possible if speed is 0).
+ * Frame IDs are shifted on each loop over the file, so that they keep increasing.
+ * Front end commands are acknowledged with a zero filled reply.
+ */
+class ReplayCard : public AbstractDAQCard {
+public:
+	ReplayCard(const char *fileName, double speed, int nLoops);
+	~ReplayCard();
+
+	int getWords(uint64_t *buffer, int count);
+	int sendCommand(int portID, int slaveID, char *buffer, int bufferSize, int commandLength);
+	int recvReply(char *buffer, int bufferSize);
+	int setAcquistionOnOff(bool enable);
+	uint64_t getPortUp();
+	uint64_t getPortCounts(int channel, int whichCount);
+
+private:
+	std::vector<uint64_t> fileWords;
+	std::vector<size_t> frameStart;
+	unsigned long long firstFrameID;
+	unsigned long long fileFrameIDSpan;
+	double speed;
+	int nLoops;
+
+	volatile bool acquisitionOn;
+	volatile bool restartRequested;
+
+	// Only touched by the thread calling getWords()
+	size_t nextFrame;
+	int loop;
+	boost::posix_time::ptime startTime;
+	std::vector<uint64_t> streamWords;	// the frame being served, with its framing words
+	size_t streamPosition;
+	bool loadNextFrame();
+
+	pthread_mutex_t replyLock;
+	pthread_cond_t condReply;
+	std::queue<std::vector<char> > replyQueue;
+	uint64_t nCommands;
+};
+
+}
+#endif
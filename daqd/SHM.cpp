@@ -9,69 +9,103 @@
 #include <sys/stat.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 using namespace DAQd;
 
+// Names with a single leading slash are POSIX shared memory objects,
+// anything else is a regular path (e.g., on a hugetlbfs mount)
+static int openPath(std::string &shmPath, int flags)
+{
+	if(shmPath.find('/', 1) == std::string::npos)
+		return shm_open(shmPath.c_str(), flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	else
+		return open(shmPath.c_str(), flags);
+}
+
 SHM::SHM(std::string shmPath)
+	: shmPath(shmPath), writableHeader(NULL), writableHeaderFailed(false)
 {
-	shmfd = shm_open(shmPath.c_str(), 
-			O_RDONLY, 
-			S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	shmfd = openPath(shmPath, O_RDONLY);
 	if (shmfd < 0) {
 		fprintf(stderr, "Opening '%s' returned %d (errno = %d)\n", shmPath.c_str(), shmfd, errno );		
 		exit(1);
 	}
 	shmSize = lseek(shmfd, 0, SEEK_END);
-	assert(shmSize = MaxDataFrameQueueSize * sizeof(DataFrame));
+	if(shmSize < SHMHeaderSize) {
+		fprintf(stderr, "'%s' is too small (%lld bytes) to be a daqd frame ring\n", shmPath.c_str(), (long long)shmSize);
+		exit(1);
+	}
 	
-	shm = (DataFrame *)mmap(NULL, 
+	shm = (char *)mmap(NULL, 
 				shmSize,
 				PROT_READ, 
 				MAP_SHARED, 
 				shmfd,
 				0);
-				
-				
-	m_lut[ 0x7FFF ] = -1; // invalid state
-	uint16_t lfsr = 0x0000;
-	for ( int16_t n = 0; n < ( 1 << 15 ) - 1; ++n )
-	{
-		m_lut[ lfsr ] = n;
-		const uint8_t bits13_14 = lfsr >> 13;
-		uint8_t new_bit;
-		switch ( bits13_14 )
-		{ // new_bit = !(bit13 ^ bit14)
-			case 0x00:
-			case 0x03:
-				new_bit = 0x01;
-				break;
-			case 0x01:
-			case 0x02:
-				new_bit = 0x00;
-				break;
-		}// switch
-		lfsr = ( lfsr << 1 ) | new_bit; // add the new bit to the right
-		lfsr &= 0x7FFF; // throw away the 16th bit from the shift
-	}// for
-	assert ( lfsr == 0x0000 ); // after 2^15-1 steps we're back at 0				
-  
+	if(shm == MAP_FAILED) {
+		fprintf(stderr, "Could not mmap() '%s' (errno = %d)\n", shmPath.c_str(), errno);
+		exit(1);
+	}
+
+	header = (SHMHeader *)shm;
+	if(memcmp(header->magic, SHMMagic, sizeof(SHMMagic)) != 0) {
+		fprintf(stderr, "'%s' does not have the expected layout; check that daqd and its clients were built from the same version\n", shmPath.c_str());
+		exit(1);
+	}
+	nSlots = header->nSlots;
+	flags = header->flags;
+	dataSize = header->dataSize;
+	slots = (FrameSlot *)(shm + header->slotsOffset);
+	data = shm + header->dataOffset;
 }
 
 SHM::~SHM()
 {
+	if(writableHeader != NULL)
+		munmap(writableHeader, SHMHeaderSize);
 	munmap(shm, shmSize);
 	close(shmfd);
 }
 
-unsigned long long SHM::getSizeInBytes()
+bool SHM::releaseFrames(uint32_t generation, unsigned rdPointer)
 {
-	assert (shmSize = MaxDataFrameQueueSize * sizeof(DataFrame));
-	return shmSize;
+	if(writableHeader == NULL) {
+		if(writableHeaderFailed)
+			return false;
+		// Only the header is mapped for writing, the frames stay read only
+		int fd = openPath(shmPath, O_RDWR);
+		void *p = MAP_FAILED;
+		if(fd >= 0) {
+			p = mmap(NULL, SHMHeaderSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			close(fd);
+		}
+		if(p == MAP_FAILED) {
+			fprintf(stderr, "Could not open '%s' for writing (errno = %d), frames will only be released at the end of each block\n", shmPath.c_str(), errno);
+			writableHeaderFailed = true;
+			return false;
+		}
+		writableHeader = (SHMHeader *)p;
+	}
+	// Everything read from the frames must be done before daqd sees them released
+	__sync_synchronize();
+	writableHeader->releasedReadPointer = (uint64_t(generation) << 32) | rdPointer;
+	return true;
 }
 
+bool SHM::waitForFrames(uint32_t sequence, unsigned timeout)
+{
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000000;
+	ts.tv_nsec = (timeout % 1000000) * 1000;
+	// Not FUTEX_PRIVATE_FLAG, daqd wakes us from another process
+	int r = syscall(SYS_futex, &header->frameSequence, FUTEX_WAIT, sequence, timeout > 0 ? &ts : NULL, NULL, 0);
+	return !(r == -1 && errno == ETIMEDOUT);
+}
 
-unsigned SHM::decodeSticCoarse(unsigned coarse, unsigned long long frameID)
+unsigned long long SHM::getSizeInBytes()
 {
-	coarse = m_lut[coarse];
-	return coarse;
+	return shmSize;
 }
@@ -2,7 +2,9 @@
 #define __DAQD_SHM_CPP__DEFINED__
 
 #include "Protocol.hpp"
+#include "SticCoarse.hpp"
 #include <sys/types.h>
+#include <string.h>
 #include <string>
 #include <vector>
 #include <memory>
@@ -10,10 +12,14 @@
 namespace DAQd {
 	
 static const int MaxDataFrameSize = 2048;
-static const unsigned MaxDataFrameQueueSize = 16*1024;
+static const unsigned DefaultDataFrameQueueSize = 64*1024;
+static const unsigned long long DefaultDataFrameRingSize = 256ULL*1024*1024;
 static const int N_ASIC=2*16*16; // WARNING: non final! 16 ports, 2 FEB/D per port, 16 ASIC per FEB/D
 
 
+/*
+ * Unpacked data frame, used by daqd as a staging area while a frame is parsed
+ */
 struct DataFrame {
 		uint64_t data[MaxDataFrameSize];
 #ifndef __NO_CHANNEL_IDLE_TIME__
@@ -25,6 +31,73 @@ struct DataFrame {
 #endif
 };
 
+/*
+ * Shared memory layout
+ * - SHMHeader, padded to SHMHeaderSize
+ * - nSlots FrameSlot entries, indexed by (pointer % nSlots)
+ * - dataSize bytes of frame storage, where frames are packed back to back
+ * 
+ * A packed frame of N words holds data[N], followed by channelIdleTime[N] and
+ * tacIdleTime[N] if SHMHasIdleTime is set and by N feType bytes
+ * (padded to a whole word) if SHMHasFeType is set.
+ * Frames never wrap around the end of the storage area.
+ */
+static const char SHMMagic[8] = { 'D', 'A', 'Q', 'D', 'S', 'H', 'M', '1' };
+static const unsigned SHMHeaderSize = 4096;
+static const uint32_t SHMHasIdleTime = 0x1;
+static const uint32_t SHMHasFeType = 0x2;
+
+// Frame counters kept by daqd since it started, except for the
+// high water marks which are reset when an acquisition starts
+struct FrameCounters {
+	uint64_t framesReceived;		// frames read from the front end
+	uint64_t framesFlaggedLost;		// frames with the lost flag set by the front end
+	uint64_t framesMissing;			// gaps in the frame ID sequence
+	uint64_t framesMalformed;		// frames which failed to parse
+	uint64_t framesDroppedEmptyLost;	// empty lost frames dropped by daqd to save space
+	uint64_t framesDroppedRingFull;		// frames dropped because the ring was full
+	uint64_t resyncs;			// times daqd had to resynchronise with the data stream
+	uint64_t ringHighWaterFrames;		// highest ring occupancy, in frames
+	uint64_t ringHighWaterBytes;		// highest ring occupancy, in bytes
+};
+
+struct SHMHeader {
+	char magic[8];
+	uint32_t flags;
+	uint32_t nSlots;
+	uint64_t slotsOffset;
+	uint64_t dataOffset;
+	uint64_t dataSize;
+	// End of the last frame reserved by daqd, in bytes since daqd started
+	// A frame read from position P is intact while writePosition <= P + dataSize
+	volatile uint64_t writePosition;
+	// Updated by daqd as frames arrive
+	volatile FrameCounters counters;
+	// Bumped by daqd whenever it resets the ring pointers
+	volatile uint32_t ringGeneration;
+	volatile uint32_t reserved;
+	// ringGeneration << 32 | read pointer, published by the process decoding the frames of
+	// consumer 0 as it goes, so that daqd can reuse slots before the block is handed back
+	volatile uint64_t releasedReadPointer;
+	// Futex word, bumped by daqd when it wakes consumers waiting for frames, see SHM::waitForFrames()
+	volatile uint32_t frameSequence;
+};
+
+struct FrameSlot {
+	// Bytes since daqd started; the offset in the storage area is position % dataSize
+	uint64_t position;
+	uint32_t nWords;
+	uint32_t reserved;
+};
+
+inline unsigned packedFrameWords(unsigned nWords, uint32_t flags)
+{
+	unsigned n = nWords;
+	if(flags & SHMHasIdleTime) n += 2 * nWords;
+	if(flags & SHMHasFeType) n += (nWords + 7) / 8;
+	return n;
+}
+
 typedef struct PackedEvent {
     uint16_t asic_id;
     uint16_t chan_id;
@@ -43,83 +116,116 @@ typedef std::vector<PackedEvent_t> PackedEventVec;
 
 class SHM {
 public:
+	// path is either a POSIX shared memory name (/daqd_shm) or a file path (hugetlbfs)
 	SHM(std::string path);
 	~SHM();
 
 	unsigned long long getSizeInBytes();
 	unsigned long long  getSizeInFrames() { 
-		return MaxDataFrameQueueSize;
+		return nSlots;
 	};
 	
 	int getFrameSize(int index) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[0];
+		uint64_t eventWord = getFrameData(index)[0];
 		return (eventWord >> 36) & 0x7FFF;
 	};
 	
-	DataFrame *getDataFrame(int index) {
-		DataFrame *dataFrame = &shm[index];
-		return dataFrame;
-	}
+	const uint64_t *getFrameData(int index) {
+		return (const uint64_t *)(data + slots[index].position % dataSize);
+	};
+
+	// Position of the frame in the storage area, see isOverwritten()
+	unsigned long long getFramePosition(int index) {
+		return slots[index].position;
+	};
+
+	// True if a frame read from position may have been overwritten since
+	// Only relevant for consumers which do not hold the frames they read
+	bool isOverwritten(unsigned long long position) {
+		__sync_synchronize();
+		return header->writePosition > position + dataSize;
+	};
+
+	// Generation of the ring pointers, see SHMHeader
+	uint32_t getRingGeneration() {
+		__sync_synchronize();
+		return header->ringGeneration;
+	};
+
+	// Tells daqd that consumer 0 is done with the frames before rdPointer,
+	// ahead of the read pointer being set through the control socket
+	// generation must be the one read before rdPointer was obtained
+	// Returns false if the frame ring could not be opened for writing
+	bool releaseFrames(uint32_t generation, unsigned rdPointer);
+
+	// To sleep until daqd has new frames without missing any, read the sequence
+	// before checking the pointers and pass it to waitForFrames() if there is nothing to do
+	uint32_t getFrameSequence() {
+		__sync_synchronize();
+		return header->frameSequence;
+	};
+
+	// Sleeps until daqd moves the frame sequence on from sequence or for timeout microseconds
+	// (0 waits forever); returns false on timeout
+	bool waitForFrames(uint32_t sequence, unsigned timeout);
+
+	// Snapshot of daqd's frame counters
+	FrameCounters getCounters() {
+		__sync_synchronize();
+		FrameCounters c;
+		memcpy(&c, (const void *)&header->counters, sizeof(c));
+		return c;
+	};
 
 	unsigned long long getFrameWord(int index, int n) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[n];
-		return eventWord;
+		return getFrameData(index)[n];
 	};
 
 	unsigned long long getFrameID(int index) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[0];
+		uint64_t eventWord = getFrameData(index)[0];
 		return eventWord & 0xFFFFFFFFFULL;
 	};
 
 	bool getFrameLost(int index) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[1];
+		uint64_t eventWord = getFrameData(index)[1];
 		return (eventWord & 0x10000) != 0;
 	};
 
 	int getNEvents(int index) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[1];
+		uint64_t eventWord = getFrameData(index)[1];
 		return eventWord & 0xFFFF;
 	}; 
 
 	int getEventType(int index, int event) {
-#ifdef __ENDOTOFPET__
-		DataFrame *dataFrame = &shm[index];
-		return dataFrame->feType[event+2];
-#else
-		return 0;
-#endif
+		if((flags & SHMHasFeType) == 0) 
+			return 0;
+		unsigned nWords = slots[index].nWords;
+		const int8_t *feType = (const int8_t *)(getFrameData(index) + ((flags & SHMHasIdleTime) ? 3 * nWords : nWords));
+		return feType[event+2];
 	};
 
 	int getTCoarse(int index, int event) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[event+2];
+		uint64_t eventWord = getFrameData(index)[event+2];
 		if(getEventType(index, event) == 0) {
 			return (eventWord >> 38) & 0x3FF;
 		}
 		else {
-			return decodeSticCoarse((unsigned int) ( 0x7FFF & (eventWord  >> 26) ), getFrameID(index));
+			return decodeSticCoarse((unsigned int) ( 0x7FFF & (eventWord  >> 26) ));
 		}	  
 	}
 
 	int getECoarse(int index, int event) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[event+2];
+		uint64_t eventWord = getFrameData(index)[event+2];
 		if(getEventType(index, event) == 0) {
 			return (eventWord >> 18) & 0x3FF;
 		}
 		else {
-			return decodeSticCoarse((unsigned int) (( 0x000fffe0 & eventWord) >> 5), getFrameID(index));
+			return decodeSticCoarse((unsigned int) (( 0x000fffe0 & eventWord) >> 5));
 		}
 	};
 		
 	int getTFine(int index, int event) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[event+2];
+		uint64_t eventWord = getFrameData(index)[event+2];
 		if(getEventType(index, event) == 0) {
 			return (eventWord >> 28) & 0x3FF;
 		}
@@ -129,8 +235,7 @@ public:
 	};
 	
 	int getEFine(int index, int event) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[event+2];
+		uint64_t eventWord = getFrameData(index)[event+2];
 		if(getEventType(index, event) == 0) {
 			return (eventWord >> 8) & 0x3FF;
 		}
@@ -140,8 +245,7 @@ public:
 	};
 	
 	int getAsicID(int index, int event) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[event+2];
+		uint64_t eventWord = getFrameData(index)[event+2];
 		uint64_t idWord = eventWord >> 48;
 		uint64_t asicID = idWord & 0x3F;
 		uint64_t slaveID = (idWord >> 6) & 0x1F;
@@ -151,8 +255,7 @@ public:
 	};
 	
 	int getChannelID(int index, int event) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[event+2];
+		uint64_t eventWord = getFrameData(index)[event+2];
 		if(getEventType(index, event) == 0) {
 			return (eventWord >> 2) & 0x3F;
 		}
@@ -162,8 +265,7 @@ public:
 	};
 	
 	int getTACID(int index, int event) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[event+2];
+		uint64_t eventWord = getFrameData(index)[event+2];
 		if(getEventType(index, event) == 0) {
 			return (eventWord >> 0) & 0x3;
 		}
@@ -173,8 +275,7 @@ public:
 	};
 	
 	bool getTBadHit(int index, int event) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[event+2];
+		uint64_t eventWord = getFrameData(index)[event+2];
 		if(getEventType(index, event) == 0) {
 			return false;
 		}
@@ -184,8 +285,7 @@ public:
 	};
 	
 	bool getEBadHit(int index, int event) {
-		DataFrame *dataFrame = &shm[index];
-		uint64_t eventWord = dataFrame->data[event+2];
+		uint64_t eventWord = getFrameData(index)[event+2];
 		if(getEventType(index, event) == 0) {
 			return false;
 		}
@@ -195,32 +295,24 @@ public:
 	};
 
 	long long getTACIdleTime(int index, int event) {
-#ifndef __NO_CHANNEL_IDLE_TIME__
-		DataFrame *dataFrame = &shm[index];
-		return dataFrame->tacIdleTime[event+2];
-#else
-		return 0;
-#endif
+		if((flags & SHMHasIdleTime) == 0)
+			return 0;
+		return getFrameData(index)[2 * slots[index].nWords + event+2];
 	};
 
 	long long getChannelIdleTime(int index, int event) {
-#ifndef __NO_CHANNEL_IDLE_TIME__
-		DataFrame *dataFrame = &shm[index];
-		return dataFrame->channelIdleTime[event+2];
-#else
-		return 0;
-#endif
+		if((flags & SHMHasIdleTime) == 0)
+			return 0;
+		return getFrameData(index)[slots[index].nWords + event+2];
 	};
 
 	std::shared_ptr<PackedEventVec>  getRawFrame(int index) {
 	    int nevents = getNEvents(index);
-	    int evCount = 0;
-	    DataFrame *dataFrame = &shm[index];
+	    const uint64_t *frameData = getFrameData(index);
 	    std::shared_ptr<PackedEventVec> procFrame(new PackedEventVec());
 
 	    for (int i = 0; i < nevents; ++i) {
-	        //if (dataFrame->feType[i+2] == 0) {
-            uint64_t eventWord = dataFrame->data[i+2];
+            uint64_t eventWord = frameData[i+2];
             PackedEvent_t p;
 
             p.tcoarse = (eventWord >> 38) & 0x3FF;
@@ -238,7 +330,6 @@ public:
             p.asic_id = (slaveID & 0x1) * 16*16 + (portID & 0xF) * 16 + (asicID & 0xF);
 
             procFrame->push_back(p);
-	        //}
 	    }
 
 	    return procFrame;
@@ -246,13 +337,24 @@ public:
   
 
 private:
-	unsigned decodeSticCoarse(unsigned coarse, unsigned long long frameID);
+	unsigned decodeSticCoarse(unsigned coarse) {
+		return SticCoarse::decode(coarse);
+	};
 
+	std::string shmPath;
 	int shmfd;
-	DataFrame *shm;
+	char *shm;
 	off_t shmSize;
 
-	int16_t m_lut[ 1 << 15 ];
+	SHMHeader *header;
+	// Writable mapping of the header, only made by releaseFrames()
+	SHMHeader *writableHeader;
+	bool writableHeaderFailed;
+	FrameSlot *slots;
+	char *data;
+	unsigned nSlots;
+	uint32_t flags;
+	uint64_t dataSize;
 };
 
 }
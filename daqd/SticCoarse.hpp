@@ -0,0 +1,77 @@
+#ifndef __STICCOARSE_HPP__DEFINED__
+#define __STICCOARSE_HPP__DEFINED__
+
+#include <stdint.h>
+#include <assert.h>
+
+namespace DAQd {
+
+/*
+ * STiC coarse time counters are 15 bit LFSRs, which go through 2^15-1 states
+ * and are reset every 256 frames. The tables here are built once per process
+ * and shared by daqd, its SHM clients, the ENDOTOFPET readers and the event generator.
+ */
+class SticCoarse {
+public:
+	static const int Period = (1 << 15) - 1;
+
+	// Number of clocks for an LFSR state; -1 for 0x7FFF, which the LFSR never reaches
+	static int decode(unsigned state) {
+		return tables().decode[state & 0x7FFF];
+	};
+
+	// LFSR state after n clocks
+	static uint16_t encode(unsigned n) {
+		return tables().encode[n % Period];
+	};
+
+	// Clocks into the LFSR period at the start of frameID;
+	// the same for every hit of a frame, so callers may keep it per frame
+	static int frameOffset(unsigned long long frameID) {
+		return tables().frameOffset[frameID % 256];
+	};
+
+	// Converts a decoded coarse value into clocks since the start of its frame
+	static int compensate(unsigned coarse, int frameOffset) {
+		int c = coarse;
+		if(c < frameOffset) c += Period;
+		return c - frameOffset;
+	};
+
+	static int compensate(unsigned coarse, unsigned long long frameID) {
+		return compensate(coarse, frameOffset(frameID));
+	};
+
+private:
+	struct Tables {
+		int16_t decode[1 << 15];
+		uint16_t encode[Period];
+		int frameOffset[256];
+
+		Tables() {
+			decode[0x7FFF] = -1; // invalid state
+			uint16_t lfsr = 0x0000;
+			for(int n = 0; n < Period; n++) {
+				decode[lfsr] = n;
+				encode[n] = lfsr;
+				// new bit = !(bit13 ^ bit14)
+				uint8_t bits13_14 = lfsr >> 13;
+				uint8_t newBit = (bits13_14 == 0x00 || bits13_14 == 0x03) ? 0x01 : 0x00;
+				lfsr = ((lfsr << 1) | newBit) & 0x7FFF;
+			}
+			assert(lfsr == 0x0000); // after 2^15-1 steps we're back at 0
+
+			for(int n = 0; n < 256; n++) {
+				frameOffset[n] = (n * 1024 * 4) % Period;
+			}
+		};
+	};
+
+	static const Tables &tables() {
+		static const Tables t;
+		return t;
+	};
+};
+
+}
+#endif
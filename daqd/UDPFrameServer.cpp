@@ -10,20 +10,18 @@
 #include <sys/stat.h>
 #include <boost/crc.hpp>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>  
 #include <assert.h>
 #include <errno.h>
 
-static const char *feAddr = "192.168.1.25";
-static const unsigned short fePort = 2000;
-
 static int myFeTypeMap[1] = { 0 };
 
 using namespace DAQd;
 
-UDPFrameServer::UDPFrameServer(int debugLevel)
-	: FrameServer(1, myFeTypeMap, debugLevel)
+UDPFrameServer::UDPFrameServer(int debugLevel, const FrameRingConfig &ringConfig, const char *feAddr, unsigned short fePort)
+	: FrameServer(1, myFeTypeMap, debugLevel, ringConfig)
 {
 	udpSocket = socket(AF_INET,SOCK_DGRAM,0);
 	assert(udpSocket != -1);
@@ -42,6 +40,15 @@ UDPFrameServer::UDPFrameServer(int debugLevel)
 	tv.tv_usec = 100000;
 	r = setsockopt(udpSocket, SOL_SOCKET, SO_RCVTIMEO,&tv,sizeof(tv));
 	assert(r == 0);
+
+	// A large receive buffer absorbs bursts while the worker is busy
+	// SO_RCVBUFFORCE needs CAP_NET_ADMIN, otherwise we're capped by net.core.rmem_max
+	int rcvBufSize = RxSocketBufferSize;
+	if(setsockopt(udpSocket, SOL_SOCKET, SO_RCVBUFFORCE, &rcvBufSize, sizeof(rcvBufSize)) != 0)
+		setsockopt(udpSocket, SOL_SOCKET, SO_RCVBUF, &rcvBufSize, sizeof(rcvBufSize));
+	socklen_t optLen = sizeof(rcvBufSize);
+	getsockopt(udpSocket, SOL_SOCKET, SO_RCVBUF, &rcvBufSize, &optLen);
+	printf("UDP receive buffer is %d KiB\n", rcvBufSize / 1024);
 	
 	char buffer[32];
 	memset(buffer, 0xFF, sizeof(buffer));
@@ -64,12 +71,6 @@ UDPFrameServer::~UDPFrameServer()
 }
 
 
-static bool isFull(unsigned writePointer, unsigned readPointer)
-{
-	return (writePointer != readPointer) && ((writePointer % MaxDataFrameQueueSize) == (readPointer % MaxDataFrameQueueSize));
-}
-
-
 void *UDPFrameServer::doWork()
 {	
 	printf("UDPFrameServer::runWorker starting...\n");
@@ -82,162 +83,92 @@ void *UDPFrameServer::doWork()
 		m->channelLastEventTime[i] = 0;
 	}
 	
-	long nFramesFound = 0;
-	long nFramesPushed = 0;
+	DataFrame *dataFrame = new DataFrame;
 	
-	DataFrame *devNull = new DataFrame;
+	// Datagrams are received in batches into a ring of buffers
+	// The type byte goes into its own iovec, so that the payload lands 8 byte aligned
+	unsigned char *rxType = new unsigned char[RxBatchSize];
+	uint64_t *rxBuffers = new uint64_t[RxBatchSize * RxDatagramSize / sizeof(uint64_t)];
+	struct iovec *rxIov = new struct iovec[2 * RxBatchSize];
+	struct mmsghdr *rxMsgs = new struct mmsghdr[RxBatchSize];
+	for(int i = 0; i < RxBatchSize; i++) {
+		rxIov[2*i + 0].iov_base = rxType + i;
+		rxIov[2*i + 0].iov_len = 1;
+		rxIov[2*i + 1].iov_base = rxBuffers + i * (RxDatagramSize / sizeof(uint64_t));
+		rxIov[2*i + 1].iov_len = RxDatagramSize;
+	}
 	
-	unsigned char rxBuffer[2048];
-	uint64_t dataBuffer[2048/sizeof(uint64_t)];
 	while(!m->die) {
-		int r = recv(m->udpSocket, rxBuffer, sizeof(rxBuffer), 0);
-
-		if (r == -1 && (errno = EAGAIN || errno == EWOULDBLOCK)) {	
+		for(int i = 0; i < RxBatchSize; i++) {
+			memset(&rxMsgs[i], 0, sizeof(struct mmsghdr));
+			rxMsgs[i].msg_hdr.msg_iov = rxIov + 2*i;
+			rxMsgs[i].msg_hdr.msg_iovlen = 2;
+		}
+		
+		// Blocks (up to SO_RCVTIMEO) for the first datagram, then takes whatever else is queued
+		int nMsgs = recvmmsg(m->udpSocket, rxMsgs, RxBatchSize, MSG_WAITFORONE, NULL);
+		if (nMsgs == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {	
 			continue;
 		}
 		
-		assert(r >= 0);
+		assert(nMsgs >= 0);
 
-		if(rxBuffer[0] == 0x5A) {
-			if(m->debugLevel > 2) printf("Worker:: Found a reply frame with %d bytes\n", r);
-			reply_t *reply = new reply_t;
-			memcpy(reply->buffer, rxBuffer + 1, r - 1);
-			reply->size = r - 1;
-			pthread_mutex_lock(&m->lock);
-			m->replyQueue.push(reply);
-			pthread_mutex_unlock(&m->lock);
-		}
-		else if(rxBuffer[0] == 0xA5) {
-			if(m->debugLevel > 2) printf("Worker:: Found a data frame with %d bytes\n", r);
-			if (m->acquisitionMode != 0) {			
-				unsigned nWords = (r-1)/sizeof(uint64_t);			
-				memcpy(dataBuffer, rxBuffer+1, nWords*sizeof(uint64_t));
-/*				uint64_t *p1 = (uint64_t *)rxBuffer+1;
-				for(unsigned i = 0; i < nWords; i++)
-					dataBuffer[i] = be64toh(p1[i]);*/
+		bool pushedFrames = false;
+		for(int i = 0; i < nMsgs; i++) {
+			int r = rxMsgs[i].msg_len;
+			if(r < 1) continue;
+			uint64_t *dataBuffer = rxBuffers + i * (RxDatagramSize / sizeof(uint64_t));
+			
+			if(rxType[i] == 0x5A) {
+				if(m->debugLevel > 2) printf("Worker:: Found a reply frame with %d bytes\n", r);
+				m->dispatchReply((char *)dataBuffer, r - 1);
+			}
+			else if(rxType[i] == 0xA5) {
+				if(m->debugLevel > 2) printf("Worker:: Found a data frame with %d bytes\n", r);
+				if (m->acquisitionMode == 0) continue;
 				
+				unsigned nWords = (r-1)/sizeof(uint64_t);
 				uint64_t *p = dataBuffer;
-				do {
+				while(p < dataBuffer + nWords) {
 					unsigned frameSize = (p[0] >> 36) & 0x7FFF;
-					
-					DataFrame *dataFrame = devNull;
-					
-					pthread_mutex_lock(&m->lock);
-					if(!isFull(m->dataFrameWritePointer,  m->dataFrameReadPointer)) {
-						dataFrame = &dataFrameSharedMemory[m->dataFrameWritePointer  % MaxDataFrameQueueSize];
+					if(frameSize < 2 || p + frameSize > dataBuffer + nWords) {
+						m->counters->framesMalformed++;
+						break;
 					}
-					pthread_mutex_unlock(&m->lock);
 					
 					memcpy(dataFrame->data, p, frameSize * sizeof(uint64_t));
 					if(!m->parseDataFrame(dataFrame)) break;
 					
-					pthread_mutex_lock(&m->lock);					
-					if(dataFrame != devNull) {
-						m->dataFrameWritePointer = (m->dataFrameWritePointer + 1) % (2*MaxDataFrameQueueSize);
-					}
-					pthread_cond_signal(&m->condDirtyDataFrame);
-					pthread_mutex_unlock(&m->lock);
+					// If the ring is full, the frame is dropped
+					// Frames are published once for the whole batch
+					if(m->pushDataFrame(dataFrame, false))
+						pushedFrames = true;
 					p += frameSize;
-					
-				} while(p < dataBuffer + nWords);
-				
+				}
+			}
+			else {
+				printf("Worker: found an unknown frame (0x%02X) with %d bytes\n", unsigned(rxType[i]), r);
 			}
 		}
-		else {
-			printf("Worker: found an unknown frame (0x%02X) with %d bytes\n", unsigned(rxBuffer[0]), r);
-			
-		}
-		pthread_mutex_lock(&m->lock);					
-		pthread_cond_signal(&m->condReplyQueue);
-		pthread_mutex_unlock(&m->lock);					
-			
-		
 		
+		if(pushedFrames)
+			m->publishDataFrames();
 	}
 	
-	delete devNull;
+	delete [] rxMsgs;
+	delete [] rxIov;
+	delete [] rxBuffers;
+	delete [] rxType;
+	delete dataFrame;
 	printf("UDPFrameServer::runWorker exiting...\n");
 	return NULL;
 }
 
 
-int UDPFrameServer::sendCommand(int portID, int slaveID, char *buffer, int bufferSize, int commandLength)
+int UDPFrameServer::transmitCommand(int portID, int slaveID, char *buffer, int commandLength)
 {
-	boost::posix_time::ptime start = boost::posix_time::microsec_clock::local_time();	
-	uint16_t sentSN = (unsigned(buffer[0]) << 8) + unsigned(buffer[1]);	
-	boost::posix_time::ptime t1 = boost::posix_time::microsec_clock::local_time();
-
-	send(udpSocket, buffer, commandLength, 0);
-	
-	boost::posix_time::ptime t2 = boost::posix_time::microsec_clock::local_time();
-
-	int replyLength = 0;	
-	int nLoops = 0;
-	do {
-		pthread_mutex_lock(&lock);
-		reply_t *reply = NULL;
-	
-/*		if(replyQueue.empty()) {
-			pthread_cond_wait(&condReplyQueue, &lock);
-		}*/
-
-		if(replyQueue.empty()) {
-			struct timespec ts; 
-			clock_gettime(CLOCK_REALTIME, &ts);
-			ts.tv_nsec += 10000000L; // 10 ms
-			ts.tv_sec += (ts.tv_nsec / 100000000L);
-			ts.tv_nsec = (ts.tv_nsec % 100000000L);                        
-			pthread_cond_timedwait(&condReplyQueue, &lock, &ts);
-		}
-
-		if (!replyQueue.empty()) {
-			reply = replyQueue.front();
-			replyQueue.pop();
-			
-		}
-		pthread_mutex_unlock(&lock);
-		
-		if(reply == NULL) {
-			boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
-			if ((now - start).total_milliseconds() > CommandTimeout) 
-				break;
-			else
-				continue;
-			
-		}
-		//printf("Found something on queue with size: %d\n", reply->size);
-	
-		if (reply->size < 2) {
-			fprintf(stderr, "WARNING: Reply only had %d bytes\n", reply->size);
-		}
-		else {
-			uint16_t recvSN = (unsigned(reply->buffer[0]) << 8) + reply->buffer[1];
-			if(sentSN == recvSN) {
-				memcpy(buffer, reply->buffer, reply->size);
-				replyLength = reply->size;
-			}
-			else {
-				fprintf(stderr, "Mismatched SN: sent %6hx, got %6hx\n", sentSN, recvSN);
-			}
-		}
-		
-		delete reply;		
-		nLoops++;
-
-	} while(replyLength == 0);
-	
-	boost::posix_time::ptime t3 = boost::posix_time::microsec_clock::local_time();
-	
-	if (replyLength == 0 ) {
-		printf("Command reply timing: (t2 - t1) => %ld, (t3 - t2) => %ld, i = %d, status = %s\n", 
-			(t2 - t1).total_milliseconds(), 
-			(t3 - t2).total_milliseconds(),
-			nLoops,
-			replyLength > 0 ? "OK" : "FAIL"
-		);
-	}
-	
-	return replyLength;
+	int r = send(udpSocket, buffer, commandLength, 0);
+	return r == commandLength ? 0 : -1;
 }
 
 uint64_t UDPFrameServer::getPortUp()
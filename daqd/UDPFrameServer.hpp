@@ -12,18 +12,22 @@ namespace DAQd {
 class UDPFrameServer : public FrameServer
 {
 public:
-	UDPFrameServer(int debugLevel);
+	UDPFrameServer(int debugLevel, const FrameRingConfig &ringConfig, const char *feAddr, unsigned short fePort);
 	virtual ~UDPFrameServer();	
 
-	int sendCommand(int portID, int slaveID, char *buffer, int bufferSize, int commandLength);
 	uint64_t getPortUp();
 	virtual uint64_t getPortCounts(int port, int whichCount);
 	
 private:
 	
 	int udpSocket;
+	
+	static const int RxBatchSize = 64;			// datagrams per recvmmsg()
+	static const int RxDatagramSize = 9216;			// large enough for jumbo frames
+	static const int RxSocketBufferSize = 32*1024*1024;
 
 protected:
+	int transmitCommand(int portID, int slaveID, char *buffer, int commandLength);
 	void * doWork();
 	
 };
@@ -11,6 +11,7 @@
 #include <limits.h>
 #include <sys/stat.h>
 #include <map>
+#include <string>
 #include "UDPFrameServer.hpp"
 #include "FrameServer.hpp"
 #include "Protocol.hpp"
@@ -19,6 +20,8 @@
 #include <string.h>
 #include <getopt.h>
 
+#include "ReplayCard.hpp"
+
 #ifdef __DTFLY__
 #include "DtFlyP.hpp"
 #endif
@@ -52,12 +55,27 @@ int main(int argc, char *argv[])
 	int debugLevel = 0;
 	
 	int daqType = -1;
+	FrameRingConfig ringConfig;
+	std::string gbeAddress = "192.168.1.25";
+	unsigned short gbePort = 2000;
+	char *replayFileName = NULL;
+	double replaySpeed = 1.0;
+	int replayLoops = 1;
 	
 	static struct option longOptions[] = {
 		{ "fe-type", required_argument, 0, 0 },
 		{ "socket-name", required_argument, 0, 0 },
 		{ "debug-level", required_argument, 0, 0 },
 		{ "daq-type", required_argument, 0, 0 },
+		{ "ring-frames", required_argument, 0, 0 },
+		{ "ring-size", required_argument, 0, 0 },
+		{ "hugepages", required_argument, 0, 0 },
+		{ "gbe-address", required_argument, 0, 0 },
+		{ "replay-file", required_argument, 0, 0 },
+		{ "replay-speed", required_argument, 0, 0 },
+		{ "replay-loops", required_argument, 0, 0 },
+		{ "notify-frames", required_argument, 0, 0 },
+		{ "notify-interval", required_argument, 0, 0 },
 		{ NULL, 0, 0, 0 }
 	};
 	while(1) {
@@ -122,13 +140,44 @@ int main(int argc, char *argv[])
 				return -1;
 #endif 
 			}
+			else if (strcmp((char *)optarg, "REPLAY") == 0) {
+				daqType = 3;
+			}
 			else {
 				fprintf(stderr, "ERROR: '%s' is not a valid DAQ type\n", (char *)optarg);
-				fprintf(stderr, "Valid DAQ types are 'GBE', 'DTFLY' or 'PFP_KX7'\n");
+				fprintf(stderr, "Valid DAQ types are 'GBE', 'DTFLY', 'PFP_KX7' or 'REPLAY'\n");
 				return -1;
 			}
 			
 		}
+		else if (c == 0 && optionIndex == 4)
+			ringConfig.nFrames = boost::lexical_cast<unsigned>((char *)optarg);
+		else if (c == 0 && optionIndex == 5)
+			ringConfig.dataSize = boost::lexical_cast<unsigned long long>((char *)optarg) * 1024 * 1024;
+		else if (c == 0 && optionIndex == 6)
+			ringConfig.hugePagesPath = (char *)optarg;
+		else if (c == 0 && optionIndex == 7) {
+			// address[:port] of the GBE front end, eg. 127.0.0.1:2000 for udpReplay
+			gbeAddress = (char *)optarg;
+			size_t colon = gbeAddress.find(':');
+			if(colon != std::string::npos) {
+				gbePort = boost::lexical_cast<unsigned short>(gbeAddress.substr(colon+1));
+				gbeAddress = gbeAddress.substr(0, colon);
+			}
+		}
+		else if (c == 0 && optionIndex == 8)
+			replayFileName = (char *)optarg;
+		else if (c == 0 && optionIndex == 9)
+			// 1 is the original rate, 0 is as fast as possible
+			replaySpeed = boost::lexical_cast<double>((char *)optarg);
+		else if (c == 0 && optionIndex == 10)
+			// 0 loops forever
+			replayLoops = boost::lexical_cast<int>((char *)optarg);
+		else if (c == 0 && optionIndex == 11)
+			ringConfig.notifyFrames = boost::lexical_cast<unsigned>((char *)optarg);
+		else if (c == 0 && optionIndex == 12)
+			// microseconds
+			ringConfig.notifyInterval = boost::lexical_cast<unsigned>((char *)optarg);
 		else {
 			fprintf(stderr, "ERROR: Unknown option!\n");
 		}
@@ -145,6 +194,16 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	if (daqType == 3 && replayFileName == NULL) {
+		fprintf(stderr, "--replay-file xxx.rawf required for REPLAY\n");
+		return -1;
+	}
+	if (daqType == 3 && !feTypeHasBeenSet) {
+		// Replayed data is TOFPET unless told otherwise
+		for(int i = 0; i < 5; i++) feType[i] = 0;
+		feTypeHasBeenSet = true;
+	}
+
 	if(!feTypeHasBeenSet) {
 		fprintf(stderr, "--fe-type xxxxx required\n");
 		return -1;
@@ -163,16 +222,19 @@ int main(int argc, char *argv[])
 
 	
 	if (daqType == 0) {
-		globalFrameServer = new UDPFrameServer(debugLevel);
+		globalFrameServer = new UDPFrameServer(debugLevel, ringConfig, gbeAddress.c_str(), gbePort);
+	}
+	else if (daqType == 3) {
+		globalFrameServer = new DAQFrameServer(new ReplayCard(replayFileName, replaySpeed, replayLoops), 5, feType, debugLevel, ringConfig);
 	}
 #ifdef __DTFLY__ 
 	else if (daqType == 1) {		
-		globalFrameServer = new DAQFrameServer(new DtFlyP(), 5, feType, debugLevel);
+		globalFrameServer = new DAQFrameServer(new DtFlyP(), 5, feType, debugLevel, ringConfig);
 	}
 #endif
 #ifdef __PFP_KX7__
 	else if (daqType == 2) {		
-		globalFrameServer = new DAQFrameServer(new PFP_KX7(), 0, NULL, debugLevel);
+		globalFrameServer = new DAQFrameServer(new PFP_KX7(), 0, NULL, debugLevel, ringConfig);
 	}
 #endif
 	
@@ -229,6 +291,8 @@ void pollSocket(int listeningSocket, FrameServer *frameServer)
 	sigaddset(&mask, SIGINT);
 	sigaddset(&mask, SIGTERM);
 	
+	static const int MaxEvents = 32;
+	struct epoll_event events[MaxEvents];
 	struct epoll_event event;	
 	int epoll_fd = epoll_create(10);
 	if(epoll_fd == -1) {
@@ -259,9 +323,8 @@ void pollSocket(int listeningSocket, FrameServer *frameServer)
 			break;
 		}
 	  
-		// Poll for one event
-		memset(&event, 0, sizeof(event));
-		int nReady = epoll_pwait(epoll_fd, &event, 1, 100, &omask);		
+		// Poll for all the pending events
+		int nReady = epoll_pwait(epoll_fd, events, MaxEvents, 100, &omask);
 		sigprocmask(SIG_SETMASK, &omask, NULL);
 	  
 		if (nReady == -1) {
@@ -269,51 +332,50 @@ void pollSocket(int listeningSocket, FrameServer *frameServer)
 		  break;
 		  
 		}
-		else if (nReady < 1)
-		  continue;
 		
-		if(event.data.fd == listeningSocket) {
-			int client = accept(listeningSocket, NULL, NULL);
-			fprintf(stderr, "Got a new client: %d\n", client);
-			
-			// Add the event to the list
-			memset(&event, 0, sizeof(event));
-			event.data.fd = client;
-			event.events = EPOLLIN | EPOLLERR | EPOLLHUP;
-			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &event);
+		for(int n = 0; n < nReady; n++) {
+			struct epoll_event &event = events[n];
+			if(event.data.fd == listeningSocket) {
+				int client = accept(listeningSocket, NULL, NULL);
+				fprintf(stderr, "Got a new client: %d\n", client);
+				
+				// Add the event to the list
+				struct epoll_event clientEvent;
+				memset(&clientEvent, 0, sizeof(clientEvent));
+				clientEvent.data.fd = client;
+				clientEvent.events = EPOLLIN | EPOLLERR | EPOLLHUP;
+				epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &clientEvent);
+				
+				clientList.insert(std::pair<int, Client *>(client, new Client(client, frameServer)));
+				continue;
+			}
 			
-			clientList.insert(std::pair<int, Client *>(client, new Client(client, frameServer)));
-		}		
-		else {
-//		  fprintf(stderr, "Got a client (%d) event %08llX\n", event.data.fd, event.events);
-		  if ((event.events & EPOLLHUP) || (event.events & EPOLLERR)) {
-			fprintf(stderr, "INFO: Client hung up or error\n");
-			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, event.data.fd, NULL);
-			delete clientList[event.data.fd]; clientList.erase(event.data.fd);
-		  }
-		  else if (event.events & EPOLLIN) {			
-			Client * client = clientList[event.data.fd];
-			int actionStatus = client->handleRequest();
+			// The client may have been removed while handling an earlier event of this batch
+			std::map<int, Client *>::iterator it = clientList.find(event.data.fd);
+			if(it == clientList.end())
+				continue;
 			
-			if(actionStatus == -1) {
-				fprintf(stderr, "ERROR: Handling client %d\n", event.data.fd);
+//			fprintf(stderr, "Got a client (%d) event %08llX\n", event.data.fd, event.events);
+			if ((event.events & EPOLLHUP) || (event.events & EPOLLERR)) {
+				fprintf(stderr, "INFO: Client hung up or error\n");
 				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, event.data.fd, NULL);
-				delete clientList[event.data.fd]; clientList.erase(event.data.fd);
-				continue;
+				delete it->second; clientList.erase(it);
+			}
+			else if (event.events & EPOLLIN) {
+				int actionStatus = it->second->handleRequest();
+				
+				if(actionStatus == -1) {
+					fprintf(stderr, "ERROR: Handling client %d\n", event.data.fd);
+					epoll_ctl(epoll_fd, EPOLL_CTL_DEL, event.data.fd, NULL);
+					delete it->second; clientList.erase(it);
+				}
+			}
+			else {
+				fprintf(stderr, "WARING: epoll() event was WTF\n");
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, event.data.fd, NULL);
+				delete it->second; clientList.erase(it);
 			}
-			
-		  }
-		  else {
-			fprintf(stderr, "WARING: epoll() event was WTF\n");
-			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, event.data.fd, NULL);
-			delete clientList[event.data.fd]; clientList.erase(event.data.fd);
-		  }
-		  
-		  
-		  
 		}
-		  
-		
 		
 	}
 	
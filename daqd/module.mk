@@ -6,10 +6,10 @@ CXXFLAGS := -g -O2  -std=c++0x -L$(BOOST_LIB_PATH) -I$(BOOST_INC_PATH)
 LDFLAGS := -L$(BOOST_LIB_PATH) -I$(BOOST_INC_PATH) $(LDFLAGS) -lpthread -lrt
 
 
-HEADERS := Client.hpp FrameServer.hpp UDPFrameServer.hpp DAQFrameServer.hpp DtFlyP.hpp Protocol.hpp SHM.hpp PFP_KX7.hpp
-OBJS := FrameServer.cpp.o  UDPFrameServer.cpp.o Client.cpp.o 
+HEADERS := Client.hpp FrameServer.hpp UDPFrameServer.hpp DAQFrameServer.hpp ReplayCard.hpp DtFlyP.hpp Protocol.hpp SHM.hpp SticCoarse.hpp PFP_KX7.hpp
+OBJS := FrameServer.cpp.o  UDPFrameServer.cpp.o Client.cpp.o DAQFrameServer.cpp.o ReplayCard.cpp.o
 ifeq (1, ${DTFLY})
-	OBJS := $(OBJS) DtFlyP.cpp.o DAQFrameServer.cpp.o
+	OBJS := $(OBJS) DtFlyP.cpp.o
 	CPPFLAGS := $(CPPFLAGS) -D__DTFLY__
 	LDFLAGS := $(LDFLAGS)  -ldtfly -lwdapi1011 
 endif 
@@ -21,13 +21,13 @@ ifeq (1, ${ENDOTOFPET})
 	CPPFLAGS := $(CPPFLAGS) -D__ENDOTOFPET__
 endif 
 ifeq (1, ${PFP_KX7})
-	OBJS := $(OBJS) DAQFrameServer.cpp.o PFP_KX7.cpp.o
+	OBJS := $(OBJS) PFP_KX7.cpp.o
 	CPPFLAGS := $(CPPFLAGS) -I ./include -DLINUX -D__PFP_KX7__
 	LDFLAGS := $(LDFLAGS)  -lpfp_kx7_api -lwdapi1160 
 endif 
 
 
-all: daqd SHM.o DSHM.so
+all: daqd SHM.o DSHM.so udpReplay
 
 
 DSHM.so: SHM.cpp.o DSHM.cpp.o
@@ -40,10 +40,13 @@ daqd: daqd.cpp.o $(OBJS)
 	$(CXX) -o $@ daqd.cpp.o $(OBJS) $(LDFLAGS)
 
 
+udpReplay: udpReplay.cpp.o
+	$(CXX) -o $@ udpReplay.cpp.o $(LDFLAGS)
+
 %.cpp.o: %.cpp $(HEADERS)
 	$(CXX) -c -o $@ $< $(CXXFLAGS) $(CPPFLAGS) -fPIC
 
 clean: 
-	rm -f daqd *.cpp.o SHM.o DSHM.so SHM.cpp.o DSHM.cpp.o
+	rm -f daqd udpReplay *.cpp.o SHM.o DSHM.so SHM.cpp.o DSHM.cpp.o
 
 .PHONY: all headers clean
@@ -0,0 +1,276 @@
+/*
+ * Stands in for the GBE front end, so that daqd's UDP data path can be
+ * exercised and benchmarked without hardware.
+ *
+ * Start it first, then run daqd with --daq-type GBE --gbe-address 127.0.0.1:2000
+ * Data frames are taken from a .rawf file (as written by writeRaw in R mode)
+ * or generated on the fly, packed into 0xA5 datagrams and sent to daqd.
+ * Commands are acknowledged with a zero filled reply.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+#include "boost/date_time/posix_time/posix_time.hpp"
+
+static bool globalUserStop = false;
+static void catchUserStop(int) {
+	globalUserStop = true;
+}
+
+static void displayUsage(char *argv0)
+{
+	printf("Usage: %s [--port N] [--file FILE.rawf] [options]\n", argv0);
+	printf("\t--port N\t\t UDP port to listen on (default: 2000)\n");
+	printf("\t--file FILE\t\t .rawf file to replay; synthetic frames are sent if not given\n");
+	printf("\t--frames N\t\t number of frames to send; 0 for no limit (default: 1000000)\n");
+	printf("\t--events N\t\t events per synthetic frame (default: 20)\n");
+	printf("\t--rate R\t\t frames per second; 0 to send as fast as possible (default: 0)\n");
+	printf("\t--datagram-size N\t maximum datagram payload in bytes (default: 1472)\n");
+	printf("\t--delay S\t\t seconds to wait (answering commands) before sending data (default: 2)\n");
+}
+
+// Loads all the frames of a .rawf file; returns the number of frames
+static int loadRawFrameFile(const char *fileName, std::vector<uint64_t> &words, std::vector<size_t> &frameStart)
+{
+	FILE *f = fopen(fileName, "rb");
+	if(f == NULL) {
+		fprintf(stderr, "ERROR: Could not open '%s' for reading\n", fileName);
+		exit(1);
+	}
+
+	uint64_t header[2];
+	while(fread(header, sizeof(uint64_t), 2, f) == 2) {
+		unsigned frameSize = (header[0] >> 36) & 0x7FFF;
+		if(frameSize < 2) {
+			fprintf(stderr, "ERROR: Bad frame size %u in '%s'\n", frameSize, fileName);
+			exit(1);
+		}
+		size_t start = words.size();
+		words.resize(start + frameSize);
+		words[start + 0] = header[0];
+		words[start + 1] = header[1];
+		if(fread(&words[start + 2], sizeof(uint64_t), frameSize - 2, f) != frameSize - 2) {
+			words.resize(start);
+			break;
+		}
+		frameStart.push_back(start);
+	}
+	fclose(f);
+	return frameStart.size();
+}
+
+// Replies with SN, command echo and a zero status, padded to the size of a register read reply
+static void answerCommand(int udpSocket, unsigned char *command, int commandLength)
+{
+	unsigned char reply[17];
+	memset(reply, 0, sizeof(reply));
+	reply[0] = 0x5A;
+	reply[1] = command[0];
+	reply[2] = command[1];
+	reply[3] = commandLength > 2 ? command[2] : 0x00;
+	send(udpSocket, reply, sizeof(reply), 0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned short port = 2000;
+	char *fileName = NULL;
+	long long nFramesToSend = 1000000;
+	unsigned nEventsPerFrame = 20;
+	double rate = 0;
+	unsigned datagramSize = 1472;
+	double delay = 2;
+
+	static struct option longOptions[] = {
+		{ "help", no_argument, 0, 0 },
+		{ "port", required_argument, 0, 0 },
+		{ "file", required_argument, 0, 0 },
+		{ "frames", required_argument, 0, 0 },
+		{ "events", required_argument, 0, 0 },
+		{ "rate", required_argument, 0, 0 },
+		{ "datagram-size", required_argument, 0, 0 },
+		{ "delay", required_argument, 0, 0 },
+		{ NULL, 0, 0, 0 }
+	};
+	while(1) {
+		int optionIndex = 0;
+		int c = getopt_long(argc, argv, "", longOptions, &optionIndex);
+		if (c == -1) break;
+
+		if (c == 0 && optionIndex == 0) {
+			displayUsage(argv[0]);
+			return 0;
+		}
+		else if (c == 0 && optionIndex == 1)
+			port = boost::lexical_cast<unsigned short>((char *)optarg);
+		else if (c == 0 && optionIndex == 2)
+			fileName = (char *)optarg;
+		else if (c == 0 && optionIndex == 3)
+			nFramesToSend = boost::lexical_cast<long long>((char *)optarg);
+		else if (c == 0 && optionIndex == 4)
+			nEventsPerFrame = boost::lexical_cast<unsigned>((char *)optarg);
+		else if (c == 0 && optionIndex == 5)
+			rate = boost::lexical_cast<double>((char *)optarg);
+		else if (c == 0 && optionIndex == 6)
+			datagramSize = boost::lexical_cast<unsigned>((char *)optarg);
+		else if (c == 0 && optionIndex == 7)
+			delay = boost::lexical_cast<double>((char *)optarg);
+		else {
+			displayUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	std::vector<uint64_t> fileWords;
+	std::vector<size_t> fileFrameStart;
+	if(fileName != NULL) {
+		int nFrames = loadRawFrameFile(fileName, fileWords, fileFrameStart);
+		printf("Loaded %d frames from '%s'\n", nFrames, fileName);
+		if(nFrames == 0) return 1;
+	}
+
+	unsigned maxFrameWords = fileName != NULL ? 0x7FFF : 2 + nEventsPerFrame;
+	if(1 + sizeof(uint64_t) * (2 + nEventsPerFrame) > datagramSize && fileName == NULL) {
+		fprintf(stderr, "ERROR: %u events do not fit in a %u byte datagram\n", nEventsPerFrame, datagramSize);
+		return 1;
+	}
+
+	int udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in localAddress;
+	memset(&localAddress, 0, sizeof(localAddress));
+	localAddress.sin_family = AF_INET;
+	localAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+	localAddress.sin_port = htons(port);
+	if(bind(udpSocket, (struct sockaddr *)&localAddress, sizeof(localAddress)) != 0) {
+		fprintf(stderr, "ERROR: Could not bind to port %hu (%d)\n", port, errno);
+		return 1;
+	}
+
+	int sndBufSize = 8*1024*1024;
+	setsockopt(udpSocket, SOL_SOCKET, SO_SNDBUF, &sndBufSize, sizeof(sndBufSize));
+
+	// daqd opens with a probe datagram, which tells us where to send data to
+	printf("Waiting for daqd on port %hu...\n", port);
+	unsigned char rxBuffer[2048];
+	struct sockaddr_in daqdAddress;
+	socklen_t daqdAddressLength = sizeof(daqdAddress);
+	int r = recvfrom(udpSocket, rxBuffer, sizeof(rxBuffer), 0, (struct sockaddr *)&daqdAddress, &daqdAddressLength);
+	if(r < 1) {
+		fprintf(stderr, "ERROR: recvfrom() failed (%d)\n", errno);
+		return 1;
+	}
+	connect(udpSocket, (struct sockaddr *)&daqdAddress, daqdAddressLength);
+	send(udpSocket, rxBuffer, r, 0);
+	printf("Got daqd at %s:%hu\n", inet_ntoa(daqdAddress.sin_addr), ntohs(daqdAddress.sin_port));
+
+	signal(SIGTERM, catchUserStop);
+	signal(SIGINT, catchUserStop);
+
+	// txBuffer + 1 is 8 byte aligned
+	uint64_t *txWords = new uint64_t[datagramSize / sizeof(uint64_t) + 2];
+	unsigned char *txBuffer = (unsigned char *)(txWords + 1) - 1;
+	uint64_t *frameWords = new uint64_t[maxFrameWords];
+
+	long long nFramesSent = 0;
+	long long nDatagramsSent = 0;
+	long long nBytesSent = 0;
+	long long nCommands = 0;
+
+	// Give the user time to configure and start the acquisition
+	struct timeval tv;
+	tv.tv_sec = 0;
+	tv.tv_usec = 10000;
+	setsockopt(udpSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	boost::posix_time::ptime delayStart = boost::posix_time::microsec_clock::local_time();
+	while(!globalUserStop && (boost::posix_time::microsec_clock::local_time() - delayStart).total_milliseconds() < delay * 1000) {
+		r = recv(udpSocket, rxBuffer, sizeof(rxBuffer), 0);
+		if(r < 2) continue;
+		answerCommand(udpSocket, rxBuffer, r);
+		nCommands++;
+	}
+
+	unsigned long long frameID = 0;
+	unsigned fileIndex = 0;
+	uint64_t lfsr = 0x1234567887654321ULL;
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::local_time();
+	unsigned txLength = 1;
+	txBuffer[0] = 0xA5;
+	while(!globalUserStop && (nFramesToSend == 0 || nFramesSent < nFramesToSend)) {
+		// Answer commands
+		while((r = recv(udpSocket, rxBuffer, sizeof(rxBuffer), MSG_DONTWAIT)) > 0) {
+			if(r < 2) continue;
+			answerCommand(udpSocket, rxBuffer, r);
+			nCommands++;
+		}
+
+		// Next frame, with IDs renumbered so that loops over a file look continuous
+		unsigned frameSize;
+		if(fileName != NULL) {
+			const uint64_t *src = &fileWords[fileFrameStart[fileIndex]];
+			frameSize = (src[0] >> 36) & 0x7FFF;
+			memcpy(frameWords, src, frameSize * sizeof(uint64_t));
+			fileIndex = (fileIndex + 1) % fileFrameStart.size();
+		}
+		else {
+			frameSize = 2 + nEventsPerFrame;
+			frameWords[1] = nEventsPerFrame;
+			for(unsigned n = 0; n < nEventsPerFrame; n++) {
+				lfsr ^= lfsr << 13; lfsr ^= lfsr >> 7; lfsr ^= lfsr << 17;
+				frameWords[2 + n] = lfsr;
+			}
+		}
+		frameWords[0] = (uint64_t(frameSize) << 36) | (frameID & 0xFFFFFFFFFULL);
+		frameID++;
+
+		unsigned frameBytes = frameSize * sizeof(uint64_t);
+		if(1 + frameBytes > datagramSize) {
+			fprintf(stderr, "WARNING: Skipping frame with %u words, too large for a datagram\n", frameSize);
+			continue;
+		}
+		if(txLength + frameBytes > datagramSize) {
+			send(udpSocket, txBuffer, txLength, 0);
+			nDatagramsSent++;
+			nBytesSent += txLength;
+			txLength = 1;
+		}
+		memcpy(txBuffer + txLength, frameWords, frameBytes);
+		txLength += frameBytes;
+		nFramesSent++;
+
+		if(rate > 0) {
+			// Sleep until this frame is due
+			boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
+			long long dueUs = (long long)(nFramesSent / rate * 1E6);
+			long long aheadUs = dueUs - (now - start).total_microseconds();
+			if(aheadUs > 1000) usleep(aheadUs);
+		}
+	}
+	if(txLength > 1) {
+		send(udpSocket, txBuffer, txLength, 0);
+		nDatagramsSent++;
+		nBytesSent += txLength;
+	}
+
+	boost::posix_time::ptime end = boost::posix_time::microsec_clock::local_time();
+	double elapsed = (end - start).total_microseconds() / 1E6;
+	printf("Sent %lld frames in %lld datagrams (%.1f MiB) in %.3f s: %.0f frames/s, %.1f MiB/s\n",
+		nFramesSent, nDatagramsSent, nBytesSent / 1048576.0, elapsed,
+		nFramesSent / elapsed, nBytesSent / 1048576.0 / elapsed);
+	printf("Answered %lld commands\n", nCommands);
+
+	delete [] frameWords;
+	delete [] txWords;
+	close(udpSocket);
+	return 0;
+}